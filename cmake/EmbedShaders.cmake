@@ -0,0 +1,42 @@
+# Turns GLSL sources into a C header of constant string tables
+#
+# Usage: cmake -DOUTPUT=<header> -DSOURCE_ROOT=<dir> -DSHADERS="<file>;<file>..." -P EmbedShaders.cmake
+#
+# Every shader is stored as a NUL terminated char array and listed in embeddedShaders[]
+# under its path relative to SOURCE_ROOT, the same path the program loads it with,
+# e.g. "resources/shaders/glsl430/nbody.comp". See nbody_shadercache.h.
+
+if(NOT OUTPUT OR NOT SOURCE_ROOT OR NOT SHADERS)
+    message(FATAL_ERROR "EmbedShaders: OUTPUT, SOURCE_ROOT and SHADERS must be defined")
+endif()
+
+set(TABLE "")
+set(CONTENT "// Generated by cmake/EmbedShaders.cmake, do not edit\n\n")
+set(COUNT 0)
+
+foreach(SHADER ${SHADERS})
+    file(RELATIVE_PATH NAME "${SOURCE_ROOT}" "${SHADER}")
+    string(MAKE_C_IDENTIFIER "${NAME}" IDENTIFIER)
+
+    # Hex bytes, split in lines of 16
+    file(READ "${SHADER}" HEX HEX)
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+    string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n    " BYTES "${BYTES}")
+
+    string(APPEND CONTENT "static const char ${IDENTIFIER}[] = {\n    ${BYTES}0x00\n};\n\n")
+    string(APPEND TABLE "    { \"${NAME}\", ${IDENTIFIER} },\n")
+    math(EXPR COUNT "${COUNT} + 1")
+endforeach()
+
+string(APPEND CONTENT "#define EMBEDDED_SHADER_COUNT ${COUNT}\n\n")
+string(APPEND CONTENT "static const struct { const char *fileName; const char *text; } embeddedShaders[EMBEDDED_SHADER_COUNT] = {\n${TABLE}};\n")
+
+# Only touch the header when shaders changed, avoids needless rebuilds
+if(EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" PREVIOUS)
+    if(PREVIOUS STREQUAL CONTENT)
+        return()
+    endif()
+endif()
+
+file(WRITE "${OUTPUT}" "${CONTENT}")
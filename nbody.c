@@ -20,14 +20,73 @@
 #include "raymath.h"
 #include "rlgl.h"
 
-#define RLIGHTS_IMPLEMENTATION
-#include "rlights.h"
+#include "external/glad.h"  // Required for: glMemoryBarrier()
 
 #include <stdlib.h>         // Required for: calloc(), free()
+#include <stdio.h>          // Required for: fopen(), fprintf(), fclose(), snprintf()
 
 #define NUM_X 50
 #define NUM_Y 50
 #define NUM_BODIES 4096
+#define TIME_STEP 0.008f    // IMPORTANT: must match DT in nbody.comp
+#define BODY_RESERVE 512    // Slots parked at init, free for spawns
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define RLIGHTS_IMPLEMENTATION
+#include "rlights.h"
+
+#define NBODY_LIGHTS_IMPLEMENTATION
+#include "nbody_lights.h"
+
+#define NBODY_DEFERRED_IMPLEMENTATION
+#include "nbody_deferred.h"
+
+#define NBODY_TIMER_IMPLEMENTATION
+#include "nbody_timer.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_HIZ_IMPLEMENTATION
+#include "nbody_hiz.h"
+
+#define NBODY_STATS_IMPLEMENTATION
+#include "nbody_stats.h"
+
+#define NBODY_MONITOR_IMPLEMENTATION
+#include "nbody_monitor.h"
+
+#define NBODY_TRAILS_IMPLEMENTATION
+#include "nbody_trails.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+#define NBODY_EWALD_IMPLEMENTATION
+#include "nbody_ewald.h"
+
+#define NBODY_INSTANCES_IMPLEMENTATION
+#include "nbody_instances.h"
+
+#define NBODY_NEIGHBOURS_IMPLEMENTATION
+#include "nbody_neighbours.h"
+
+#define NBODY_BVH_IMPLEMENTATION
+#include "nbody_bvh.h"
+
+#define NBODY_CONTACTS_IMPLEMENTATION
+#include "nbody_contacts.h"
+
+#define NBODY_SLEEP_IMPLEMENTATION
+#include "nbody_sleep.h"
+
+#define NBODY_EDITS_IMPLEMENTATION
+#include "nbody_edits.h"
+
+#define NBODY_PICKING_IMPLEMENTATION
+#include "nbody_picking.h"
 //------------------------------------------------------------------------------------
 // Program main entry point
 //------------------------------------------------------------------------------------
@@ -59,24 +118,27 @@ int main(void)
         float vz;
     } Nbody;
 
-    // compute shader
-    char *nbodyCode = LoadFileText("resources/shaders/glsl430/nbody.comp");
-    unsigned int nbodyShader = rlCompileShader(nbodyCode, RL_COMPUTE_SHADER);
-    unsigned int nbodyProgram = rlLoadComputeShaderProgram(nbodyShader);
-    UnloadFileText(nbodyCode);
+    // compute shader, program binaries are cached in SHADER_CACHE_PATH across launches
+    unsigned int nbodyProgram = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", NULL);
 
     //char *collisionCode = LoadFileText("resources/shaders/glsl430/collision.comp");
     //unsigned int collisionShader = rlCompileShader(collisionCode, RL_COMPUTE_SHADER);
     //unsigned int collisionProgram = rlLoadComputeShaderProgram(collisionShader);
     //UnloadFileText(collisionCode);
 
-    // Define transforms to be uploaded to GPU for instances
-    Matrix *display_trans = (Matrix *)RL_CALLOC(NUM_BODIES, sizeof(Matrix));   // Pre-multiplied transformations passed to rlgl
-
     // Load shader storage buffer object (SSBO), id returned
     unsigned int nbodiesA = rlLoadShaderBuffer(NUM_BODIES*sizeof(Nbody), NULL, RL_DYNAMIC_COPY);
     unsigned int nbodiesB = rlLoadShaderBuffer(NUM_BODIES*sizeof(Nbody), NULL, RL_DYNAMIC_COPY);
-    unsigned int transforms = rlLoadShaderBuffer(NUM_BODIES*sizeof(Matrix), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(NUM_BODIES*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    // Instance positions, written by a step while the previous step is drawn
+    InstanceRing instances = LoadInstanceRing();
+
+    // Per body potential is only computed on conservation monitor steps
+    int computePotential = 0;
+    bool potentialPending = false;      // Monitor step not yet reduced
+    long long simulationStep = 0;
+    int computePotentialLoc = rlGetLocationUniform(nbodyProgram, "computePotential");
 
     Nbody init_bodies[NUM_BODIES];
 
@@ -102,6 +164,15 @@ int main(void)
         init_bodies[i].vz = mag * (init_bodies[i].px / dist);
     }
 
+    // Last slots parked, ids are the slots until the first reorder
+    unsigned int reserveIds[BODY_RESERVE];
+
+    for (int i = 0; i < BODY_RESERVE; i++)
+    {
+        reserveIds[i] = NUM_BODIES - BODY_RESERVE + i;
+        init_bodies[reserveIds[i]] = (Nbody){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    }
+
     rlUpdateShaderBuffer(nbodiesA, &init_bodies, NUM_BODIES*sizeof(Nbody), 0);
 
     // Define mesh to be instanced
@@ -109,12 +180,13 @@ int main(void)
 
     //--------------------------------------------------------------------------------------
     // Load lighting shader
-    Shader shader = LoadShader(TextFormat("resources/shaders/glsl%i/lighting_instancing.vs", 430),
-                               TextFormat("resources/shaders/glsl%i/lighting.fs", 430));
+    Shader shader = LoadShaderCached(TextFormat("resources/shaders/glsl%i/lighting_instancing.vs", 430),
+                                     TextFormat("resources/shaders/glsl%i/lighting.fs", 430), NULL);
     // Get shader locations
     shader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(shader, "mvp");
     shader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(shader, "viewPos");
-    shader.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(shader, "instanceTransform");
+    shader.locs[SHADER_LOC_MATRIX_VIEW] = GetShaderLocation(shader, "matView");
+    shader.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(shader, "instancePosition");
 
     // Set shader value: ambient light level
     int ambientLoc = GetShaderLocation(shader, "ambient");
@@ -123,8 +195,95 @@ int main(void)
     // Create one light
     CreateLight(LIGHT_DIRECTIONAL, (Vector3){ 50.0f, 50.0f, 0.0f }, Vector3Zero(), WHITE, shader);
 
+    // Load clustered point lights, one every LIGHT_BODY_STRIDE bodies
+    LightClusters lightClusters = LoadLightClusters();
+    SetLightClustersShaderValues(shader, screenWidth, screenHeight);
+
+    int pointLightsEnabled = 1;
+    int pointLightsLoc = GetShaderLocation(shader, "pointLightsEnabled");
+    SetShaderValue(shader, pointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+
+    // Load deferred renderer, lit by the same lights as the forward shader
+    DeferredRenderer deferred = LoadDeferredRenderer(screenWidth, screenHeight);
+    SetShaderValue(deferred.lightingShader, GetShaderLocation(deferred.lightingShader, "ambient"), (float[4]){ 0.2f, 0.2f, 0.2f, 1.0f }, SHADER_UNIFORM_VEC4);
+    CreateLight(LIGHT_DIRECTIONAL, (Vector3){ 50.0f, 50.0f, 0.0f }, Vector3Zero(), WHITE, deferred.lightingShader);
+
+    int deferredPointLightsLoc = GetShaderLocation(deferred.lightingShader, "pointLightsEnabled");
+    SetShaderValue(deferred.lightingShader, deferredPointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+
+    // Load forward shader variant drawing Hi-Z culled instances
+    Shader culledShader = LoadShaderCached("resources/shaders/glsl430/lighting_indirect.vs", "resources/shaders/glsl430/lighting.fs", NULL);
+    culledShader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(culledShader, "viewPos");
+    culledShader.locs[SHADER_LOC_MATRIX_VIEW] = GetShaderLocation(culledShader, "matView");
+    SetShaderValue(culledShader, GetShaderLocation(culledShader, "ambient"), (float[4]){ 0.2f, 0.2f, 0.2f, 1.0f }, SHADER_UNIFORM_VEC4);
+    CreateLight(LIGHT_DIRECTIONAL, (Vector3){ 50.0f, 50.0f, 0.0f }, Vector3Zero(), WHITE, culledShader);
+    SetLightClustersShaderValues(culledShader, screenWidth, screenHeight);
+
+    int culledPointLightsLoc = GetShaderLocation(culledShader, "pointLightsEnabled");
+    SetShaderValue(culledShader, culledPointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+
+    Material matCulled = LoadMaterialDefault();
+    matCulled.shader = culledShader;
+    matCulled.maps[MATERIAL_MAP_DIFFUSE].color = WHITE;
+
+    // Load Hi-Z occlusion culling, pyramid built from the scene depth of both shading paths
+    bool cullingEnabled = false;
+    HiZCulling culling = LoadHiZCulling(screenWidth, screenHeight, cube);
+
+    // Scene render timers, to compare forward and deferred shading
+    bool deferredEnabled = false;
+    GpuTimer forwardTimer = LoadGpuTimer();
+    GpuTimer deferredTimer = LoadGpuTimer();
+
+    // Body trails, history recorded by the nbody program
+    bool trailsEnabled = true;
+    BodyTrails trails = LoadBodyTrails(nbodyProgram);
+
+    // Space filling curve reordering, bodies keep stable ids for trails and lights
+    bool reorderEnabled = true;
+    BodyReorder reorder = LoadBodyReorder(REORDER_INTERVAL, REORDER_CURVE_HILBERT);
+
+    // Periodic box, Ewald correction tabulated once
+    bool periodicEnabled = false;
+    EwaldTable ewald = LoadEwaldTable(nbodyProgram, EWALD_BOX_SIZE);
+
+    // Verlet neighbour lists of the contacts, rebuilt on GPU once some body moved skin/2
+    bool neighbourListsEnabled = true;
+    NeighbourLists neighbours = LoadNeighbourLists(nbodyProgram, NEIGHBOUR_SKIN);
+
+    // Linear BVH broadphase of the list builds, refitted every step and rebuilt once inflated
+    bool bvhEnabled = true;
+    BodyBvh bvh = LoadBodyBvh(BVH_REBUILD_INFLATION);
+
+    // Iterative contact solver on the neighbour lists, allows steps of several times DT
+    bool contactSolverEnabled = false;
+    int stepScale = 1;
+    ContactSolver contacts = LoadContactSolver(nbodyProgram, CONTACT_ITERATIONS, TIME_STEP);
+
+    // Resting contact islands sleep, found on the neighbour lists
+    bool sleepEnabled = false;
+    SleepIslands islands = LoadSleepIslands(nbodyProgram, SLEEP_STEPS, SLEEP_ENERGY);
+
+    // Body edits queued by the keys, applied on GPU at the start of the next step
+    BodyEditQueue edits = LoadBodyEditQueue(reserveIds, BODY_RESERVE);
+
+    // Mouse picking on GPU, the camera follows the picked body
+    BodyPicker picker = LoadBodyPicker();
+
+    // Global body statistics, reduced on GPU and read back a frame later
+    StatsReduction bodyStats = LoadStatsReduction();
+
+    // Body snapshots, bodies and their stable ids are read back a few frames after the request
+    ReadbackQueue bodySnapshot = LoadReadbackQueue(1, NUM_BODIES*sizeof(Nbody));
+    ReadbackQueue idSnapshot = LoadReadbackQueue(1, NUM_BODIES*sizeof(unsigned int));
+    bool snapshotRequested = false;
+    char snapshotFileName[64] = { 0 };         // Last snapshot written
+
+    // Energy and momentum conservation time series, sampled every MONITOR_INTERVAL steps
+    ConservationMonitor monitor = LoadConservationMonitor("nbody_conservation.csv", TIME_STEP);
+
     // NOTE: We are assigning the intancing shader to material.shader
-    // to be used on mesh drawing with DrawMeshInstanced()
+    // to be used on mesh drawing with DrawMeshInstancedBuffer()
     Material matInstances = LoadMaterialDefault();
     matInstances.shader = shader;
     matInstances.maps[MATERIAL_MAP_DIFFUSE].color = WHITE;
@@ -143,6 +302,108 @@ int main(void)
     {
         // Update
         //----------------------------------------------------------------------------------
+        if (IsKeyPressed(KEY_L))
+        {
+            pointLightsEnabled = !pointLightsEnabled;
+            SetShaderValue(shader, pointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+            SetShaderValue(deferred.lightingShader, deferredPointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+            SetShaderValue(culledShader, culledPointLightsLoc, &pointLightsEnabled, SHADER_UNIFORM_INT);
+        }
+
+        if (IsKeyPressed(KEY_G)) deferredEnabled = !deferredEnabled;
+
+        if (IsKeyPressed(KEY_C))
+        {
+            cullingEnabled = !cullingEnabled;
+            culling.valid = false;      // Pyramid is stale
+        }
+
+        if (IsKeyPressed(KEY_T))
+        {
+            trailsEnabled = !trailsEnabled;
+            ResetBodyTrails(&trails);   // History is stale
+        }
+
+        // Cycle reordering: off, Morton, Hilbert
+        if (IsKeyPressed(KEY_O))
+        {
+            if (!reorderEnabled) { reorderEnabled = true; reorder.curve = REORDER_CURVE_MORTON; }
+            else if (reorder.curve == REORDER_CURVE_MORTON) reorder.curve = REORDER_CURVE_HILBERT;
+            else reorderEnabled = false;
+
+            reorder.step = 0;
+        }
+
+        if (IsKeyPressed(KEY_B)) snapshotRequested = true;
+
+        if (IsKeyPressed(KEY_N))
+        {
+            neighbourListsEnabled = !neighbourListsEnabled;
+            InvalidateNeighbourLists(&neighbours);     // Not maintained while off
+
+            // Solver and islands walk the lists
+            if (!neighbourListsEnabled)
+            {
+                contactSolverEnabled = false;
+                sleepEnabled = false;
+            }
+        }
+
+        if (IsKeyPressed(KEY_H))
+        {
+            bvhEnabled = !bvhEnabled;
+            InvalidateBodyBvh(&bvh);        // Not refitted while off
+        }
+
+        if (IsKeyPressed(KEY_S))
+        {
+            sleepEnabled = !sleepEnabled;
+            ResetSleepIslands(&islands);    // Rest counts are stale
+
+            if (sleepEnabled && !neighbourListsEnabled)
+            {
+                neighbourListsEnabled = true;
+                InvalidateNeighbourLists(&neighbours);
+            }
+        }
+
+        if (IsKeyPressed(KEY_K))
+        {
+            contactSolverEnabled = !contactSolverEnabled;
+
+            if (contactSolverEnabled && !neighbourListsEnabled)
+            {
+                neighbourListsEnabled = true;
+                InvalidateNeighbourLists(&neighbours);
+            }
+        }
+
+        // Cycle the step length of the contact solver: 1, 2, 4 times DT
+        if (IsKeyPressed(KEY_V))
+        {
+            stepScale = (stepScale < CONTACT_MAX_STEP_SCALE)? stepScale*2 : 1;
+            contacts.timeStep = TIME_STEP*stepScale;
+        }
+
+        // Cycle the sweeps of the contact solver: 8 to 128, deeper clumps need more
+        if (IsKeyPressed(KEY_I)) contacts.iterations = (contacts.iterations < 128)? contacts.iterations*2 : 8;
+
+        // Edits around the camera target: spawn a cluster, delete, kick up, swirl
+        if (IsKeyPressed(KEY_ONE)) QueueBodySpawn(&edits, camera.target, 10.0f, 64, (Vector3){ 0.0f, 0.0f, 0.0f });
+        if (IsKeyPressed(KEY_TWO)) QueueBodyDelete(&edits, camera.target, 20.0f);
+        if (IsKeyPressed(KEY_THREE)) QueueBodyImpulse(&edits, camera.target, 30.0f, (Vector3){ 0.0f, 20.0f, 0.0f });
+        if (IsKeyPressed(KEY_FOUR)) QueueBodyVelocityField(&edits, camera.target, 40.0f, (Vector3){ 0.0f, 0.0f, 0.0f }, 0.5f);
+
+        if (IsKeyPressed(KEY_P))
+        {
+            periodicEnabled = !periodicEnabled;
+            ResetBodyTrails(&trails);   // Bodies jump when wrapped into the box
+
+            // Lists gain or lose the pairs across the box faces, a wrap moves a body by exactly
+            // the box size, which the nearest image displacement check does not see
+            InvalidateNeighbourLists(&neighbours);
+            InvalidateBodyBvh(&bvh);
+        }
 
         // Process collisions
         //rlEnableShader(collisionProgram);
@@ -156,32 +417,139 @@ int main(void)
         //nbodiesA = nbodiesB;
         //nbodiesB = temp;
 
+        // Potentials are accumulated by the force loop, only when the monitor samples
+        if (IsConservationStep(simulationStep)) potentialPending = true;
+        computePotential = potentialPending? 1 : 0;
+
+        // Sort bodies along the curve, quantized over the last bounds read back
+        // NOTE: nbodiesB is free until the nbody program writes it
+        if (reorderEnabled && bodyStats.ready)
+        {
+            // Lists and BVH leaves hold slots
+            if (UpdateBodyReorder(&reorder, &nbodiesA, &nbodiesB, bodyStats.stats.boundsMin, bodyStats.stats.boundsMax))
+            {
+                InvalidateNeighbourLists(&neighbours);
+                InvalidateBodyBvh(&bvh);
+            }
+        }
+
+        // Spawns and deletes change which slots hold bodies
+        edits.watchedId = picker.pickedId;
+        if (ApplyBodyEdits(&edits, nbodiesA, reorder.idBuffers[0], reorder.slotBuffer))
+        {
+            InvalidateNeighbourLists(&neighbours);
+            InvalidateBodyBvh(&bvh);
+            ResetBodyTrails(&trails);
+        }
+
+        // The followed body was deleted, a spawn may already hold its id
+        if (edits.watchedDeleted)
+        {
+            ClearBodyPick(&picker);
+            edits.watchedDeleted = false;
+        }
+
+        // List builds walk the BVH once bounds are known for its keys, refitted on the same bodies
+        bool bvhUsed = neighbourListsEnabled && bvhEnabled && bodyStats.ready;
+        if (bvhUsed) UpdateBodyBvh(&bvh, nbodiesA, bodyStats.stats.boundsMin, bodyStats.stats.boundsMax);
+        neighbours.bvhBuffer = bvhUsed? bvh.nodeBuffer : 0;
+
+        if (neighbourListsEnabled) UpdateNeighbourLists(&neighbours, nbodiesA, periodicEnabled? ewald.boxSize : 0.0f);
+        if (sleepEnabled) UpdateSleepIslands(&islands, nbodiesA, reorder.idBuffers[0], neighbours, periodicEnabled? ewald.boxSize : 0.0f);
+
         // Process nbody
         rlEnableShader(nbodyProgram);
         rlBindShaderBuffer(nbodiesA, 0);
         rlBindShaderBuffer(nbodiesB, 1);
-        rlBindShaderBuffer(transforms, 2);
+        unsigned int instanceBuffer = BeginInstanceWrite(&instances);
+        rlBindShaderBuffer(instanceBuffer, 2);
+        rlBindShaderBuffer(potentials, 8);
+        rlSetUniform(computePotentialLoc, &computePotential, RL_SHADER_UNIFORM_INT, 1);
+        BindBodyTrails(&trails, trailsEnabled);
+        BindBodyIds(reorder);
+        BindEwaldTable(ewald, periodicEnabled);
+        BindNeighbourLists(neighbours, neighbourListsEnabled);
+        BindContactSolver(contacts, contactSolverEnabled);
+        BindSleepIslands(islands, sleepEnabled);
         rlComputeShaderDispatch(16, 16, 16);
         rlDisableShader();
 
+        // Overlaps of the predicted step relaxed in place, instances rewritten with the result
+        if (contactSolverEnabled)
+        {
+            contacts.sleeping = sleepEnabled;
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            // Lists checked again on the predicted positions the solver works on, a long step
+            // moves bodies further than the check on the input positions allows for
+            if (bvhUsed) UpdateBodyBvh(&bvh, nbodiesB, bodyStats.stats.boundsMin, bodyStats.stats.boundsMax);
+            UpdateNeighbourLists(&neighbours, nbodiesB, periodicEnabled? ewald.boxSize : 0.0f);
+
+            SolveContacts(contacts, nbodiesA, nbodiesB, instanceBuffer, neighbours, periodicEnabled? ewald.boxSize : 0.0f);
+        }
+
+        // Bodies are read by later passes, instances are published to the draws by the next
+        // BeginInstanceWrite(), so this frame draws do not wait on this dispatch
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        EndInstanceWrite(&instances);
+
+        // Instances drawn this frame, written by the previous step
+        unsigned int drawnInstances = instances.buffers[instances.readIndex];
+
         // ssboA <-> ssboB
         unsigned int temp = nbodiesA;
         nbodiesA = nbodiesB;
         nbodiesB = temp;
 
-        rlReadShaderBuffer(transforms, display_trans, NUM_BODIES*sizeof(Matrix), 0);
-        
-        Vector3 pos = (Vector3){ 0.0f, 0.0f, 0.0f };
-        for (int i = 0; i < NUM_BODIES; i++)
+        // Reduce the state the potentials were computed from
+        // NOTE: nbodiesB holds the input bodies of the last step
+        if (UpdateStatsReduction(&bodyStats, nbodiesB, potentials, simulationStep, computePotential == 1)) potentialPending = false;
+        UpdateConservationMonitor(&monitor, bodyStats);
+
+        simulationStep++;
+
+        // Snapshot of the bodies just integrated, queued behind the step
+        if (snapshotRequested && !IsReadbackQueueFull(bodySnapshot) && !IsReadbackQueueFull(idSnapshot))
         {
-            pos.x = display_trans[i].m12;
-            pos.y = display_trans[i].m13;
-            pos.z = display_trans[i].m14;
+            RequestReadback(&bodySnapshot, nbodiesA, 0, NUM_BODIES*sizeof(Nbody), simulationStep);
+            RequestReadback(&idSnapshot, reorder.idBuffers[0], 0, NUM_BODIES*sizeof(unsigned int), simulationStep);
+            snapshotRequested = false;
         }
 
-        pos.x /= NUM_BODIES;
-        pos.y /= NUM_BODIES;
-        pos.z /= NUM_BODIES;
+        int bodySlot = PollReadback(&bodySnapshot);
+        int idSlot = PollReadback(&idSnapshot);
+
+        if ((bodySlot >= 0) && (idSlot >= 0))
+        {
+            const Nbody *bodies = (const Nbody *)GetReadbackData(bodySnapshot, bodySlot);
+            const unsigned int *ids = (const unsigned int *)GetReadbackData(idSnapshot, idSlot);
+
+            snprintf(snapshotFileName, sizeof(snapshotFileName), "nbody_snapshot_%lld.csv", bodySnapshot.tags[bodySlot]);
+            FILE *snapshotFile = fopen(snapshotFileName, "w");
+
+            if (snapshotFile != NULL)
+            {
+                fprintf(snapshotFile, "id,px,py,pz,vx,vy,vz\n");
+                for (int i = 0; i < NUM_BODIES; i++) if (bodies[i].px < BODY_PARKED) fprintf(snapshotFile, "%u,%g,%g,%g,%g,%g,%g\n", ids[i], bodies[i].px, bodies[i].py, bodies[i].pz, bodies[i].vx, bodies[i].vy, bodies[i].vz);
+                fclose(snapshotFile);
+            }
+            else TraceLog(LOG_WARNING, "SNAPSHOT: [%s] Failed to open file", snapshotFileName);
+
+            ReleaseReadback(&bodySnapshot, bodySlot);
+            ReleaseReadback(&idSnapshot, idSlot);
+        }
+
+        // Pick against the bodies drawn this frame, with the camera they were drawn with
+        // NOTE: nbodiesB holds the input of the last step, the output of the step drawn this frame
+        if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) RequestBodyPick(&picker, GetMouseRay(GetMousePosition(), camera), nbodiesB, reorder.idBuffers[0]);
+        if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) ClearBodyPick(&picker);
+        UpdateBodyPicker(&picker, nbodiesB, reorder.slotBuffer);
+
+        // Follow the picked body, or else the center of mass once the first reduction is read back
+        // NOTE: The periodic box stays centered on the origin, nothing to follow
+        Vector3 pos = (Vector3){ 0.0f, 0.0f, 0.0f };
+        if (picker.trackedValid) pos = picker.trackedPosition;
+        else if (bodyStats.ready && !periodicEnabled) pos = (Vector3){ bodyStats.stats.centerOfMass[0], bodyStats.stats.centerOfMass[1], bodyStats.stats.centerOfMass[2] };
 
         camera.target = pos;
         
@@ -202,6 +570,14 @@ int main(void)
         // Update the light shader with the camera view position
         float cameraPos[3] = { camera.position.x, camera.position.y, camera.position.z };
         SetShaderValue(shader, shader.locs[SHADER_LOC_VECTOR_VIEW], cameraPos, SHADER_UNIFORM_VEC3);
+        SetShaderValue(culledShader, culledShader.locs[SHADER_LOC_VECTOR_VIEW], cameraPos, SHADER_UNIFORM_VEC3);
+
+        // Rebuild point light cluster lists for this view
+        // NOTE: nbodiesB holds the input of the last step, the output of the step drawn this frame
+        if (pointLightsEnabled) UpdateLightClusters(lightClusters, nbodiesB, reorder.slotBuffer, camera, (float)screenWidth/(float)screenHeight);
+
+        // Cull hidden bodies against the depth pyramid of the previous frame
+        if (cullingEnabled) UpdateHiZCulling(&culling, drawnInstances, camera, (float)screenWidth/(float)screenHeight);
 
         //----------------------------------------------------------------------------------
         // Draw
@@ -210,19 +586,117 @@ int main(void)
 
             ClearBackground(BLACK);
 
-            BeginMode3D(camera);
-
-                // Draw cube mesh with default material (BLUE)
-                //DrawMesh(cube, matDefault, MatrixTranslate(-10.0f, 0.0f, 0.0f));
-                
-                // Draw meshes instanced using material containing instancing shader (RED + lighting),
-                // transforms[] for the instances should be provided, they are dynamically
-                // updated in GPU every frame, so we can animate the different mesh instances
-                DrawMeshInstanced(cube, matInstances, display_trans, NUM_BODIES);
-
-            EndMode3D();
+            BindLightClusters(lightClusters);
+
+            if (deferredEnabled)
+            {
+                BeginGpuTimer(&deferredTimer);
+
+                // Geometry pass: normals, albedo and depth of every body
+                BeginDeferredGeometry(deferred);
+                    BeginMode3D(camera);
+                        if (cullingEnabled) DrawMeshCulled(culling, cube, deferred.geometryIndirectMaterial);
+                        else DrawMeshInstancedBuffer(cube, deferred.geometryMaterial, drawnInstances, NUM_BODIES);
+                    EndMode3D();
+                EndDeferredGeometry();
+
+                if (cullingEnabled) BuildHiZPyramid(&culling, deferred.gbuffer.depthTexture, camera, (float)screenWidth/(float)screenHeight);
+
+                // Lighting pass: once per covered pixel
+                DrawDeferredLighting(deferred, camera, (float)screenWidth/(float)screenHeight);
+
+                EndGpuTimer(&deferredTimer);
+            }
+            else
+            {
+                BeginGpuTimer(&forwardTimer);
+
+                if (cullingEnabled)
+                {
+                    // Offscreen, so the depth is available to the pyramid build
+                    BeginForwardTarget(deferred);
+                        BeginMode3D(camera);
+                            DrawMeshCulled(culling, cube, matCulled);
+                        EndMode3D();
+                    EndForwardTarget();
+
+                    BuildHiZPyramid(&culling, deferred.gbuffer.depthTexture, camera, (float)screenWidth/(float)screenHeight);
+                    DrawForwardResolve(deferred);
+                }
+                else
+                {
+                    BeginMode3D(camera);
+
+                        // Draw cube mesh with default material (BLUE)
+                        //DrawMesh(cube, matDefault, MatrixTranslate(-10.0f, 0.0f, 0.0f));
+
+                        // Draw meshes instanced using material containing instancing shader (RED + lighting),
+                        // instances[] stay in GPU, they are written by the
+                        // nbody program every frame, so we can animate the different mesh instances
+                        DrawMeshInstancedBuffer(cube, matInstances, drawnInstances, NUM_BODIES);
+
+                    EndMode3D();
+                }
+
+                EndGpuTimer(&forwardTimer);
+            }
+
+            // Trails blended over the scene depth of either shading path
+            if (trailsEnabled)
+            {
+                BeginMode3D(camera);
+                    DrawBodyTrails(trails, Fade(SKYBLUE, 0.6f));
+                EndMode3D();
+            }
+
+            if (picker.trackedValid)
+            {
+                BeginMode3D(camera);
+                    DrawSphereWires(picker.trackedPosition, 2.0f, 6, 12, YELLOW);
+                EndMode3D();
+            }
+
+            if (periodicEnabled)
+            {
+                BeginMode3D(camera);
+                    DrawCubeWires((Vector3){ 0.0f, 0.0f, 0.0f }, ewald.boxSize, ewald.boxSize, ewald.boxSize, Fade(LIGHTGRAY, 0.5f));
+                EndMode3D();
+            }
 
             DrawFPS(10, 10);
+            DrawText(TextFormat("[L] Point lights: %s (%i)", pointLightsEnabled? "on" : "off", MAX_POINT_LIGHTS), 10, 40, 20, LIGHTGRAY);
+            DrawText(TextFormat("[G] Shading: %s", deferredEnabled? "deferred" : "forward"), 10, 70, 20, LIGHTGRAY);
+            DrawText(TextFormat("Scene GPU time: forward %.2f ms, deferred %.2f ms", forwardTimer.averageMs, deferredTimer.averageMs), 10, 100, 20, LIGHTGRAY);
+            if (cullingEnabled) DrawText(TextFormat("[C] Hi-Z culling: on (%i/%i visible)", culling.visibleCount, NUM_BODIES), 10, 130, 20, LIGHTGRAY);
+            else DrawText("[C] Hi-Z culling: off", 10, 130, 20, LIGHTGRAY);
+
+            DrawText(TextFormat("[T] Trails: %s", trailsEnabled? "on" : "off"), 10, 160, 20, LIGHTGRAY);
+            if (reorderEnabled) DrawText(TextFormat("[O] Reorder: %s every %i steps", (reorder.curve == REORDER_CURVE_HILBERT)? "Hilbert" : "Morton", reorder.interval), 10, 280, 20, LIGHTGRAY);
+            else DrawText("[O] Reorder: off", 10, 280, 20, LIGHTGRAY);
+            if (periodicEnabled) DrawText(TextFormat("[P] Periodic box: %.0f (Ewald)", ewald.boxSize), 10, 310, 20, LIGHTGRAY);
+            else DrawText("[P] Periodic box: off", 10, 310, 20, LIGHTGRAY);
+            DrawText(TextFormat("Instance buffers: %i, steps stalled by drawing: %lld", INSTANCE_BUFFERS, instances.stalls), 10, 340, 20, LIGHTGRAY);
+            DrawText(TextFormat("[B] Body snapshot: %s", (snapshotFileName[0] != '\0')? snapshotFileName : "none"), 10, 370, 20, LIGHTGRAY);
+            if (neighbourListsEnabled) DrawText(TextFormat("[N] Neighbour lists: %i builds in %lld steps, %i entries (%i truncated), max drift %.2f/%.2f",
+                neighbours.rebuilds, neighbours.steps, neighbours.listSize, neighbours.overflow, neighbours.maxDisplacement, neighbours.skin*0.5f), 10, 400, 20, LIGHTGRAY);
+            else DrawText("[N] Neighbour lists: off (contacts in the force loop)", 10, 400, 20, LIGHTGRAY);
+            if (contactSolverEnabled) DrawText(TextFormat("[K] Contact solver: [I] %i sweeps, [V] step %i x DT", contacts.iterations, stepScale), 10, 430, 20, LIGHTGRAY);
+            else DrawText("[K] Contact solver: off (one push per overlap, step DT)", 10, 430, 20, LIGHTGRAY);
+
+            BodyStats stats = bodyStats.stats;
+            DrawText(TextFormat("Energy: kinetic %.4g, potential %.4g, total %.4g (drift %+.3f%%)", monitor.last.energy[0], monitor.last.energy[1], monitor.last.energy[2], monitor.energyDrift*100.0f), 10, 190, 20, LIGHTGRAY);
+            DrawText(TextFormat("Momentum: (%.3g, %.3g, %.3g), max speed %.3g, |dP| %.3g, |dL|/|L0| %.3f%%", stats.momentum[0], stats.momentum[1], stats.momentum[2], stats.momentum[3], monitor.momentumDrift, monitor.angularMomentumDrift*100.0f), 10, 220, 20, LIGHTGRAY);
+            DrawText(TextFormat("Bounds: (%.0f, %.0f, %.0f) - (%.0f, %.0f, %.0f)", stats.boundsMin[0], stats.boundsMin[1], stats.boundsMin[2], stats.boundsMax[0], stats.boundsMax[1], stats.boundsMax[2]), 10, 250, 20, LIGHTGRAY);
+            DrawText(TextFormat("[1-4] Spawn, delete, kick, swirl: %.0f bodies, %u free, %u spawns dropped", stats.centerOfMass[3], edits.counters.freeCount, edits.counters.dropped), 10, 460, 20, LIGHTGRAY);
+            if (sleepEnabled) DrawText(TextFormat("[S] Sleeping islands: %u/%u asleep, %u bodies asleep, %u gravity sources", islands.counters.sleepingIslands, islands.counters.islandCount, islands.counters.sleepingBodies, islands.counters.sourceCount), 10, 520, 20, LIGHTGRAY);
+            else DrawText("[S] Sleeping islands: off", 10, 520, 20, LIGHTGRAY);
+            if (bvhEnabled) DrawText(TextFormat("[H] BVH broadphase: %i rebuilds in %lld refits, inflation %.2f/%.2f", bvh.rebuilds, bvh.refits, bvh.inflation, bvh.rebuildInflation), 10, 550, 20, LIGHTGRAY);
+            else DrawText("[H] BVH broadphase: off (list builds test every pair)", 10, 550, 20, LIGHTGRAY);
+            if (picker.pickedId >= 0) DrawText(TextFormat("[Mouse] Following body %i at (%.1f, %.1f, %.1f), right click to release", picker.pickedId, picker.trackedPosition.x, picker.trackedPosition.y, picker.trackedPosition.z), 10, 490, 20, LIGHTGRAY);
+            else DrawText("[Mouse] Click a body to follow it, camera on the center of mass", 10, 490, 20, LIGHTGRAY);
+
+            // The integrator may overwrite this frame instances once its draws are done
+            EndInstanceRead(&instances);
 
         EndDrawing();
         //----------------------------------------------------------------------------------
@@ -232,12 +706,31 @@ int main(void)
     // Unload shader buffers objects
     rlUnloadShaderBuffer(nbodiesA);
     rlUnloadShaderBuffer(nbodiesB);
-    rlUnloadShaderBuffer(transforms);
+    UnloadInstanceRing(instances);
+    rlUnloadShaderBuffer(potentials);
+    UnloadLightClusters(lightClusters);
+    UnloadDeferredRenderer(deferred);
+    UnloadHiZCulling(culling);
+    UnloadShader(culledShader);
+    UnloadGpuTimer(forwardTimer);
+    UnloadGpuTimer(deferredTimer);
+    UnloadStatsReduction(bodyStats);
+    UnloadReadbackQueue(bodySnapshot);
+    UnloadReadbackQueue(idSnapshot);
+    UnloadConservationMonitor(monitor);
+    UnloadBodyTrails(trails);
+    UnloadBodyReorder(reorder);
+    UnloadEwaldTable(ewald);
+    UnloadNeighbourLists(neighbours);
+    UnloadBodyBvh(bvh);
+    UnloadContactSolver(contacts);
+    UnloadSleepIslands(islands);
+    UnloadBodyEditQueue(edits);
+    UnloadBodyPicker(picker);
 
     // Unload compute shader programs
     rlUnloadShaderProgram(nbodyProgram);
     //rlUnloadShaderProgram(collisionCode);
-    RL_FREE(display_trans);    // Free transforms
 
     CloseWindow();          // Close window and OpenGL context
     //--------------------------------------------------------------------------------------
@@ -0,0 +1,261 @@
+/**********************************************************************************************
+*
+*   nbody.bvh - Linear BVH broadphase over the body spheres, built and refitted on GPU
+*
+*   Building the neighbour lists by testing every pair of bodies costs O(N^2) per build. Here
+*   bvh_build.comp keeps a binary tree of boxes over the bodies, and the list builds of
+*   nbody_neighbours.h walk it, so a build costs about O(N log N):
+*
+*       Keys        Morton key of every quantized body position, radix sorted with the
+*                   RadixSorter of nbody_reorder.h, parked slots sort last
+*       Hierarchy   Every internal node finds its range of sorted keys and its split at once,
+*                   from the common key prefixes of its neighbours (Karras 2012)
+*       Refit       Leaves box their body sphere and climb towards the root, an atomic visit
+*                   counter per node lets only the second child to arrive join both boxes
+*
+*   Bodies move little per step, so the tree is refitted every step and only rebuilt when it
+*   was invalidated or when refits have inflated it too much: the refit sums, per internal
+*   node, its surface area over the area it had at the last rebuild, and the mean is read
+*   back a few frames late. Leaf boxes hold each body sphere, so queries stay exact for bodies
+*   of different radii.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_BVH_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define BVH_REBUILD_INFLATION
+*       May be defined before including this file to override the default below.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input)
+*      12 - uint keys[]                         (radix sort input, see nbody_reorder.h)
+*      13 - uint values[]
+*      31 - BvhNode nodes[]                     (read by neighbour_list.comp)
+*      32 - BVH state                           (inflation counters, per node visit counters)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the counters
+*       nbody_reorder.h     Radix sort of the keys
+*
+*   NOTE: Leaves hold slots, reordering or editing bodies invalidates the tree, see
+*   InvalidateBodyBvh(). Bodies share RADIUS for now, the leaf boxes are where a per body
+*   radius would go
+*
+**********************************************************************************************/
+
+#ifndef NBODY_BVH_H
+#define NBODY_BVH_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef BVH_REBUILD_INFLATION
+    #define BVH_REBUILD_INFLATION   1.5f        // Mean node area over its area at the last rebuild
+#endif
+
+// IMPORTANT: These must match the defines in bvh_build.comp and neighbour_list.comp
+#define BVH_GROUP_SIZE              64
+#define BVH_NODES                   (2*NUM_BODIES - 1)  // Internal nodes, then leaves
+#define BVH_NODE_SIZE               48          // std430 size of BvhNode, in bytes
+#define BVH_FIXED_SCALE             256.0f      // Fixed point of the inflation sum
+#define BVH_KEY_BITS                30          // 3 axes of 10 bits
+
+#define BVH_READBACK_SLOTS          3           // Counters in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// BVH counters, std430 layout of the head of bvh_build.comp binding 32
+typedef struct BvhCounters {
+    unsigned int inflation;         // Sum of the node area ratios, fixed point
+    unsigned int measured;          // Internal nodes in the sum
+    unsigned int padding[2];
+} BvhCounters;
+
+// Body BVH data
+typedef struct BodyBvh {
+    unsigned int program;
+    RadixSorter sorter;
+    unsigned int nodeBuffer;        // SSBO: BVH_NODES nodes of BVH_NODE_SIZE bytes
+    unsigned int stateBuffer;       // SSBO: BvhCounters, uint[NUM_BODIES] visit counters
+    ReadbackQueue counterReadback;
+
+    float rebuildInflation;
+    bool invalid;                   // Next update rebuilds whatever the inflation
+
+    long long refits;               // Updates since load
+    long long rebuiltRefit;         // Refit of the last rebuild, earlier counters are stale
+    int rebuilds;                   // Rebuilds since load
+    float inflation;                // Mean node inflation, read back a few frames late
+
+    int stageLoc;
+    int rebuiltLoc;
+    int boundsMinLoc;
+    int boundsScaleLoc;
+} BodyBvh;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+BodyBvh LoadBodyBvh(float rebuildInflation);                                    // Load BVH programs and buffers, first update builds
+void UnloadBodyBvh(BodyBvh bvh);                                                // Unload BVH programs and buffers
+void UpdateBodyBvh(BodyBvh *bvh, unsigned int bodyBuffer, const float *boundsMin, const float *boundsMax);  // Refit, rebuild first when needed
+void InvalidateBodyBvh(BodyBvh *bvh);                                           // Force a rebuild on the next update
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_BVH_H
+
+
+/***********************************************************************************
+*
+*   NBODY BVH IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_BVH_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <math.h>           // Required for: fmaxf()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load BVH programs and buffers, the first update always builds
+// NOTE: rebuildInflation <= 1 selects BVH_REBUILD_INFLATION
+BodyBvh LoadBodyBvh(float rebuildInflation)
+{
+    BodyBvh bvh = { 0 };
+
+    bvh.program = LoadComputeProgramCached("resources/shaders/glsl430/bvh_build.comp", NULL);
+    bvh.stageLoc = rlGetLocationUniform(bvh.program, "stage");
+    bvh.rebuiltLoc = rlGetLocationUniform(bvh.program, "rebuilt");
+    bvh.boundsMinLoc = rlGetLocationUniform(bvh.program, "boundsMin");
+    bvh.boundsScaleLoc = rlGetLocationUniform(bvh.program, "boundsScale");
+
+    bvh.sorter = LoadRadixSorter();
+    bvh.nodeBuffer = rlLoadShaderBuffer(BVH_NODES*BVH_NODE_SIZE, NULL, RL_DYNAMIC_COPY);
+    bvh.stateBuffer = rlLoadShaderBuffer(sizeof(BvhCounters) + NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    bvh.counterReadback = LoadReadbackQueue(BVH_READBACK_SLOTS, sizeof(BvhCounters));
+
+    bvh.rebuildInflation = (rebuildInflation > 1.0f)? rebuildInflation : BVH_REBUILD_INFLATION;
+    bvh.invalid = true;
+    bvh.inflation = 1.0f;
+
+    return bvh;
+}
+
+// Unload BVH programs and buffers
+void UnloadBodyBvh(BodyBvh bvh)
+{
+    UnloadRadixSorter(bvh.sorter);
+    rlUnloadShaderBuffer(bvh.nodeBuffer);
+    rlUnloadShaderBuffer(bvh.stateBuffer);
+    UnloadReadbackQueue(bvh.counterReadback);
+    rlUnloadShaderProgram(bvh.program);
+}
+
+// Refit the tree on the bodies, rebuild it first when invalid or inflated past rebuildInflation
+// NOTE: boundsMin/boundsMax only set the key quantization of rebuilds, stale bounds just
+// clamp the outer bodies into the same cells. Counters of the earlier updates are collected
+// here, without waiting
+void UpdateBodyBvh(BodyBvh *bvh, unsigned int bodyBuffer, const float *boundsMin, const float *boundsMax)
+{
+    for (int slot = PollReadback(&bvh->counterReadback); slot >= 0; slot = PollReadback(&bvh->counterReadback))
+    {
+        const BvhCounters *counters = (const BvhCounters *)GetReadbackData(bvh->counterReadback, slot);
+
+        if ((bvh->counterReadback.tags[slot] >= bvh->rebuiltRefit) && (counters->measured > 0)) bvh->inflation = (float)counters->inflation/(BVH_FIXED_SCALE*(float)counters->measured);
+
+        ReleaseReadback(&bvh->counterReadback, slot);
+    }
+
+    bool rebuild = bvh->invalid || (bvh->inflation > bvh->rebuildInflation);
+    int stage = 0;
+
+    bvh->refits++;
+
+    if (rebuild)
+    {
+        // Cubic cell grid over the bounds, like the reorder keys
+        float extent = fmaxf(boundsMax[0] - boundsMin[0], fmaxf(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+        float step = (extent > 0.0f)? (float)(1 << (BVH_KEY_BITS/3))/extent : 1.0f;
+        float boundsScale[3] = { step, step, step };
+
+        rlEnableShader(bvh->program);
+        rlBindShaderBuffer(bodyBuffer, 0);
+        rlBindShaderBuffer(bvh->sorter.keyBuffers[0], 12);
+        rlBindShaderBuffer(bvh->sorter.valueBuffers[0], 13);
+        rlSetUniform(bvh->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(bvh->boundsMinLoc, boundsMin, RL_SHADER_UNIFORM_VEC3, 1);
+        rlSetUniform(bvh->boundsScaleLoc, boundsScale, RL_SHADER_UNIFORM_VEC3, 1);
+        rlComputeShaderDispatch(NUM_BODIES/BVH_GROUP_SIZE, 1, 1);
+        rlDisableShader();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        SortRadixKeys(&bvh->sorter, BVH_KEY_BITS);
+
+        // Hierarchy of the sorted keys
+        stage = 1;
+
+        rlEnableShader(bvh->program);
+        rlBindShaderBuffer(bvh->sorter.keyBuffers[0], 12);
+        rlBindShaderBuffer(bvh->sorter.valueBuffers[0], 13);
+        rlBindShaderBuffer(bvh->nodeBuffer, 31);
+        rlSetUniform(bvh->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/BVH_GROUP_SIZE, 1, 1);
+        rlDisableShader();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        bvh->invalid = false;
+        bvh->rebuilds++;
+        bvh->rebuiltRefit = bvh->refits;
+        bvh->inflation = 1.0f;
+    }
+
+    // Clear the counters, then refit from the leaves, a rebuild refit sets the reference areas
+    int rebuilt = rebuild? 1 : 0;
+
+    rlEnableShader(bvh->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(bvh->nodeBuffer, 31);
+    rlBindShaderBuffer(bvh->stateBuffer, 32);
+    rlSetUniform(bvh->rebuiltLoc, &rebuilt, RL_SHADER_UNIFORM_INT, 1);
+
+    for (stage = 2; stage <= 3; stage++)
+    {
+        rlSetUniform(bvh->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/BVH_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    rlDisableShader();
+
+    if (!IsReadbackQueueFull(bvh->counterReadback)) RequestReadback(&bvh->counterReadback, bvh->stateBuffer, 0, sizeof(BvhCounters), bvh->refits);
+}
+
+// Force a rebuild on the next update, e.g. once bodies changed slots
+void InvalidateBodyBvh(BodyBvh *bvh)
+{
+    bvh->invalid = true;
+}
+
+#endif // NBODY_BVH_IMPLEMENTATION
@@ -0,0 +1,256 @@
+/**********************************************************************************************
+*
+*   nbody.contacts - Iterative position based contact solver
+*
+*   The default contact response pushes a body out of each overlap once, pair after pair,
+*   against the other body input position. In dense clumps the pushes fight each other, bodies
+*   jitter and the step has to stay at DT to keep them from blowing up.
+*
+*   With the solver enabled nbody.comp only applies gravity and predicts the positions of the
+*   step, then contact_solve.comp relaxes all overlaps together (position based dynamics):
+*
+*       Normals     One per neighbour list entry (nbody_neighbours.h), fixed over the step: the
+*                   pair direction of the input state, or the predicted one when the pair turned
+*                   a lot during the step (fast grazing approach)
+*       Iterate     iterations Jacobi sweeps, each body moves by half the depth of its overlaps
+*                   along the normals, scaled by the larger contact count of the pair, over-relaxed
+*       Finalize    Velocity is the displacement over the step, which removes the approach speed
+*                   along the contacts
+*
+*   Jacobi sweeps need no graph colouring to run in parallel, and the pair scale keeps them
+*   stable however crowded a body is while corrections stay equal and opposite (momentum kept).
+*   Input normals keep angular momentum: normals turned with a rotating, gravity compressed
+*   clump make every correction a small torque and spin the clump up within a few hundred steps.
+*
+*   Plain Jacobi sweeps carry the gravity compression out one layer of bodies at a time and
+*   need about as many sweeps as a clump has layers squared. After CONTACT_CHEBYSHEV_DELAY plain
+*   sweeps the iterations are Chebyshev accelerated: each iterate is blended with the one before
+*   the last, weights from the estimated spectral radius of a sweep (CONTACT_SPECTRAL_RADIUS).
+*   Overestimating the radius makes clumps boil (0.99 does), underestimating only converges slower.
+*
+*   Clumps come to rest instead of jittering and timeStep can be up to CONTACT_MAX_STEP_SCALE
+*   times DT. A 512 body lattice collapsing at 4*DT with 32 sweeps comes to rest within 200 to
+*   400 steps, overlaps below 0.25, while 32 plain sweeps throw it apart and 64 keep 0.37 deep
+*   overlaps. At 8*DT a step is half the free-fall time of a clump, gravity compresses it by a
+*   third of its radius in one step and no sweep count holds it.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_CONTACTS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define CONTACT_ITERATIONS
+*   #define CONTACT_RELAXATION
+*   #define CONTACT_SPECTRAL_RADIUS
+*   #define CONTACT_CHEBYSHEV_DELAY
+*       May be defined before including this file to override the defaults below.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input state of the step)
+*       1 - nbody nbodiesDest[]                 (predicted state written by nbody.comp, solved in place)
+*       2 - vec4 instances[]                    (solved positions, see nbody_instances.h)
+*      20 - uint neighbourData[]                (contact candidates, see nbody_neighbours.h)
+*      23 - vec4 contactPositions[]             (iteration ping-pong)
+*      24 - vec4 contactNormals[]               (one per neighbour list entry)
+*      28 - sleep state                         (pinned bodies when sleeping, see nbody_sleep.h)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_neighbours.h  Contact candidates
+*
+*   NOTE: Contacts are perfectly inelastic, the solver has no restitution. Only list neighbours
+*   are seen, so the lists must also be checked on the predicted positions before solving
+*   (UpdateNeighbourLists() on bodyBuffer), a long step can move bodies by several skins
+*
+**********************************************************************************************/
+
+#ifndef NBODY_CONTACTS_H
+#define NBODY_CONTACTS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef CONTACT_ITERATIONS
+    #define CONTACT_ITERATIONS      32          // Jacobi sweeps per step
+#endif
+#ifndef CONTACT_RELAXATION
+    #define CONTACT_RELAXATION      1.5f        // Over-relaxation of the scaled corrections
+#endif
+#ifndef CONTACT_SPECTRAL_RADIUS
+    #define CONTACT_SPECTRAL_RADIUS 0.97f       // Estimated convergence rate of a sweep, 0 disables Chebyshev acceleration
+#endif
+#ifndef CONTACT_CHEBYSHEV_DELAY
+    #define CONTACT_CHEBYSHEV_DELAY 8           // Plain sweeps before the acceleration starts, at least 2
+#endif
+
+#define CONTACT_MAX_STEP_SCALE      4           // Longest timeStep the solver holds clumps at, in DT
+
+// IMPORTANT: Must match the define in contact_solve.comp
+#define CONTACT_GROUP_SIZE          64
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Contact solver data
+typedef struct ContactSolver {
+    unsigned int program;
+    unsigned int positionBuffer;    // SSBO: vec4[2*NUM_BODIES]
+    unsigned int normalBuffer;      // SSBO: vec4[NEIGHBOUR_CAPACITY]
+
+    int iterations;                 // Jacobi sweeps per step
+    float relaxation;
+    float spectralRadius;           // Chebyshev acceleration of the sweeps, 0 for plain Jacobi
+    float timeStep;                 // Step length, DT unless changed
+    bool sleeping;                  // Sleeping bodies are pinned, sleep state bound by BindSleepIslands()
+
+    int stageLoc;
+    int iterationLoc;
+    int timeStepLoc;
+    int relaxationLoc;
+    int omegaLoc;
+    int boxSizeLoc;
+    int sleepingLoc;
+    int integratorIterationsLoc;    // Integrator uniform locations
+    int integratorTimeStepLoc;
+} ContactSolver;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+ContactSolver LoadContactSolver(unsigned int integratorProgram, int iterations, float timeStep);  // Load solver program and buffers
+void UnloadContactSolver(ContactSolver solver);                             // Unload solver program and buffers
+void BindContactSolver(ContactSolver solver, bool enabled);                 // Set step length and contact mode of the enabled integrator program
+void SolveContacts(ContactSolver solver, unsigned int inputBuffer, unsigned int bodyBuffer, unsigned int instanceBuffer, NeighbourLists lists, float boxSize);  // Relax the overlaps of the predicted bodies
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_CONTACTS_H
+
+
+/***********************************************************************************
+*
+*   NBODY CONTACTS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_CONTACTS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load solver program and buffers
+// NOTE: iterations <= 0 selects CONTACT_ITERATIONS
+ContactSolver LoadContactSolver(unsigned int integratorProgram, int iterations, float timeStep)
+{
+    ContactSolver solver = { 0 };
+
+    solver.program = LoadComputeProgramCached("resources/shaders/glsl430/contact_solve.comp", NULL);
+    solver.stageLoc = rlGetLocationUniform(solver.program, "stage");
+    solver.iterationLoc = rlGetLocationUniform(solver.program, "iteration");
+    solver.timeStepLoc = rlGetLocationUniform(solver.program, "timeStep");
+    solver.relaxationLoc = rlGetLocationUniform(solver.program, "relaxation");
+    solver.omegaLoc = rlGetLocationUniform(solver.program, "omega");
+    solver.boxSizeLoc = rlGetLocationUniform(solver.program, "boxSize");
+    solver.sleepingLoc = rlGetLocationUniform(solver.program, "sleeping");
+    solver.integratorIterationsLoc = rlGetLocationUniform(integratorProgram, "contactIterations");
+    solver.integratorTimeStepLoc = rlGetLocationUniform(integratorProgram, "timeStep");
+
+    solver.positionBuffer = rlLoadShaderBuffer(2*NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    solver.normalBuffer = rlLoadShaderBuffer(NEIGHBOUR_CAPACITY*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    solver.iterations = (iterations > 0)? iterations : CONTACT_ITERATIONS;
+    solver.relaxation = CONTACT_RELAXATION;
+    solver.spectralRadius = CONTACT_SPECTRAL_RADIUS;
+    solver.timeStep = timeStep;
+
+    return solver;
+}
+
+// Unload solver program and buffers
+void UnloadContactSolver(ContactSolver solver)
+{
+    rlUnloadShaderBuffer(solver.positionBuffer);
+    rlUnloadShaderBuffer(solver.normalBuffer);
+    rlUnloadShaderProgram(solver.program);
+}
+
+// Set step length and contact mode of the enabled integrator program
+// NOTE: When disabled, nbody.comp resolves contacts itself at DT and SolveContacts() must not run
+void BindContactSolver(ContactSolver solver, bool enabled)
+{
+    int iterations = enabled? solver.iterations : 0;
+    float timeStep = enabled? solver.timeStep : 0.0f;
+
+    rlSetUniform(solver.integratorIterationsLoc, &iterations, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(solver.integratorTimeStepLoc, &timeStep, RL_SHADER_UNIFORM_FLOAT, 1);
+}
+
+// Relax the overlaps of the bodies predicted by the integrator, in place
+// NOTE: Lists must be up to date with the input of the step, see UpdateNeighbourLists()
+void SolveContacts(ContactSolver solver, unsigned int inputBuffer, unsigned int bodyBuffer, unsigned int instanceBuffer, NeighbourLists lists, float boxSize)
+{
+    int stage = 0;
+    int iteration = 0;
+    int sleeping = solver.sleeping? 1 : 0;
+    float rho2 = solver.spectralRadius*solver.spectralRadius;
+    float omega = 1.0f;
+
+    rlEnableShader(solver.program);
+    rlBindShaderBuffer(inputBuffer, 0);
+    rlBindShaderBuffer(bodyBuffer, 1);
+    rlBindShaderBuffer(instanceBuffer, 2);
+    rlBindShaderBuffer(lists.listBuffer, 20);
+    rlBindShaderBuffer(solver.positionBuffer, 23);
+    rlBindShaderBuffer(solver.normalBuffer, 24);
+    rlSetUniform(solver.timeStepLoc, &solver.timeStep, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(solver.relaxationLoc, &solver.relaxation, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(solver.boxSizeLoc, &boxSize, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(solver.sleepingLoc, &sleeping, RL_SHADER_UNIFORM_INT, 1);
+
+    rlSetUniform(solver.stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(NUM_BODIES/CONTACT_GROUP_SIZE, 1, 1);
+
+    stage = 1;
+    rlSetUniform(solver.stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+
+    for (iteration = 0; iteration < solver.iterations; iteration++)
+    {
+        // Chebyshev weights: 1 while plain, then omega(k+1) = 4/(4 - rho^2*omega(k))
+        if (iteration < CONTACT_CHEBYSHEV_DELAY) omega = 1.0f;
+        else if (iteration == CONTACT_CHEBYSHEV_DELAY) omega = 2.0f/(2.0f - rho2);
+        else omega = 4.0f/(4.0f - rho2*omega);
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        rlSetUniform(solver.iterationLoc, &iteration, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(solver.omegaLoc, &omega, RL_SHADER_UNIFORM_FLOAT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/CONTACT_GROUP_SIZE, 1, 1);
+    }
+
+    // Solved positions are in the half the last sweep wrote
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    stage = 2;
+    rlSetUniform(solver.stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(solver.iterationLoc, &iteration, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(NUM_BODIES/CONTACT_GROUP_SIZE, 1, 1);
+
+    rlDisableShader();
+}
+
+#endif // NBODY_CONTACTS_IMPLEMENTATION
@@ -0,0 +1,177 @@
+/**********************************************************************************************
+*
+*   nbody.cpu - CPU reference integrator
+*
+*   Plain C port of one nbody.comp step: same pair loop order, same contact response and
+*   same single precision operations, so it can be diffed against the GPU path and against
+*   stored snapshots (see tests/nbody_regression.c). It is meant to be obviously correct,
+*   not fast, every step is O(n^2) on a single thread.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_CPU_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   NOTE: Does not depend on raylib, only on the C standard library.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_CPU_H
+#define NBODY_CPU_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+// IMPORTANT: These must match the defines and constants in nbody.comp
+#define BODY_RADIUS             1.0f
+#define BODY_TIME_STEP          0.008f
+#define BODY_GM                 (1.0f/BODY_TIME_STEP)   // Gravity changes velocity by 1/dist^2 per step
+#define BODY_DAMPING            0.998f      // Velocity kept after each step
+#define CONTACT_SEPARATION      1.99f       // Overlap divisor of the position correction
+#define CONTACT_RESTITUTION     1.08f       // Normal velocity divisor of the contact response
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Body state, std430 layout
+// NOTE: matches the nbody structure defined in nbody.comp
+typedef struct Body {
+    float px;
+    float py;
+    float pz;
+    float vx;
+    float vy;
+    float vz;
+} Body;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+void StepBodiesReference(const Body *bodies, Body *result, float *potentials, int count);  // Integrate one step, potentials may be NULL
+void AccumulateBodyTile(Body *targets, float *potentials, int targetFirst, int targetCount, const Body *tile, int tileFirst, int tileCount);  // Apply pair interactions of a tile
+void ApplyBodyPair(Body *body, float *potential, const Body *otherBody);                    // Apply the interaction of one body, potential must not be NULL
+void IntegrateBodies(Body *bodies, int count);                                              // Drift and damp, ends a step
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_CPU_H
+
+
+/***********************************************************************************
+*
+*   NBODY CPU IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_CPU_IMPLEMENTATION)
+
+#include <math.h>           // Required for: sqrtf()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Integrate one step from bodies into result, optionally writing the potential of each input body
+void StepBodiesReference(const Body *bodies, Body *result, float *potentials, int count)
+{
+    for (int i = 0; i < count; i++) result[i] = bodies[i];
+    if (potentials != NULL) for (int i = 0; i < count; i++) potentials[i] = 0.0f;
+
+    AccumulateBodyTile(result, potentials, 0, count, bodies, 0, count);
+    IntegrateBodies(result, count);
+}
+
+// Apply the pair interactions of a tile of input bodies to a range of bodies being integrated
+// NOTE: targets hold the input state of bodies [targetFirst, targetFirst + targetCount) on the
+// first tile and are updated in place, tile bodies are [tileFirst, tileFirst + tileCount) of
+// the input state. Self pairs are skipped by index. Like the GPU path, each body resolves its
+// contacts against the input state of the others while its own position moves, the response
+// is not symmetric and depends on the tile order
+void AccumulateBodyTile(Body *targets, float *potentials, int targetFirst, int targetCount, const Body *tile, int tileFirst, int tileCount)
+{
+    for (int t = 0; t < targetCount; t++)
+    {
+        Body newBody = targets[t];
+        float potential = 0.0f;
+
+        for (int i = 0; i < tileCount; i++)
+        {
+            if ((tileFirst + i) != (targetFirst + t)) ApplyBodyPair(&newBody, &potential, &tile[i]);
+        }
+
+        targets[t] = newBody;
+        if (potentials != NULL) potentials[t] += potential;
+    }
+}
+
+// Apply the interaction of one input body to a body being integrated, contact or gravity
+// NOTE: Contact moves body out of the overlap, later pairs see the corrected position
+void ApplyBodyPair(Body *body, float *potential, const Body *otherBody)
+{
+    float dx = body->px - otherBody->px;
+    float dy = body->py - otherBody->py;
+    float dz = body->pz - otherBody->pz;
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+
+    if (dist < 0.001f) return;
+
+    // normalize() is v*inversesqrt(dot(v, v))
+    float invLength = 1.0f/sqrtf(dx*dx + dy*dy + dz*dz);
+    float ux = dx*invLength;
+    float uy = dy*invLength;
+    float uz = dz*invLength;
+
+    if (dist < (2.0f*BODY_RADIUS))
+    {
+        // No gravity in contact, potential stays flat below 2*BODY_RADIUS
+        *potential -= BODY_GM/(2.0f*BODY_RADIUS);
+
+        float depth = ((2.0f*BODY_RADIUS) - dist)/CONTACT_SEPARATION;
+        body->px += ux*depth;
+        body->py += uy*depth;
+        body->pz += uz*depth;
+
+        float b1Vel = body->vx*ux + body->vy*uy + body->vz*uz;
+        float b2Vel = otherBody->vx*ux + otherBody->vy*uy + otherBody->vz*uz;
+
+        float response = (b1Vel - b2Vel)/CONTACT_RESTITUTION;
+
+        body->vx -= ux*response;
+        body->vy -= uy*response;
+        body->vz -= uz*response;
+    }
+    else
+    {
+        float dist2 = dist*dist;
+        *potential -= BODY_GM/dist;
+
+        body->vx -= ux/dist2;
+        body->vy -= uy/dist2;
+        body->vz -= uz/dist2;
+    }
+}
+
+// Drift positions by the accumulated velocities and damp them, ends a step
+void IntegrateBodies(Body *bodies, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        bodies[i].px += bodies[i].vx*BODY_TIME_STEP;
+        bodies[i].py += bodies[i].vy*BODY_TIME_STEP;
+        bodies[i].pz += bodies[i].vz*BODY_TIME_STEP;
+        bodies[i].vx *= BODY_DAMPING;
+        bodies[i].vy *= BODY_DAMPING;
+        bodies[i].vz *= BODY_DAMPING;
+    }
+}
+
+#endif // NBODY_CPU_IMPLEMENTATION
@@ -0,0 +1,282 @@
+/**********************************************************************************************
+*
+*   nbody.deferred - Deferred shading path for the instanced bodies
+*
+*   The geometry pass writes normals, albedo and depth of the instanced spheres into a
+*   G-buffer, the lighting pass then shades each covered pixel exactly once with the same
+*   lights as the forward path (directional light + clustered point lights). In dense clumps
+*   the forward path shades every overdrawn fragment, here shading cost only depends on
+*   the screen coverage.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_DEFERRED_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   The forward path can also render offscreen into the albedo texture and the G-buffer depth
+*   (BeginForwardTarget()), which makes the scene depth available to later passes in both
+*   shading modes, see nbody_hiz.h.
+*
+*   DEPENDENCIES:
+*       nbody_lights.h      Cluster layout uniforms and light SSBOs used by the lighting pass
+*       nbody_shadercache.h Cached geometry, lighting and resolve shaders
+*
+**********************************************************************************************/
+
+#ifndef NBODY_DEFERRED_H
+#define NBODY_DEFERRED_H
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// G-buffer data
+typedef struct GBuffer {
+    unsigned int framebuffer;
+    unsigned int normalTexture;     // RGB16F: world space normal
+    unsigned int albedoTexture;     // RGBA8: albedo
+    unsigned int depthTexture;      // Depth, used to rebuild world position
+    unsigned int forwardFramebuffer; // Forward shading target: albedoTexture + depthTexture
+    int width;
+    int height;
+} GBuffer;
+
+// Deferred renderer data
+typedef struct DeferredRenderer {
+    GBuffer gbuffer;
+    Shader geometryShader;          // gbuffer_instancing.vs + gbuffer.fs
+    Shader lightingShader;          // deferred_shading.vs + deferred_shading.fs
+    Material geometryMaterial;      // Material used to draw bodies into the G-buffer
+    Shader geometryIndirectShader;  // gbuffer_indirect.vs + gbuffer.fs, culled instances
+    Material geometryIndirectMaterial;
+    Shader resolveShader;           // deferred_shading.vs + scene_resolve.fs
+    int invViewProjLoc;
+} DeferredRenderer;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+DeferredRenderer LoadDeferredRenderer(int width, int height);           // Load G-buffer and deferred shaders
+void UnloadDeferredRenderer(DeferredRenderer renderer);                 // Unload G-buffer and deferred shaders
+void BeginDeferredGeometry(DeferredRenderer renderer);                  // Begin drawing into the G-buffer
+void EndDeferredGeometry(void);                                         // End drawing into the G-buffer
+void DrawDeferredLighting(DeferredRenderer renderer, Camera camera, float aspect); // Shade G-buffer into the current framebuffer
+void BeginForwardTarget(DeferredRenderer renderer);                     // Begin forward drawing into the offscreen target
+void EndForwardTarget(void);                                            // End forward drawing into the offscreen target
+void DrawForwardResolve(DeferredRenderer renderer);                     // Copy offscreen forward target into the current framebuffer
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_DEFERRED_H
+
+
+/***********************************************************************************
+*
+*   NBODY DEFERRED IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_DEFERRED_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "raymath.h"
+#include "rlgl.h"
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load G-buffer and deferred shaders
+DeferredRenderer LoadDeferredRenderer(int width, int height)
+{
+    DeferredRenderer renderer = { 0 };
+
+    // Initialize the G-buffer
+    GBuffer gbuffer = { 0 };
+    gbuffer.width = width;
+    gbuffer.height = height;
+    gbuffer.framebuffer = rlLoadFramebuffer(width, height);
+
+    rlEnableFramebuffer(gbuffer.framebuffer);
+    gbuffer.normalTexture = rlLoadTexture(NULL, width, height, RL_PIXELFORMAT_UNCOMPRESSED_R16G16B16, 1);
+    gbuffer.albedoTexture = rlLoadTexture(NULL, width, height, RL_PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, 1);
+    gbuffer.depthTexture = rlLoadTextureDepth(width, height, false);
+
+    rlActiveDrawBuffers(2);
+    rlFramebufferAttach(gbuffer.framebuffer, gbuffer.normalTexture, RL_ATTACHMENT_COLOR_CHANNEL0, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlFramebufferAttach(gbuffer.framebuffer, gbuffer.albedoTexture, RL_ATTACHMENT_COLOR_CHANNEL1, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlFramebufferAttach(gbuffer.framebuffer, gbuffer.depthTexture, RL_ATTACHMENT_DEPTH, RL_ATTACHMENT_TEXTURE2D, 0);
+
+    if (!rlFramebufferComplete(gbuffer.framebuffer)) TraceLog(LOG_WARNING, "DEFERRED: G-buffer framebuffer is not complete");
+    rlDisableFramebuffer();
+
+    // Forward target shares the G-buffer textures, no extra memory
+    gbuffer.forwardFramebuffer = rlLoadFramebuffer(width, height);
+
+    rlEnableFramebuffer(gbuffer.forwardFramebuffer);
+    rlFramebufferAttach(gbuffer.forwardFramebuffer, gbuffer.albedoTexture, RL_ATTACHMENT_COLOR_CHANNEL0, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlFramebufferAttach(gbuffer.forwardFramebuffer, gbuffer.depthTexture, RL_ATTACHMENT_DEPTH, RL_ATTACHMENT_TEXTURE2D, 0);
+
+    if (!rlFramebufferComplete(gbuffer.forwardFramebuffer)) TraceLog(LOG_WARNING, "DEFERRED: Forward target framebuffer is not complete");
+    rlDisableFramebuffer();
+
+    renderer.gbuffer = gbuffer;
+
+    // Geometry pass shader
+    renderer.geometryShader = LoadShaderCached("resources/shaders/glsl430/gbuffer_instancing.vs", "resources/shaders/glsl430/gbuffer.fs", NULL);
+    renderer.geometryShader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(renderer.geometryShader, "mvp");
+    renderer.geometryShader.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(renderer.geometryShader, "instancePosition");
+
+    renderer.geometryMaterial = LoadMaterialDefault();
+    renderer.geometryMaterial.shader = renderer.geometryShader;
+    renderer.geometryMaterial.maps[MATERIAL_MAP_DIFFUSE].color = WHITE;
+
+    renderer.geometryIndirectShader = LoadShaderCached("resources/shaders/glsl430/gbuffer_indirect.vs", "resources/shaders/glsl430/gbuffer.fs", NULL);
+    renderer.geometryIndirectShader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(renderer.geometryIndirectShader, "mvp");
+
+    renderer.geometryIndirectMaterial = LoadMaterialDefault();
+    renderer.geometryIndirectMaterial.shader = renderer.geometryIndirectShader;
+    renderer.geometryIndirectMaterial.maps[MATERIAL_MAP_DIFFUSE].color = WHITE;
+
+    // Lighting pass shader
+    renderer.lightingShader = LoadShaderCached("resources/shaders/glsl430/deferred_shading.vs", "resources/shaders/glsl430/deferred_shading.fs", NULL);
+    renderer.lightingShader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(renderer.lightingShader, "viewPos");
+    renderer.lightingShader.locs[SHADER_LOC_MATRIX_VIEW] = GetShaderLocation(renderer.lightingShader, "matView");
+    renderer.invViewProjLoc = GetShaderLocation(renderer.lightingShader, "invViewProj");
+
+    rlEnableShader(renderer.lightingShader.id);
+        rlSetUniform(rlGetLocationUniform(renderer.lightingShader.id, "gNormal"), (int[1]){ 0 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+        rlSetUniform(rlGetLocationUniform(renderer.lightingShader.id, "gAlbedo"), (int[1]){ 1 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+        rlSetUniform(rlGetLocationUniform(renderer.lightingShader.id, "gDepth"), (int[1]){ 2 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+    rlDisableShader();
+
+    SetLightClustersShaderValues(renderer.lightingShader, width, height);
+
+    // Forward target resolve shader
+    renderer.resolveShader = LoadShaderCached("resources/shaders/glsl430/deferred_shading.vs", "resources/shaders/glsl430/scene_resolve.fs", NULL);
+
+    rlEnableShader(renderer.resolveShader.id);
+        rlSetUniform(rlGetLocationUniform(renderer.resolveShader.id, "sceneColor"), (int[1]){ 0 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+        rlSetUniform(rlGetLocationUniform(renderer.resolveShader.id, "sceneDepth"), (int[1]){ 1 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+    rlDisableShader();
+
+    return renderer;
+}
+
+// Unload G-buffer and deferred shaders
+void UnloadDeferredRenderer(DeferredRenderer renderer)
+{
+    rlUnloadFramebuffer(renderer.gbuffer.framebuffer);
+    rlUnloadFramebuffer(renderer.gbuffer.forwardFramebuffer);
+    rlUnloadTexture(renderer.gbuffer.normalTexture);
+    rlUnloadTexture(renderer.gbuffer.albedoTexture);
+    rlUnloadTexture(renderer.gbuffer.depthTexture);
+
+    UnloadShader(renderer.geometryShader);
+    UnloadShader(renderer.geometryIndirectShader);
+    UnloadShader(renderer.lightingShader);
+    UnloadShader(renderer.resolveShader);
+}
+
+// Begin drawing into the G-buffer
+// NOTE: Bodies must be drawn with renderer.geometryMaterial inside BeginMode3D()
+void BeginDeferredGeometry(DeferredRenderer renderer)
+{
+    rlEnableFramebuffer(renderer.gbuffer.framebuffer);
+    rlActiveDrawBuffers(2);
+    rlClearColor(0, 0, 0, 0);
+    rlClearScreenBuffers();
+    rlDisableColorBlend();
+}
+
+// End drawing into the G-buffer
+void EndDeferredGeometry(void)
+{
+    rlEnableColorBlend();
+    rlDisableFramebuffer();
+}
+
+// Shade G-buffer into the current framebuffer
+// NOTE: Light clusters must be bound and up to date, see BindLightClusters()
+void DrawDeferredLighting(DeferredRenderer renderer, Camera camera, float aspect)
+{
+    Matrix matView = GetCameraMatrix(camera);
+    Matrix matProj = MatrixPerspective(camera.fovy*DEG2RAD, aspect, RL_CULL_DISTANCE_NEAR, RL_CULL_DISTANCE_FAR);
+    Matrix invViewProj = MatrixInvert(MatrixMultiply(matView, matProj));
+
+    float cameraPos[3] = { camera.position.x, camera.position.y, camera.position.z };
+
+    rlEnableDepthTest();
+    rlDisableColorBlend();
+
+    rlEnableShader(renderer.lightingShader.id);
+        rlSetUniformMatrix(renderer.invViewProjLoc, invViewProj);
+        rlSetUniformMatrix(renderer.lightingShader.locs[SHADER_LOC_MATRIX_VIEW], matView);
+        rlSetUniform(renderer.lightingShader.locs[SHADER_LOC_VECTOR_VIEW], cameraPos, RL_SHADER_UNIFORM_VEC3, 1);
+
+        rlActiveTextureSlot(0);
+        rlEnableTexture(renderer.gbuffer.normalTexture);
+        rlActiveTextureSlot(1);
+        rlEnableTexture(renderer.gbuffer.albedoTexture);
+        rlActiveTextureSlot(2);
+        rlEnableTexture(renderer.gbuffer.depthTexture);
+
+        // Fullscreen quad shaded by the deferred shader
+        rlLoadDrawQuad();
+
+        rlActiveTextureSlot(2);
+        rlDisableTexture();
+        rlActiveTextureSlot(1);
+        rlDisableTexture();
+        rlActiveTextureSlot(0);
+        rlDisableTexture();
+    rlDisableShader();
+
+    rlEnableColorBlend();
+    rlDisableDepthTest();
+}
+
+// Begin forward drawing into the offscreen target
+void BeginForwardTarget(DeferredRenderer renderer)
+{
+    rlEnableFramebuffer(renderer.gbuffer.forwardFramebuffer);
+    rlClearColor(0, 0, 0, 0);
+    rlClearScreenBuffers();
+}
+
+// End forward drawing into the offscreen target
+void EndForwardTarget(void)
+{
+    rlDisableFramebuffer();
+}
+
+// Copy offscreen forward target (color and depth) into the current framebuffer
+void DrawForwardResolve(DeferredRenderer renderer)
+{
+    rlEnableDepthTest();
+
+    rlEnableShader(renderer.resolveShader.id);
+        rlActiveTextureSlot(0);
+        rlEnableTexture(renderer.gbuffer.albedoTexture);
+        rlActiveTextureSlot(1);
+        rlEnableTexture(renderer.gbuffer.depthTexture);
+
+        rlLoadDrawQuad();
+
+        rlDisableTexture();
+        rlActiveTextureSlot(0);
+        rlDisableTexture();
+    rlDisableShader();
+
+    rlDisableDepthTest();
+}
+
+#endif // NBODY_DEFERRED_IMPLEMENTATION
@@ -0,0 +1,332 @@
+/**********************************************************************************************
+*
+*   nbody.edits - Runtime body edits applied on GPU from a command queue
+*
+*   Interactive or scripted edits are queued on CPU as small commands and applied at the start
+*   of the next step by body_edit.comp, bodies never come back to the CPU:
+*
+*       Spawn       count bodies uniformly in a ball, all with the same velocity
+*       Delete      bodies in a ball are parked, their ids pushed on the free list
+*       Impulse     velocity change of the bodies in a ball
+*       Velocity    velocity of the bodies in a ball set to a uniform velocity plus a rotation
+*                   about the vertical axis through the center (swirl)
+*
+*   Only the queued commands are uploaded, the upload is proportional to the edit. Spawns run
+*   one thread per spawned body and pop stable ids off a GPU free list with atomics. Region
+*   commands are matched by one pass over the slots (no spatial index), a few microseconds for
+*   NUM_BODIES, and nothing runs when the queue is empty.
+*
+*   The body count is fixed at NUM_BODIES, a free slot holds a parked body: px is BODY_PARKED,
+*   at rest. Every body pass skips parked bodies (no forces, no contacts, no stats) and they
+*   are drawn with no radius. The free list holds stable ids rather than slots, reordering
+*   moves bodies between slots (see nbody_reorder.h).
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_EDITS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input of the next step, edited in place)
+*      17 - uint bodyIds[]                      (slot -> id, see nbody_reorder.h)
+*      18 - uint bodySlots[]                    (id -> slot)
+*      25 - free list                           (counters, free ids)
+*      26 - commands                            (header, commands of the queue)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the counters
+*
+*   One stable id can be watched (the picked body, see nbody_picking.h): deletes report it
+*   through the counters readback, since a spawn may hand its id to a new body right away.
+*
+*   NOTE: Spawns and deletes change which slots hold bodies, neighbour lists and trails must be
+*   invalidated when ApplyBodyEdits() returns true. Spawns beyond the free ids are dropped
+*
+**********************************************************************************************/
+
+#ifndef NBODY_EDITS_H
+#define NBODY_EDITS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+
+// IMPORTANT: These must match the defines in body_edit.comp (and BODY_PARKED in every body pass)
+#define BODY_PARKED                 1.0e18f     // px of a free slot
+#define EDIT_MAX_COMMANDS           64          // Commands applied per step
+#define EDIT_GROUP_SIZE             64
+#define EDIT_NOT_DELETED            0xffffffffu     // watchedDeleted while the watched id is kept
+
+#define EDIT_READBACK_SLOTS         2           // Counters in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Body edit command type
+// NOTE: Values must match body_edit.comp
+typedef enum {
+    BODY_EDIT_SPAWN = 0,
+    BODY_EDIT_DELETE,
+    BODY_EDIT_IMPULSE,
+    BODY_EDIT_VELOCITY
+} BodyEditType;
+
+// Body edit command, std430 layout of body_edit.comp BodyEditCmd
+typedef struct BodyEditCommand {
+    float center[4];                // xyz: center of the region, w: radius
+    float vector[4];                // xyz: velocity or impulse, w: spin of the velocity field about +Y (rad/s)
+    unsigned int type;              // BodyEditType
+    unsigned int count;             // Bodies spawned
+    unsigned int seed;              // Spawn positions seed
+    unsigned int first;             // First spawn thread of the command
+} BodyEditCommand;
+
+// Command buffer, std430 layout of body_edit.comp binding 26
+typedef struct BodyEditCommands {
+    unsigned int commandCount;
+    unsigned int spawnCount;        // Spawn threads of all commands
+    unsigned int padding[2];
+    BodyEditCommand commands[EDIT_MAX_COMMANDS];
+} BodyEditCommands;
+
+// Free list counters, std430 layout of the head of body_edit.comp binding 25
+typedef struct BodyEditCounters {
+    unsigned int freeCount;         // Ids on the free list
+    unsigned int spawned;           // Counters since load
+    unsigned int deleted;
+    unsigned int dropped;           // Spawns left undone, no free id
+    unsigned int watchedDeleted;    // Watched id once a delete hit it, EDIT_NOT_DELETED after each readback
+    unsigned int padding[3];
+} BodyEditCounters;
+
+// Body edit queue data
+typedef struct BodyEditQueue {
+    unsigned int program;
+    unsigned int commandBuffer;     // SSBO: BodyEditCommands
+    unsigned int freeBuffer;        // SSBO: BodyEditCounters, uint[NUM_BODIES]
+    ReadbackQueue counterReadback;
+
+    BodyEditCommands queued;        // Commands of the next apply
+    unsigned int seed;              // Next spawn seed
+
+    long long applies;              // Non empty applies since load
+    BodyEditCounters counters;      // Read back a few frames late
+
+    int watchedId;                  // Stable id whose delete is reported, -1 when none
+    bool watchedDeleted;            // A readback showed watchedId deleted, reset by the caller
+
+    int stageLoc;
+    int watchedIdLoc;
+} BodyEditQueue;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+BodyEditQueue LoadBodyEditQueue(const unsigned int *freeIds, int freeCount);    // Load edit program and buffers, ids of the parked bodies given
+void UnloadBodyEditQueue(BodyEditQueue queue);                                  // Unload edit program and buffers
+bool QueueBodySpawn(BodyEditQueue *queue, Vector3 center, float radius, int count, Vector3 velocity);  // Queue bodies spawned in a ball
+bool QueueBodyDelete(BodyEditQueue *queue, Vector3 center, float radius);       // Queue deletion of the bodies in a ball
+bool QueueBodyImpulse(BodyEditQueue *queue, Vector3 center, float radius, Vector3 impulse);  // Queue a velocity change of the bodies in a ball
+bool QueueBodyVelocityField(BodyEditQueue *queue, Vector3 center, float radius, Vector3 velocity, float spin);  // Queue a velocity field over the bodies in a ball
+bool ApplyBodyEdits(BodyEditQueue *queue, unsigned int bodyBuffer, unsigned int idBuffer, unsigned int slotBuffer);  // Apply queued commands, true when slots changed
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_EDITS_H
+
+
+/***********************************************************************************
+*
+*   NBODY EDITS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_EDITS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stddef.h>         // Required for: offsetof()
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static bool QueueBodyEdit(BodyEditQueue *queue, BodyEditCommand command);  // Append a command, false when the queue is full
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load edit program and buffers
+// NOTE: freeIds are the stable ids of the bodies parked at init, freeCount <= NUM_BODIES
+BodyEditQueue LoadBodyEditQueue(const unsigned int *freeIds, int freeCount)
+{
+    BodyEditQueue queue = { 0 };
+
+    queue.program = LoadComputeProgramCached("resources/shaders/glsl430/body_edit.comp", NULL);
+    queue.stageLoc = rlGetLocationUniform(queue.program, "stage");
+    queue.watchedIdLoc = rlGetLocationUniform(queue.program, "watchedId");
+
+    queue.commandBuffer = rlLoadShaderBuffer(sizeof(BodyEditCommands), NULL, RL_DYNAMIC_DRAW);
+    queue.freeBuffer = rlLoadShaderBuffer(sizeof(BodyEditCounters) + NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    queue.counterReadback = LoadReadbackQueue(EDIT_READBACK_SLOTS, sizeof(BodyEditCounters));
+
+    queue.counters.freeCount = (freeCount > 0)? (unsigned int)freeCount : 0;
+    queue.counters.watchedDeleted = EDIT_NOT_DELETED;
+    rlUpdateShaderBuffer(queue.freeBuffer, &queue.counters, sizeof(BodyEditCounters), 0);
+    if (freeCount > 0) rlUpdateShaderBuffer(queue.freeBuffer, freeIds, freeCount*sizeof(unsigned int), sizeof(BodyEditCounters));
+
+    queue.seed = 1;
+    queue.watchedId = -1;
+
+    return queue;
+}
+
+// Unload edit program and buffers
+void UnloadBodyEditQueue(BodyEditQueue queue)
+{
+    rlUnloadShaderBuffer(queue.commandBuffer);
+    rlUnloadShaderBuffer(queue.freeBuffer);
+    UnloadReadbackQueue(queue.counterReadback);
+    rlUnloadShaderProgram(queue.program);
+}
+
+// Queue count bodies spawned uniformly in a ball, all at velocity
+bool QueueBodySpawn(BodyEditQueue *queue, Vector3 center, float radius, int count, Vector3 velocity)
+{
+    if (count <= 0) return true;
+    if (((int)queue->queued.spawnCount + count) > NUM_BODIES) count = NUM_BODIES - (int)queue->queued.spawnCount;
+
+    BodyEditCommand command = { { center.x, center.y, center.z, radius }, { velocity.x, velocity.y, velocity.z, 0.0f }, BODY_EDIT_SPAWN, (unsigned int)count, queue->seed, queue->queued.spawnCount };
+    if (!QueueBodyEdit(queue, command)) return false;
+
+    queue->queued.spawnCount += (unsigned int)count;
+    queue->seed = queue->seed*1664525u + 1013904223u;
+
+    return true;
+}
+
+// Queue deletion of the bodies in a ball, their ids are free for later spawns
+bool QueueBodyDelete(BodyEditQueue *queue, Vector3 center, float radius)
+{
+    BodyEditCommand command = { { center.x, center.y, center.z, radius }, { 0 }, BODY_EDIT_DELETE, 0, 0, 0 };
+    return QueueBodyEdit(queue, command);
+}
+
+// Queue a velocity change of the bodies in a ball
+bool QueueBodyImpulse(BodyEditQueue *queue, Vector3 center, float radius, Vector3 impulse)
+{
+    BodyEditCommand command = { { center.x, center.y, center.z, radius }, { impulse.x, impulse.y, impulse.z, 0.0f }, BODY_EDIT_IMPULSE, 0, 0, 0 };
+    return QueueBodyEdit(queue, command);
+}
+
+// Queue a velocity field over the bodies in a ball: velocity plus a rotation of spin rad/s
+// about the vertical axis through the center
+bool QueueBodyVelocityField(BodyEditQueue *queue, Vector3 center, float radius, Vector3 velocity, float spin)
+{
+    BodyEditCommand command = { { center.x, center.y, center.z, radius }, { velocity.x, velocity.y, velocity.z, spin }, BODY_EDIT_VELOCITY, 0, 0, 0 };
+    return QueueBodyEdit(queue, command);
+}
+
+// Apply the queued commands to the bodies in queue order, then clear the queue
+// NOTE: Must run on the bodies the integrator reads next, after any reorder. Returns true when
+// spawns or deletes were applied, slots changed. Counters of earlier applies are collected here,
+// watchedDeleted is set once they show a delete of watchedId
+bool ApplyBodyEdits(BodyEditQueue *queue, unsigned int bodyBuffer, unsigned int idBuffer, unsigned int slotBuffer)
+{
+    for (int slot = PollReadback(&queue->counterReadback); slot >= 0; slot = PollReadback(&queue->counterReadback))
+    {
+        queue->counters = *(const BodyEditCounters *)GetReadbackData(queue->counterReadback, slot);
+        if ((queue->watchedId >= 0) && (queue->counters.watchedDeleted == (unsigned int)queue->watchedId)) queue->watchedDeleted = true;
+        ReleaseReadback(&queue->counterReadback, slot);
+    }
+
+    if (queue->queued.commandCount == 0) return false;
+
+    bool slotsChanged = (queue->queued.spawnCount > 0);
+    bool regionCommands = false;
+
+    for (unsigned int i = 0; i < queue->queued.commandCount; i++)
+    {
+        if (queue->queued.commands[i].type == BODY_EDIT_DELETE) slotsChanged = true;
+        if (queue->queued.commands[i].type != BODY_EDIT_SPAWN) regionCommands = true;
+    }
+
+    // Header and queued commands only
+    rlUpdateShaderBuffer(queue->commandBuffer, &queue->queued, offsetof(BodyEditCommands, commands) + queue->queued.commandCount*sizeof(BodyEditCommand), 0);
+
+    int stage = 0;
+
+    rlEnableShader(queue->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(idBuffer, 17);
+    rlBindShaderBuffer(slotBuffer, 18);
+    rlBindShaderBuffer(queue->freeBuffer, 25);
+    rlBindShaderBuffer(queue->commandBuffer, 26);
+
+    // Region commands, deletes push their ids before the spawns pop
+    if (regionCommands)
+    {
+        rlSetUniform(queue->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(queue->watchedIdLoc, &queue->watchedId, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/EDIT_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    if (queue->queued.spawnCount > 0)
+    {
+        stage = 1;
+        rlSetUniform(queue->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch((queue->queued.spawnCount + EDIT_GROUP_SIZE - 1)/EDIT_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    rlDisableShader();
+
+    queue->applies++;
+
+    // A watched delete stays reported until a copy of the counters holds it
+    if (RequestReadback(&queue->counterReadback, queue->freeBuffer, 0, sizeof(BodyEditCounters), queue->applies) >= 0)
+    {
+        unsigned int notDeleted = EDIT_NOT_DELETED;
+        rlUpdateShaderBuffer(queue->freeBuffer, &notDeleted, sizeof(unsigned int), offsetof(BodyEditCounters, watchedDeleted));
+    }
+
+    queue->queued.commandCount = 0;
+    queue->queued.spawnCount = 0;
+
+    return slotsChanged;
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Append a command to the queue, false when the queue is full
+static bool QueueBodyEdit(BodyEditQueue *queue, BodyEditCommand command)
+{
+    if (queue->queued.commandCount >= EDIT_MAX_COMMANDS)
+    {
+        TraceLog(LOG_WARNING, "EDITS: Queue full, command dropped");
+        return false;
+    }
+
+    queue->queued.commands[queue->queued.commandCount] = command;
+    queue->queued.commandCount++;
+
+    return true;
+}
+
+#endif // NBODY_EDITS_IMPLEMENTATION
@@ -0,0 +1,236 @@
+/**********************************************************************************************
+*
+*   nbody.ewald - Periodic box with Ewald summed gravity
+*
+*   In periodic mode nbody.comp wraps bodies into a cube of side boxSize centered on the
+*   origin and takes every pair at its minimum image, contacts included. The gravity of all
+*   the other images (and of the uniform background that keeps the infinite sum finite) is
+*   added as a correction looked up in a precomputed table, instead of summing the Ewald
+*   series for each pair.
+*
+*   The correction is the Ewald sum minus the minimum image Newton term, it is smooth inside
+*   the box and scales as F(r) = f(r/L)/L^2, so it is tabulated once for a unit box. Forces
+*   are odd and potentials even along each axis, the table only covers the octant [0, 1/2]^3
+*   and the shader restores the signs. It is stored as a RGBA32F 3D texture (xyz: velocity
+*   change, w: potential) sampled with trilinear filtering.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_EWALD_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define EWALD_BOX_SIZE
+*       May be defined before including this file to override the default below.
+*
+*   SHADER BINDINGS:
+*       texture unit 0 - sampler3D ewaldTable   (read by nbody.comp)
+*
+*   NOTE: The self images of a body only add a constant to the potential, it is left out
+*
+**********************************************************************************************/
+
+#ifndef NBODY_EWALD_H
+#define NBODY_EWALD_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef EWALD_BOX_SIZE
+    #define EWALD_BOX_SIZE          500.0f      // Default periodic box side
+#endif
+
+// IMPORTANT: Must match the define in nbody.comp
+#define EWALD_TABLE_SIZE            32          // Texels per axis over half a unit box
+
+#define EWALD_ALPHA                 2.0         // Real/reciprocal space split, in 1/box side
+#define EWALD_REAL_CUTOFF           3.6         // Real space images within this distance
+#define EWALD_RECIPROCAL_CUTOFF     10          // Reciprocal vectors with |h|^2 up to this
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Periodic box data
+typedef struct EwaldTable {
+    unsigned int texture;           // RGBA32F 3D texture, EWALD_TABLE_SIZE^3
+    float boxSize;                  // Box side used when periodic mode is enabled
+
+    int boxSizeLoc;                 // Integrator uniform location
+} EwaldTable;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+EwaldTable LoadEwaldTable(unsigned int integratorProgram, float boxSize);  // Tabulate the correction, upload it
+void UnloadEwaldTable(EwaldTable table);                                    // Unload correction texture
+void BindEwaldTable(EwaldTable table, bool periodic);                       // Bind table and box side to the enabled integrator program
+void ComputeEwaldCorrection(double x, double y, double z, double *correction);  // Correction of the unit box at (x, y, z), xyz: velocity change, w: potential
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_EWALD_H
+
+
+/***********************************************************************************
+*
+*   NBODY EWALD IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_EWALD_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glTexImage3D()
+
+#include <math.h>           // Required for: sqrt(), exp(), erf(), erfc(), sin(), cos(), floor()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Tabulate the unit box correction over [0, 1/2]^3 and upload it as a 3D texture
+// NOTE: Texel i holds the correction at i/(2*(EWALD_TABLE_SIZE - 1)), so the table ends lie
+// on texel centers, the shader maps offsets accordingly
+EwaldTable LoadEwaldTable(unsigned int integratorProgram, float boxSize)
+{
+    EwaldTable table = { 0 };
+    float *texels = (float *)RL_MALLOC(EWALD_TABLE_SIZE*EWALD_TABLE_SIZE*EWALD_TABLE_SIZE*4*sizeof(float));
+
+    for (int k = 0; k < EWALD_TABLE_SIZE; k++)
+    {
+        for (int j = 0; j < EWALD_TABLE_SIZE; j++)
+        {
+            for (int i = 0; i < EWALD_TABLE_SIZE; i++)
+            {
+                double correction[4] = { 0 };
+                ComputeEwaldCorrection(0.5*i/(EWALD_TABLE_SIZE - 1), 0.5*j/(EWALD_TABLE_SIZE - 1), 0.5*k/(EWALD_TABLE_SIZE - 1), correction);
+
+                float *texel = &texels[((k*EWALD_TABLE_SIZE + j)*EWALD_TABLE_SIZE + i)*4];
+                for (int c = 0; c < 4; c++) texel[c] = (float)correction[c];
+            }
+        }
+    }
+
+    glGenTextures(1, &table.texture);
+    glBindTexture(GL_TEXTURE_3D, table.texture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, EWALD_TABLE_SIZE, EWALD_TABLE_SIZE, EWALD_TABLE_SIZE, 0, GL_RGBA, GL_FLOAT, texels);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    RL_FREE(texels);
+
+    table.boxSize = boxSize;
+    table.boxSizeLoc = rlGetLocationUniform(integratorProgram, "boxSize");
+
+    return table;
+}
+
+// Unload correction texture
+void UnloadEwaldTable(EwaldTable table)
+{
+    rlUnloadTexture(table.texture);
+}
+
+// Bind table (texture unit 0) and box side to the enabled integrator program
+// NOTE: A box side of 0 puts the integrator back in open space
+void BindEwaldTable(EwaldTable table, bool periodic)
+{
+    float boxSize = periodic? table.boxSize : 0.0f;
+
+    rlSetUniform(table.boxSizeLoc, &boxSize, RL_SHADER_UNIFORM_FLOAT, 1);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, periodic? table.texture : 0);
+}
+
+// Correction of the unit box for a pair offset (x, y, z): Ewald sum minus the minimum image
+// Newton term, as a velocity change (xyz, dv = grad(phi)) and a potential (w, phi = sum 1/r)
+// NOTE: Real space terms erfc(a*r)/r over the images, reciprocal space terms
+// exp(-pi^2*h^2/a^2)/(pi*h^2)*cos(2*pi*h.r), minus the uniform background pi/a^2
+void ComputeEwaldCorrection(double x, double y, double z, double *correction)
+{
+    const double alpha = EWALD_ALPHA;
+    const double sqrtPi = sqrt(PI);
+    int range = (int)ceil(EWALD_REAL_CUTOFF);
+
+    double force[3] = { 0.0 };
+    double potential = -PI/(alpha*alpha);
+
+    // Real space, the minimum image Newton term is removed analytically
+    for (int nz = -range; nz <= range; nz++)
+    {
+        for (int ny = -range; ny <= range; ny++)
+        {
+            for (int nx = -range; nx <= range; nx++)
+            {
+                double rx = x + nx;
+                double ry = y + ny;
+                double rz = z + nz;
+                double r = sqrt(rx*rx + ry*ry + rz*rz);
+
+                if (r > EWALD_REAL_CUTOFF) continue;
+
+                bool minimumImage = ((nx == 0) && (ny == 0) && (nz == 0));
+
+                if (minimumImage && (r < 1e-9))
+                {
+                    potential -= 2.0*alpha/sqrtPi;      // Limit of -erf(a*r)/r
+                    continue;
+                }
+
+                double gaussian = 2.0*alpha*r/sqrtPi*exp(-alpha*alpha*r*r);
+                double screen = minimumImage? (erfc(alpha*r) - 1.0) : erfc(alpha*r);
+                double scale = -(screen + gaussian)/(r*r*r);
+
+                force[0] += scale*rx;
+                force[1] += scale*ry;
+                force[2] += scale*rz;
+                potential += screen/r;
+            }
+        }
+    }
+
+    // Reciprocal space
+    int hRange = (int)ceil(sqrt((double)EWALD_RECIPROCAL_CUTOFF));
+
+    for (int hz = -hRange; hz <= hRange; hz++)
+    {
+        for (int hy = -hRange; hy <= hRange; hy++)
+        {
+            for (int hx = -hRange; hx <= hRange; hx++)
+            {
+                int h2 = hx*hx + hy*hy + hz*hz;
+                if ((h2 == 0) || (h2 > EWALD_RECIPROCAL_CUTOFF)) continue;
+
+                double weight = exp(-PI*PI*h2/(alpha*alpha))/(PI*h2);
+                double phase = 2.0*PI*(hx*x + hy*y + hz*z);
+
+                force[0] -= 2.0*PI*weight*hx*sin(phase);
+                force[1] -= 2.0*PI*weight*hy*sin(phase);
+                force[2] -= 2.0*PI*weight*hz*sin(phase);
+                potential += weight*cos(phase);
+            }
+        }
+    }
+
+    correction[0] = force[0];
+    correction[1] = force[1];
+    correction[2] = force[2];
+    correction[3] = potential;
+}
+
+#endif // NBODY_EWALD_IMPLEMENTATION
@@ -0,0 +1,535 @@
+/**********************************************************************************************
+*
+*   nbody.fmm - Fast Multipole Method integrator
+*
+*   Cartesian Taylor series FMM on the adaptive octree of nbody_tree.h:
+*
+*       P2M     Leaf multipoles from their bodies, about the leaf center of mass
+*       M2M     Parent multipoles shifted up from their children
+*       M2L     Multipole of a source cell turned into a local expansion of a target cell
+*       L2L     Local expansions shifted down to the children
+*       L2P     Local expansion gradient applied to the bodies of each leaf
+*       P2P     Near field pairs, body by body with the direct kernel (ApplyBodyPair), contacts included
+*
+*   Cell pairs are found with a dual-tree traversal (Dehnen 2002) starting from (root, root):
+*   well separated pairs interact through M2L both ways, other pairs split the larger cell,
+*   leaf pairs fall back to P2P. The work is O(N) for a given accuracy, the accuracy is set by
+*   the expansion order and the opening angle theta.
+*
+*   Expansions are truncated at total order fmm.order (1 to FMM_MAX_ORDER), multipoles are
+*   M[b] = sum (-d)^b/b! over bodies at offset d from the cell center, locals L[a] are the
+*   derivatives of the potential at the cell center. Taylor coefficients of 1/r come from the
+*   recurrence of Duan and Krasny (2001). Everything is accumulated in double precision.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_FMM_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type, pair interaction and integration
+*       nbody_tasks.h       Work-stealing task pool, used by the tree build
+*       nbody_tree.h        Adaptive octree
+*
+*   NOTE: The traversal is serial, mutual M2L and P2P write to both cells of a pair.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_FMM_H
+#define NBODY_FMM_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define FMM_MAX_ORDER           8           // Max expansion order
+#define FMM_MAX_TERMS           165         // Multi-indices of total order <= FMM_MAX_ORDER, (p+1)(p+2)(p+3)/6
+#define FMM_LEAF_SIZE           16          // Max bodies of a leaf, P2P is cheap up to a few tens
+#define FMM_DEFAULT_ORDER       4
+#define FMM_DEFAULT_THETA       0.5f
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// FMM solver data
+typedef struct FmmSolver {
+    BodyTree tree;              // Adaptive octree, rebuilt every step
+    int order;                  // Expansion order, 1 to FMM_MAX_ORDER
+    float theta;                // Opening angle of the cell pairs
+    double *multipoles;         // FMM_MAX_TERMS per node
+    double *locals;             // FMM_MAX_TERMS per node
+    float *radii;               // Max distance from the node center of mass to its bodies
+
+    long long m2lCount;         // Cell pair interactions of the last step
+    long long p2pCount;         // Body pair interactions of the last step
+} FmmSolver;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+FmmSolver LoadFmmSolver(int capacity, int order, float theta);              // Allocate solver for up to capacity bodies
+void UnloadFmmSolver(FmmSolver fmm);                                        // Free solver
+void StepBodiesFmm(FmmSolver *fmm, TaskPool *pool, const Body *bodies, Body *result, int count);  // Integrate one step
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_FMM_H
+
+
+/***********************************************************************************
+*
+*   NBODY FMM IMPLEMENTATION
+*
+************************************************************************************/
+
+
+#if defined(NBODY_FMM_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: memset(), memcpy()
+#include <math.h>           // Required for: sqrt(), fmaxf()
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define FMM_MAX_PAIRS           3003        // Multi-index pairs (u, v) with |u| + |v| <= FMM_MAX_ORDER, (p+1)...(p+6)/720
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Pair of multi-indices (u, v) and their sum, shared by M2M, M2L and L2L
+typedef struct FmmPair {
+    short u;
+    short v;
+    short sum;                  // Term of u + v
+    short odd;                  // |u| + |v| is odd
+} FmmPair;
+
+// One FMM step
+typedef struct FmmStep {
+    FmmSolver *fmm;
+    const Body *bodies;
+    Body *result;
+    int terms;                  // Multi-indices up to fmm->order
+    int pairs;                  // Multi-index pairs up to fmm->order
+} FmmStep;
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static bool fmmTablesReady = false;
+static int fmmExponents[FMM_MAX_TERMS][3];          // Term to multi-index, sorted by total order
+static int fmmLower[FMM_MAX_TERMS][3];              // Term of k - e_d, -1 if k_d == 0
+static int fmmHigher[FMM_MAX_TERMS][3];             // Term of k + e_d, -1 above FMM_MAX_ORDER
+static double fmmFactorials[FMM_MAX_TERMS];         // k! = k_x! k_y! k_z!
+static FmmPair fmmPairs[FMM_MAX_PAIRS];             // Sorted by |u| + |v|
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static void InitFmmTables(void);
+static int GetFmmTermCount(int order);                                      // Multi-indices of total order <= order
+static int GetFmmPairCount(int order);                                      // Multi-index pairs of total order <= order
+static void ComputeFmmShift(const double *offset, int terms, double *shift);    // offset^k/k! for every term k
+static void ComputeFmmDerivatives(const double *r, int terms, double *derivatives);  // D^k(1/|r|) for every term k
+static void UpwardFmmPass(FmmStep *step, int node);                         // P2M and M2M, radii
+static void InteractFmmCells(FmmStep *step, int a, int b);                  // Dual-tree traversal
+static void ApplyFmmM2L(FmmStep *step, int a, int b);                       // Both ways
+static void ApplyFmmP2P(FmmStep *step, int target, int source);             // Bodies of source on bodies of target
+static void DownwardFmmPass(FmmStep *step, int node);                       // L2L and L2P
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Allocate solver for up to capacity bodies
+FmmSolver LoadFmmSolver(int capacity, int order, float theta)
+{
+    FmmSolver fmm = { 0 };
+
+    InitFmmTables();
+
+    fmm.tree = LoadBodyTree(capacity, theta);
+    fmm.tree.leafSize = FMM_LEAF_SIZE;
+    fmm.order = (order < 1)? 1 : ((order > FMM_MAX_ORDER)? FMM_MAX_ORDER : order);
+    fmm.theta = theta;
+    fmm.multipoles = (double *)calloc((size_t)fmm.tree.nodeCapacity*FMM_MAX_TERMS, sizeof(double));
+    fmm.locals = (double *)calloc((size_t)fmm.tree.nodeCapacity*FMM_MAX_TERMS, sizeof(double));
+    fmm.radii = (float *)calloc(fmm.tree.nodeCapacity, sizeof(float));
+
+    return fmm;
+}
+
+// Free solver
+void UnloadFmmSolver(FmmSolver fmm)
+{
+    UnloadBodyTree(fmm.tree);
+    free(fmm.multipoles);
+    free(fmm.locals);
+    free(fmm.radii);
+}
+
+// Integrate one step of bodies into result
+void StepBodiesFmm(FmmSolver *fmm, TaskPool *pool, const Body *bodies, Body *result, int count)
+{
+    if (count > fmm->tree.capacity) count = fmm->tree.capacity;
+    if (count == 0) return;
+
+    BuildBodyTree(&fmm->tree, pool, bodies, count);
+
+    FmmStep step = { fmm, bodies, result, GetFmmTermCount(fmm->order), GetFmmPairCount(fmm->order) };
+    int nodeCount = atomic_load(&fmm->tree.nodeCount);
+    if (nodeCount > fmm->tree.nodeCapacity) nodeCount = fmm->tree.nodeCapacity;
+
+    memset(fmm->locals, 0, (size_t)nodeCount*FMM_MAX_TERMS*sizeof(double));
+    memcpy(result, bodies, count*sizeof(Body));
+
+    fmm->m2lCount = 0;
+    fmm->p2pCount = 0;
+
+    UpwardFmmPass(&step, 0);
+    InteractFmmCells(&step, 0, 0);
+    DownwardFmmPass(&step, 0);
+
+    IntegrateBodies(result, count);
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Multi-index tables, terms and pairs sorted by total order so the first
+// GetFmmTermCount(p) terms and GetFmmPairCount(p) pairs are those of order <= p
+static void InitFmmTables(void)
+{
+    if (fmmTablesReady) return;
+
+    static int index[FMM_MAX_ORDER + 2][FMM_MAX_ORDER + 2][FMM_MAX_ORDER + 2];
+    double factorials[FMM_MAX_ORDER + 1] = { 1.0 };
+    int term = 0;
+
+    for (int n = 1; n <= FMM_MAX_ORDER; n++) factorials[n] = factorials[n - 1]*n;
+
+    memset(index, -1, sizeof(index));
+
+    for (int n = 0; n <= FMM_MAX_ORDER; n++)
+    {
+        for (int i = n; i >= 0; i--)
+        {
+            for (int j = n - i; j >= 0; j--)
+            {
+                int k = n - i - j;
+
+                index[i][j][k] = term;
+                fmmExponents[term][0] = i;
+                fmmExponents[term][1] = j;
+                fmmExponents[term][2] = k;
+                fmmFactorials[term] = factorials[i]*factorials[j]*factorials[k];
+                term++;
+            }
+        }
+    }
+
+    for (int t = 0; t < FMM_MAX_TERMS; t++)
+    {
+        const int *k = fmmExponents[t];
+
+        fmmLower[t][0] = (k[0] > 0)? index[k[0] - 1][k[1]][k[2]] : -1;
+        fmmLower[t][1] = (k[1] > 0)? index[k[0]][k[1] - 1][k[2]] : -1;
+        fmmLower[t][2] = (k[2] > 0)? index[k[0]][k[1]][k[2] - 1] : -1;
+        fmmHigher[t][0] = index[k[0] + 1][k[1]][k[2]];
+        fmmHigher[t][1] = index[k[0]][k[1] + 1][k[2]];
+        fmmHigher[t][2] = index[k[0]][k[1]][k[2] + 1];
+    }
+
+    int pair = 0;
+
+    for (int n = 0; n <= FMM_MAX_ORDER; n++)
+    {
+        for (int u = 0; u < FMM_MAX_TERMS; u++)
+        {
+            const int *eu = fmmExponents[u];
+            int orderU = eu[0] + eu[1] + eu[2];
+            if (orderU > n) break;
+
+            for (int v = GetFmmTermCount(n - orderU - 1); v < GetFmmTermCount(n - orderU); v++)
+            {
+                const int *ev = fmmExponents[v];
+
+                fmmPairs[pair].u = (short)u;
+                fmmPairs[pair].v = (short)v;
+                fmmPairs[pair].sum = (short)index[eu[0] + ev[0]][eu[1] + ev[1]][eu[2] + ev[2]];
+                fmmPairs[pair].odd = (short)(n & 1);
+                pair++;
+            }
+        }
+    }
+
+    fmmTablesReady = true;
+}
+
+// Multi-indices of total order <= order, 0 for order -1
+static int GetFmmTermCount(int order)
+{
+    return (order + 1)*(order + 2)*(order + 3)/6;
+}
+
+// Multi-index pairs of total order <= order
+static int GetFmmPairCount(int order)
+{
+    return (order + 1)*(order + 2)*(order + 3)*(order + 4)*(order + 5)*(order + 6)/720;
+}
+
+// offset^k/k! for every term k
+static void ComputeFmmShift(const double *offset, int terms, double *shift)
+{
+    shift[0] = 1.0;
+
+    for (int t = 1; t < terms; t++)
+    {
+        // Any axis with a non zero exponent gives the lower term
+        int d = (fmmLower[t][0] >= 0)? 0 : ((fmmLower[t][1] >= 0)? 1 : 2);
+        shift[t] = shift[fmmLower[t][d]]*offset[d]/fmmExponents[t][d];
+    }
+}
+
+// Derivatives D^k(1/|r|) = k! T[k] for every term k, T from the recurrence of the Taylor coefficients
+// NOTE: |k| r^2 T[k] = -(2|k| - 1) sum_d r_d T[k - e_d] - (|k| - 1) sum_d T[k - 2e_d]
+static void ComputeFmmDerivatives(const double *r, int terms, double *derivatives)
+{
+    double r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+
+    derivatives[0] = 1.0/sqrt(r2);
+
+    for (int t = 1; t < terms; t++)
+    {
+        const int *k = fmmExponents[t];
+        int n = k[0] + k[1] + k[2];
+        double first = 0.0;
+        double second = 0.0;
+
+        for (int d = 0; d < 3; d++)
+        {
+            int lower = fmmLower[t][d];
+            if (lower < 0) continue;
+
+            first += r[d]*derivatives[lower];
+            if (fmmLower[lower][d] >= 0) second += derivatives[fmmLower[lower][d]];
+        }
+
+        derivatives[t] = (-(2.0*n - 1.0)*first - (n - 1.0)*second)/(n*r2);
+    }
+
+    for (int t = 1; t < terms; t++) derivatives[t] *= fmmFactorials[t];
+}
+
+// P2M at leaves, M2M at internal nodes, and the radius around each center of mass
+static void UpwardFmmPass(FmmStep *step, int node)
+{
+    FmmSolver *fmm = step->fmm;
+    const BodyTree *tree = &fmm->tree;
+    const TreeNode *cell = &tree->nodes[node];
+    double *multipole = &fmm->multipoles[(size_t)node*FMM_MAX_TERMS];
+    double shift[FMM_MAX_TERMS];
+    float radius = 0.0f;
+
+    memset(multipole, 0, step->terms*sizeof(double));
+
+    if (cell->firstChild < 0)
+    {
+        // P2M: M[k] += (-d)^k/k!, d = body - center
+        for (int i = cell->first; i < (cell->first + cell->count); i++)
+        {
+            const Body *body = &step->bodies[tree->order[i]];
+            double offset[3] = { cell->centerOfMass[0] - body->px, cell->centerOfMass[1] - body->py, cell->centerOfMass[2] - body->pz };
+
+            ComputeFmmShift(offset, step->terms, shift);
+            for (int t = 0; t < step->terms; t++) multipole[t] += shift[t];
+
+            radius = fmaxf(radius, (float)sqrt(offset[0]*offset[0] + offset[1]*offset[1] + offset[2]*offset[2]));
+        }
+    }
+    else
+    {
+        for (int c = 0; c < cell->childCount; c++)
+        {
+            int child = cell->firstChild + c;
+            const TreeNode *childCell = &tree->nodes[child];
+            const double *childMultipole = &fmm->multipoles[(size_t)child*FMM_MAX_TERMS];
+
+            UpwardFmmPass(step, child);
+
+            // M2M: M[u + v] += Mc[u] (-d)^v/v!, d = child center - parent center
+            double offset[3] = { cell->centerOfMass[0] - childCell->centerOfMass[0], cell->centerOfMass[1] - childCell->centerOfMass[1], cell->centerOfMass[2] - childCell->centerOfMass[2] };
+
+            ComputeFmmShift(offset, step->terms, shift);
+            for (int p = 0; p < step->pairs; p++) multipole[fmmPairs[p].sum] += childMultipole[fmmPairs[p].u]*shift[fmmPairs[p].v];
+
+            float distance = (float)sqrt(offset[0]*offset[0] + offset[1]*offset[1] + offset[2]*offset[2]);
+            radius = fmaxf(radius, distance + fmm->radii[child]);
+        }
+    }
+
+    fmm->radii[node] = radius;
+}
+
+// Dual-tree traversal of the cell pair (a, b), a == b for the self interaction of a cell
+static void InteractFmmCells(FmmStep *step, int a, int b)
+{
+    FmmSolver *fmm = step->fmm;
+    const TreeNode *cellA = &fmm->tree.nodes[a];
+    const TreeNode *cellB = &fmm->tree.nodes[b];
+    bool leafA = (cellA->firstChild < 0);
+    bool leafB = (cellB->firstChild < 0);
+
+    if (a == b)
+    {
+        if (leafA) ApplyFmmP2P(step, a, a);
+        else
+        {
+            for (int i = 0; i < cellA->childCount; i++)
+            {
+                for (int j = i; j < cellA->childCount; j++) InteractFmmCells(step, cellA->firstChild + i, cellA->firstChild + j);
+            }
+        }
+
+        return;
+    }
+
+    float dx = cellA->centerOfMass[0] - cellB->centerOfMass[0];
+    float dy = cellA->centerOfMass[1] - cellB->centerOfMass[1];
+    float dz = cellA->centerOfMass[2] - cellB->centerOfMass[2];
+    float distance = sqrtf(dx*dx + dy*dy + dz*dz);
+    float reach = fmm->radii[a] + fmm->radii[b];
+
+    // Well separated, and no body of one cell can touch a body of the other
+    if ((reach < (fmm->theta*distance)) && ((distance - reach) > (2.0f*BODY_RADIUS))) ApplyFmmM2L(step, a, b);
+    else if (leafA && leafB)
+    {
+        ApplyFmmP2P(step, a, b);
+        ApplyFmmP2P(step, b, a);
+    }
+    else if (leafB || (!leafA && (fmm->radii[a] >= fmm->radii[b])))
+    {
+        // Split the larger cell
+        for (int c = 0; c < cellA->childCount; c++) InteractFmmCells(step, cellA->firstChild + c, b);
+    }
+    else
+    {
+        for (int c = 0; c < cellB->childCount; c++) InteractFmmCells(step, a, cellB->firstChild + c);
+    }
+}
+
+// M2L both ways between well separated cells: L[u] += D^(u + v)(1/|r|) M[v]
+// NOTE: Derivatives at r = center B - center A serve A to B, those at -r only flip odd orders
+static void ApplyFmmM2L(FmmStep *step, int a, int b)
+{
+    FmmSolver *fmm = step->fmm;
+    const TreeNode *cellA = &fmm->tree.nodes[a];
+    const TreeNode *cellB = &fmm->tree.nodes[b];
+    const double *multipoleA = &fmm->multipoles[(size_t)a*FMM_MAX_TERMS];
+    const double *multipoleB = &fmm->multipoles[(size_t)b*FMM_MAX_TERMS];
+    double *localA = &fmm->locals[(size_t)a*FMM_MAX_TERMS];
+    double *localB = &fmm->locals[(size_t)b*FMM_MAX_TERMS];
+
+    double r[3] = { cellB->centerOfMass[0] - cellA->centerOfMass[0], cellB->centerOfMass[1] - cellA->centerOfMass[1], cellB->centerOfMass[2] - cellA->centerOfMass[2] };
+    double derivatives[FMM_MAX_TERMS];
+    ComputeFmmDerivatives(r, step->terms, derivatives);
+
+    for (int p = 0; p < step->pairs; p++)
+    {
+        const FmmPair *pair = &fmmPairs[p];
+        double derivative = derivatives[pair->sum];
+
+        localB[pair->u] += derivative*multipoleA[pair->v];
+        localA[pair->u] += (pair->odd? -derivative : derivative)*multipoleB[pair->v];
+    }
+
+    fmm->m2lCount += 2;
+}
+
+// Direct pairs of the bodies of source on the bodies of target, same leaf for the self interaction
+static void ApplyFmmP2P(FmmStep *step, int target, int source)
+{
+    const BodyTree *tree = &step->fmm->tree;
+    const TreeNode *targetCell = &tree->nodes[target];
+    const TreeNode *sourceCell = &tree->nodes[source];
+
+    for (int i = targetCell->first; i < (targetCell->first + targetCell->count); i++)
+    {
+        float potential = 0.0f;
+        Body *body = &step->result[tree->order[i]];
+
+        for (int j = sourceCell->first; j < (sourceCell->first + sourceCell->count); j++)
+        {
+            if (i != j) ApplyBodyPair(body, &potential, &step->bodies[tree->order[j]]);
+        }
+    }
+
+    step->fmm->p2pCount += (long long)targetCell->count*sourceCell->count - ((target == source)? targetCell->count : 0);
+}
+
+// L2L down to the children, L2P at leaves: dv = grad(phi), phi = sum over k of L[k] x^k/k!
+static void DownwardFmmPass(FmmStep *step, int node)
+{
+    FmmSolver *fmm = step->fmm;
+    const BodyTree *tree = &fmm->tree;
+    const TreeNode *cell = &tree->nodes[node];
+    const double *local = &fmm->locals[(size_t)node*FMM_MAX_TERMS];
+    double shift[FMM_MAX_TERMS];
+
+    if (cell->firstChild < 0)
+    {
+        // Gradient of the order p potential is an order p - 1 expansion
+        int gradientTerms = GetFmmTermCount(fmm->order - 1);
+
+        for (int i = cell->first; i < (cell->first + cell->count); i++)
+        {
+            int index = tree->order[i];
+            const Body *body = &step->bodies[index];
+            double offset[3] = { body->px - cell->centerOfMass[0], body->py - cell->centerOfMass[1], body->pz - cell->centerOfMass[2] };
+            double gradient[3] = { 0.0 };
+
+            ComputeFmmShift(offset, gradientTerms, shift);
+
+            for (int t = 0; t < gradientTerms; t++)
+            {
+                gradient[0] += local[fmmHigher[t][0]]*shift[t];
+                gradient[1] += local[fmmHigher[t][1]]*shift[t];
+                gradient[2] += local[fmmHigher[t][2]]*shift[t];
+            }
+
+            step->result[index].vx += (float)gradient[0];
+            step->result[index].vy += (float)gradient[1];
+            step->result[index].vz += (float)gradient[2];
+        }
+
+        return;
+    }
+
+    for (int c = 0; c < cell->childCount; c++)
+    {
+        int child = cell->firstChild + c;
+        const TreeNode *childCell = &tree->nodes[child];
+        double *childLocal = &fmm->locals[(size_t)child*FMM_MAX_TERMS];
+
+        // L2L: Lc[u] += L[u + v] e^v/v!, e = child center - parent center
+        double offset[3] = { childCell->centerOfMass[0] - cell->centerOfMass[0], childCell->centerOfMass[1] - cell->centerOfMass[1], childCell->centerOfMass[2] - cell->centerOfMass[2] };
+
+        ComputeFmmShift(offset, step->terms, shift);
+        for (int p = 0; p < step->pairs; p++) childLocal[fmmPairs[p].u] += local[fmmPairs[p].sum]*shift[fmmPairs[p].v];
+
+        DownwardFmmPass(step, child);
+    }
+}
+
+#endif // NBODY_FMM_IMPLEMENTATION
@@ -0,0 +1,314 @@
+/**********************************************************************************************
+*
+*   nbody.hiz - Hierarchical-Z occlusion culling of body instances
+*
+*   After the scene is drawn, its depth is reduced into a max-depth mip pyramid (Hi-Z).
+*   On the next frame a compute pass projects every body bounding sphere with the matrices
+*   of that previous frame, picks the pyramid level where the sphere covers at most 2x2
+*   texels and drops it when it lies behind all of them. Bodies outside the frustum are
+*   dropped as well. Survivors are compacted into an instance list drawn with a single
+*   indirect draw, so hidden bodies never reach the vertex or fragment stages.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_HIZ_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       2 - vec4 instances[]                    (input, xyz position, w radius, written by nbody.comp)
+*       6 - vec4 visibleInstances[]             (xyz position, w radius)
+*       7 - indirect draw command               (instanceCount written by hiz_cull.comp)
+*
+*   NOTE: The pyramid lags one frame behind, a body uncovered by moving occluders
+*   shows up one frame late.
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the visible count
+*
+**********************************************************************************************/
+
+#ifndef NBODY_HIZ_H
+#define NBODY_HIZ_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define HIZ_BUILD_GROUP_SIZE        8           // hiz_build.comp local_size_x/y
+#define HIZ_CULL_GROUP_SIZE         64          // hiz_cull.comp local_size_x
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Hi-Z culling data
+typedef struct HiZCulling {
+    unsigned int buildProgram;      // Depth -> max-depth pyramid compute program
+    unsigned int cullProgram;       // Instances -> visible instances compute program
+
+    unsigned int hizTexture;        // R32F, full mip chain
+    int width;
+    int height;
+    int levels;
+    bool valid;                     // Pyramid holds the depth of the previous frame
+    Matrix prevViewProj;            // View-projection the pyramid was built with
+
+    unsigned int visibleBuffer;     // SSBO: vec4[NUM_BODIES]
+    unsigned int commandBuffer;     // SSBO + GL_DRAW_INDIRECT_BUFFER: 5 uints
+    unsigned int vertexCount;       // Mesh vertex (or index) count
+    bool indexed;                   // Mesh drawn with glDrawElementsIndirect()
+
+    ReadbackQueue countReadback;    // Visible counts in flight
+    int visibleCount;               // Visible bodies, a frame or two late
+
+    int firstLevelLoc;
+    int viewProjLoc;
+    int prevViewProjLoc;
+    int hizLevelsLoc;
+} HiZCulling;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+HiZCulling LoadHiZCulling(int width, int height, Mesh mesh);               // Load pyramid, culling programs and buffers
+void UnloadHiZCulling(HiZCulling culling);                                  // Unload pyramid, culling programs and buffers
+void UpdateHiZCulling(HiZCulling *culling, unsigned int transformBuffer, Camera camera, float aspect); // Cull instances for this frame
+void BuildHiZPyramid(HiZCulling *culling, unsigned int depthTexture, Camera camera, float aspect);     // Build pyramid from the depth of this frame
+void DrawMeshCulled(HiZCulling culling, Mesh mesh, Material material);     // Draw visible instances with one indirect draw
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_HIZ_H
+
+
+/***********************************************************************************
+*
+*   NBODY HIZ IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_HIZ_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "raymath.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glTexStorage2D(), glBindImageTexture(), glDrawArraysIndirect()
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static Matrix GetCameraViewProj(Camera camera, float aspect);
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load pyramid, culling programs and buffers
+// NOTE: width and height must match the depth texture given to BuildHiZPyramid()
+HiZCulling LoadHiZCulling(int width, int height, Mesh mesh)
+{
+    HiZCulling culling = { 0 };
+
+    culling.buildProgram = LoadComputeProgramCached("resources/shaders/glsl430/hiz_build.comp", NULL);
+    culling.cullProgram = LoadComputeProgramCached("resources/shaders/glsl430/hiz_cull.comp", NULL);
+
+    culling.firstLevelLoc = rlGetLocationUniform(culling.buildProgram, "firstLevel");
+    culling.viewProjLoc = rlGetLocationUniform(culling.cullProgram, "viewProj");
+    culling.prevViewProjLoc = rlGetLocationUniform(culling.cullProgram, "prevViewProj");
+    culling.hizLevelsLoc = rlGetLocationUniform(culling.cullProgram, "hizLevels");
+
+    rlEnableShader(culling.buildProgram);
+        rlSetUniform(rlGetLocationUniform(culling.buildProgram, "depthTexture"), (int[1]){ 0 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+    rlDisableShader();
+
+    rlEnableShader(culling.cullProgram);
+        rlSetUniform(rlGetLocationUniform(culling.cullProgram, "hizTexture"), (int[1]){ 0 }, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+    rlDisableShader();
+
+    // Max-depth pyramid, full mip chain down to 1x1
+    culling.width = width;
+    culling.height = height;
+    culling.levels = 1;
+    while (((width >> culling.levels) > 0) || ((height >> culling.levels) > 0)) culling.levels++;
+
+    glGenTextures(1, &culling.hizTexture);
+    glBindTexture(GL_TEXTURE_2D, culling.hizTexture);
+    glTexStorage2D(GL_TEXTURE_2D, culling.levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    culling.vertexCount = (mesh.indices != NULL)? mesh.triangleCount*3 : mesh.vertexCount;
+    culling.indexed = (mesh.indices != NULL);
+
+    culling.visibleBuffer = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    culling.commandBuffer = rlLoadShaderBuffer(5*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    culling.countReadback = LoadReadbackQueue(2, sizeof(unsigned int));
+
+    return culling;
+}
+
+// Unload pyramid, culling programs and buffers
+void UnloadHiZCulling(HiZCulling culling)
+{
+    UnloadReadbackQueue(culling.countReadback);
+
+    glDeleteTextures(1, &culling.hizTexture);
+
+    rlUnloadShaderBuffer(culling.visibleBuffer);
+    rlUnloadShaderBuffer(culling.commandBuffer);
+
+    rlUnloadShaderProgram(culling.buildProgram);
+    rlUnloadShaderProgram(culling.cullProgram);
+}
+
+// Cull instances for this frame
+// NOTE: Without a valid pyramid (first frame, just enabled) only frustum culling is applied
+void UpdateHiZCulling(HiZCulling *culling, unsigned int transformBuffer, Camera camera, float aspect)
+{
+    // Collect visible counts of earlier frames, only those already copied
+    for (int slot = PollReadback(&culling->countReadback); slot >= 0; slot = PollReadback(&culling->countReadback))
+    {
+        culling->visibleCount = (int)*(const unsigned int *)GetReadbackData(culling->countReadback, slot);
+        ReleaseReadback(&culling->countReadback, slot);
+    }
+
+    // Reset draw command: { count, instanceCount, first, baseVertex/baseInstance, baseInstance }
+    unsigned int command[5] = { culling->vertexCount, 0, 0, 0, 0 };
+    rlUpdateShaderBuffer(culling->commandBuffer, command, sizeof(command), 0);
+
+    int hizLevels = culling->valid? culling->levels : 0;
+
+    rlEnableShader(culling->cullProgram);
+    rlSetUniformMatrix(culling->viewProjLoc, GetCameraViewProj(camera, aspect));
+    rlSetUniformMatrix(culling->prevViewProjLoc, culling->prevViewProj);
+    rlSetUniform(culling->hizLevelsLoc, &hizLevels, RL_SHADER_UNIFORM_INT, 1);
+
+    rlActiveTextureSlot(0);
+    rlEnableTexture(culling->hizTexture);
+
+    rlBindShaderBuffer(transformBuffer, 2);
+    rlBindShaderBuffer(culling->visibleBuffer, 6);
+    rlBindShaderBuffer(culling->commandBuffer, 7);
+    rlComputeShaderDispatch((NUM_BODIES + HIZ_CULL_GROUP_SIZE - 1)/HIZ_CULL_GROUP_SIZE, 1, 1);
+
+    rlDisableTexture();
+    rlDisableShader();
+
+    // Instances are read by the vertex shader, the count by the indirect draw
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    // instanceCount of the draw command
+    if (!IsReadbackQueueFull(culling->countReadback)) RequestReadback(&culling->countReadback, culling->commandBuffer, sizeof(unsigned int), sizeof(unsigned int), 0);
+}
+
+// Build pyramid from the depth of this frame, used to cull the next one
+void BuildHiZPyramid(HiZCulling *culling, unsigned int depthTexture, Camera camera, float aspect)
+{
+    int firstLevel = 1;
+
+    rlEnableShader(culling->buildProgram);
+
+    for (int level = 0; level < culling->levels; level++)
+    {
+        int levelWidth = (culling->width >> level) > 0? (culling->width >> level) : 1;
+        int levelHeight = (culling->height >> level) > 0? (culling->height >> level) : 1;
+
+        rlSetUniform(culling->firstLevelLoc, &firstLevel, RL_SHADER_UNIFORM_INT, 1);
+
+        if (level == 0)
+        {
+            rlActiveTextureSlot(0);
+            rlEnableTexture(depthTexture);
+        }
+        else glBindImageTexture(0, culling->hizTexture, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+
+        glBindImageTexture(1, culling->hizTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+        rlComputeShaderDispatch((levelWidth + HIZ_BUILD_GROUP_SIZE - 1)/HIZ_BUILD_GROUP_SIZE,
+                                (levelHeight + HIZ_BUILD_GROUP_SIZE - 1)/HIZ_BUILD_GROUP_SIZE, 1);
+
+        // Next level reads this one
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+        if (level == 0)
+        {
+            rlDisableTexture();
+            firstLevel = 0;
+        }
+    }
+
+    rlDisableShader();
+
+    // Pyramid is sampled by the cull pass
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    culling->prevViewProj = GetCameraViewProj(camera, aspect);
+    culling->valid = true;
+}
+
+// Draw visible instances with one indirect draw
+// NOTE: Must be called inside BeginMode3D(), material shader fetches instances from binding 6
+void DrawMeshCulled(HiZCulling culling, Mesh mesh, Material material)
+{
+    rlEnableShader(material.shader.id);
+
+    // Same uniforms DrawMeshInstanced() would send
+    float color[4] = {
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.r/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.g/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.b/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.a/255.0f
+    };
+    rlSetUniform(material.shader.locs[SHADER_LOC_COLOR_DIFFUSE], color, RL_SHADER_UNIFORM_VEC4, 1);
+
+    Matrix matView = rlGetMatrixModelview();
+    Matrix matProjection = rlGetMatrixProjection();
+    if (material.shader.locs[SHADER_LOC_MATRIX_VIEW] != -1) rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_VIEW], matView);
+    rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(matView, matProjection));
+
+    int textureSlot = 0;
+    rlActiveTextureSlot(0);
+    rlEnableTexture(material.maps[MATERIAL_MAP_DIFFUSE].texture.id);
+    rlSetUniform(material.shader.locs[SHADER_LOC_MAP_DIFFUSE], &textureSlot, RL_SHADER_UNIFORM_INT, 1);
+
+    rlBindShaderBuffer(culling.visibleBuffer, 6);
+
+    rlEnableVertexArray(mesh.vaoId);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling.commandBuffer);
+
+    if (culling.indexed) glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, NULL);
+    else glDrawArraysIndirect(GL_TRIANGLES, NULL);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    rlDisableVertexArray();
+
+    rlDisableTexture();
+    rlDisableShader();
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// View-projection matching BeginMode3D()
+static Matrix GetCameraViewProj(Camera camera, float aspect)
+{
+    Matrix matView = GetCameraMatrix(camera);
+    Matrix matProj = MatrixPerspective(camera.fovy*DEG2RAD, aspect, RL_CULL_DISTANCE_NEAR, RL_CULL_DISTANCE_FAR);
+
+    return MatrixMultiply(matView, matProj);
+}
+
+#endif // NBODY_HIZ_IMPLEMENTATION
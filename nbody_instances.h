@@ -0,0 +1,213 @@
+/**********************************************************************************************
+*
+*   nbody.instances - Ring of GPU instance buffers shared by compute and render
+*
+*   The integrator writes the instances of a step into one buffer of a ring of
+*   INSTANCE_BUFFERS while the frame draws the buffer written by the previous step, bound
+*   straight as the instanced vertex attribute. Nothing is read back to the CPU, so the CPU
+*   never waits on the step. A fence after the last draw reading a buffer guards its reuse by
+*   the integrator.
+*
+*   The vertex attribute barrier covers every earlier shader write, not one buffer, so it is
+*   issued by BeginInstanceWrite(), before the dispatch of the step: it publishes the buffer
+*   of the previous step to the draws of this frame, which then do not wait on the dispatch
+*   writing the other buffer. Only the first step, drawn right away, has its own barrier.
+*
+*   With three buffers one is being written, one is being drawn and one may still be read
+*   by the draws of the frame before, so the integrator only blocks when the GPU is more
+*   than a frame behind.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_INSTANCES_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       2 - vec4 instances[]                    (written by nbody.comp, instancePosition attribute)
+*
+*   NOTE: An instance is 16 bytes, xyz: integrated position, w: radius. The vertex shaders build
+*   the model matrix (uniform scale and translation) from it. Bodies are drawn one step behind
+*   the simulation
+*
+**********************************************************************************************/
+
+#ifndef NBODY_INSTANCES_H
+#define NBODY_INSTANCES_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define INSTANCE_BUFFERS            3           // Written, drawn, and drawn by the previous frame
+#define INSTANCE_SIZE               (4*sizeof(float))   // vec4 per body
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Instance buffer ring data
+typedef struct InstanceRing {
+    unsigned int buffers[INSTANCE_BUFFERS];     // SSBO + instance VBO: vec4[NUM_BODIES]
+    void *fences[INSTANCE_BUFFERS];             // Signaled once the last draw reading the buffer is done
+    int writeIndex;                             // Buffer written by the last step
+    int readIndex;                              // Buffer drawn this frame
+    int latestIndex;                            // Newest complete buffer, -1 before the first step
+
+    long long stalls;                           // Steps that waited for a draw to release their buffer
+} InstanceRing;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+InstanceRing LoadInstanceRing(void);                                    // Load instance buffers
+void UnloadInstanceRing(InstanceRing ring);                             // Unload instance buffers and fences
+unsigned int BeginInstanceWrite(InstanceRing *ring);                    // Next buffer for the integrator, waits until no draw reads it
+void EndInstanceWrite(InstanceRing *ring);                              // Publish the written buffer, select the buffer to draw
+void EndInstanceRead(InstanceRing *ring);                               // Fence the draws of this frame
+void DrawMeshInstancedBuffer(Mesh mesh, Material material, unsigned int instanceBuffer, int instances);  // DrawMeshInstanced() with GPU resident instances
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_INSTANCES_H
+
+
+/***********************************************************************************
+*
+*   NBODY INSTANCES IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_INSTANCES_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"        // Required for: MatrixMultiply(), MatrixIdentity()
+
+#include "external/glad.h"  // Required for: glFenceSync(), glClientWaitSync(), glVertexAttribDivisor(), glMemoryBarrier()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load instance buffers
+InstanceRing LoadInstanceRing(void)
+{
+    InstanceRing ring = { 0 };
+
+    for (int i = 0; i < INSTANCE_BUFFERS; i++) ring.buffers[i] = rlLoadShaderBuffer(NUM_BODIES*INSTANCE_SIZE, NULL, RL_DYNAMIC_COPY);
+
+    ring.latestIndex = -1;
+
+    return ring;
+}
+
+// Unload instance buffers and fences
+void UnloadInstanceRing(InstanceRing ring)
+{
+    for (int i = 0; i < INSTANCE_BUFFERS; i++)
+    {
+        if (ring.fences[i] != NULL) glDeleteSync((GLsync)ring.fences[i]);
+        rlUnloadShaderBuffer(ring.buffers[i]);
+    }
+}
+
+// Next buffer for the integrator to write, never the one drawn this frame
+// NOTE: Blocks only while the draws of two frames ago still read it. Must be called before
+// the step dispatch, the barrier orders the previous step writes before the draws
+unsigned int BeginInstanceWrite(InstanceRing *ring)
+{
+    if (ring->latestIndex >= 0) glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    ring->writeIndex = (ring->latestIndex + 1)%INSTANCE_BUFFERS;
+
+    GLsync fence = (GLsync)ring->fences[ring->writeIndex];
+
+    if (fence != NULL)
+    {
+        if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            ring->stalls++;
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        }
+
+        glDeleteSync(fence);
+        ring->fences[ring->writeIndex] = NULL;
+    }
+
+    return ring->buffers[ring->writeIndex];
+}
+
+// Publish the buffer just written, the frame draws the one published by the previous step
+// NOTE: The first step has no previous buffer, its own is drawn and waited for
+void EndInstanceWrite(InstanceRing *ring)
+{
+    if (ring->latestIndex < 0) glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+    ring->readIndex = (ring->latestIndex >= 0)? ring->latestIndex : ring->writeIndex;
+    ring->latestIndex = ring->writeIndex;
+}
+
+// Fence the draws of this frame, the integrator waits on it before writing that buffer again
+void EndInstanceRead(InstanceRing *ring)
+{
+    if (ring->fences[ring->readIndex] != NULL) glDeleteSync((GLsync)ring->fences[ring->readIndex]);
+    ring->fences[ring->readIndex] = (void *)glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Draw instances with the positions of a GPU buffer, same uniforms as DrawMeshInstanced()
+// NOTE: The buffer feeds the material shader instancePosition attribute, located by
+// material.shader.locs[SHADER_LOC_MATRIX_MODEL], one vec4 per instance
+void DrawMeshInstancedBuffer(Mesh mesh, Material material, unsigned int instanceBuffer, int instances)
+{
+    rlEnableShader(material.shader.id);
+
+    float color[4] = {
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.r/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.g/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.b/255.0f,
+        (float)material.maps[MATERIAL_MAP_DIFFUSE].color.a/255.0f
+    };
+    rlSetUniform(material.shader.locs[SHADER_LOC_COLOR_DIFFUSE], color, RL_SHADER_UNIFORM_VEC4, 1);
+
+    Matrix matView = rlGetMatrixModelview();
+    Matrix matProjection = rlGetMatrixProjection();
+    if (material.shader.locs[SHADER_LOC_MATRIX_VIEW] != -1) rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_VIEW], matView);
+    if (material.shader.locs[SHADER_LOC_MATRIX_PROJECTION] != -1) rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_PROJECTION], matProjection);
+    if (material.shader.locs[SHADER_LOC_MATRIX_NORMAL] != -1) rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_NORMAL], MatrixIdentity());
+    rlSetUniformMatrix(material.shader.locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(matView, matProjection));
+
+    int textureSlot = 0;
+    rlActiveTextureSlot(0);
+    rlEnableTexture(material.maps[MATERIAL_MAP_DIFFUSE].texture.id);
+    rlSetUniform(material.shader.locs[SHADER_LOC_MAP_DIFFUSE], &textureSlot, RL_SHADER_UNIFORM_INT, 1);
+
+    rlEnableVertexArray(mesh.vaoId);
+
+    int location = material.shader.locs[SHADER_LOC_MATRIX_MODEL];
+
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    glEnableVertexAttribArray(location);
+    glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, INSTANCE_SIZE, (void *)0);
+    glVertexAttribDivisor(location, 1);
+
+    if (mesh.indices != NULL) glDrawElementsInstanced(GL_TRIANGLES, mesh.triangleCount*3, GL_UNSIGNED_SHORT, NULL, instances);
+    else glDrawArraysInstanced(GL_TRIANGLES, 0, mesh.vertexCount, instances);
+
+    // The mesh vertex array is shared with the indirect draws, leave it as it was
+    glVertexAttribDivisor(location, 0);
+    glDisableVertexAttribArray(location);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    rlDisableVertexArray();
+    rlDisableTexture();
+    rlDisableShader();
+}
+
+#endif // NBODY_INSTANCES_IMPLEMENTATION
@@ -0,0 +1,201 @@
+/**********************************************************************************************
+*
+*   nbody.lights - Clustered point lights sourced from simulated bodies
+*
+*   Every LIGHT_BODY_STRIDE-th body is turned into a point light by a compute pass that
+*   copies its position into a light SSBO. A second compute pass splits the view frustum
+*   into CLUSTER_X*CLUSTER_Y*CLUSTER_Z froxels (exponential depth slices) and builds a
+*   compact per-cluster light index list, so lighting.fs only shades the lights touching
+*   the cluster of the current fragment instead of looping over a fixed uniform array.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_LIGHTS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input)
+*       3 - PointLight pointLights[]            (written by light_gather.comp)
+*       4 - uvec2 clusterGrid[]                 (offset, count) into clusterIndices
+*       5 - uint clusterIndexCount + indices    (written by light_clusters.comp)
+*      18 - uint bodySlots[]                    (input, stable id -> slot, see nbody_reorder.h)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*
+**********************************************************************************************/
+
+#ifndef NBODY_LIGHTS_H
+#define NBODY_LIGHTS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+// IMPORTANT: These must match the defines in light_gather.comp, light_clusters.comp
+// and lighting.fs
+#define LIGHT_BODY_STRIDE           8           // One body out of LIGHT_BODY_STRIDE emits light
+#define MAX_POINT_LIGHTS            (NUM_BODIES/LIGHT_BODY_STRIDE)
+#define LIGHT_RADIUS                40.0f       // Point light range of influence
+
+#define CLUSTER_X                   16
+#define CLUSTER_Y                   9
+#define CLUSTER_Z                   24
+#define CLUSTER_COUNT               (CLUSTER_X*CLUSTER_Y*CLUSTER_Z)
+#define CLUSTER_NEAR                10.0f       // First depth slice starts here (view space)
+#define CLUSTER_FAR                 1000.0f     // Last depth slice ends here (matches RL_CULL_DISTANCE_FAR)
+#define MAX_CLUSTER_INDICES         (CLUSTER_COUNT*64)
+
+#define LIGHT_GATHER_GROUP_SIZE     64          // light_gather.comp local_size_x
+#define LIGHT_CLUSTER_GROUP_SIZE    128         // light_clusters.comp local_size_x
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Point light data, std430 layout
+// NOTE: matches the structure defined in light_gather.comp and lighting.fs
+typedef struct PointLight {
+    float position[4];      // xyz: world position, w: radius of influence
+    float color[4];         // rgb: color, a: intensity
+} PointLight;
+
+// Clustered lights state
+typedef struct LightClusters {
+    unsigned int gatherProgram;     // Bodies -> point lights compute program
+    unsigned int clusterProgram;    // Point lights -> cluster light lists compute program
+
+    unsigned int lightBuffer;       // SSBO: PointLight[MAX_POINT_LIGHTS]
+    unsigned int gridBuffer;        // SSBO: uvec2[CLUSTER_COUNT]
+    unsigned int indexBuffer;       // SSBO: uint count + uint[MAX_CLUSTER_INDICES]
+
+    int viewLoc;                    // light_clusters.comp: view matrix
+    int tanHalfFovLoc;              // light_clusters.comp: tan(fov/2) on x and y
+} LightClusters;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+LightClusters LoadLightClusters(void);                                      // Load cluster compute programs and buffers
+void UnloadLightClusters(LightClusters clusters);                           // Unload cluster compute programs and buffers
+void SetLightClustersShaderValues(Shader shader, int width, int height);    // Send cluster layout to lighting shader
+void UpdateLightClusters(LightClusters clusters, unsigned int bodyBuffer, unsigned int slotBuffer, Camera camera, float aspect); // Gather lights and rebuild cluster lists
+void BindLightClusters(LightClusters clusters);                             // Bind light SSBOs for the lighting shader
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_LIGHTS_H
+
+
+/***********************************************************************************
+*
+*   NBODY LIGHTS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_LIGHTS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "raymath.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <math.h>           // Required for: tanf()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load cluster compute programs and buffers
+LightClusters LoadLightClusters(void)
+{
+    LightClusters clusters = { 0 };
+
+    clusters.gatherProgram = LoadComputeProgramCached("resources/shaders/glsl430/light_gather.comp", NULL);
+    clusters.clusterProgram = LoadComputeProgramCached("resources/shaders/glsl430/light_clusters.comp", NULL);
+
+    clusters.viewLoc = rlGetLocationUniform(clusters.clusterProgram, "matView");
+    clusters.tanHalfFovLoc = rlGetLocationUniform(clusters.clusterProgram, "tanHalfFov");
+
+    clusters.lightBuffer = rlLoadShaderBuffer(MAX_POINT_LIGHTS*sizeof(PointLight), NULL, RL_DYNAMIC_COPY);
+    clusters.gridBuffer = rlLoadShaderBuffer(CLUSTER_COUNT*2*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    clusters.indexBuffer = rlLoadShaderBuffer((MAX_CLUSTER_INDICES + 1)*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+
+    return clusters;
+}
+
+// Unload cluster compute programs and buffers
+void UnloadLightClusters(LightClusters clusters)
+{
+    rlUnloadShaderBuffer(clusters.lightBuffer);
+    rlUnloadShaderBuffer(clusters.gridBuffer);
+    rlUnloadShaderBuffer(clusters.indexBuffer);
+
+    rlUnloadShaderProgram(clusters.gatherProgram);
+    rlUnloadShaderProgram(clusters.clusterProgram);
+}
+
+// Send cluster layout to lighting shader
+// NOTE: Must be called again if the render size changes
+void SetLightClustersShaderValues(Shader shader, int width, int height)
+{
+    float screenSize[2] = { (float)width, (float)height };
+    float clusterDepth[2] = { CLUSTER_NEAR, CLUSTER_FAR };
+
+    SetShaderValue(shader, GetShaderLocation(shader, "screenSize"), screenSize, SHADER_UNIFORM_VEC2);
+    SetShaderValue(shader, GetShaderLocation(shader, "clusterDepth"), clusterDepth, SHADER_UNIFORM_VEC2);
+}
+
+// Gather lights from current body positions and rebuild cluster light lists
+// NOTE: Camera projection must be the one used by BeginMode3D() (symmetric perspective)
+// NOTE: slotBuffer maps stable body ids to slots of bodyBuffer, so lights stay on their bodies
+void UpdateLightClusters(LightClusters clusters, unsigned int bodyBuffer, unsigned int slotBuffer, Camera camera, float aspect)
+{
+    // Bodies -> point lights
+    rlEnableShader(clusters.gatherProgram);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(slotBuffer, 18);
+    rlBindShaderBuffer(clusters.lightBuffer, 3);
+    rlComputeShaderDispatch((MAX_POINT_LIGHTS + LIGHT_GATHER_GROUP_SIZE - 1)/LIGHT_GATHER_GROUP_SIZE, 1, 1);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Reset global index list allocator
+    unsigned int zero = 0;
+    rlUpdateShaderBuffer(clusters.indexBuffer, &zero, sizeof(unsigned int), 0);
+
+    // Point lights -> cluster light lists
+    float tanHalfFovY = tanf(camera.fovy*0.5f*DEG2RAD);
+    float tanHalfFov[2] = { tanHalfFovY*aspect, tanHalfFovY };
+
+    rlEnableShader(clusters.clusterProgram);
+    rlSetUniformMatrix(clusters.viewLoc, GetCameraMatrix(camera));
+    rlSetUniform(clusters.tanHalfFovLoc, tanHalfFov, RL_SHADER_UNIFORM_VEC2, 1);
+    rlBindShaderBuffer(clusters.lightBuffer, 3);
+    rlBindShaderBuffer(clusters.gridBuffer, 4);
+    rlBindShaderBuffer(clusters.indexBuffer, 5);
+    rlComputeShaderDispatch((CLUSTER_COUNT + LIGHT_CLUSTER_GROUP_SIZE - 1)/LIGHT_CLUSTER_GROUP_SIZE, 1, 1);
+    rlDisableShader();
+
+    // Cluster lists are read by the lighting fragment shader
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// Bind light SSBOs for the lighting shader
+void BindLightClusters(LightClusters clusters)
+{
+    rlBindShaderBuffer(clusters.lightBuffer, 3);
+    rlBindShaderBuffer(clusters.gridBuffer, 4);
+    rlBindShaderBuffer(clusters.indexBuffer, 5);
+}
+
+#endif // NBODY_LIGHTS_IMPLEMENTATION
@@ -0,0 +1,188 @@
+/**********************************************************************************************
+*
+*   nbody.monitor - Energy and momentum conservation monitor
+*
+*   Every MONITOR_INTERVAL steps the integrator also accumulates the pair potential of each
+*   body (same loop, same distances as the forces) and the stats reduction of nbody_stats.h
+*   turns it into total kinetic and potential energy, linear momentum and angular momentum
+*   about the center of mass. Results arrive through the reduction fences a frame later and
+*   are appended as a time series to a CSV file, with their drift from the first sample.
+*
+*   Non-conservative terms (velocity damping, contact restitution) show up as energy drift,
+*   momentum drift comes from the non-symmetric contact response.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_MONITOR_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define MONITOR_INTERVAL
+*       Simulation steps between two samples, 100 by default
+*
+*   DEPENDENCIES:
+*       nbody_stats.h       GPU reduction providing the samples
+*
+*   NOTE: The log is written through a large stdio buffer, the file only sees a write
+*   every few hundred samples. Unload the monitor to flush it.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_MONITOR_H
+#define NBODY_MONITOR_H
+
+#include <stdio.h>          // Required for: FILE
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef MONITOR_INTERVAL
+    #define MONITOR_INTERVAL        100         // Simulation steps between two samples
+#endif
+
+#define MONITOR_LOG_BUFFER_SIZE     65536       // Bytes buffered before writing the log
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Conservation monitor data
+typedef struct ConservationMonitor {
+    FILE *log;                  // CSV time series, NULL if it could not be opened
+    char *logBuffer;            // stdio buffer of log
+    float timeStep;             // Simulation time of one step
+
+    bool hasReference;          // First sample taken
+    BodyStats reference;        // First sample, drifts are measured against it
+    BodyStats last;             // Latest sample
+    long long lastStep;         // Simulation step of the latest sample
+
+    float energyDrift;          // (E - E0)/|E0|
+    float momentumDrift;        // |P - P0|
+    float angularMomentumDrift; // |L - L0|/|L0|
+} ConservationMonitor;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+ConservationMonitor LoadConservationMonitor(const char *fileName, float timeStep);  // Open time series log
+void UnloadConservationMonitor(ConservationMonitor monitor);                        // Flush and close time series log
+bool IsConservationStep(long long step);                                            // Check if step must be sampled
+void UpdateConservationMonitor(ConservationMonitor *monitor, StatsReduction reduction);  // Log sample read back by the last stats update, if any
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_MONITOR_H
+
+
+/***********************************************************************************
+*
+*   NBODY MONITOR IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_MONITOR_IMPLEMENTATION)
+
+#include "raylib.h"         // Required for: TraceLog()
+
+#include <stdlib.h>         // Required for: malloc(), free()
+#include <math.h>           // Required for: sqrtf(), fabsf(), fmaxf()
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static float Float3Distance(const float *a, const float *b);    // Distance between xyz of two float[4]
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Open time series log
+ConservationMonitor LoadConservationMonitor(const char *fileName, float timeStep)
+{
+    ConservationMonitor monitor = { 0 };
+
+    monitor.timeStep = timeStep;
+    monitor.log = fopen(fileName, "w");
+
+    if (monitor.log != NULL)
+    {
+        monitor.logBuffer = (char *)RL_MALLOC(MONITOR_LOG_BUFFER_SIZE);
+        setvbuf(monitor.log, monitor.logBuffer, _IOFBF, MONITOR_LOG_BUFFER_SIZE);
+
+        fprintf(monitor.log, "step,time,kinetic,potential,total,energy_drift,px,py,pz,lx,ly,lz,angular_momentum_drift,max_speed\n");
+    }
+    else TraceLog(LOG_WARNING, "MONITOR: [%s] Failed to open conservation log", fileName);
+
+    return monitor;
+}
+
+// Flush and close time series log
+void UnloadConservationMonitor(ConservationMonitor monitor)
+{
+    if (monitor.log != NULL) fclose(monitor.log);
+    RL_FREE(monitor.logBuffer);
+}
+
+// Check if step must be sampled, potentials must be computed for it
+bool IsConservationStep(long long step)
+{
+    return ((step%MONITOR_INTERVAL) == 0);
+}
+
+// Log sample read back by the last stats update, if any
+void UpdateConservationMonitor(ConservationMonitor *monitor, StatsReduction reduction)
+{
+    if (!reduction.diagnosticsUpdated) return;
+
+    BodyStats sample = reduction.diagnostics;
+
+    if (!monitor->hasReference)
+    {
+        monitor->reference = sample;
+        monitor->hasReference = true;
+    }
+
+    const BodyStats *ref = &monitor->reference;
+    float referenceL = sqrtf(ref->angularMomentum[0]*ref->angularMomentum[0] + ref->angularMomentum[1]*ref->angularMomentum[1] + ref->angularMomentum[2]*ref->angularMomentum[2]);
+
+    monitor->energyDrift = (sample.energy[2] - ref->energy[2])/fmaxf(fabsf(ref->energy[2]), 1e-30f);
+    monitor->momentumDrift = Float3Distance(sample.momentum, ref->momentum);
+    monitor->angularMomentumDrift = Float3Distance(sample.angularMomentum, ref->angularMomentum)/fmaxf(referenceL, 1e-30f);
+
+    monitor->last = sample;
+    monitor->lastStep = reduction.diagnosticsStep;
+
+    if (monitor->log != NULL)
+    {
+        fprintf(monitor->log, "%lld,%g,%.9g,%.9g,%.9g,%.6g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.6g,%.6g\n",
+            monitor->lastStep, (double)(monitor->lastStep*monitor->timeStep),
+            sample.energy[0], sample.energy[1], sample.energy[2], monitor->energyDrift,
+            sample.momentum[0], sample.momentum[1], sample.momentum[2],
+            sample.angularMomentum[0], sample.angularMomentum[1], sample.angularMomentum[2], monitor->angularMomentumDrift,
+            sample.momentum[3]);
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Distance between xyz of two float[4]
+static float Float3Distance(const float *a, const float *b)
+{
+    float dx = a[0] - b[0];
+    float dy = a[1] - b[1];
+    float dz = a[2] - b[2];
+
+    return sqrtf(dx*dx + dy*dy + dz*dz);
+}
+
+#endif // NBODY_MONITOR_IMPLEMENTATION
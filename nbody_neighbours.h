@@ -0,0 +1,255 @@
+/**********************************************************************************************
+*
+*   nbody.neighbours - Verlet neighbour lists of the contact pass
+*
+*   Contacts only happen between bodies closer than 2*RADIUS, and in clumped states the set of
+*   such pairs barely changes from a step to the next. neighbour_list.comp keeps, for every
+*   body, the list of bodies within 2*RADIUS + skin when the lists were built, in CSR layout
+*   (a range per body into one array of neighbour slots). nbody.comp then resolves contacts by
+*   walking that short list after the force loop, the force loop itself only does gravity.
+*
+*   Lists stay valid until some body has moved more than skin/2 since the build, no pair can
+*   get closer than 2*RADIUS without entering the list before that. Every step a check pass
+*   reduces the largest displacement on GPU (atomicMax) and writes the indirect dispatch of
+*   the two build passes (count, then reserve and fill), which is empty unless a rebuild is
+*   needed. The CPU never waits for the decision, the counters are read back a few frames late.
+*
+*   A build tests every pair of bodies, unless bvhBuffer holds the BVH of nbody_bvh.h refitted
+*   on the same bodies: then every body walks the tree for its neighbours and sorts them, and
+*   the lists come out the same, lists truncated past NEIGHBOUR_CAPACITY keeping their lowest
+*   slots either way (checked by tests/nbody_gpu_lists.c).
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_NEIGHBOURS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define NEIGHBOUR_SKIN
+*       May be defined before including this file to override the default below.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input)
+*      20 - uint neighbourData[]                (written here, read by nbody.comp)
+*      21 - vec4 referencePositions[]           (positions at the last build)
+*      22 - neighbour state                     (indirect dispatch, counters)
+*      31 - BvhNode nodes[]                     (when bvhBuffer is set, see nbody_bvh.h)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the counters
+*
+*   NOTE: Lists hold slots, reordering bodies invalidates them, see InvalidateNeighbourLists().
+*   Contacts are resolved after the whole gravity sum instead of in between, so the contact
+*   response also cancels the gravity pull of the step along the contact normal
+*
+**********************************************************************************************/
+
+#ifndef NBODY_NEIGHBOURS_H
+#define NBODY_NEIGHBOURS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef NEIGHBOUR_SKIN
+    #define NEIGHBOUR_SKIN          1.0f        // Margin over the contact distance, in world units
+#endif
+
+// IMPORTANT: These must match the defines in neighbour_list.comp
+#define NEIGHBOUR_GROUP_SIZE        64
+#define NEIGHBOUR_CAPACITY          (NUM_BODIES*32)     // Neighbour slots of all lists together
+
+#define NEIGHBOUR_READBACK_SLOTS    3           // Counters in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Neighbour state, std430 layout of neighbour_list.comp binding 22
+typedef struct NeighbourState {
+    unsigned int rebuildGroups[3];  // Indirect dispatch of the build passes, 0 groups when lists are valid
+    float maxDisplacement;          // Largest displacement since the last build
+    unsigned int listSize;          // Neighbour slots used by the build
+    unsigned int overflow;          // Bodies whose list was truncated by the build
+    unsigned int rebuilds;          // Builds since load, the only field not reset every step
+    unsigned int padding;
+} NeighbourState;
+
+// Neighbour lists data
+typedef struct NeighbourLists {
+    unsigned int program;
+    unsigned int listBuffer;        // SSBO: uint[2*NUM_BODIES + NEIGHBOUR_CAPACITY]
+    unsigned int referenceBuffer;   // SSBO: vec4[NUM_BODIES]
+    unsigned int stateBuffer;       // SSBO + indirect dispatch buffer: NeighbourState
+    ReadbackQueue stateReadback;
+    unsigned int bvhBuffer;         // BVH nodes walked by the builds, 0 to test every pair
+
+    float skin;
+    bool invalid;                   // Next update rebuilds whatever the displacements
+
+    long long steps;                // Updates checked
+    int rebuilds;                   // Builds since load, read back a few frames late
+    int listSize;                   // Neighbour slots of the last build read back
+    int overflow;                   // Truncated lists of the last build read back
+    float maxDisplacement;          // Largest displacement of the last check read back
+
+    int stageLoc;
+    int skinLoc;
+    int boxSizeLoc;
+    int bvhLoc;
+    int enabledLoc;                 // Integrator uniform location
+} NeighbourLists;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+NeighbourLists LoadNeighbourLists(unsigned int integratorProgram, float skin);  // Load list program and buffers, first update builds
+void UnloadNeighbourLists(NeighbourLists lists);                                // Unload list program and buffers
+void UpdateNeighbourLists(NeighbourLists *lists, unsigned int bodyBuffer, float boxSize);  // Check displacements, rebuild on GPU when needed
+void InvalidateNeighbourLists(NeighbourLists *lists);                           // Force a rebuild on the next update
+void BindNeighbourLists(NeighbourLists lists, bool enabled);                    // Bind lists to the enabled integrator program
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_NEIGHBOURS_H
+
+
+/***********************************************************************************
+*
+*   NBODY NEIGHBOURS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_NEIGHBOURS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier(), glDispatchComputeIndirect()
+
+#include <stddef.h>         // Required for: offsetof()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load list program and buffers, the first update always builds
+NeighbourLists LoadNeighbourLists(unsigned int integratorProgram, float skin)
+{
+    NeighbourLists lists = { 0 };
+
+    lists.program = LoadComputeProgramCached("resources/shaders/glsl430/neighbour_list.comp", NULL);
+    lists.stageLoc = rlGetLocationUniform(lists.program, "stage");
+    lists.skinLoc = rlGetLocationUniform(lists.program, "skin");
+    lists.boxSizeLoc = rlGetLocationUniform(lists.program, "boxSize");
+    lists.bvhLoc = rlGetLocationUniform(lists.program, "bvh");
+    lists.enabledLoc = rlGetLocationUniform(integratorProgram, "neighbourLists");
+
+    lists.listBuffer = rlLoadShaderBuffer((2*NUM_BODIES + NEIGHBOUR_CAPACITY)*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    lists.referenceBuffer = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    lists.stateBuffer = rlLoadShaderBuffer(sizeof(NeighbourState), NULL, RL_DYNAMIC_COPY);
+    lists.stateReadback = LoadReadbackQueue(NEIGHBOUR_READBACK_SLOTS, sizeof(NeighbourState));
+
+    lists.skin = (skin > 0.0f)? skin : NEIGHBOUR_SKIN;
+    lists.invalid = true;
+
+    return lists;
+}
+
+// Unload list program and buffers
+void UnloadNeighbourLists(NeighbourLists lists)
+{
+    rlUnloadShaderBuffer(lists.listBuffer);
+    rlUnloadShaderBuffer(lists.referenceBuffer);
+    rlUnloadShaderBuffer(lists.stateBuffer);
+    UnloadReadbackQueue(lists.stateReadback);
+    rlUnloadShaderProgram(lists.program);
+}
+
+// Check the displacements of the bodies since the last build, rebuild the lists when some body
+// moved more than skin/2, all decided on GPU
+// NOTE: Must run on the bodies the integrator reads next, after any reorder, and after the
+// refit of lists->bvhBuffer when set. Counters of the earlier updates are collected here,
+// without waiting
+void UpdateNeighbourLists(NeighbourLists *lists, unsigned int bodyBuffer, float boxSize)
+{
+    for (int slot = PollReadback(&lists->stateReadback); slot >= 0; slot = PollReadback(&lists->stateReadback))
+    {
+        const NeighbourState *state = (const NeighbourState *)GetReadbackData(lists->stateReadback, slot);
+
+        lists->maxDisplacement = state->maxDisplacement;
+        lists->rebuilds = (int)state->rebuilds;
+
+        if (state->rebuildGroups[0] > 0)
+        {
+            lists->listSize = (int)state->listSize;
+            lists->overflow = (int)state->overflow;
+        }
+
+        ReleaseReadback(&lists->stateReadback, slot);
+    }
+
+    // Queued after the previous step, the check overwrites it only to request a rebuild
+    NeighbourState reset = { { lists->invalid? NUM_BODIES/NEIGHBOUR_GROUP_SIZE : 0, 1, 1 }, 0.0f, 0, 0, 0, 0 };
+    rlUpdateShaderBuffer(lists->stateBuffer, &reset, offsetof(NeighbourState, rebuilds), 0);
+
+    lists->invalid = false;
+    lists->steps++;
+
+    int stage = 0;
+    int bvh = (lists->bvhBuffer != 0)? 1 : 0;
+
+    rlEnableShader(lists->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(lists->listBuffer, 20);
+    rlBindShaderBuffer(lists->referenceBuffer, 21);
+    rlBindShaderBuffer(lists->stateBuffer, 22);
+    if (bvh == 1) rlBindShaderBuffer(lists->bvhBuffer, 31);
+    rlSetUniform(lists->bvhLoc, &bvh, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(lists->skinLoc, &lists->skin, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(lists->boxSizeLoc, &boxSize, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(lists->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(NUM_BODIES/NEIGHBOUR_GROUP_SIZE, 1, 1);
+
+    // Count, then reserve and fill, both empty dispatches unless the check asked for a rebuild
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, lists->stateBuffer);
+
+    for (stage = 1; stage <= 2; stage++)
+    {
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+        rlSetUniform(lists->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        glDispatchComputeIndirect(0);
+    }
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if (!IsReadbackQueueFull(lists->stateReadback)) RequestReadback(&lists->stateReadback, lists->stateBuffer, 0, sizeof(NeighbourState), lists->steps);
+}
+
+// Force a rebuild on the next update, e.g. once bodies changed slots
+void InvalidateNeighbourLists(NeighbourLists *lists)
+{
+    lists->invalid = true;
+}
+
+// Bind lists (binding 20) to the enabled integrator program, contacts come from them when enabled
+void BindNeighbourLists(NeighbourLists lists, bool enabled)
+{
+    int neighbourLists = enabled? 1 : 0;
+
+    rlSetUniform(lists.enabledLoc, &neighbourLists, RL_SHADER_UNIFORM_INT, 1);
+    rlBindShaderBuffer(lists.listBuffer, 20);
+}
+
+#endif // NBODY_NEIGHBOURS_IMPLEMENTATION
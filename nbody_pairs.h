@@ -0,0 +1,320 @@
+/**********************************************************************************************
+*
+*   nbody.pairs - Symmetric direct sum on the work-stealing task pool
+*
+*   The reference integrator (nbody_cpu.h), like nbody.comp, gathers: body i loops over every
+*   other body j, so each unordered pair is evaluated twice. Here each pair is evaluated once
+*   and its opposite contributions go to both bodies (Newton's third law), halving the
+*   arithmetic of a step:
+*
+*       Accumulate  Bodies are cut into blocks of PAIR_BLOCK_SIZE, the tiles (I, J) with I <= J
+*                   are split into laneCount contiguous runs, one task per run. Each lane adds
+*                   its pairs into its own accumulators, no atomics, no sharing
+*       Reduce      ParallelFor over bodies, the lane accumulators are summed in lane order,
+*                   added to the input state and cleared for the next step, then bodies drift
+*
+*   Which worker runs a lane does not matter, tiles of a lane and the reduction order are
+*   fixed, so results are bit identical from run to run for a given laneCount.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_PAIRS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type, physics constants and integration
+*       nbody_tasks.h       Work-stealing task pool
+*
+*   NOTE: Every pair sees the input state of both bodies (Jacobi), while the gather loop moves a
+*   body out of a contact before its later pairs. Gravity matches the reference to round-off,
+*   bodies in several contacts at once are pushed by the sum of their overlaps instead.
+*   Accumulators take laneCount*capacity*32 bytes.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_PAIRS_H
+#define NBODY_PAIRS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define PAIR_BLOCK_SIZE         64          // Bodies per tile side, two blocks of bodies and accumulators fit in L1
+#define PAIR_REDUCE_GRAIN       1024        // Bodies per reduction task
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Per lane contribution to a body
+typedef struct PairAccumulator {
+    float dp[3];                // Contact position correction
+    float dv[3];                // Velocity change
+    float potential;
+    float padding;              // 32 bytes, accumulators do not straddle cache lines
+} PairAccumulator;
+
+// Symmetric direct sum solver data
+typedef struct PairSolver {
+    int capacity;               // Max bodies
+    int laneCount;              // Tile runs, each with its own accumulators
+    PairAccumulator *accumulators;  // laneCount*capacity, zero between steps
+    long long pairCount;        // Pairs evaluated by the last step
+} PairSolver;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+PairSolver LoadPairSolver(int capacity, int laneCount);                    // Allocate solver, laneCount <= 0 for one lane
+void UnloadPairSolver(PairSolver solver);                                   // Free solver
+void StepBodiesPairs(PairSolver *solver, TaskPool *pool, const Body *bodies, Body *result, float *potentials, int count);  // Integrate one step, potentials may be NULL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_PAIRS_H
+
+
+/***********************************************************************************
+*
+*   NBODY PAIRS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_PAIRS_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <math.h>           // Required for: sqrtf()
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// One symmetric step, shared by all tasks
+typedef struct PairStep {
+    PairSolver *solver;
+    TaskPool *pool;
+    const Body *bodies;
+    Body *result;
+    float *potentials;
+    int count;
+    int blockCount;
+    long long tileCount;        // Upper triangle tiles, diagonal included
+} PairStep;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static void StepPairsTask(void *data);                              // Root task: accumulate, reduce
+static void AccumulatePairLanes(void *data, int begin, int end);    // Tiles of lanes [begin, end)
+static void AccumulatePairTile(const PairStep *step, PairAccumulator *lane, int blockA, int blockB);
+static void ApplySymmetricPair(const Body *a, const Body *b, PairAccumulator *accA, PairAccumulator *accB);
+static void ReducePairRange(void *data, int begin, int end);        // Sum lanes into bodies [begin, end), drift
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Allocate solver for up to capacity bodies
+// NOTE: Results depend on laneCount, not on the pool size, one lane per worker balances best
+PairSolver LoadPairSolver(int capacity, int laneCount)
+{
+    PairSolver solver = { 0 };
+
+    solver.capacity = capacity;
+    solver.laneCount = (laneCount > 0)? laneCount : 1;
+    solver.accumulators = (PairAccumulator *)calloc((size_t)solver.laneCount*capacity, sizeof(PairAccumulator));
+
+    return solver;
+}
+
+// Free solver
+void UnloadPairSolver(PairSolver solver)
+{
+    free(solver.accumulators);
+}
+
+// Integrate one step from bodies into result, each pair evaluated once
+// NOTE: Potentials of the input bodies are written when not NULL, same as StepBodiesReference()
+void StepBodiesPairs(PairSolver *solver, TaskPool *pool, const Body *bodies, Body *result, float *potentials, int count)
+{
+    if (count > solver->capacity) count = solver->capacity;
+
+    int blockCount = (count + PAIR_BLOCK_SIZE - 1)/PAIR_BLOCK_SIZE;
+
+    PairStep step = { solver, pool, bodies, result, potentials, count, blockCount, (long long)blockCount*(blockCount + 1)/2 };
+    RunTaskPool(pool, StepPairsTask, &step);
+
+    solver->pairCount = (long long)count*(count - 1)/2;
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Root task of a step: one task per lane, then the reduction once all lanes joined
+static void StepPairsTask(void *data)
+{
+    PairStep *step = (PairStep *)data;
+
+    if (step->count == 0) return;
+
+    ParallelFor(step->pool, 0, step->solver->laneCount, 1, AccumulatePairLanes, step);
+    ParallelFor(step->pool, 0, step->count, PAIR_REDUCE_GRAIN, ReducePairRange, step);
+}
+
+// Tiles of lanes [begin, end), lane l takes tiles [l*T/L, (l + 1)*T/L) of the row major upper triangle
+static void AccumulatePairLanes(void *data, int begin, int end)
+{
+    PairStep *step = (PairStep *)data;
+    int laneCount = step->solver->laneCount;
+
+    for (int l = begin; l < end; l++)
+    {
+        PairAccumulator *lane = step->solver->accumulators + (size_t)l*step->solver->capacity;
+        long long first = step->tileCount*l/laneCount;
+        long long last = step->tileCount*(l + 1)/laneCount;
+
+        if (first == last) continue;
+
+        // Row and column of the first tile, row I holds blockCount - I tiles
+        int blockA = 0;
+        long long rowStart = 0;
+        while ((rowStart + step->blockCount - blockA) <= first)
+        {
+            rowStart += step->blockCount - blockA;
+            blockA++;
+        }
+        int blockB = blockA + (int)(first - rowStart);
+
+        for (long long t = first; t < last; t++)
+        {
+            AccumulatePairTile(step, lane, blockA, blockB);
+
+            if (++blockB == step->blockCount)
+            {
+                blockA++;
+                blockB = blockA;
+            }
+        }
+    }
+}
+
+// Pairs of a tile, i < j on diagonal tiles
+static void AccumulatePairTile(const PairStep *step, PairAccumulator *lane, int blockA, int blockB)
+{
+    int firstA = blockA*PAIR_BLOCK_SIZE;
+    int lastA = (firstA + PAIR_BLOCK_SIZE < step->count)? firstA + PAIR_BLOCK_SIZE : step->count;
+    int firstB = blockB*PAIR_BLOCK_SIZE;
+    int lastB = (firstB + PAIR_BLOCK_SIZE < step->count)? firstB + PAIR_BLOCK_SIZE : step->count;
+
+    for (int i = firstA; i < lastA; i++)
+    {
+        for (int j = (blockA == blockB)? i + 1 : firstB; j < lastB; j++)
+        {
+            ApplySymmetricPair(&step->bodies[i], &step->bodies[j], &lane[i], &lane[j]);
+        }
+    }
+}
+
+// Interaction of a pair from the input state, opposite contributions to both bodies
+// NOTE: Same operations as ApplyBodyPair(), the contact response of b is the one of a mirrored
+static void ApplySymmetricPair(const Body *a, const Body *b, PairAccumulator *accA, PairAccumulator *accB)
+{
+    float dx = a->px - b->px;
+    float dy = a->py - b->py;
+    float dz = a->pz - b->pz;
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+
+    if (dist < 0.001f) return;
+
+    float invLength = 1.0f/dist;
+    float ux = dx*invLength;
+    float uy = dy*invLength;
+    float uz = dz*invLength;
+
+    if (dist < (2.0f*BODY_RADIUS))
+    {
+        // No gravity in contact, potential stays flat below 2*BODY_RADIUS
+        accA->potential -= BODY_GM/(2.0f*BODY_RADIUS);
+        accB->potential -= BODY_GM/(2.0f*BODY_RADIUS);
+
+        float depth = ((2.0f*BODY_RADIUS) - dist)/CONTACT_SEPARATION;
+        accA->dp[0] += ux*depth;
+        accA->dp[1] += uy*depth;
+        accA->dp[2] += uz*depth;
+        accB->dp[0] -= ux*depth;
+        accB->dp[1] -= uy*depth;
+        accB->dp[2] -= uz*depth;
+
+        float response = ((a->vx - b->vx)*ux + (a->vy - b->vy)*uy + (a->vz - b->vz)*uz)/CONTACT_RESTITUTION;
+
+        accA->dv[0] -= ux*response;
+        accA->dv[1] -= uy*response;
+        accA->dv[2] -= uz*response;
+        accB->dv[0] += ux*response;
+        accB->dv[1] += uy*response;
+        accB->dv[2] += uz*response;
+    }
+    else
+    {
+        float dist2 = dist*dist;
+        accA->potential -= BODY_GM/dist;
+        accB->potential -= BODY_GM/dist;
+
+        float gx = ux/dist2;
+        float gy = uy/dist2;
+        float gz = uz/dist2;
+
+        accA->dv[0] -= gx;
+        accA->dv[1] -= gy;
+        accA->dv[2] -= gz;
+        accB->dv[0] += gx;
+        accB->dv[1] += gy;
+        accB->dv[2] += gz;
+    }
+}
+
+// Sum the lane accumulators of bodies [begin, end) in lane order, clear them, drift
+static void ReducePairRange(void *data, int begin, int end)
+{
+    PairStep *step = (PairStep *)data;
+    PairSolver *solver = step->solver;
+
+    for (int i = begin; i < end; i++)
+    {
+        PairAccumulator sum = { 0 };
+
+        for (int l = 0; l < solver->laneCount; l++)
+        {
+            PairAccumulator *acc = &solver->accumulators[(size_t)l*solver->capacity + i];
+
+            for (int k = 0; k < 3; k++)
+            {
+                sum.dp[k] += acc->dp[k];
+                sum.dv[k] += acc->dv[k];
+            }
+            sum.potential += acc->potential;
+
+            *acc = (PairAccumulator){ 0 };
+        }
+
+        const Body *body = &step->bodies[i];
+        step->result[i] = (Body){
+            body->px + sum.dp[0], body->py + sum.dp[1], body->pz + sum.dp[2],
+            body->vx + sum.dv[0], body->vy + sum.dv[1], body->vz + sum.dv[2]
+        };
+
+        if (step->potentials != NULL) step->potentials[i] = sum.potential;
+    }
+
+    IntegrateBodies(step->result + begin, end - begin);
+}
+
+#endif // NBODY_PAIRS_IMPLEMENTATION
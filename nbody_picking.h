@@ -0,0 +1,254 @@
+/**********************************************************************************************
+*
+*   nbody.picking - Mouse ray picking and tracking of bodies on GPU
+*
+*   Picking on CPU would need the bodies read back and a loop over all of them. Here a click
+*   queues body_pick.comp, which intersects the ray with every body sphere and keeps the
+*   nearest hit with atomics, and only the 8 byte result (hit depth, stable id) is read back
+*   a few frames later through the readback queue:
+*
+*       Depth       atomicMin of the hit distance bits, positive floats order like their bits
+*       Id          atomicMin of the stable ids hit at exactly that depth, ties are deterministic
+*
+*   Core GLSL has no 64-bit atomics, so the (depth, id) pair is found in two passes rather than
+*   one atomicMin on a packed value. Once a body is picked, a one thread pass copies its
+*   position every frame (16 bytes read back) and the camera follows it instead of the center
+*   of mass. The picked id is stable, the body is tracked across reorders.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_PICKING_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (bodies drawn this frame)
+*      17 - uint bodyIds[]                      (slot -> id, see nbody_reorder.h)
+*      18 - uint bodySlots[]                    (id -> slot)
+*      27 - pick result                         (hit depth and id, tracked position)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the result
+*
+*   NOTE: Picks test every body, there is no spatial structure to walk. A picked body that
+*   gets deleted must be dropped with ClearBodyPick(): its id goes back on the free list of
+*   nbody_edits.h and the next spawn may reuse it, so the tracked copy alone cannot tell. Watch
+*   pickedId with the edit queue (watchedId) and clear once it reports the delete
+*
+**********************************************************************************************/
+
+#ifndef NBODY_PICKING_H
+#define NBODY_PICKING_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+
+// IMPORTANT: These must match the defines in body_pick.comp
+#define PICK_GROUP_SIZE             64
+#define PICK_NONE                   0xffffffffu     // Id of a miss
+
+#define PICK_READBACK_SLOTS         3           // Results in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Pick result, std430 layout of body_pick.comp binding 27
+typedef struct PickResult {
+    unsigned int depth;             // Hit distance bits
+    unsigned int id;                // Stable id of the hit body, PICK_NONE on a miss
+    unsigned int padding[2];
+    float tracked[4];               // xyz: position of the tracked body, w: 1 live, 0 parked
+} PickResult;
+
+// Body picker data
+typedef struct BodyPicker {
+    unsigned int program;
+    unsigned int resultBuffer;      // SSBO: PickResult
+    ReadbackQueue pickReadback;     // 8 bytes per pick
+    ReadbackQueue trackReadback;    // Tracked position, 16 bytes per frame
+
+    int pickedId;                   // Stable id of the tracked body, -1 when none
+    bool trackedValid;              // trackedPosition read back for pickedId
+    Vector3 trackedPosition;        // Read back a few frames late
+
+    long long picks;                // Picks requested since load
+    long long clearedPicks;         // Picks up to this one are stale
+
+    int stageLoc;
+    int rayOriginLoc;
+    int rayDirectionLoc;
+    int trackedIdLoc;
+} BodyPicker;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+BodyPicker LoadBodyPicker(void);                                                // Load pick program and buffers
+void UnloadBodyPicker(BodyPicker picker);                                       // Unload pick program and buffers
+void RequestBodyPick(BodyPicker *picker, Ray ray, unsigned int bodyBuffer, unsigned int idBuffer);  // Queue a pick of the nearest body hit by the ray
+void UpdateBodyPicker(BodyPicker *picker, unsigned int bodyBuffer, unsigned int slotBuffer);  // Collect picks, queue the tracked position copy
+void ClearBodyPick(BodyPicker *picker);                                         // Stop tracking, picks in flight are ignored
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_PICKING_H
+
+
+/***********************************************************************************
+*
+*   NBODY PICKING IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_PICKING_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"        // Required for: Vector3Normalize()
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stddef.h>         // Required for: offsetof()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load pick program and buffers
+BodyPicker LoadBodyPicker(void)
+{
+    BodyPicker picker = { 0 };
+
+    picker.program = LoadComputeProgramCached("resources/shaders/glsl430/body_pick.comp", NULL);
+    picker.stageLoc = rlGetLocationUniform(picker.program, "stage");
+    picker.rayOriginLoc = rlGetLocationUniform(picker.program, "rayOrigin");
+    picker.rayDirectionLoc = rlGetLocationUniform(picker.program, "rayDirection");
+    picker.trackedIdLoc = rlGetLocationUniform(picker.program, "trackedId");
+
+    picker.resultBuffer = rlLoadShaderBuffer(sizeof(PickResult), NULL, RL_DYNAMIC_COPY);
+    picker.pickReadback = LoadReadbackQueue(PICK_READBACK_SLOTS, 2*sizeof(unsigned int));
+    picker.trackReadback = LoadReadbackQueue(PICK_READBACK_SLOTS, 4*sizeof(float));
+
+    picker.pickedId = -1;
+
+    return picker;
+}
+
+// Unload pick program and buffers
+void UnloadBodyPicker(BodyPicker picker)
+{
+    rlUnloadShaderBuffer(picker.resultBuffer);
+    UnloadReadbackQueue(picker.pickReadback);
+    UnloadReadbackQueue(picker.trackReadback);
+    rlUnloadShaderProgram(picker.program);
+}
+
+// Queue a pick of the nearest body hit by the ray, the result is collected by a later
+// UpdateBodyPicker(). Ignored while all readback slots are in flight
+void RequestBodyPick(BodyPicker *picker, Ray ray, unsigned int bodyBuffer, unsigned int idBuffer)
+{
+    if (IsReadbackQueueFull(picker->pickReadback)) return;
+
+    unsigned int reset[2] = { PICK_NONE, PICK_NONE };
+    rlUpdateShaderBuffer(picker->resultBuffer, reset, sizeof(reset), 0);
+
+    Vector3 direction = Vector3Normalize(ray.direction);
+    int stage = 0;
+
+    rlEnableShader(picker->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(idBuffer, 17);
+    rlBindShaderBuffer(picker->resultBuffer, 27);
+    rlSetUniform(picker->rayOriginLoc, &ray.position, RL_SHADER_UNIFORM_VEC3, 1);
+    rlSetUniform(picker->rayDirectionLoc, &direction, RL_SHADER_UNIFORM_VEC3, 1);
+
+    for (stage = 0; stage <= 1; stage++)
+    {
+        rlSetUniform(picker->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/PICK_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    rlDisableShader();
+
+    picker->picks++;
+    RequestReadback(&picker->pickReadback, picker->resultBuffer, 0, 2*sizeof(unsigned int), picker->picks);
+}
+
+// Collect picks read back since the last update, a hit starts tracking its body and a miss
+// stops it. Then queue the copy of the tracked body position
+// NOTE: bodyBuffer and slotBuffer must be current, the tracked body is found by its stable id
+void UpdateBodyPicker(BodyPicker *picker, unsigned int bodyBuffer, unsigned int slotBuffer)
+{
+    for (int slot = PollReadback(&picker->pickReadback); slot >= 0; slot = PollReadback(&picker->pickReadback))
+    {
+        const unsigned int *result = (const unsigned int *)GetReadbackData(picker->pickReadback, slot);
+
+        // Picks requested before a clear are stale
+        if (picker->pickReadback.tags[slot] > picker->clearedPicks)
+        {
+            picker->pickedId = (result[1] != PICK_NONE)? (int)result[1] : -1;
+            picker->trackedValid = false;
+        }
+
+        ReleaseReadback(&picker->pickReadback, slot);
+    }
+
+    for (int slot = PollReadback(&picker->trackReadback); slot >= 0; slot = PollReadback(&picker->trackReadback))
+    {
+        const float *tracked = (const float *)GetReadbackData(picker->trackReadback, slot);
+
+        // Copies of an earlier pick are stale
+        if (picker->trackReadback.tags[slot] == picker->pickedId)
+        {
+            picker->trackedPosition = (Vector3){ tracked[0], tracked[1], tracked[2] };
+            picker->trackedValid = true;
+
+            // Deleted body
+            if (tracked[3] == 0.0f)
+            {
+                picker->pickedId = -1;
+                picker->trackedValid = false;
+            }
+        }
+
+        ReleaseReadback(&picker->trackReadback, slot);
+    }
+
+    if ((picker->pickedId < 0) || IsReadbackQueueFull(picker->trackReadback)) return;
+
+    int stage = 2;
+
+    rlEnableShader(picker->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(slotBuffer, 18);
+    rlBindShaderBuffer(picker->resultBuffer, 27);
+    rlSetUniform(picker->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(picker->trackedIdLoc, &picker->pickedId, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(1, 1, 1);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    RequestReadback(&picker->trackReadback, picker->resultBuffer, offsetof(PickResult, tracked), 4*sizeof(float), picker->pickedId);
+}
+
+// Stop tracking, the camera goes back to the center of mass
+void ClearBodyPick(BodyPicker *picker)
+{
+    picker->pickedId = -1;
+    picker->trackedValid = false;
+    picker->clearedPicks = picker->picks;
+}
+
+#endif // NBODY_PICKING_IMPLEMENTATION
@@ -0,0 +1,753 @@
+/**********************************************************************************************
+*
+*   nbody.pm - Particle-Mesh and P3M integrator
+*
+*   Long-range gravity on a 3D mesh, short-range gravity and contacts body by body:
+*
+*       Deposit     Cloud-in-cell (CIC) mass assignment of every body onto the mesh
+*       Solve       Forward FFT, product with the long-range Green function, inverse FFT
+*       Gradient    Fourth order finite differences of the mesh potential
+*       Interpolate CIC interpolation of the mesh field back to every body
+*       Short range Pairs closer than the cutoff, through the direct kernel (ApplyBodyPair)
+*                   minus the long-range part already on the mesh (P3M)
+*
+*   The force is split with a Gaussian of radius rs (PM_SPLIT_CELLS mesh cells): the mesh carries
+*   erf(r/2rs)/r, whose Fourier transform is 4pi/k^2 exp(-k^2 rs^2), and the pairs carry the
+*   rest, which is negligible beyond PM_CUTOFF_SPLITS*rs. Pairs are found on a chaining mesh of
+*   cells at least as large as the cutoff.
+*
+*   Boundaries:
+*       PM_BOUNDARY_PERIODIC    Cubic box of side boxSize centered on the origin, bodies wrap
+*                               around, pairs use the minimum image, the mean density is removed
+*       PM_BOUNDARY_ISOLATED    Mesh fitted around the bodies every step, zero-padded to twice
+*                               its size so the FFT convolution has no periodic images (Hockney)
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_PM_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type, pair interaction and integration
+*       nbody_tasks.h       Work-stealing task pool, FFT lines, field and bodies run in parallel
+*
+*   NOTE: FFT is a built-in radix-2 complex transform, mesh sizes are powers of two. Without the
+*   short-range part (PM only) gravity is smoothed below a few mesh cells and contacts are ignored.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_PM_H
+#define NBODY_PM_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define PM_MIN_GRID             16          // Min mesh size, the cutoff must stay below half the periodic box
+#define PM_MAX_FFT              512         // Max FFT length: periodic mesh size, twice the isolated mesh size
+#define PM_SPLIT_CELLS          1.25f       // Force split radius rs, in mesh cells
+#define PM_CUTOFF_SPLITS        4.5f        // Short-range cutoff, in split radii, the long-range part is 1 - 1e-4 there
+#define PM_GRID_MARGIN          3           // Isolated mesh cells kept empty around the bodies (CIC and gradient stencils)
+#define PM_MAX_CHAIN_CELLS      128         // Max chaining mesh cells per axis
+#define PM_BODY_GRAIN           256         // Bodies per interpolation and short-range task
+#define PM_LINE_GRAIN           16          // FFT lines per task
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Mesh boundary condition
+typedef enum {
+    PM_BOUNDARY_PERIODIC = 0,
+    PM_BOUNDARY_ISOLATED
+} PmBoundary;
+
+// PM solver data
+typedef struct PmSolver {
+    int capacity;               // Max bodies
+    int gridSize;               // Mesh cells per axis, N
+    int fftSize;                // FFT length, N periodic, 2N isolated
+    PmBoundary boundary;
+    float boxSize;              // Periodic box side
+    bool shortRange;            // P3M, add the short-range pairs
+
+    float *grid;                // Complex mesh, fftSize^3 interleaved (re, im)
+    float *kernel;              // Green function in Fourier space for a unit spacing, fftSize^3
+    float *field;               // Potential gradient, gridSize^3 interleaved (x, y, z)
+    float *twiddles;            // exp(-2i pi k/fftSize), fftSize/2 interleaved (re, im)
+    int *cellStart;             // Chaining mesh: first body of each cell, cells + 1
+    int *cellBodies;            // Chaining mesh: bodies sorted by cell
+} PmSolver;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+PmSolver LoadPmSolver(int capacity, int gridSize, PmBoundary boundary, float boxSize, bool shortRange);  // Allocate solver, gridSize rounded to a power of two
+void UnloadPmSolver(PmSolver pm);                                           // Free solver
+void StepBodiesPm(PmSolver *pm, TaskPool *pool, const Body *bodies, Body *result, int count);  // Integrate one step
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_PM_H
+
+
+/***********************************************************************************
+*
+*   NBODY PM IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_PM_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: memset(), memcpy()
+#include <math.h>           // Required for: sqrtf(), expf(), erff(), erfcf(), floorf(), cos(), sin()
+
+#ifndef PI
+    #define PI 3.14159265358979323846f
+#endif
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// One PM step
+typedef struct PmStep {
+    PmSolver *pm;
+    TaskPool *pool;
+    const Body *bodies;
+    Body *result;
+    int count;
+
+    float origin[3];            // Position of mesh node (0, 0, 0)
+    float spacing;              // Mesh cell size, h
+    float splitRadius;          // rs
+    float cutoff;               // Short-range cutoff
+    float chainOrigin[3];       // Position of chaining cell (0, 0, 0)
+    float chainSpacing;         // Chaining cell size, at least the cutoff
+    int chainCells;             // Chaining cells per axis
+} PmStep;
+
+// FFT of the lines along one axis, lines enumerated over the two other axes up to limits
+typedef struct PmTransform {
+    PmSolver *pm;
+    int axis;                   // 0 x, 1 y, 2 z
+    int limitA;                 // Lines over the first other axis (y for x, x otherwise)
+    int limitB;                 // Lines over the second other axis (z for x and y, y for z)
+    bool inverse;
+} PmTransform;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static void StepPmTask(void *data);                                 // Root task: box, deposit, solve, bodies
+static void InitPmKernel(PmSolver *pm);                             // Green function for a unit spacing
+static void TransformPmAxis(PmStep *step, int axis, int limitA, int limitB, bool inverse);
+static void TransformPmLines(void *data, int begin, int end);       // FFT lines [begin, end) of an axis
+static void TransformPmLine(float *line, int n, const float *twiddles, bool inverse);  // In place radix-2 FFT
+static void DepositPmMass(PmStep *step);                            // CIC deposit, serial
+static void ComputePmField(void *data, int begin, int end);         // Gradient of z slices [begin, end)
+static void BuildPmChain(PmStep *step);                             // Chaining mesh of the bodies
+static void ApplyPmBodies(void *data, int begin, int end);          // Mesh field, short range, integration
+static int GetPmChainCell(const PmStep *step, const Body *body, int axis);
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Allocate solver for up to capacity bodies
+// NOTE: The isolated FFT mesh is twice gridSize per axis, PM_MAX_FFT bounds both
+PmSolver LoadPmSolver(int capacity, int gridSize, PmBoundary boundary, float boxSize, bool shortRange)
+{
+    PmSolver pm = { 0 };
+
+    int maxGrid = (boundary == PM_BOUNDARY_ISOLATED)? PM_MAX_FFT/2 : PM_MAX_FFT;
+    int size = PM_MIN_GRID;
+    while ((size < gridSize) && (size < maxGrid)) size *= 2;
+
+    pm.capacity = capacity;
+    pm.gridSize = size;
+    pm.fftSize = (boundary == PM_BOUNDARY_ISOLATED)? 2*size : size;
+    pm.boundary = boundary;
+    pm.boxSize = boxSize;
+    pm.shortRange = shortRange;
+
+    size_t fftCells = (size_t)pm.fftSize*pm.fftSize*pm.fftSize;
+    size_t gridCells = (size_t)size*size*size;
+    int chainCells = PM_MAX_CHAIN_CELLS*PM_MAX_CHAIN_CELLS*PM_MAX_CHAIN_CELLS;
+
+    pm.grid = (float *)calloc(2*fftCells, sizeof(float));
+    pm.kernel = (float *)calloc(fftCells, sizeof(float));
+    pm.field = (float *)calloc(3*gridCells, sizeof(float));
+    pm.twiddles = (float *)calloc(pm.fftSize, sizeof(float));
+    pm.cellStart = (int *)calloc(chainCells + 1, sizeof(int));
+    pm.cellBodies = (int *)calloc(capacity, sizeof(int));
+
+    for (int k = 0; k < pm.fftSize/2; k++)
+    {
+        double angle = -2.0*3.14159265358979323846*k/pm.fftSize;
+        pm.twiddles[2*k] = (float)cos(angle);
+        pm.twiddles[2*k + 1] = (float)sin(angle);
+    }
+
+    InitPmKernel(&pm);
+
+    return pm;
+}
+
+// Free solver
+void UnloadPmSolver(PmSolver pm)
+{
+    free(pm.grid);
+    free(pm.kernel);
+    free(pm.field);
+    free(pm.twiddles);
+    free(pm.cellStart);
+    free(pm.cellBodies);
+}
+
+// Integrate one step of bodies into result
+void StepBodiesPm(PmSolver *pm, TaskPool *pool, const Body *bodies, Body *result, int count)
+{
+    if (count > pm->capacity) count = pm->capacity;
+    if (count == 0) return;
+
+    PmStep step = { 0 };
+    step.pm = pm;
+    step.pool = pool;
+    step.bodies = bodies;
+    step.result = result;
+    step.count = count;
+
+    RunTaskPool(pool, StepPmTask, &step);
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Root task of a step: mesh placement, deposit, FFT solve, field, then bodies in parallel
+static void StepPmTask(void *data)
+{
+    PmStep *step = (PmStep *)data;
+    PmSolver *pm = step->pm;
+    int n = pm->gridSize;
+    int m = pm->fftSize;
+
+    if (pm->boundary == PM_BOUNDARY_PERIODIC)
+    {
+        step->spacing = pm->boxSize/n;
+        for (int d = 0; d < 3; d++) step->origin[d] = -0.5f*pm->boxSize;
+    }
+    else
+    {
+        // Cube around all bodies, PM_GRID_MARGIN empty cells on each side
+        float boundsMin[3] = { step->bodies[0].px, step->bodies[0].py, step->bodies[0].pz };
+        float boundsMax[3] = { step->bodies[0].px, step->bodies[0].py, step->bodies[0].pz };
+
+        for (int i = 1; i < step->count; i++)
+        {
+            const float position[3] = { step->bodies[i].px, step->bodies[i].py, step->bodies[i].pz };
+
+            for (int d = 0; d < 3; d++)
+            {
+                if (position[d] < boundsMin[d]) boundsMin[d] = position[d];
+                if (position[d] > boundsMax[d]) boundsMax[d] = position[d];
+            }
+        }
+
+        float extent = fmaxf(boundsMax[0] - boundsMin[0], fmaxf(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+        step->spacing = fmaxf(extent, BODY_RADIUS)/(n - 2*PM_GRID_MARGIN - 1);
+
+        for (int d = 0; d < 3; d++) step->origin[d] = 0.5f*(boundsMin[d] + boundsMax[d]) - 0.5f*n*step->spacing;
+    }
+
+    step->splitRadius = PM_SPLIT_CELLS*step->spacing;
+    step->cutoff = fmaxf(PM_CUTOFF_SPLITS*step->splitRadius, 2.0f*BODY_RADIUS);     // Contacts always go through the pairs
+
+    // Long range: deposit, convolution with the Green function, finite difference field
+    memset(pm->grid, 0, 2*(size_t)m*m*m*sizeof(float));
+    DepositPmMass(step);
+
+    // Padded lines of zeros are skipped forward, lines out of the mesh are skipped backward
+    TransformPmAxis(step, 0, n, n, false);
+    TransformPmAxis(step, 1, m, n, false);
+    TransformPmAxis(step, 2, m, m, false);
+
+    float scale = 1.0f/step->spacing;
+    for (size_t c = 0; c < (size_t)m*m*m; c++)
+    {
+        pm->grid[2*c] *= pm->kernel[c]*scale;
+        pm->grid[2*c + 1] *= pm->kernel[c]*scale;
+    }
+
+    TransformPmAxis(step, 2, m, m, true);
+    TransformPmAxis(step, 1, m, n, true);
+    TransformPmAxis(step, 0, n, n, true);
+
+    ParallelFor(step->pool, 0, n, 1, ComputePmField, step);
+
+    if (pm->shortRange) BuildPmChain(step);
+
+    ParallelFor(step->pool, 0, step->count, PM_BODY_GRAIN, ApplyPmBodies, step);
+}
+
+// Green function of the mesh in Fourier space, for a unit mesh spacing, CIC deconvolved
+// NOTE: Includes the 1/fftSize^3 of the inverse FFT, scales as 1/spacing
+static void InitPmKernel(PmSolver *pm)
+{
+    int m = pm->fftSize;
+    float rs = PM_SPLIT_CELLS;
+
+    if (pm->boundary == PM_BOUNDARY_ISOLATED)
+    {
+        // erf(r/2rs)/r sampled on the padded mesh, distances wrap around so the FFT sees it even
+        for (int z = 0; z < m; z++)
+        {
+            for (int y = 0; y < m; y++)
+            {
+                for (int x = 0; x < m; x++)
+                {
+                    float dx = (float)((x <= m/2)? x : m - x);
+                    float dy = (float)((y <= m/2)? y : m - y);
+                    float dz = (float)((z <= m/2)? z : m - z);
+                    float r = sqrtf(dx*dx + dy*dy + dz*dz);
+                    size_t c = ((size_t)z*m + y)*m + x;
+
+                    pm->grid[2*c] = (r > 0.0f)? erff(0.5f*r/rs)/r : 1.0f/(rs*sqrtf(PI));
+                    pm->grid[2*c + 1] = 0.0f;
+                }
+            }
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            PmTransform transform = { pm, axis, m, m, false };
+            TransformPmLines(&transform, 0, m*m);
+        }
+    }
+
+    for (int z = 0; z < m; z++)
+    {
+        for (int y = 0; y < m; y++)
+        {
+            for (int x = 0; x < m; x++)
+            {
+                int frequency[3] = { (x <= m/2)? x : x - m, (y <= m/2)? y : y - m, (z <= m/2)? z : z - m };
+                size_t c = ((size_t)z*m + y)*m + x;
+                float window = 1.0f;
+                float k2 = 0.0f;
+
+                // CIC assignment window, sinc^2 per axis, applied twice (deposit and interpolation)
+                for (int d = 0; d < 3; d++)
+                {
+                    float k = 2.0f*PI*frequency[d]/m;
+                    float sinc = (frequency[d] != 0)? sinf(0.5f*k)/(0.5f*k) : 1.0f;
+
+                    window *= sinc*sinc;
+                    k2 += k*k;
+                }
+
+                float green = 0.0f;
+
+                if (pm->boundary == PM_BOUNDARY_ISOLATED) green = pm->grid[2*c];
+                else if (k2 > 0.0f) green = 4.0f*PI/k2*expf(-k2*rs*rs);    // Mean density removed
+
+                pm->kernel[c] = green/(window*window)/((float)m*m*m);
+            }
+        }
+    }
+}
+
+// FFT of the lines of the complex mesh along one axis, in parallel
+static void TransformPmAxis(PmStep *step, int axis, int limitA, int limitB, bool inverse)
+{
+    PmTransform transform = { step->pm, axis, limitA, limitB, inverse };
+
+    ParallelFor(step->pool, 0, limitA*limitB, PM_LINE_GRAIN, TransformPmLines, &transform);
+}
+
+// FFT lines [begin, end) of an axis: gather, transform, scatter
+static void TransformPmLines(void *data, int begin, int end)
+{
+    PmTransform *transform = (PmTransform *)data;
+    PmSolver *pm = transform->pm;
+    int m = pm->fftSize;
+    float line[2*PM_MAX_FFT];
+
+    size_t stride = (transform->axis == 0)? 1 : ((transform->axis == 1)? (size_t)m : (size_t)m*m);
+
+    for (int l = begin; l < end; l++)
+    {
+        int a = l%transform->limitA;
+        int b = l/transform->limitA;
+        size_t first = 0;
+
+        if (transform->axis == 0) first = ((size_t)b*m + a)*m;          // a = y, b = z
+        else if (transform->axis == 1) first = (size_t)b*m*m + a;       // a = x, b = z
+        else first = (size_t)b*m + a;                                   // a = x, b = y
+
+        for (int i = 0; i < m; i++)
+        {
+            line[2*i] = pm->grid[2*(first + i*stride)];
+            line[2*i + 1] = pm->grid[2*(first + i*stride) + 1];
+        }
+
+        TransformPmLine(line, m, pm->twiddles, transform->inverse);
+
+        for (int i = 0; i < m; i++)
+        {
+            pm->grid[2*(first + i*stride)] = line[2*i];
+            pm->grid[2*(first + i*stride) + 1] = line[2*i + 1];
+        }
+    }
+}
+
+// In place iterative radix-2 FFT of n complex values, unnormalized
+// NOTE: twiddles are exp(-2i pi k/n) for k < n/2, conjugated for the inverse
+static void TransformPmLine(float *line, int n, const float *twiddles, bool inverse)
+{
+    // Bit reversal permutation
+    for (int i = 1, j = 0; i < n; i++)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if (i < j)
+        {
+            float re = line[2*i];
+            float im = line[2*i + 1];
+            line[2*i] = line[2*j];
+            line[2*i + 1] = line[2*j + 1];
+            line[2*j] = re;
+            line[2*j + 1] = im;
+        }
+    }
+
+    float sign = inverse? -1.0f : 1.0f;
+
+    for (int length = 2; length <= n; length <<= 1)
+    {
+        int half = length >> 1;
+        int twiddleStep = n/length;
+
+        for (int i = 0; i < n; i += length)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                float wr = twiddles[2*k*twiddleStep];
+                float wi = sign*twiddles[2*k*twiddleStep + 1];
+                float *u = &line[2*(i + k)];
+                float *v = &line[2*(i + k + half)];
+                float tr = v[0]*wr - v[1]*wi;
+                float ti = v[0]*wi + v[1]*wr;
+
+                v[0] = u[0] - tr;
+                v[1] = u[1] - ti;
+                u[0] += tr;
+                u[1] += ti;
+            }
+        }
+    }
+}
+
+// Cloud-in-cell mass deposit, each body spreads its unit mass over the 8 nearest mesh nodes
+// NOTE: Serial, neighbouring bodies write the same nodes; it is a small part of the step
+static void DepositPmMass(PmStep *step)
+{
+    PmSolver *pm = step->pm;
+    int n = pm->gridSize;
+    int m = pm->fftSize;
+    bool periodic = (pm->boundary == PM_BOUNDARY_PERIODIC);
+
+    for (int i = 0; i < step->count; i++)
+    {
+        const float position[3] = { step->bodies[i].px, step->bodies[i].py, step->bodies[i].pz };
+        int node[3] = { 0 };
+        float fraction[3] = { 0 };
+
+        for (int d = 0; d < 3; d++)
+        {
+            float g = (position[d] - step->origin[d])/step->spacing;
+            float cell = floorf(g);
+
+            fraction[d] = g - cell;
+            node[d] = (int)cell;
+            if (periodic) node[d] = ((node[d]%n) + n)%n;
+        }
+
+        for (int corner = 0; corner < 8; corner++)
+        {
+            int x = node[0] + (corner & 1);
+            int y = node[1] + ((corner >> 1) & 1);
+            int z = node[2] + ((corner >> 2) & 1);
+
+            if (periodic)
+            {
+                x %= n;
+                y %= n;
+                z %= n;
+            }
+            else if ((x < 0) || (y < 0) || (z < 0) || (x >= n) || (y >= n) || (z >= n)) continue;
+
+            float weight = ((corner & 1)? fraction[0] : 1.0f - fraction[0])*
+                           (((corner >> 1) & 1)? fraction[1] : 1.0f - fraction[1])*
+                           (((corner >> 2) & 1)? fraction[2] : 1.0f - fraction[2]);
+
+            pm->grid[2*(((size_t)z*m + y)*m + x)] += weight;
+        }
+    }
+}
+
+// Potential gradient of z slices [begin, end) of the mesh, fourth order central differences
+// NOTE: Isolated nodes read up to 2 cells out of the mesh, only in the empty margin
+static void ComputePmField(void *data, int begin, int end)
+{
+    PmStep *step = (PmStep *)data;
+    PmSolver *pm = step->pm;
+    int n = pm->gridSize;
+    int m = pm->fftSize;
+    float scale = 1.0f/(12.0f*step->spacing);
+
+    for (int z = begin; z < end; z++)
+    {
+        for (int y = 0; y < n; y++)
+        {
+            for (int x = 0; x < n; x++)
+            {
+                int node[3] = { x, y, z };
+                float *field = &pm->field[3*(((size_t)z*n + y)*n + x)];
+
+                for (int d = 0; d < 3; d++)
+                {
+                    float potential[4] = { 0 };
+                    const int offsets[4] = { -2, -1, 1, 2 };
+
+                    for (int o = 0; o < 4; o++)
+                    {
+                        int neighbour[3] = { node[0], node[1], node[2] };
+                        neighbour[d] = (neighbour[d] + offsets[o] + m)%m;
+                        potential[o] = pm->grid[2*(((size_t)neighbour[2]*m + neighbour[1])*m + neighbour[0])];
+                    }
+
+                    field[d] = (8.0f*(potential[2] - potential[1]) - (potential[3] - potential[0]))*scale;
+                }
+            }
+        }
+    }
+}
+
+// Chaining mesh of cells at least as large as the cutoff, bodies counting sorted by cell
+static void BuildPmChain(PmStep *step)
+{
+    PmSolver *pm = step->pm;
+
+    if (pm->boundary == PM_BOUNDARY_PERIODIC)
+    {
+        step->chainCells = (int)(pm->boxSize/step->cutoff);
+        if (step->chainCells > PM_MAX_CHAIN_CELLS) step->chainCells = PM_MAX_CHAIN_CELLS;
+        if (step->chainCells < 1) step->chainCells = 1;
+
+        step->chainSpacing = pm->boxSize/step->chainCells;
+        for (int d = 0; d < 3; d++) step->chainOrigin[d] = -0.5f*pm->boxSize;
+    }
+    else
+    {
+        float extent = pm->gridSize*step->spacing;
+
+        step->chainCells = (int)ceilf(extent/step->cutoff);
+        if (step->chainCells > PM_MAX_CHAIN_CELLS) step->chainCells = PM_MAX_CHAIN_CELLS;
+        if (step->chainCells < 1) step->chainCells = 1;
+
+        step->chainSpacing = fmaxf(step->cutoff, extent/step->chainCells);
+        for (int d = 0; d < 3; d++) step->chainOrigin[d] = step->origin[d];
+    }
+
+    int cells = step->chainCells*step->chainCells*step->chainCells;
+
+    memset(pm->cellStart, 0, (cells + 1)*sizeof(int));
+
+    for (int i = 0; i < step->count; i++)
+    {
+        const Body *body = &step->bodies[i];
+        int cell = (GetPmChainCell(step, body, 2)*step->chainCells + GetPmChainCell(step, body, 1))*step->chainCells + GetPmChainCell(step, body, 0);
+        pm->cellStart[cell + 1]++;
+    }
+
+    for (int c = 0; c < cells; c++) pm->cellStart[c + 1] += pm->cellStart[c];
+
+    // Fill from the cell ends backwards, keeps bodies in index order within a cell
+    for (int i = step->count - 1; i >= 0; i--)
+    {
+        const Body *body = &step->bodies[i];
+        int cell = (GetPmChainCell(step, body, 2)*step->chainCells + GetPmChainCell(step, body, 1))*step->chainCells + GetPmChainCell(step, body, 0);
+        pm->cellBodies[--pm->cellStart[cell + 1]] = i;
+    }
+
+    // cellStart[c + 1] now holds the start of cell c
+    for (int c = 0; c < cells; c++) pm->cellStart[c] = pm->cellStart[c + 1];
+    pm->cellStart[cells] = step->count;
+}
+
+// Chaining cell of a body along one axis, wrapped around the periodic box
+static int GetPmChainCell(const PmStep *step, const Body *body, int axis)
+{
+    float position = (axis == 0)? body->px : ((axis == 1)? body->py : body->pz);
+    int cell = (int)floorf((position - step->chainOrigin[axis])/step->chainSpacing);
+
+    if (step->pm->boundary == PM_BOUNDARY_PERIODIC) return ((cell%step->chainCells) + step->chainCells)%step->chainCells;
+
+    return (cell < 0)? 0 : ((cell >= step->chainCells)? step->chainCells - 1 : cell);
+}
+
+// Bodies [begin, end): mesh field, short-range pairs, integration
+// NOTE: With the short range, bodies are processed in chaining mesh order for locality. The
+// long-range terms go in after the pairs, so contact responses only see short-range velocities
+static void ApplyPmBodies(void *data, int begin, int end)
+{
+    PmStep *step = (PmStep *)data;
+    PmSolver *pm = step->pm;
+    int n = pm->gridSize;
+    bool periodic = (pm->boundary == PM_BOUNDARY_PERIODIC);
+    float potential = 0.0f;     // Not reported
+
+    for (int k = begin; k < end; k++)
+    {
+        int index = pm->shortRange? pm->cellBodies[k] : k;
+        Body newBody = step->bodies[index];
+        float longRange[3] = { 0 };     // Added after the pairs, contacts only respond to the short range
+
+        // CIC interpolation of the mesh field
+        const float position[3] = { newBody.px, newBody.py, newBody.pz };
+        int node[3] = { 0 };
+        float fraction[3] = { 0 };
+
+        for (int d = 0; d < 3; d++)
+        {
+            float g = (position[d] - step->origin[d])/step->spacing;
+            float cell = floorf(g);
+
+            fraction[d] = g - cell;
+            node[d] = (int)cell;
+            if (periodic) node[d] = ((node[d]%n) + n)%n;
+        }
+
+        for (int corner = 0; corner < 8; corner++)
+        {
+            int x = node[0] + (corner & 1);
+            int y = node[1] + ((corner >> 1) & 1);
+            int z = node[2] + ((corner >> 2) & 1);
+
+            if (periodic)
+            {
+                x %= n;
+                y %= n;
+                z %= n;
+            }
+            else if ((x < 0) || (y < 0) || (z < 0) || (x >= n) || (y >= n) || (z >= n)) continue;
+
+            float weight = ((corner & 1)? fraction[0] : 1.0f - fraction[0])*
+                           (((corner >> 1) & 1)? fraction[1] : 1.0f - fraction[1])*
+                           (((corner >> 2) & 1)? fraction[2] : 1.0f - fraction[2]);
+            const float *field = &pm->field[3*(((size_t)z*n + y)*n + x)];
+
+            longRange[0] += weight*field[0];
+            longRange[1] += weight*field[1];
+            longRange[2] += weight*field[2];
+        }
+
+        if (pm->shortRange)
+        {
+            int cells = step->chainCells;
+            int span = (cells < 3)? cells : 3;      // Small periodic boxes, visit each cell once
+            int home[3] = { GetPmChainCell(step, &newBody, 0), GetPmChainCell(step, &newBody, 1), GetPmChainCell(step, &newBody, 2) };
+            float rs = step->splitRadius;
+
+            for (int oz = 0; oz < span; oz++)
+            {
+                for (int oy = 0; oy < span; oy++)
+                {
+                    for (int ox = 0; ox < span; ox++)
+                    {
+                        int cell[3] = { ox, oy, oz };
+
+                        for (int d = 0; d < 3; d++)
+                        {
+                            if (cells < 3) continue;
+
+                            cell[d] += home[d] - 1;
+                            if (periodic) cell[d] = (cell[d] + cells)%cells;
+                        }
+
+                        if (!periodic && ((cell[0] < 0) || (cell[1] < 0) || (cell[2] < 0) || (cell[0] >= cells) || (cell[1] >= cells) || (cell[2] >= cells))) continue;
+
+                        int c = (cell[2]*cells + cell[1])*cells + cell[0];
+
+                        for (int j = pm->cellStart[c]; j < pm->cellStart[c + 1]; j++)
+                        {
+                            int other = pm->cellBodies[j];
+                            if (other == index) continue;
+
+                            // Nearest periodic image of the other body
+                            Body otherBody = step->bodies[other];
+                            float dx = newBody.px - otherBody.px;
+                            float dy = newBody.py - otherBody.py;
+                            float dz = newBody.pz - otherBody.pz;
+
+                            if (periodic)
+                            {
+                                float shift[3] = { pm->boxSize*roundf(dx/pm->boxSize), pm->boxSize*roundf(dy/pm->boxSize), pm->boxSize*roundf(dz/pm->boxSize) };
+
+                                otherBody.px += shift[0];
+                                otherBody.py += shift[1];
+                                otherBody.pz += shift[2];
+                                dx -= shift[0];
+                                dy -= shift[1];
+                                dz -= shift[2];
+                            }
+
+                            float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+                            if ((dist >= step->cutoff) || (dist < 0.001f)) continue;
+
+                            ApplyBodyPair(&newBody, &potential, &otherBody);
+
+                            // Remove the long-range part of the pair already on the mesh, (1 - S(r))/r^2
+                            float x = 0.5f*dist/rs;
+                            float scale = (1.0f - erfcf(x) - 2.0f*x*expf(-x*x)/sqrtf(PI))/(dist*dist*dist);
+
+                            longRange[0] += dx*scale;
+                            longRange[1] += dy*scale;
+                            longRange[2] += dz*scale;
+                        }
+                    }
+                }
+            }
+        }
+
+        newBody.vx += longRange[0];
+        newBody.vy += longRange[1];
+        newBody.vz += longRange[2];
+
+        IntegrateBodies(&newBody, 1);
+
+        if (periodic)
+        {
+            // Wrap back into [-boxSize/2, boxSize/2)
+            newBody.px -= pm->boxSize*floorf(newBody.px/pm->boxSize + 0.5f);
+            newBody.py -= pm->boxSize*floorf(newBody.py/pm->boxSize + 0.5f);
+            newBody.pz -= pm->boxSize*floorf(newBody.pz/pm->boxSize + 0.5f);
+        }
+
+        step->result[index] = newBody;
+    }
+}
+
+#endif // NBODY_PM_IMPLEMENTATION
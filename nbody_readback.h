@@ -0,0 +1,245 @@
+/**********************************************************************************************
+*
+*   nbody.readback - Asynchronous GPU to CPU copies through persistently mapped buffers
+*
+*   A consumer requests a copy of a GPU buffer range, it is queued on the GPU after the work
+*   producing the data and fenced. Some frames later, once the fence has signaled, the copy
+*   is read in place through a persistent coherent mapping, with no glGetBufferSubData()
+*   and no pipeline drain. Each queue owns READBACK_MAX_SLOTS at most, requests fail rather
+*   than wait when they are all in flight or held.
+*
+*   Persistent mappings need glBufferStorage() (OpenGL 4.4 or ARB_buffer_storage), loaded by
+*   glad with the context and NULL when the driver lacks it. Without it slots are plain buffers
+*   copied out with glGetBufferSubData() once signaled, which no longer stalls but costs a copy.
+*   A failed fence wait drops the copy and frees its slot, the consumer requests again.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_READBACK_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   NOTE: Ready slots are returned in request order, a slot must be released before reuse
+*
+**********************************************************************************************/
+
+#ifndef NBODY_READBACK_H
+#define NBODY_READBACK_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define READBACK_MAX_SLOTS          8           // Copies in flight or held per queue
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Readback slot state
+typedef enum {
+    READBACK_FREE = 0,
+    READBACK_PENDING,               // Copy queued, fence not signaled yet
+    READBACK_READY                  // Data readable until the slot is released
+} ReadbackState;
+
+// Readback queue data
+typedef struct ReadbackQueue {
+    int slotCount;
+    int capacity;                                   // Bytes per slot
+    bool persistent;                                // Slots are persistently mapped
+
+    unsigned int buffers[READBACK_MAX_SLOTS];
+    unsigned char *data[READBACK_MAX_SLOTS];        // Mapping, or CPU copy without persistent mapping
+    void *fences[READBACK_MAX_SLOTS];
+    ReadbackState states[READBACK_MAX_SLOTS];
+    int sizes[READBACK_MAX_SLOTS];                  // Bytes requested
+    long long tags[READBACK_MAX_SLOTS];             // Consumer data, e.g. simulation step
+    long long sequences[READBACK_MAX_SLOTS];        // Request order
+    long long nextSequence;
+} ReadbackQueue;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+ReadbackQueue LoadReadbackQueue(int slotCount, int capacity);           // Load readback slots of capacity bytes
+void UnloadReadbackQueue(ReadbackQueue queue);                          // Unload readback slots
+int RequestReadback(ReadbackQueue *queue, unsigned int buffer, int offset, int size, long long tag);  // Queue a copy, returns the slot or -1 when none is free
+bool IsReadbackQueueFull(ReadbackQueue queue);                          // Check if a request would fail
+int PollReadback(ReadbackQueue *queue);                                 // Oldest signaled slot, -1 if none, never blocks
+const void *GetReadbackData(ReadbackQueue queue, int slot);             // Copied data of a ready slot
+void ReleaseReadback(ReadbackQueue *queue, int slot);                   // Give a ready slot back to the queue
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_READBACK_H
+
+
+/***********************************************************************************
+*
+*   NBODY READBACK IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_READBACK_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glBufferStorage(), glCopyBufferSubData(), glMapBufferRange(), glFenceSync()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load readback slots of capacity bytes, persistently mapped when the driver allows it
+ReadbackQueue LoadReadbackQueue(int slotCount, int capacity)
+{
+    ReadbackQueue queue = { 0 };
+
+    queue.slotCount = (slotCount < READBACK_MAX_SLOTS)? slotCount : READBACK_MAX_SLOTS;
+    queue.capacity = capacity;
+
+    queue.persistent = (glBufferStorage != NULL);
+
+    for (int i = 0; i < queue.slotCount; i++)
+    {
+        glGenBuffers(1, &queue.buffers[i]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, queue.buffers[i]);
+
+        if (queue.persistent)
+        {
+            GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, NULL, flags);
+            queue.data[i] = (unsigned char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, capacity, flags);
+        }
+        else
+        {
+            glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_STREAM_READ);
+            queue.data[i] = (unsigned char *)RL_MALLOC(capacity);
+        }
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    if (!queue.persistent) TraceLog(LOG_WARNING, "READBACK: glBufferStorage() not available, slots are copied out once signaled");
+
+    return queue;
+}
+
+// Unload readback slots
+void UnloadReadbackQueue(ReadbackQueue queue)
+{
+    for (int i = 0; i < queue.slotCount; i++)
+    {
+        if (queue.fences[i] != NULL) glDeleteSync((GLsync)queue.fences[i]);
+
+        if (queue.persistent)
+        {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, queue.buffers[i]);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        }
+        else RL_FREE(queue.data[i]);
+
+        glDeleteBuffers(1, &queue.buffers[i]);
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Queue a copy of buffer [offset, offset + size) after the GPU work already submitted
+// NOTE: Shader storage writes are made visible to the copy here, tag is handed back untouched
+int RequestReadback(ReadbackQueue *queue, unsigned int buffer, int offset, int size, long long tag)
+{
+    int slot = -1;
+    for (int i = 0; (i < queue->slotCount) && (slot < 0); i++) if (queue->states[i] == READBACK_FREE) slot = i;
+
+    if ((slot < 0) || (size > queue->capacity)) return -1;
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, queue->buffers[slot]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, 0, size);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    queue->fences[slot] = (void *)glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    queue->states[slot] = READBACK_PENDING;
+    queue->sizes[slot] = size;
+    queue->tags[slot] = tag;
+    queue->sequences[slot] = queue->nextSequence++;
+
+    return slot;
+}
+
+// Check if a request would fail, so the producing work can be skipped as well
+bool IsReadbackQueueFull(ReadbackQueue queue)
+{
+    for (int i = 0; i < queue.slotCount; i++) if (queue.states[i] == READBACK_FREE) return false;
+
+    return true;
+}
+
+// Oldest slot whose copy has landed, -1 if none, never blocks
+// NOTE: Ready slots stay ready until released, a later poll returns them again. A failed wait
+// frees the slot and returns -1 too
+int PollReadback(ReadbackQueue *queue)
+{
+    int oldest = -1;
+
+    for (int i = 0; i < queue->slotCount; i++)
+    {
+        if (queue->states[i] == READBACK_FREE) continue;
+        if ((oldest < 0) || (queue->sequences[i] < queue->sequences[oldest])) oldest = i;
+    }
+
+    if ((oldest < 0) || (queue->states[oldest] == READBACK_READY)) return oldest;
+
+    GLenum status = glClientWaitSync((GLsync)queue->fences[oldest], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+
+    if (status == GL_TIMEOUT_EXPIRED) return -1;
+
+    glDeleteSync((GLsync)queue->fences[oldest]);
+    queue->fences[oldest] = NULL;
+
+    // The wait failed (invalid fence, lost context), the copy may never land: dropped
+    if (status == GL_WAIT_FAILED)
+    {
+        TraceLog(LOG_WARNING, "READBACK: Fence wait failed, copy of slot %i dropped", oldest);
+        queue->states[oldest] = READBACK_FREE;
+        return -1;
+    }
+
+    // Signaled, so the copy out does not wait
+    if (!queue->persistent)
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, queue->buffers[oldest]);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, queue->sizes[oldest], queue->data[oldest]);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    queue->states[oldest] = READBACK_READY;
+
+    return oldest;
+}
+
+// Copied data of a ready slot, valid until the slot is released
+const void *GetReadbackData(ReadbackQueue queue, int slot)
+{
+    return (queue.states[slot] == READBACK_READY)? queue.data[slot] : NULL;
+}
+
+// Give a ready slot back to the queue
+void ReleaseReadback(ReadbackQueue *queue, int slot)
+{
+    queue->states[slot] = READBACK_FREE;
+}
+
+#endif // NBODY_READBACK_IMPLEMENTATION
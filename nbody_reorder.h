@@ -0,0 +1,320 @@
+/**********************************************************************************************
+*
+*   nbody.reorder - Space filling curve reordering of the GPU body buffer
+*
+*   Every REORDER_INTERVAL steps, reorder.comp computes the Morton or Hilbert key of each
+*   body quantized position, radix_sort.comp sorts the (key, slot) pairs with a stable LSD
+*   radix sort, and reorder.comp gathers the bodies into the spare body buffer in key order.
+*   Bodies close in space end up close in memory, so the force tiles and the later neighbour
+*   passes touch fewer cache lines.
+*
+*   Sorting moves bodies between slots, so every body keeps a stable id: bodyIds[] maps a
+*   slot to the id of the body it holds, bodySlots[] maps an id back to its current slot.
+*   Anything that must follow one body across reorders (trails, lights) goes through them.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_REORDER_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define REORDER_INTERVAL
+*       May be defined before including this file to override the default below.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input)
+*       1 - nbody nbodiesDest[]                 (sorted output, the spare body buffer)
+*      12 - uint keys[]                         (radix sort input)
+*      13 - uint values[]
+*      14 - uint keysOut[]                      (radix sort output of a pass)
+*      15 - uint valuesOut[]
+*      16 - uint counts[]                       (digit counts, then scatter offsets)
+*      17 - uint bodyIds[]                      (slot -> id, read by nbody.comp)
+*      18 - uint bodySlots[]                    (id -> slot, read by light_gather.comp)
+*      19 - uint bodyIdsDest[]                  (slot -> id after the reorder)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*
+*   NOTE: NUM_BODIES must be a multiple of RADIX_GROUP_SIZE, the radix sort has no tail
+*
+**********************************************************************************************/
+
+#ifndef NBODY_REORDER_H
+#define NBODY_REORDER_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef REORDER_INTERVAL
+    #define REORDER_INTERVAL        64          // Simulation steps between two reorders
+#endif
+
+// IMPORTANT: These must match the defines in radix_sort.comp and reorder.comp
+#define RADIX_GROUP_SIZE            256
+#define RADIX_BITS                  4
+#define RADIX_BUCKETS               (1 << RADIX_BITS)
+#define RADIX_BLOCKS                (NUM_BODIES/RADIX_GROUP_SIZE)
+#define REORDER_GROUP_SIZE          256
+#define REORDER_KEY_BITS            30          // 3 axes of SFC_BITS, see nbody_sfc.h
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Space filling curves, value of the curve uniform of reorder.comp
+typedef enum {
+    REORDER_CURVE_MORTON = 0,
+    REORDER_CURVE_HILBERT
+} ReorderCurve;
+
+// GPU radix sort of NUM_BODIES (key, value) pairs
+typedef struct RadixSorter {
+    unsigned int program;
+    unsigned int keyBuffers[2];     // SSBO: uint[NUM_BODIES], sorted keys end in keyBuffers[0]
+    unsigned int valueBuffers[2];   // SSBO: uint[NUM_BODIES], values follow their keys
+    unsigned int countBuffer;       // SSBO: uint[RADIX_BUCKETS*RADIX_BLOCKS]
+    int stageLoc;
+    int shiftLoc;
+} RadixSorter;
+
+// Body reorder data
+typedef struct BodyReorder {
+    RadixSorter sorter;
+    unsigned int program;
+    unsigned int idBuffers[2];      // SSBO: uint[NUM_BODIES], slot -> id, current in idBuffers[0]
+    unsigned int slotBuffer;        // SSBO: uint[NUM_BODIES], id -> slot
+
+    ReorderCurve curve;
+    int interval;                   // Simulation steps between two reorders
+    int step;                       // Simulation steps since the last reorder
+
+    int stageLoc;
+    int curveLoc;
+    int boundsMinLoc;
+    int boundsScaleLoc;
+} BodyReorder;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+RadixSorter LoadRadixSorter(void);                                      // Load radix sort program and buffers
+void UnloadRadixSorter(RadixSorter sorter);                             // Unload radix sort program and buffers
+void SortRadixKeys(RadixSorter *sorter, int keyBits);                   // Sort keyBuffers[0] and valueBuffers[0] by the low keyBits of the keys
+
+BodyReorder LoadBodyReorder(int interval, ReorderCurve curve);          // Load reorder programs and buffers, identity ids
+void UnloadBodyReorder(BodyReorder reorder);                            // Unload reorder programs and buffers
+bool UpdateBodyReorder(BodyReorder *reorder, unsigned int *bodyBuffer, unsigned int *spareBuffer, const float *boundsMin, const float *boundsMax); // Advance one step, reorder bodies when due
+void BindBodyIds(BodyReorder reorder);                                  // Bind slot -> id and id -> slot maps to the enabled program
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_REORDER_H
+
+
+/***********************************************************************************
+*
+*   NBODY REORDER IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_REORDER_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <math.h>           // Required for: fmaxf()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load radix sort program and buffers
+RadixSorter LoadRadixSorter(void)
+{
+    RadixSorter sorter = { 0 };
+
+    sorter.program = LoadComputeProgramCached("resources/shaders/glsl430/radix_sort.comp", NULL);
+    sorter.stageLoc = rlGetLocationUniform(sorter.program, "stage");
+    sorter.shiftLoc = rlGetLocationUniform(sorter.program, "shift");
+
+    for (int i = 0; i < 2; i++)
+    {
+        sorter.keyBuffers[i] = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+        sorter.valueBuffers[i] = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    }
+
+    sorter.countBuffer = rlLoadShaderBuffer(RADIX_BUCKETS*RADIX_BLOCKS*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+
+    return sorter;
+}
+
+// Unload radix sort program and buffers
+void UnloadRadixSorter(RadixSorter sorter)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        rlUnloadShaderBuffer(sorter.keyBuffers[i]);
+        rlUnloadShaderBuffer(sorter.valueBuffers[i]);
+    }
+
+    rlUnloadShaderBuffer(sorter.countBuffer);
+    rlUnloadShaderProgram(sorter.program);
+}
+
+// Sort keyBuffers[0] and valueBuffers[0] by the low keyBits of the keys, stable
+// NOTE: One count, scan and scatter dispatch per RADIX_BITS digit, the pairs ping-pong
+// between both buffers and an odd pass count ends with a copy back into buffers 0
+void SortRadixKeys(RadixSorter *sorter, int keyBits)
+{
+    int passes = (keyBits + RADIX_BITS - 1)/RADIX_BITS;
+
+    rlEnableShader(sorter->program);
+    rlBindShaderBuffer(sorter->countBuffer, 16);
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        int source = pass%2;
+        int shift = pass*RADIX_BITS;
+
+        rlBindShaderBuffer(sorter->keyBuffers[source], 12);
+        rlBindShaderBuffer(sorter->valueBuffers[source], 13);
+        rlBindShaderBuffer(sorter->keyBuffers[1 - source], 14);
+        rlBindShaderBuffer(sorter->valueBuffers[1 - source], 15);
+        rlSetUniform(sorter->shiftLoc, &shift, RL_SHADER_UNIFORM_INT, 1);
+
+        for (int stage = 0; stage < 3; stage++)
+        {
+            rlSetUniform(sorter->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+            rlComputeShaderDispatch((stage == 1)? 1 : RADIX_BLOCKS, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+    }
+
+    rlDisableShader();
+
+    if ((passes%2) == 1)
+    {
+        rlCopyShaderBuffer(sorter->keyBuffers[0], sorter->keyBuffers[1], 0, 0, NUM_BODIES*sizeof(unsigned int));
+        rlCopyShaderBuffer(sorter->valueBuffers[0], sorter->valueBuffers[1], 0, 0, NUM_BODIES*sizeof(unsigned int));
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+}
+
+// Load reorder programs and buffers, every body starts in the slot of its id
+BodyReorder LoadBodyReorder(int interval, ReorderCurve curve)
+{
+    BodyReorder reorder = { 0 };
+
+    reorder.sorter = LoadRadixSorter();
+    reorder.program = LoadComputeProgramCached("resources/shaders/glsl430/reorder.comp", NULL);
+    reorder.stageLoc = rlGetLocationUniform(reorder.program, "stage");
+    reorder.curveLoc = rlGetLocationUniform(reorder.program, "curve");
+    reorder.boundsMinLoc = rlGetLocationUniform(reorder.program, "boundsMin");
+    reorder.boundsScaleLoc = rlGetLocationUniform(reorder.program, "boundsScale");
+
+    unsigned int *identity = (unsigned int *)RL_MALLOC(NUM_BODIES*sizeof(unsigned int));
+    for (int i = 0; i < NUM_BODIES; i++) identity[i] = (unsigned int)i;
+
+    reorder.idBuffers[0] = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), identity, RL_DYNAMIC_COPY);
+    reorder.idBuffers[1] = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    reorder.slotBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), identity, RL_DYNAMIC_COPY);
+
+    RL_FREE(identity);
+
+    reorder.curve = curve;
+    reorder.interval = (interval > 0)? interval : REORDER_INTERVAL;
+
+    return reorder;
+}
+
+// Unload reorder programs and buffers
+void UnloadBodyReorder(BodyReorder reorder)
+{
+    rlUnloadShaderBuffer(reorder.idBuffers[0]);
+    rlUnloadShaderBuffer(reorder.idBuffers[1]);
+    rlUnloadShaderBuffer(reorder.slotBuffer);
+    rlUnloadShaderProgram(reorder.program);
+    UnloadRadixSorter(reorder.sorter);
+}
+
+// Advance one step, reorder bodies along the curve every reorder->interval steps
+// NOTE: Bodies are gathered into *spareBuffer and the handles are swapped, so *bodyBuffer
+// always holds the current bodies. boundsMin/boundsMax only set the key quantization,
+// stale bounds (e.g. read back a few frames late) just clamp the outer bodies
+// NOTE: Returns true when bodies were reordered
+bool UpdateBodyReorder(BodyReorder *reorder, unsigned int *bodyBuffer, unsigned int *spareBuffer, const float *boundsMin, const float *boundsMax)
+{
+    bool due = (reorder->step == 0);
+    reorder->step = (reorder->step + 1)%reorder->interval;
+
+    if (!due) return false;
+
+    // Cubic cell grid over the bounds, so the curve locality is the same along every axis
+    float extent = fmaxf(boundsMax[0] - boundsMin[0], fmaxf(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+    float step = (extent > 0.0f)? (float)(1 << (REORDER_KEY_BITS/3))/extent : 1.0f;
+    float boundsScale[3] = { step, step, step };
+    int curve = (int)reorder->curve;
+    int stage = 0;
+
+    // Keys of the current slots
+    rlEnableShader(reorder->program);
+    rlBindShaderBuffer(*bodyBuffer, 0);
+    rlBindShaderBuffer(reorder->sorter.keyBuffers[0], 12);
+    rlBindShaderBuffer(reorder->sorter.valueBuffers[0], 13);
+    rlSetUniform(reorder->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(reorder->curveLoc, &curve, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(reorder->boundsMinLoc, boundsMin, RL_SHADER_UNIFORM_VEC3, 1);
+    rlSetUniform(reorder->boundsScaleLoc, boundsScale, RL_SHADER_UNIFORM_VEC3, 1);
+    rlComputeShaderDispatch(NUM_BODIES/REORDER_GROUP_SIZE, 1, 1);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    SortRadixKeys(&reorder->sorter, REORDER_KEY_BITS);
+
+    // Gather bodies and ids in key order, rebuild the id -> slot map
+    stage = 1;
+
+    rlEnableShader(reorder->program);
+    rlBindShaderBuffer(*bodyBuffer, 0);
+    rlBindShaderBuffer(*spareBuffer, 1);
+    rlBindShaderBuffer(reorder->sorter.keyBuffers[0], 12);
+    rlBindShaderBuffer(reorder->sorter.valueBuffers[0], 13);
+    rlBindShaderBuffer(reorder->idBuffers[0], 17);
+    rlBindShaderBuffer(reorder->slotBuffer, 18);
+    rlBindShaderBuffer(reorder->idBuffers[1], 19);
+    rlSetUniform(reorder->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(NUM_BODIES/REORDER_GROUP_SIZE, 1, 1);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    unsigned int temp = *bodyBuffer;
+    *bodyBuffer = *spareBuffer;
+    *spareBuffer = temp;
+
+    temp = reorder->idBuffers[0];
+    reorder->idBuffers[0] = reorder->idBuffers[1];
+    reorder->idBuffers[1] = temp;
+
+    return true;
+}
+
+// Bind slot -> id (binding 17) and id -> slot (binding 18) maps to the enabled program
+void BindBodyIds(BodyReorder reorder)
+{
+    rlBindShaderBuffer(reorder.idBuffers[0], 17);
+    rlBindShaderBuffer(reorder.slotBuffer, 18);
+}
+
+#endif // NBODY_REORDER_IMPLEMENTATION
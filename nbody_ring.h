@@ -0,0 +1,1226 @@
+/**********************************************************************************************
+*
+*   nbody.ring - Multi-process N-body with ring-pass body exchange
+*
+*   Bodies are split between ranks, each one a separate process owning a contiguous slice.
+*   Every step, each rank integrates its own slice against all bodies by passing tiles of
+*   bodies around a ring: a rank starts with a copy of its own slice, then ranks-1 times
+*   forwards the tile it holds to the next rank and receives one from the previous rank.
+*   The exchange of the next tile runs on a persistent helper thread of the rank while the
+*   current tile is applied, so communication is overlapped with computation. No rank ever
+*   holds more than its slice plus two tiles.
+*
+*   With an opening angle, ranks run the Barnes-Hut tree (nbody_tree.h) instead of the ring
+*   pass, on spatial domains. Every step:
+*
+*       ORB         Each rank samples up to RING_ORB_SAMPLES positions of its bodies, samples
+*                   go around the ring to every rank, and all ranks cut the same orthogonal
+*                   recursive bisection of the weighted samples into one box per rank
+*       Migrate     Bodies leaving the box of their rank are routed to the rank owning it
+*       LET         Ranks share the bounds of their bodies, then each rank walks its own tree
+*                   against the bounds of every other rank: nodes far enough for every body
+*                   there travel as point masses, the bodies of the nodes opened travel as is
+*       Walk        Each rank integrates its bodies over a tree of its bodies and the remote
+*                   ones, plus the remote point masses (the locally essential tree)
+*
+*   The domains follow the bodies, so no rank holds the whole set: its bodies, the bodies of
+*   the neighbouring domains and a few point masses per remote node accepted.
+*
+*   Ranks only talk through a RingTransport: a full duplex exchange with the ring neighbours,
+*   and a control channel to the coordinator (scattered bodies, step and gather commands,
+*   replies). Messages of the tree mode to a rank further down the ring are forwarded by the
+*   ranks in between. The built-in transport is a single host stand-in: LoadRingCluster()
+*   forks the ranks and connects them with local sockets, so the body count is still limited
+*   by one machine. Spanning machines takes another transport (TCP, MPI) and a launcher that
+*   calls RunRingRank() on every host and speaks the same commands, the rank loop and the
+*   ring exchange do not change.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_RING_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type, tile interactions and integration
+*       nbody_tasks.h       Task pool of the tree walk, one worker per rank
+*       nbody_tree.h        Barnes-Hut tree of the ORB mode
+*       POSIX               fork(), socketpair(), poll(), pthreads (not available on Windows)
+*
+*   NOTE: Tiles are applied in ring order (own slice first, then the slices of the previous
+*   ranks), not in body index order, so results match the CPU reference to round-off and
+*   contact ordering only, not bit for bit. The ORB mode matches the tree to its force error.
+*
+*   NOTE: Rank processes are forked, load the cluster before starting threads (task pools) in
+*   the coordinator, a forked child only keeps the thread that forked
+*
+**********************************************************************************************/
+
+#ifndef NBODY_RING_H
+#define NBODY_RING_H
+
+#include <stdbool.h>        // Required for: bool
+#include <stddef.h>         // Required for: size_t
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define RING_MAX_RANKS          64          // Max processes of a ring cluster
+#define RING_ORB_SAMPLES        256         // Positions sampled per rank for the bisection
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Channels of a rank, the only way it communicates
+// NOTE: Functions return false once the channel is broken, the rank then stops
+typedef struct RingTransport {
+    void *context;
+    bool (*exchange)(void *context, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize);  // Send to the next rank while receiving from the previous rank
+    bool (*send)(void *context, const void *data, size_t size);         // Reply to the coordinator
+    bool (*receive)(void *context, void *data, size_t size);            // Bodies or command from the coordinator
+} RingTransport;
+
+// Control commands sent by the coordinator, after the slice bodies
+typedef enum {
+    RING_COMMAND_STEP = 1,              // Run argument steps, reply RingTiming
+    RING_COMMAND_GATHER,                // Reply the owned bodies
+    RING_COMMAND_QUIT                   // Stop the rank
+} RingCommandType;
+
+typedef struct RingCommand {
+    int type;
+    int argument;
+} RingCommand;
+
+// Step timing reported by a rank
+typedef struct RingTiming {
+    double computeTime;
+    double waitTime;
+} RingTiming;
+
+// Ring cluster data, owned by the coordinating process
+typedef struct RingCluster {
+    int ranks;                          // Rank processes
+    int count;                          // Total bodies
+    int sliceCount;                     // Bodies scattered per rank, the last ranks may own fewer
+    float theta;                        // Tree opening angle of the ORB mode, 0 for the ring pass
+    int pids[RING_MAX_RANKS];           // Rank process ids
+    int controls[RING_MAX_RANKS];       // Coordinator side of the control socket of each rank
+    bool ready;                         // All ranks started and alive
+
+    double computeTime;                 // Seconds spent applying tiles, max over ranks, last StepRingCluster()
+    double waitTime;                    // Seconds waiting for tiles after computing, max over ranks
+} RingCluster;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+RingCluster LoadRingCluster(const Body *bodies, int count, int ranks, float theta);  // Start rank processes, scatter bodies
+void UnloadRingCluster(RingCluster cluster);                                // Stop rank processes
+bool StepRingCluster(RingCluster *cluster, int steps);                      // Run steps on all ranks, wait for them
+bool GetRingClusterBodies(RingCluster cluster, Body *bodies);               // Gather bodies of all ranks
+void RunRingRank(int rank, int ranks, int count, float theta, RingTransport transport);  // Serve coordinator commands as one rank, until asked to quit
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_RING_H
+
+
+/***********************************************************************************
+*
+*   NBODY RING IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_RING_IMPLEMENTATION)
+
+#if !defined(_WIN32)
+
+#include <stdlib.h>         // Required for: malloc(), free(), realloc(), qsort()
+#include <string.h>         // Required for: memcpy()
+#include <float.h>          // Required for: FLT_MAX
+#include <math.h>           // Required for: sqrtf(), fmaxf(), fminf()
+#include <errno.h>          // Required for: errno, EINTR, EAGAIN
+#include <fcntl.h>          // Required for: fcntl()
+#include <poll.h>           // Required for: poll()
+#include <pthread.h>        // Required for: pthread_create(), pthread_join(), pthread_cond_wait()
+#include <time.h>           // Required for: clock_gettime()
+#include <unistd.h>         // Required for: fork(), close(), _exit()
+#include <sys/socket.h>     // Required for: socketpair(), send(), recv()
+#include <sys/wait.h>       // Required for: waitpid()
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Bodies traveling around the ring, header followed by sliceCount bodies
+typedef struct RingTile {
+    int first;                          // Global index of the first body
+    int count;                          // Valid bodies
+    Body bodies[];
+} RingTile;
+
+// Persistent helper thread of a rank, runs one tile exchange at a time
+typedef struct RingHelper {
+    RingTransport transport;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    bool started;                       // Thread running, exchanges run inline otherwise
+    bool pending;                       // Exchange posted and not finished
+    bool quit;
+    const void *outgoing;
+    size_t outgoingSize;
+    void *incoming;
+    size_t incomingSize;
+    bool success;                       // Result of the last exchange
+    double waitTime;                    // Spent in ExchangeRing(), ORB mode
+} RingHelper;
+
+// Body with its global index, the ORB mode moves bodies between ranks
+typedef struct RingRecord {
+    int id;
+    Body body;
+} RingRecord;
+
+// Growable byte buffer of the ORB mode messages
+typedef struct RingBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} RingBuffer;
+
+// Header of a routed message, followed by size bytes
+typedef struct RingMessage {
+    int destination;                    // Rank
+    int size;
+} RingMessage;
+
+// Positions sampled by a rank for the bisection, weighted by the bodies they stand for
+typedef struct RingSamples {
+    int count;                          // Bodies of the rank
+    int samples;
+    float positions[RING_ORB_SAMPLES][3];
+} RingSamples;
+
+// Sample sorted along the bisection axis
+typedef struct RingSample {
+    float key;
+    float weight;
+    float position[3];
+} RingSample;
+
+// Box of a rank: ORB cell while assigning bodies, bounds of its bodies while exporting
+typedef struct RingBox {
+    int count;                          // Bodies inside, bounds only
+    float min[3];
+    float max[3];
+} RingBox;
+
+// Header of the locally essential tree sent to a rank, followed by the bodies and point masses
+typedef struct RingEssential {
+    int bodyCount;
+    int massCount;                      // xyz and mass
+} RingEssential;
+
+// State of a rank in the ORB mode
+typedef struct RingTreeRank {
+    int count;                          // Owned bodies
+    int capacity;
+    RingRecord *records;                // Owned bodies with their global index
+    Body *bodies;                       // Owned bodies, then the remote bodies of the step
+    Body *result;
+    RingBuffer masses;                  // Remote point masses of the step, float xyz and mass
+    RingBox boxes[RING_MAX_RANKS];      // Per rank
+    RingSamples *samples;               // Per rank
+    RingSample *sorted;                 // All samples
+    RingBuffer outgoing[RING_MAX_RANKS];  // Messages per destination
+    RingBuffer received;                // Payloads received by this rank
+    RingBuffer bundles[2];              // Messages in transit
+    BodyTree tree;
+    TaskPool *pool;                     // One worker, the ranks are the parallelism
+} RingTreeRank;
+
+// Built-in transport: local sockets of a forked rank process
+typedef struct RingSocketLink {
+    int control;                        // Coordinator
+    int sendSocket;                     // Next rank, non-blocking
+    int receiveSocket;                  // Previous rank, non-blocking
+} RingSocketLink;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static bool StepRingRank(RingTile *local, RingTile *next, RingTile *tiles[2], size_t tileSize, int ranks, RingHelper *helper, RingTiming *timing);  // One step of the owned bodies
+static bool StepRingTreeRank(RingTreeRank *state, int rank, int ranks, float theta, RingHelper *helper, RingTiming *timing);  // One ORB and LET step of the owned bodies
+static void CutRingDomains(RingSample *samples, int sampleCount, int firstRank, int rankCount, RingBox cell, RingBox *boxes);  // Recursive bisection of weighted samples
+static int FindRingDomain(const RingBox *boxes, int ranks, const Body *body);  // Rank whose ORB cell holds the body, -1 if none
+static void ExportRingEssential(const BodyTree *tree, const Body *bodies, RingBox box, float theta, RingBuffer *message);  // Nodes and bodies of the tree needed by a box
+static bool GatherRingBlocks(RingHelper *helper, int rank, int ranks, void *blocks, size_t size);  // Every rank block to every rank
+static bool RouteRingMessages(RingTreeRank *state, RingHelper *helper, int rank, int ranks);  // Outgoing messages to their ranks, payloads for this rank appended to received
+static bool ExchangeRing(RingHelper *helper, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize);  // Exchange with the neighbours, waits for it
+static void LoadRingTreeRank(RingTreeRank *state, const RingTile *local, int ranks, float theta);  // Owned bodies of the scattered slice
+static void UnloadRingTreeRank(RingTreeRank *state, int ranks);
+static void ReserveRingTreeRank(RingTreeRank *state, int capacity);        // Room for owned and remote bodies
+static void ReserveRingBuffer(RingBuffer *buffer, size_t capacity);
+static void AppendRingBuffer(RingBuffer *buffer, const void *data, size_t size);
+static int CompareRingSamples(const void *a, const void *b);
+static void StartRingExchange(RingHelper *helper, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize);  // Post an exchange to the helper thread
+static bool WaitRingExchange(RingHelper *helper);                           // Wait for the posted exchange
+static void *RunRingHelper(void *data);                                     // Helper thread loop
+static bool ExchangeSocketTiles(void *context, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize);  // Send and receive, full duplex
+static bool SendSocketControl(void *context, const void *data, size_t size);
+static bool ReceiveSocketControl(void *context, void *data, size_t size);
+static bool SendFully(int socket, const void *data, size_t size);
+static bool ReceiveFully(int socket, void *data, size_t size);
+static double GetRingTime(void);
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Start rank processes connected in a ring and scatter bodies to them, ranks pass tiles or,
+// with theta > 0, run the tree on ORB domains
+// NOTE: Returned cluster is not ready if any rank failed to start
+RingCluster LoadRingCluster(const Body *bodies, int count, int ranks, float theta)
+{
+    RingCluster cluster = { 0 };
+
+    if (ranks < 1) ranks = 1;
+    if (ranks > RING_MAX_RANKS) ranks = RING_MAX_RANKS;
+
+    cluster.ranks = ranks;
+    cluster.count = count;
+    cluster.sliceCount = (count + ranks - 1)/ranks;
+    cluster.theta = (theta > 0.0f)? theta : 0.0f;
+
+    // Link r carries tiles from rank r to rank r + 1
+    int links[RING_MAX_RANKS][2] = { 0 };
+    int controls[RING_MAX_RANKS][2] = { 0 };
+    bool created = true;
+
+    for (int r = 0; r < ranks; r++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, links[r]) != 0) created = false;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, controls[r]) != 0) created = false;
+        cluster.controls[r] = controls[r][0];
+        cluster.pids[r] = -1;
+    }
+
+    if (!created) return cluster;
+
+    for (int r = 0; r < ranks; r++)
+    {
+        int pid = fork();
+
+        if (pid == 0)
+        {
+            int sendSocket = links[r][0];
+            int receiveSocket = links[(r + ranks - 1)%ranks][1];
+
+            // Keep only this rank sockets
+            for (int i = 0; i < ranks; i++)
+            {
+                if (links[i][0] != sendSocket) close(links[i][0]);
+                if (links[i][1] != receiveSocket) close(links[i][1]);
+                close(controls[i][0]);
+                if (i != r) close(controls[i][1]);
+            }
+
+            // Tile exchange progresses both directions at once, see ExchangeSocketTiles()
+            fcntl(sendSocket, F_SETFL, fcntl(sendSocket, F_GETFL) | O_NONBLOCK);
+            fcntl(receiveSocket, F_SETFL, fcntl(receiveSocket, F_GETFL) | O_NONBLOCK);
+
+            RingSocketLink link = { controls[r][1], sendSocket, receiveSocket };
+            RingTransport transport = { &link, ExchangeSocketTiles, SendSocketControl, ReceiveSocketControl };
+
+            RunRingRank(r, ranks, count, cluster.theta, transport);
+
+            close(link.control);
+            close(link.sendSocket);
+            close(link.receiveSocket);
+
+            // Skip atexit handlers and stdio buffers of the coordinator
+            _exit(0);
+        }
+
+        cluster.pids[r] = pid;
+        if (pid < 0) created = false;
+    }
+
+    for (int r = 0; r < ranks; r++)
+    {
+        close(links[r][0]);
+        close(links[r][1]);
+        close(controls[r][1]);
+    }
+
+    cluster.ready = created;
+
+    // Scatter slices
+    for (int r = 0; cluster.ready && (r < ranks); r++)
+    {
+        int first = r*cluster.sliceCount;
+        int sliceCount = (first < count)? (((count - first) < cluster.sliceCount)? (count - first) : cluster.sliceCount) : 0;
+
+        if (!SendFully(cluster.controls[r], bodies + first, sliceCount*sizeof(Body))) cluster.ready = false;
+    }
+
+    return cluster;
+}
+
+// Stop rank processes
+void UnloadRingCluster(RingCluster cluster)
+{
+    RingCommand command = { RING_COMMAND_QUIT, 0 };
+
+    for (int r = 0; r < cluster.ranks; r++)
+    {
+        if (cluster.pids[r] > 0) SendFully(cluster.controls[r], &command, sizeof(command));
+        close(cluster.controls[r]);
+    }
+
+    for (int r = 0; r < cluster.ranks; r++)
+    {
+        if (cluster.pids[r] > 0) waitpid(cluster.pids[r], NULL, 0);
+    }
+}
+
+// Run steps on all ranks and wait for them to finish
+// NOTE: Returns false if any rank died, the cluster is not usable anymore
+bool StepRingCluster(RingCluster *cluster, int steps)
+{
+    if (!cluster->ready) return false;
+
+    RingCommand command = { RING_COMMAND_STEP, steps };
+
+    for (int r = 0; r < cluster->ranks; r++)
+    {
+        if (!SendFully(cluster->controls[r], &command, sizeof(command))) cluster->ready = false;
+    }
+
+    cluster->computeTime = 0.0;
+    cluster->waitTime = 0.0;
+
+    for (int r = 0; r < cluster->ranks; r++)
+    {
+        RingTiming timing = { 0 };
+
+        if (!ReceiveFully(cluster->controls[r], &timing, sizeof(timing))) cluster->ready = false;
+
+        if (timing.computeTime > cluster->computeTime) cluster->computeTime = timing.computeTime;
+        if (timing.waitTime > cluster->waitTime) cluster->waitTime = timing.waitTime;
+    }
+
+    return cluster->ready;
+}
+
+// Gather bodies of all ranks, in body index order
+// NOTE: In the ORB mode ranks reply their body count then the bodies with their index
+bool GetRingClusterBodies(RingCluster cluster, Body *bodies)
+{
+    if (!cluster.ready) return false;
+
+    RingCommand command = { RING_COMMAND_GATHER, 0 };
+    bool success = true;
+    int gathered = 0;
+
+    for (int r = 0; r < cluster.ranks; r++)
+    {
+        if (!SendFully(cluster.controls[r], &command, sizeof(command))) success = false;
+
+        if (cluster.theta > 0.0f)
+        {
+            int count = 0;
+            if (success && !ReceiveFully(cluster.controls[r], &count, sizeof(count))) success = false;
+
+            for (int i = 0; success && (i < count); i++)
+            {
+                RingRecord record = { 0 };
+
+                if (!ReceiveFully(cluster.controls[r], &record, sizeof(record))) success = false;
+                else if ((record.id >= 0) && (record.id < cluster.count)) bodies[record.id] = record.body;
+            }
+
+            gathered += count;
+            continue;
+        }
+
+        int first = r*cluster.sliceCount;
+        int sliceCount = (first < cluster.count)? (((cluster.count - first) < cluster.sliceCount)? (cluster.count - first) : cluster.sliceCount) : 0;
+
+        if (success && !ReceiveFully(cluster.controls[r], bodies + first, sliceCount*sizeof(Body))) success = false;
+        gathered += sliceCount;
+    }
+
+    // Every body owned by exactly one rank
+    return success && (gathered == cluster.count);
+}
+
+// Serve coordinator commands as one rank until asked to quit: receive the owned slice, then
+// step and gather on command. Slices are ceil(count/ranks) bodies, the last ranks may own fewer.
+// With theta > 0 the slice only seeds the rank, ORB moves bodies to their domain every step
+// NOTE: Runs in the forked rank processes of LoadRingCluster(), or on any host given a transport
+void RunRingRank(int rank, int ranks, int count, float theta, RingTransport transport)
+{
+    int sliceCount = (count + ranks - 1)/ranks;
+    size_t tileSize = sizeof(RingTile) + sliceCount*sizeof(Body);
+    bool orb = (theta > 0.0f);
+
+    RingTile *local = (RingTile *)calloc(1, tileSize);      // Owned bodies, input state of the step
+    RingTile *next = orb? NULL : (RingTile *)calloc(1, tileSize);   // Owned bodies being integrated
+    RingTile *tiles[2] = { orb? NULL : (RingTile *)calloc(1, tileSize), orb? NULL : (RingTile *)calloc(1, tileSize) };
+    RingTreeRank tree = { 0 };
+
+    local->first = rank*sliceCount;
+    local->count = (local->first < count)? (((count - local->first) < sliceCount)? (count - local->first) : sliceCount) : 0;
+
+    // One helper thread for the lifetime of the rank, exchanges run inline if it can not start
+    RingHelper helper = { 0 };
+    helper.transport = transport;
+    pthread_mutex_init(&helper.mutex, NULL);
+    pthread_cond_init(&helper.condition, NULL);
+    helper.started = (pthread_create(&helper.thread, NULL, RunRingHelper, &helper) == 0);
+
+    bool running = transport.receive(transport.context, local->bodies, local->count*sizeof(Body));
+
+    if (orb) LoadRingTreeRank(&tree, local, ranks, theta);
+
+    while (running)
+    {
+        RingCommand command = { 0 };
+        if (!transport.receive(transport.context, &command, sizeof(command))) break;
+
+        if (command.type == RING_COMMAND_STEP)
+        {
+            RingTiming timing = { 0 };
+
+            for (int step = 0; running && (step < command.argument); step++)
+            {
+                if (orb) running = StepRingTreeRank(&tree, rank, ranks, theta, &helper, &timing);
+                else running = StepRingRank(local, next, tiles, tileSize, ranks, &helper, &timing);
+            }
+
+            if (running) running = transport.send(transport.context, &timing, sizeof(timing));
+        }
+        else if (command.type == RING_COMMAND_GATHER)
+        {
+            if (!orb) running = transport.send(transport.context, local->bodies, local->count*sizeof(Body));
+            else running = transport.send(transport.context, &tree.count, sizeof(int)) && transport.send(transport.context, tree.records, tree.count*sizeof(RingRecord));
+        }
+        else running = false;
+    }
+
+    if (helper.started)
+    {
+        pthread_mutex_lock(&helper.mutex);
+        helper.quit = true;
+        pthread_cond_broadcast(&helper.condition);
+        pthread_mutex_unlock(&helper.mutex);
+
+        pthread_join(helper.thread, NULL);
+    }
+
+    pthread_cond_destroy(&helper.condition);
+    pthread_mutex_destroy(&helper.mutex);
+
+    if (orb) UnloadRingTreeRank(&tree, ranks);
+
+    free(local);
+    free(next);
+    free(tiles[0]);
+    free(tiles[1]);
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// One simulation step of the owned bodies, tiles passed around the ring
+// NOTE: Tiles always travel with tileSize bytes, ranks do not know the slices of the others
+static bool StepRingRank(RingTile *local, RingTile *next, RingTile *tiles[2], size_t tileSize, int ranks, RingHelper *helper, RingTiming *timing)
+{
+    // Own slice is both the bodies being integrated and the first tile to travel
+    memcpy(next, local, tileSize);
+    memcpy(tiles[0], local, tileSize);
+
+    RingTile *current = tiles[0];
+    RingTile *incoming = tiles[1];
+    bool success = true;
+
+    for (int k = 0; success && (k < ranks); k++)
+    {
+        bool last = (k == (ranks - 1));
+
+        // Forward the current tile and receive the next one while applying the current one
+        if (!last) StartRingExchange(helper, current, tileSize, incoming, tileSize);
+
+        double start = GetRingTime();
+        AccumulateBodyTile(next->bodies, NULL, next->first, next->count, current->bodies, current->first, current->count);
+        double computed = GetRingTime();
+
+        timing->computeTime += computed - start;
+
+        if (!last)
+        {
+            success = WaitRingExchange(helper);
+            timing->waitTime += GetRingTime() - computed;
+
+            RingTile *swap = current;
+            current = incoming;
+            incoming = swap;
+        }
+    }
+
+    if (success)
+    {
+        IntegrateBodies(next->bodies, next->count);
+        memcpy(local->bodies, next->bodies, next->count*sizeof(Body));
+    }
+
+    return success;
+}
+
+// One simulation step of the owned bodies in the ORB mode: bisection, migration, locally
+// essential tree exchange, then the tree walk
+// NOTE: Every rank cuts the same domains from the same gathered samples, no rank decides alone
+static bool StepRingTreeRank(RingTreeRank *state, int rank, int ranks, float theta, RingHelper *helper, RingTiming *timing)
+{
+    double start = GetRingTime();
+    helper->waitTime = 0.0;
+
+    // Samples spread over the owned bodies, weighted by the bodies they stand for
+    RingSamples *own = &state->samples[rank];
+    own->count = state->count;
+    own->samples = (state->count < RING_ORB_SAMPLES)? state->count : RING_ORB_SAMPLES;
+
+    for (int s = 0; s < own->samples; s++)
+    {
+        const Body *body = &state->records[(int)((long long)s*state->count/own->samples)].body;
+
+        own->positions[s][0] = body->px;
+        own->positions[s][1] = body->py;
+        own->positions[s][2] = body->pz;
+    }
+
+    if (!GatherRingBlocks(helper, rank, ranks, state->samples, sizeof(RingSamples))) return false;
+
+    int sampleCount = 0;
+
+    for (int r = 0; r < ranks; r++)
+    {
+        const RingSamples *samples = &state->samples[r];
+        float weight = (samples->samples > 0)? (float)samples->count/(float)samples->samples : 0.0f;
+
+        for (int s = 0; s < samples->samples; s++)
+        {
+            RingSample *sample = &state->sorted[sampleCount++];
+
+            sample->key = 0.0f;
+            sample->weight = weight;
+            memcpy(sample->position, samples->positions[s], sizeof(sample->position));
+        }
+    }
+
+    RingBox space = { 0, { -FLT_MAX, -FLT_MAX, -FLT_MAX }, { FLT_MAX, FLT_MAX, FLT_MAX } };
+    CutRingDomains(state->sorted, sampleCount, 0, ranks, space, state->boxes);
+
+    // Bodies outside the domain of this rank go to the rank owning it
+    int kept = 0;
+
+    for (int i = 0; i < state->count; i++)
+    {
+        int domain = FindRingDomain(state->boxes, ranks, &state->records[i].body);
+
+        if ((domain >= 0) && (domain != rank)) AppendRingBuffer(&state->outgoing[domain], &state->records[i], sizeof(RingRecord));
+        else state->records[kept++] = state->records[i];
+    }
+
+    state->count = kept;
+
+    if (!RouteRingMessages(state, helper, rank, ranks)) return false;
+
+    int arrived = (int)(state->received.size/sizeof(RingRecord));
+    ReserveRingTreeRank(state, state->count + arrived);
+    memcpy(state->records + state->count, state->received.data, arrived*sizeof(RingRecord));
+    state->count += arrived;
+
+    // Bounds of the owned bodies, to every rank
+    RingBox *bounds = &state->boxes[rank];
+    *bounds = (RingBox){ state->count, { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+
+    for (int i = 0; i < state->count; i++)
+    {
+        const Body *body = &state->records[i].body;
+        float p[3] = { body->px, body->py, body->pz };
+
+        for (int k = 0; k < 3; k++)
+        {
+            bounds->min[k] = fminf(bounds->min[k], p[k]);
+            bounds->max[k] = fmaxf(bounds->max[k], p[k]);
+        }
+
+        state->bodies[i] = *body;
+    }
+
+    if (!GatherRingBlocks(helper, rank, ranks, state->boxes, sizeof(RingBox))) return false;
+
+    // Locally essential tree of every other rank holding bodies
+    if (state->count > 0)
+    {
+        BuildBodyTree(&state->tree, state->pool, state->bodies, state->count);
+
+        for (int r = 0; r < ranks; r++)
+        {
+            if ((r != rank) && (state->boxes[r].count > 0)) ExportRingEssential(&state->tree, state->bodies, state->boxes[r], theta, &state->outgoing[r]);
+        }
+    }
+
+    if (!RouteRingMessages(state, helper, rank, ranks)) return false;
+
+    // Received trees: remote bodies after the owned ones, point masses apart
+    int remoteCount = 0;
+    int massCount = 0;
+
+    for (size_t offset = 0; offset < state->received.size; )
+    {
+        RingEssential essential = { 0 };
+        memcpy(&essential, state->received.data + offset, sizeof(essential));
+
+        remoteCount += essential.bodyCount;
+        massCount += essential.massCount;
+        offset += sizeof(essential) + essential.bodyCount*sizeof(Body) + essential.massCount*4*sizeof(float);
+    }
+
+    ReserveRingTreeRank(state, state->count + remoteCount);
+    state->masses.size = 0;
+    ReserveRingBuffer(&state->masses, massCount*4*sizeof(float));
+
+    int remote = state->count;
+
+    for (size_t offset = 0; offset < state->received.size; )
+    {
+        RingEssential essential = { 0 };
+        memcpy(&essential, state->received.data + offset, sizeof(essential));
+        offset += sizeof(essential);
+
+        memcpy(state->bodies + remote, state->received.data + offset, essential.bodyCount*sizeof(Body));
+        remote += essential.bodyCount;
+        offset += essential.bodyCount*sizeof(Body);
+
+        AppendRingBuffer(&state->masses, state->received.data + offset, essential.massCount*4*sizeof(float));
+        offset += essential.massCount*4*sizeof(float);
+    }
+
+    StepBodiesTreeLet(&state->tree, state->pool, state->bodies, state->result, state->count, remoteCount, (const float *)state->masses.data, massCount);
+
+    for (int i = 0; i < state->count; i++) state->records[i].body = state->result[i];
+
+    timing->computeTime += (GetRingTime() - start) - helper->waitTime;
+    timing->waitTime += helper->waitTime;
+
+    return true;
+}
+
+// Split the ranks [firstRank, firstRank + rankCount) of a cell in two halves along the longest
+// extent of its samples, at the weighted sample splitting the bodies in the same ratio
+// NOTE: Cells are half-open [min, max), every point of space falls in exactly one
+static void CutRingDomains(RingSample *samples, int sampleCount, int firstRank, int rankCount, RingBox cell, RingBox *boxes)
+{
+    if (rankCount == 1)
+    {
+        boxes[firstRank] = cell;
+        return;
+    }
+
+    float extentMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float extentMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    float total = 0.0f;
+
+    for (int s = 0; s < sampleCount; s++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            extentMin[k] = fminf(extentMin[k], samples[s].position[k]);
+            extentMax[k] = fmaxf(extentMax[k], samples[s].position[k]);
+        }
+
+        total += samples[s].weight;
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++) if ((extentMax[k] - extentMin[k]) > (extentMax[axis] - extentMin[axis])) axis = k;
+
+    for (int s = 0; s < sampleCount; s++) samples[s].key = samples[s].position[axis];
+    qsort(samples, sampleCount, sizeof(RingSample), CompareRingSamples);
+
+    // Closest cut to the share of the low half
+    int lowRanks = rankCount/2;
+    float target = total*(float)lowRanks/(float)rankCount;
+    float sum = 0.0f;
+    int cut = 0;
+
+    while ((cut < sampleCount) && ((sum + 0.5f*samples[cut].weight) <= target)) sum += samples[cut++].weight;
+
+    float split = cell.max[axis];
+    if ((cut > 0) && (cut < sampleCount)) split = 0.5f*(samples[cut - 1].key + samples[cut].key);
+    else if (cut == 0 && (sampleCount > 0)) split = samples[0].key;
+
+    int lowCount = 0;
+    while ((lowCount < sampleCount) && (samples[lowCount].key < split)) lowCount++;
+
+    RingBox low = cell;
+    RingBox high = cell;
+    low.max[axis] = split;
+    high.min[axis] = split;
+
+    CutRingDomains(samples, lowCount, firstRank, lowRanks, low, boxes);
+    CutRingDomains(samples + lowCount, sampleCount - lowCount, firstRank + lowRanks, rankCount - lowRanks, high, boxes);
+}
+
+// Rank whose ORB cell holds the body, -1 if none (not a finite position)
+static int FindRingDomain(const RingBox *boxes, int ranks, const Body *body)
+{
+    float p[3] = { body->px, body->py, body->pz };
+
+    for (int r = 0; r < ranks; r++)
+    {
+        bool inside = true;
+        for (int k = 0; k < 3; k++) if (!((p[k] >= boxes[r].min[k]) && (p[k] < boxes[r].max[k]))) inside = false;
+
+        if (inside) return r;
+    }
+
+    return -1;
+}
+
+// Append the locally essential tree of a box to a message: the nodes accepted by every point
+// of the box travel as point masses, the leaves opened as bodies
+// NOTE: Same criterion as the tree walk with the distance from the box instead of the body,
+// a body in the box sees the node at least that far, contacts always travel as bodies
+static void ExportRingEssential(const BodyTree *tree, const Body *bodies, RingBox box, float theta, RingBuffer *message)
+{
+    size_t header = message->size;
+    RingEssential essential = { 0 };
+    AppendRingBuffer(message, &essential, sizeof(essential));
+
+    int stack[8*TREE_MAX_DEPTH + 8];
+
+    // Bodies first, then point masses
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            const TreeNode *node = &tree->nodes[stack[--stackSize]];
+
+            float distSqr = 0.0f;
+            for (int k = 0; k < 3; k++)
+            {
+                float d = fmaxf(fmaxf(box.min[k] - node->centerOfMass[k], node->centerOfMass[k] - box.max[k]), 0.0f);
+                distSqr += d*d;
+            }
+
+            float dist = sqrtf(distSqr);
+
+            if ((node->firstChild >= 0) && ((2.0f*node->halfSize) < (theta*dist)) && ((dist - 3.4642f*node->halfSize) > (2.0f*BODY_RADIUS)))
+            {
+                if (pass == 1)
+                {
+                    float mass[4] = { node->centerOfMass[0], node->centerOfMass[1], node->centerOfMass[2], node->mass };
+                    AppendRingBuffer(message, mass, sizeof(mass));
+                    essential.massCount++;
+                }
+            }
+            else if (node->firstChild < 0)
+            {
+                if (pass == 0)
+                {
+                    for (int i = node->first; i < (node->first + node->count); i++) AppendRingBuffer(message, &bodies[tree->order[i]], sizeof(Body));
+                    essential.bodyCount += node->count;
+                }
+            }
+            else
+            {
+                for (int c = node->childCount - 1; c >= 0; c--) stack[stackSize++] = node->firstChild + c;
+            }
+        }
+    }
+
+    memcpy(message->data + header, &essential, sizeof(essential));
+}
+
+// Every rank block to every rank: at hop k a rank forwards the block received at hop k - 1,
+// its own at first, and receives the block of the rank k + 1 places before it
+static bool GatherRingBlocks(RingHelper *helper, int rank, int ranks, void *blocks, size_t size)
+{
+    char *data = (char *)blocks;
+    bool success = true;
+
+    for (int k = 0; success && (k < (ranks - 1)); k++)
+    {
+        int sent = (rank - k + ranks)%ranks;
+        int received = (rank - k - 1 + ranks)%ranks;
+
+        success = ExchangeRing(helper, data + sent*size, size, data + received*size, size);
+    }
+
+    return success;
+}
+
+// Route the outgoing messages of every rank to their destination: messages travel around
+// the ring in one bundle, each rank keeps its own and forwards the others
+// NOTE: A message to the rank d places down the ring arrives after d hops, ranks - 1 at most
+static bool RouteRingMessages(RingTreeRank *state, RingHelper *helper, int rank, int ranks)
+{
+    RingBuffer *sending = &state->bundles[0];
+    RingBuffer *receiving = &state->bundles[1];
+
+    state->received.size = 0;
+    sending->size = 0;
+
+    for (int d = 1; d < ranks; d++)
+    {
+        int destination = (rank + d)%ranks;
+        RingBuffer *outgoing = &state->outgoing[destination];
+
+        if (outgoing->size > 0)
+        {
+            RingMessage message = { destination, (int)outgoing->size };
+            AppendRingBuffer(sending, &message, sizeof(message));
+            AppendRingBuffer(sending, outgoing->data, outgoing->size);
+        }
+
+        outgoing->size = 0;
+    }
+
+    bool success = true;
+
+    for (int k = 0; success && (k < (ranks - 1)); k++)
+    {
+        // Sizes first, bundles differ between ranks
+        size_t incomingSize = 0;
+        success = ExchangeRing(helper, &sending->size, sizeof(size_t), &incomingSize, sizeof(size_t));
+
+        if (success)
+        {
+            receiving->size = 0;
+            ReserveRingBuffer(receiving, incomingSize);
+            success = ExchangeRing(helper, sending->data, sending->size, receiving->data, incomingSize);
+            receiving->size = incomingSize;
+        }
+
+        sending->size = 0;
+
+        for (size_t offset = 0; success && (offset < receiving->size); )
+        {
+            RingMessage message = { 0 };
+            memcpy(&message, receiving->data + offset, sizeof(message));
+
+            if (message.destination == rank) AppendRingBuffer(&state->received, receiving->data + offset + sizeof(message), message.size);
+            else AppendRingBuffer(sending, receiving->data + offset, sizeof(message) + message.size);
+
+            offset += sizeof(message) + message.size;
+        }
+    }
+
+    return success;
+}
+
+// Exchange with the ring neighbours and wait for it, waiting time added to the helper
+static bool ExchangeRing(RingHelper *helper, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize)
+{
+    double start = GetRingTime();
+
+    StartRingExchange(helper, outgoing, outgoingSize, incoming, incomingSize);
+    bool success = WaitRingExchange(helper);
+
+    helper->waitTime += GetRingTime() - start;
+
+    return success;
+}
+
+// Owned bodies of the scattered slice, with their global index
+static void LoadRingTreeRank(RingTreeRank *state, const RingTile *local, int ranks, float theta)
+{
+    *state = (RingTreeRank){ 0 };
+
+    state->tree.theta = theta;
+    ReserveRingTreeRank(state, (local->count > 0)? local->count : 1);
+
+    state->count = local->count;
+    for (int i = 0; i < local->count; i++) state->records[i] = (RingRecord){ local->first + i, local->bodies[i] };
+
+    state->samples = (RingSamples *)calloc(ranks, sizeof(RingSamples));
+    state->sorted = (RingSample *)calloc(ranks*RING_ORB_SAMPLES, sizeof(RingSample));
+    state->pool = LoadTaskPool(1);
+}
+
+// Free the state of a rank in the ORB mode
+static void UnloadRingTreeRank(RingTreeRank *state, int ranks)
+{
+    UnloadTaskPool(state->pool);
+    UnloadBodyTree(state->tree);
+
+    free(state->records);
+    free(state->bodies);
+    free(state->result);
+    free(state->masses.data);
+    free(state->samples);
+    free(state->sorted);
+    free(state->received.data);
+    free(state->bundles[0].data);
+    free(state->bundles[1].data);
+
+    for (int r = 0; r < ranks; r++) free(state->outgoing[r].data);
+}
+
+// Grow the bodies and the tree of a rank to hold capacity bodies, owned and remote
+static void ReserveRingTreeRank(RingTreeRank *state, int capacity)
+{
+    if (capacity <= state->capacity) return;
+    if (capacity < 2*state->capacity) capacity = 2*state->capacity;
+
+    state->records = (RingRecord *)realloc(state->records, capacity*sizeof(RingRecord));
+    state->bodies = (Body *)realloc(state->bodies, capacity*sizeof(Body));
+    state->result = (Body *)realloc(state->result, capacity*sizeof(Body));
+
+    float theta = state->tree.theta;
+    if (state->capacity > 0) UnloadBodyTree(state->tree);
+    state->tree = LoadBodyTree(capacity, theta);
+
+    state->capacity = capacity;
+}
+
+// Grow a buffer to hold capacity bytes
+static void ReserveRingBuffer(RingBuffer *buffer, size_t capacity)
+{
+    if (capacity <= buffer->capacity) return;
+    if (capacity < 2*buffer->capacity) capacity = 2*buffer->capacity;
+
+    buffer->data = (char *)realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+}
+
+// Append bytes to a buffer
+static void AppendRingBuffer(RingBuffer *buffer, const void *data, size_t size)
+{
+    ReserveRingBuffer(buffer, buffer->size + size);
+
+    if (size > 0) memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+// Samples by key, qsort() comparator
+static int CompareRingSamples(const void *a, const void *b)
+{
+    float keyA = ((const RingSample *)a)->key;
+    float keyB = ((const RingSample *)b)->key;
+
+    return (keyA < keyB)? -1 : ((keyA > keyB)? 1 : 0);
+}
+
+// Post an exchange to the helper thread, or run it right away without one
+static void StartRingExchange(RingHelper *helper, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize)
+{
+    if (!helper->started)
+    {
+        helper->success = helper->transport.exchange(helper->transport.context, outgoing, outgoingSize, incoming, incomingSize);
+        return;
+    }
+
+    pthread_mutex_lock(&helper->mutex);
+    helper->outgoing = outgoing;
+    helper->outgoingSize = outgoingSize;
+    helper->incoming = incoming;
+    helper->incomingSize = incomingSize;
+    helper->pending = true;
+    pthread_cond_broadcast(&helper->condition);
+    pthread_mutex_unlock(&helper->mutex);
+}
+
+// Wait for the exchange posted by StartRingExchange(), false if the ring is broken
+static bool WaitRingExchange(RingHelper *helper)
+{
+    if (!helper->started) return helper->success;
+
+    pthread_mutex_lock(&helper->mutex);
+    while (helper->pending) pthread_cond_wait(&helper->condition, &helper->mutex);
+    bool success = helper->success;
+    pthread_mutex_unlock(&helper->mutex);
+
+    return success;
+}
+
+// Helper thread loop, one posted exchange at a time until the rank quits
+static void *RunRingHelper(void *data)
+{
+    RingHelper *helper = (RingHelper *)data;
+
+    pthread_mutex_lock(&helper->mutex);
+
+    while (true)
+    {
+        while (!helper->pending && !helper->quit) pthread_cond_wait(&helper->condition, &helper->mutex);
+        if (helper->quit) break;
+
+        const void *outgoing = helper->outgoing;
+        size_t outgoingSize = helper->outgoingSize;
+        void *incoming = helper->incoming;
+        size_t incomingSize = helper->incomingSize;
+
+        pthread_mutex_unlock(&helper->mutex);
+        bool success = helper->transport.exchange(helper->transport.context, outgoing, outgoingSize, incoming, incomingSize);
+        pthread_mutex_lock(&helper->mutex);
+
+        helper->success = success;
+        helper->pending = false;
+        pthread_cond_broadcast(&helper->condition);
+    }
+
+    pthread_mutex_unlock(&helper->mutex);
+
+    return NULL;
+}
+
+// Send to and receive from the ring neighbours over the local sockets, full duplex
+// NOTE: Sending first then receiving would deadlock once tiles exceed the socket buffers,
+// every rank would be blocked sending to a neighbour that is not receiving yet
+static bool ExchangeSocketTiles(void *context, const void *outgoing, size_t outgoingSize, void *incoming, size_t incomingSize)
+{
+    RingSocketLink *link = (RingSocketLink *)context;
+
+    const char *sending = (const char *)outgoing;
+    char *receiving = (char *)incoming;
+    size_t sent = 0;
+    size_t received = 0;
+    bool success = true;
+
+    while (success && ((sent < outgoingSize) || (received < incomingSize)))
+    {
+        struct pollfd fds[2] = { 0 };
+        int fdCount = 0;
+
+        if (sent < outgoingSize) fds[fdCount++] = (struct pollfd){ link->sendSocket, POLLOUT, 0 };
+        if (received < incomingSize) fds[fdCount++] = (struct pollfd){ link->receiveSocket, POLLIN, 0 };
+
+        if (poll(fds, fdCount, -1) < 0)
+        {
+            if (errno != EINTR) success = false;
+            continue;
+        }
+
+        for (int i = 0; i < fdCount; i++)
+        {
+            if (fds[i].revents == 0) continue;
+
+            ssize_t bytes = 0;
+
+            if (fds[i].fd == link->sendSocket)
+            {
+                bytes = send(link->sendSocket, sending + sent, outgoingSize - sent, MSG_NOSIGNAL);
+                if (bytes > 0) sent += bytes;
+            }
+            else
+            {
+                bytes = recv(link->receiveSocket, receiving + received, incomingSize - received, 0);
+                if (bytes > 0) received += bytes;
+                else if (bytes == 0) success = false;       // Neighbour closed the ring
+            }
+
+            if ((bytes < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) success = false;
+        }
+    }
+
+    return success;
+}
+
+// Reply to the coordinator over the control socket
+static bool SendSocketControl(void *context, const void *data, size_t size)
+{
+    return SendFully(((RingSocketLink *)context)->control, data, size);
+}
+
+// Receive bodies or a command from the coordinator over the control socket
+static bool ReceiveSocketControl(void *context, void *data, size_t size)
+{
+    return ReceiveFully(((RingSocketLink *)context)->control, data, size);
+}
+
+// Send all bytes on a blocking socket
+static bool SendFully(int socket, const void *data, size_t size)
+{
+    const char *bytes = (const char *)data;
+
+    while (size > 0)
+    {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+// Receive all bytes on a blocking socket, false if the peer closed it
+static bool ReceiveFully(int socket, void *data, size_t size)
+{
+    char *bytes = (char *)data;
+
+    while (size > 0)
+    {
+        ssize_t received = recv(socket, bytes, size, 0);
+
+        if (received < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        if (received == 0) return false;
+
+        bytes += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+// Monotonic time in seconds
+static double GetRingTime(void)
+{
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec*1e-9;
+}
+
+#else
+
+// Multi-process transport not implemented on Windows, clusters are never ready
+RingCluster LoadRingCluster(const Body *bodies, int count, int ranks, float theta) { RingCluster cluster = { 0 }; return cluster; }
+void UnloadRingCluster(RingCluster cluster) { }
+bool StepRingCluster(RingCluster *cluster, int steps) { return false; }
+bool GetRingClusterBodies(RingCluster cluster, Body *bodies) { return false; }
+void RunRingRank(int rank, int ranks, int count, float theta, RingTransport transport) { }
+
+#endif // !_WIN32
+
+#endif // NBODY_RING_IMPLEMENTATION
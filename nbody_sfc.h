@@ -0,0 +1,385 @@
+/**********************************************************************************************
+*
+*   nbody.sfc - Space filling curve keys and parallel body sort for the CPU integrators
+*
+*   Bodies sorted along a Morton (Z-order) or Hilbert curve sit next to their spatial
+*   neighbours in memory, tree builds, grid deposits and pair loops then hit the cache
+*   instead of striding over the whole array. Positions are quantized to SFC_BITS bits per
+*   axis inside the bounds of the bodies, keys are 3*SFC_BITS bits.
+*
+*   SortBodiesByCurve() is a stable LSD radix sort on the task pool: every pass, chunks of
+*   bodies count their digits in parallel, a serial scan turns the chunk counts into offsets,
+*   then chunks scatter in parallel. Chunks are fixed, results do not depend on the workers.
+*   Sorting moves bodies between slots, ids[slot] keeps the stable id of each body.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_SFC_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type
+*       nbody_tasks.h       Work-stealing task pool
+*
+*   NOTE: Keys match reorder.comp, the GPU reorder pass of nbody_reorder.h
+*
+**********************************************************************************************/
+
+#ifndef NBODY_SFC_H
+#define NBODY_SFC_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+// IMPORTANT: Must match the define in reorder.comp
+#define SFC_BITS                10          // Quantization bits per axis, keys use 3*SFC_BITS bits
+
+#define SFC_SORT_BITS           8           // Key bits sorted per radix pass
+#define SFC_SORT_CHUNK          4096        // Bodies per count and scatter task
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Space filling curve
+typedef enum {
+    SFC_CURVE_MORTON = 0,       // Z-order, bit interleave of the axes
+    SFC_CURVE_HILBERT           // No jumps between consecutive cells, better locality, costlier keys
+} SfcCurve;
+
+// Body sorter data, scratch buffers for up to capacity bodies
+typedef struct BodySorter {
+    int capacity;
+    unsigned int *keys[2];      // Ping-pong keys
+    int *slots[2];              // Ping-pong source slots of the sorted keys
+    int *chunkCounts;           // Digit counts then offsets, per chunk
+    Body *scratch;              // Reordered bodies
+    int *idScratch;             // Reordered ids
+} BodySorter;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+unsigned int GetMortonKey(unsigned int x, unsigned int y, unsigned int z);    // Key of a quantized position, SFC_BITS bits per axis
+unsigned int GetHilbertKey(unsigned int x, unsigned int y, unsigned int z);   // Key of a quantized position, SFC_BITS bits per axis
+
+BodySorter LoadBodySorter(int capacity);                                    // Allocate sorter for up to capacity bodies
+void UnloadBodySorter(BodySorter sorter);                                   // Free sorter
+void SortBodiesByCurve(BodySorter *sorter, TaskPool *pool, Body *bodies, int *ids, int *slots, int count, SfcCurve curve);  // Sort bodies and their ids in place, slots (id -> slot) may be NULL
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_SFC_H
+
+
+/***********************************************************************************
+*
+*   NBODY SFC IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_SFC_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: memcpy(), memset()
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// One sort
+typedef struct SfcSort {
+    BodySorter *sorter;
+    TaskPool *pool;
+    Body *bodies;
+    int *ids;
+    int count;
+    int chunkCount;
+    SfcCurve curve;
+    float boundsMin[3];
+    float scale;                // Quantization steps per unit length
+    int source;                 // Ping-pong buffers read by this pass
+    int shift;                  // First key bit of the digit sorted by this pass
+} SfcSort;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static void SortSfcTask(void *data);                                // Root task: keys, radix passes, gather
+static unsigned int ExpandSfcBits(unsigned int v);                  // Two zero bits between each of the 10 low bits
+static void ComputeSfcKeys(void *data, int begin, int end);         // Keys of chunks [begin, end)
+static void CountSfcDigits(void *data, int begin, int end);         // Digit counts of chunks [begin, end)
+static void ScatterSfcDigits(void *data, int begin, int end);       // Stable scatter of chunks [begin, end)
+static void GatherSfcBodies(void *data, int begin, int end);        // Bodies and ids in sorted order
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Morton key, bits interleaved x, y, z from the most significant
+unsigned int GetMortonKey(unsigned int x, unsigned int y, unsigned int z)
+{
+    return (ExpandSfcBits(x) << 2) | (ExpandSfcBits(y) << 1) | ExpandSfcBits(z);
+}
+
+// Hilbert key, Skilling's transpose of the axes (AxesToTranspose) then Morton interleave
+unsigned int GetHilbertKey(unsigned int x, unsigned int y, unsigned int z)
+{
+    unsigned int p[3] = { x, y, z };
+
+    // Inverse undo
+    for (unsigned int q = 1u << (SFC_BITS - 1); q > 1u; q >>= 1)
+    {
+        unsigned int mask = q - 1u;
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (p[i] & q) p[0] ^= mask;
+            else
+            {
+                unsigned int t = (p[0] ^ p[i]) & mask;
+                p[0] ^= t;
+                p[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    p[1] ^= p[0];
+    p[2] ^= p[1];
+
+    unsigned int t = 0u;
+    for (unsigned int q = 1u << (SFC_BITS - 1); q > 1u; q >>= 1) if (p[2] & q) t ^= q - 1u;
+
+    return GetMortonKey(p[0] ^ t, p[1] ^ t, p[2] ^ t);
+}
+
+// Allocate sorter for up to capacity bodies
+BodySorter LoadBodySorter(int capacity)
+{
+    BodySorter sorter = { 0 };
+    int chunkCount = (capacity + SFC_SORT_CHUNK - 1)/SFC_SORT_CHUNK;
+
+    sorter.capacity = capacity;
+
+    for (int i = 0; i < 2; i++)
+    {
+        sorter.keys[i] = (unsigned int *)calloc(capacity, sizeof(unsigned int));
+        sorter.slots[i] = (int *)calloc(capacity, sizeof(int));
+    }
+
+    sorter.chunkCounts = (int *)calloc((size_t)chunkCount << SFC_SORT_BITS, sizeof(int));
+    sorter.scratch = (Body *)calloc(capacity, sizeof(Body));
+    sorter.idScratch = (int *)calloc(capacity, sizeof(int));
+
+    return sorter;
+}
+
+// Free sorter
+void UnloadBodySorter(BodySorter sorter)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        free(sorter.keys[i]);
+        free(sorter.slots[i]);
+    }
+
+    free(sorter.chunkCounts);
+    free(sorter.scratch);
+    free(sorter.idScratch);
+}
+
+// Sort bodies along a space filling curve inside their bounds, ids follow their bodies
+void SortBodiesByCurve(BodySorter *sorter, TaskPool *pool, Body *bodies, int *ids, int *slots, int count, SfcCurve curve)
+{
+    if (count > sorter->capacity) count = sorter->capacity;
+    if (count < 2) return;
+
+    SfcSort sort = { 0 };
+    sort.sorter = sorter;
+    sort.bodies = bodies;
+    sort.ids = ids;
+    sort.count = count;
+    sort.chunkCount = (count + SFC_SORT_CHUNK - 1)/SFC_SORT_CHUNK;
+    sort.curve = curve;
+
+    // Cube around all bodies, quantized on SFC_BITS bits
+    float boundsMax[3] = { bodies[0].px, bodies[0].py, bodies[0].pz };
+    sort.boundsMin[0] = bodies[0].px;
+    sort.boundsMin[1] = bodies[0].py;
+    sort.boundsMin[2] = bodies[0].pz;
+
+    for (int i = 1; i < count; i++)
+    {
+        const float position[3] = { bodies[i].px, bodies[i].py, bodies[i].pz };
+
+        for (int d = 0; d < 3; d++)
+        {
+            if (position[d] < sort.boundsMin[d]) sort.boundsMin[d] = position[d];
+            if (position[d] > boundsMax[d]) boundsMax[d] = position[d];
+        }
+    }
+
+    float extent = boundsMax[0] - sort.boundsMin[0];
+    if ((boundsMax[1] - sort.boundsMin[1]) > extent) extent = boundsMax[1] - sort.boundsMin[1];
+    if ((boundsMax[2] - sort.boundsMin[2]) > extent) extent = boundsMax[2] - sort.boundsMin[2];
+
+    sort.scale = (extent > 0.0f)? ((float)((1 << SFC_BITS) - 1)/extent) : 0.0f;
+    sort.pool = pool;
+
+    RunTaskPool(pool, SortSfcTask, &sort);
+
+    memcpy(bodies, sorter->scratch, count*sizeof(Body));
+    memcpy(ids, sorter->idScratch, count*sizeof(int));
+
+    if (slots != NULL)
+    {
+        for (int i = 0; i < count; i++) slots[ids[i]] = i;
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Root task of a sort: keys, radix passes, gather
+static void SortSfcTask(void *data)
+{
+    SfcSort *sort = (SfcSort *)data;
+    BodySorter *sorter = sort->sorter;
+    TaskPool *pool = sort->pool;
+
+    ParallelFor(pool, 0, sort->chunkCount, 1, ComputeSfcKeys, sort);
+
+    for (sort->shift = 0; sort->shift < 3*SFC_BITS; sort->shift += SFC_SORT_BITS)
+    {
+        ParallelFor(pool, 0, sort->chunkCount, 1, CountSfcDigits, sort);
+
+        // Digit major exclusive scan, chunks in order within a digit keeps the sort stable
+        int offset = 0;
+        for (int digit = 0; digit < (1 << SFC_SORT_BITS); digit++)
+        {
+            for (int chunk = 0; chunk < sort->chunkCount; chunk++)
+            {
+                int *chunkCount = &sorter->chunkCounts[(chunk << SFC_SORT_BITS) + digit];
+                int digitCount = *chunkCount;
+
+                *chunkCount = offset;
+                offset += digitCount;
+            }
+        }
+
+        ParallelFor(pool, 0, sort->chunkCount, 1, ScatterSfcDigits, sort);
+        sort->source = 1 - sort->source;
+    }
+
+    ParallelFor(pool, 0, sort->chunkCount, 1, GatherSfcBodies, sort);
+}
+
+// Spread the 10 low bits of v, two zero bits between each
+static unsigned int ExpandSfcBits(unsigned int v)
+{
+    v = (v*0x00010001u) & 0xFF0000FFu;
+    v = (v*0x00000101u) & 0x0F00F00Fu;
+    v = (v*0x00000011u) & 0xC30C30C3u;
+    v = (v*0x00000005u) & 0x49249249u;
+
+    return v;
+}
+
+// Keys of chunks [begin, end), values are the body slots
+static void ComputeSfcKeys(void *data, int begin, int end)
+{
+    SfcSort *sort = (SfcSort *)data;
+    BodySorter *sorter = sort->sorter;
+    int last = end*SFC_SORT_CHUNK;
+    if (last > sort->count) last = sort->count;
+
+    for (int i = begin*SFC_SORT_CHUNK; i < last; i++)
+    {
+        const Body *body = &sort->bodies[i];
+        unsigned int cell[3] = { 0 };
+        const float position[3] = { body->px, body->py, body->pz };
+
+        for (int d = 0; d < 3; d++)
+        {
+            float q = (position[d] - sort->boundsMin[d])*sort->scale;
+            cell[d] = (q <= 0.0f)? 0u : ((q >= (float)((1 << SFC_BITS) - 1))? (1u << SFC_BITS) - 1u : (unsigned int)q);
+        }
+
+        sorter->keys[0][i] = (sort->curve == SFC_CURVE_HILBERT)? GetHilbertKey(cell[0], cell[1], cell[2]) : GetMortonKey(cell[0], cell[1], cell[2]);
+        sorter->slots[0][i] = i;
+    }
+}
+
+// Digit counts of chunks [begin, end) for the current pass
+static void CountSfcDigits(void *data, int begin, int end)
+{
+    SfcSort *sort = (SfcSort *)data;
+    BodySorter *sorter = sort->sorter;
+    const unsigned int *keys = sorter->keys[sort->source];
+    unsigned int mask = (1u << SFC_SORT_BITS) - 1u;
+
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+        int *counts = &sorter->chunkCounts[chunk << SFC_SORT_BITS];
+        int last = (chunk + 1)*SFC_SORT_CHUNK;
+        if (last > sort->count) last = sort->count;
+
+        memset(counts, 0, sizeof(int) << SFC_SORT_BITS);
+        for (int i = chunk*SFC_SORT_CHUNK; i < last; i++) counts[(keys[i] >> sort->shift) & mask]++;
+    }
+}
+
+// Stable scatter of chunks [begin, end) to their digit offsets
+static void ScatterSfcDigits(void *data, int begin, int end)
+{
+    SfcSort *sort = (SfcSort *)data;
+    BodySorter *sorter = sort->sorter;
+    const unsigned int *keys = sorter->keys[sort->source];
+    const int *slots = sorter->slots[sort->source];
+    unsigned int *keysOut = sorter->keys[1 - sort->source];
+    int *slotsOut = sorter->slots[1 - sort->source];
+    unsigned int mask = (1u << SFC_SORT_BITS) - 1u;
+
+    for (int chunk = begin; chunk < end; chunk++)
+    {
+        int *offsets = &sorter->chunkCounts[chunk << SFC_SORT_BITS];
+        int last = (chunk + 1)*SFC_SORT_CHUNK;
+        if (last > sort->count) last = sort->count;
+
+        for (int i = chunk*SFC_SORT_CHUNK; i < last; i++)
+        {
+            int destination = offsets[(keys[i] >> sort->shift) & mask]++;
+
+            keysOut[destination] = keys[i];
+            slotsOut[destination] = slots[i];
+        }
+    }
+}
+
+// Bodies and ids of chunks [begin, end) of the sorted order
+static void GatherSfcBodies(void *data, int begin, int end)
+{
+    SfcSort *sort = (SfcSort *)data;
+    BodySorter *sorter = sort->sorter;
+    const int *slots = sorter->slots[sort->source];
+    int last = end*SFC_SORT_CHUNK;
+    if (last > sort->count) last = sort->count;
+
+    for (int i = begin*SFC_SORT_CHUNK; i < last; i++)
+    {
+        sorter->scratch[i] = sort->bodies[slots[i]];
+        sorter->idScratch[i] = sort->ids[slots[i]];
+    }
+}
+
+#endif // NBODY_SFC_IMPLEMENTATION
@@ -0,0 +1,422 @@
+/**********************************************************************************************
+*
+*   nbody.shadercache - On-disk cache of linked shader program binaries
+*
+*   Shader programs are loaded from source once, then their glGetProgramBinary() blob is
+*   saved to SHADER_CACHE_PATH. Next launches load the blob with glProgramBinary() and skip
+*   compiling and linking entirely. Blobs are keyed by a hash of the shader sources, the
+*   injected defines and the driver strings (vendor, renderer, version), so editing a shader
+*   or updating the driver simply misses the cache. Any cache failure (no binary format
+*   supported, missing or corrupted file, blob rejected by the driver) falls back to the
+*   regular compile from source.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_SHADERCACHE_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define SHADER_CACHE_PATH
+*       Directory holding the cached program binaries, "shadercache" by default
+*
+*   #define NBODY_EMBED_SHADERS
+*       Shader sources are taken from the embeddedShaders[] table of the generated
+*       nbody_shaders.h (see CMakeLists.txt) instead of being read from disk.
+*       Setting the NBODY_SHADER_DIR environment variable loads shaders from that directory
+*       first, by file name, so they can be edited without rebuilding.
+*
+*   NOTE: defines are inserted right after the #version line of every stage,
+*   e.g. "#define NUM_BODIES 8192\n#define RADIUS 0.5\n"
+*
+**********************************************************************************************/
+
+#ifndef NBODY_SHADERCACHE_H
+#define NBODY_SHADERCACHE_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef SHADER_CACHE_PATH
+    #define SHADER_CACHE_PATH       "shadercache"
+#endif
+
+#define SHADER_OVERRIDE_ENV         "NBODY_SHADER_DIR"
+
+#define SHADER_CACHE_MAGIC          0x4e425043  // "NBPC"
+#define SHADER_CACHE_VERSION        1
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+unsigned int LoadComputeProgramCached(const char *compFileName, const char *defines);         // Load compute program, from cache if possible
+Shader LoadShaderCached(const char *vsFileName, const char *fsFileName, const char *defines);  // Load shader, from cache if possible
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_SHADERCACHE_H
+
+
+/***********************************************************************************
+*
+*   NBODY SHADERCACHE IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_SHADERCACHE_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glGetProgramBinary(), glProgramBinary(), glGetString()
+
+#include <stdlib.h>         // Required for: malloc(), free(), getenv()
+#include <string.h>         // Required for: strlen(), strchr(), strcmp(), memcpy()
+#include <stdio.h>          // Required for: snprintf()
+
+#if defined(NBODY_EMBED_SHADERS)
+    #include "nbody_shaders.h"  // Generated by cmake/EmbedShaders.cmake: embeddedShaders[]
+#endif
+
+#if defined(_WIN32)
+    #include <direct.h>     // Required for: _mkdir()
+    #define MAKE_DIRECTORY(path) _mkdir(path)
+#else
+    #include <sys/stat.h>   // Required for: mkdir()
+    #define MAKE_DIRECTORY(path) mkdir(path, 0755)
+#endif
+
+#define SHADER_CACHE_FILENAME_LENGTH    256
+
+#ifndef RL_MAX_SHADER_LOCATIONS
+    #define RL_MAX_SHADER_LOCATIONS     32      // Must match raylib, Shader.locs is freed by UnloadShader()
+#endif
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Cache file header, followed by the program binary
+typedef struct ShaderCacheHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int format;            // Binary format returned by glGetProgramBinary()
+    unsigned int size;              // Program binary size in bytes
+} ShaderCacheHeader;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static char *LoadShaderSource(const char *fileName, const char *defines);
+static unsigned long long HashShaderSource(unsigned long long hash, const char *text);
+static bool GetShaderCacheFileName(const char **sources, int count, char *fileName);
+static unsigned int LoadCachedProgram(const char *cacheFileName);
+static void SaveCachedProgram(const char *cacheFileName, unsigned int program);
+static unsigned int LinkProgram(unsigned int *shaders, int count, bool bindAttribs);
+static Shader GetShaderFromProgram(unsigned int program);
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load compute program, from cache if possible
+unsigned int LoadComputeProgramCached(const char *compFileName, const char *defines)
+{
+    char *compCode = LoadShaderSource(compFileName, defines);
+    if (compCode == NULL) return 0;
+
+    char cacheFileName[SHADER_CACHE_FILENAME_LENGTH] = { 0 };
+    bool cacheSupported = GetShaderCacheFileName((const char *[1]){ compCode }, 1, cacheFileName);
+    unsigned int program = cacheSupported? LoadCachedProgram(cacheFileName) : 0;
+
+    if (program == 0)
+    {
+        unsigned int compShader = rlCompileShader(compCode, RL_COMPUTE_SHADER);
+        program = LinkProgram(&compShader, 1, false);
+
+        if ((program != 0) && cacheSupported) SaveCachedProgram(cacheFileName, program);
+    }
+    else TraceLog(LOG_INFO, "SHADERCACHE: [%s] Program loaded from cache", compFileName);
+
+    RL_FREE(compCode);
+
+    return program;
+}
+
+// Load shader, from cache if possible
+// NOTE: Default shader locations are set as LoadShader() does
+Shader LoadShaderCached(const char *vsFileName, const char *fsFileName, const char *defines)
+{
+    Shader shader = { 0 };
+
+    char *vsCode = LoadShaderSource(vsFileName, defines);
+    char *fsCode = LoadShaderSource(fsFileName, defines);
+
+    if ((vsCode != NULL) && (fsCode != NULL))
+    {
+        char cacheFileName[SHADER_CACHE_FILENAME_LENGTH] = { 0 };
+        bool cacheSupported = GetShaderCacheFileName((const char *[2]){ vsCode, fsCode }, 2, cacheFileName);
+        unsigned int program = cacheSupported? LoadCachedProgram(cacheFileName) : 0;
+
+        if (program == 0)
+        {
+            unsigned int shaders[2] = { rlCompileShader(vsCode, RL_VERTEX_SHADER), rlCompileShader(fsCode, RL_FRAGMENT_SHADER) };
+            program = LinkProgram(shaders, 2, true);
+
+            if ((program != 0) && cacheSupported) SaveCachedProgram(cacheFileName, program);
+        }
+        else TraceLog(LOG_INFO, "SHADERCACHE: [%s, %s] Program loaded from cache", vsFileName, fsFileName);
+
+        // Link failed: let raylib report it and fall back to its default shader
+        if (program != 0) shader = GetShaderFromProgram(program);
+        else shader = LoadShaderFromMemory(vsCode, fsCode);
+    }
+    else shader = LoadShader(vsFileName, fsFileName);
+
+    RL_FREE(vsCode);
+    RL_FREE(fsCode);
+
+    return shader;
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load shader source text, defines inserted after the #version line
+// NOTE: Returned text must be freed with RL_FREE()
+static char *LoadShaderSource(const char *fileName, const char *defines)
+{
+    const char *text = NULL;
+    char *fileText = NULL;
+
+    // Development override, edited shaders are picked up without rebuilding
+    const char *overrideDir = getenv(SHADER_OVERRIDE_ENV);
+    if ((overrideDir != NULL) && (overrideDir[0] != '\0'))
+    {
+        fileText = LoadFileText(TextFormat("%s/%s", overrideDir, GetFileName(fileName)));
+        text = fileText;
+    }
+
+#if defined(NBODY_EMBED_SHADERS)
+    for (int i = 0; (text == NULL) && (i < EMBEDDED_SHADER_COUNT); i++)
+    {
+        if (strcmp(embeddedShaders[i].fileName, fileName) == 0) text = embeddedShaders[i].text;
+    }
+
+    if (text == NULL) TraceLog(LOG_WARNING, "SHADERCACHE: [%s] Shader not embedded, loading from file", fileName);
+#endif
+
+    if (text == NULL)
+    {
+        fileText = LoadFileText(fileName);
+        text = fileText;
+    }
+
+    if (text == NULL) return NULL;
+
+    int textLength = (int)strlen(text);
+    int definesLength = (defines != NULL)? (int)strlen(defines) : 0;
+
+    // Everything up to the end of the #version line stays first
+    const char *lineEnd = strchr(text, '\n');
+    int versionLength = (lineEnd != NULL)? (int)(lineEnd - text) + 1 : textLength;
+
+    char *source = (char *)RL_MALLOC(textLength + definesLength + 2);
+    memcpy(source, text, versionLength);
+
+    int offset = versionLength;
+    if (lineEnd == NULL) source[offset++] = '\n';
+    if (definesLength > 0) memcpy(source + offset, defines, definesLength);
+    offset += definesLength;
+    memcpy(source + offset, text + versionLength, textLength - versionLength + 1);   // Including '\0'
+
+    if (fileText != NULL) UnloadFileText(fileText);
+
+    return source;
+}
+
+// FNV-1a 64 bit hash of a string, chained from a previous hash
+static unsigned long long HashShaderSource(unsigned long long hash, const char *text)
+{
+    if (text == NULL) return hash;
+
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    // Separator, so ("ab", "c") and ("a", "bc") hash differently
+    hash ^= 0xff;
+    hash *= 0x100000001b3ULL;
+
+    return hash;
+}
+
+// Get cache file name for the given sources on the current driver
+// NOTE: Returns false when the driver supports no program binary format
+static bool GetShaderCacheFileName(const char **sources, int count, char *fileName)
+{
+    GLint formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    if (formatCount <= 0) return false;
+
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    hash = HashShaderSource(hash, (const char *)glGetString(GL_VENDOR));
+    hash = HashShaderSource(hash, (const char *)glGetString(GL_RENDERER));
+    hash = HashShaderSource(hash, (const char *)glGetString(GL_VERSION));
+    for (int i = 0; i < count; i++) hash = HashShaderSource(hash, sources[i]);
+
+    snprintf(fileName, SHADER_CACHE_FILENAME_LENGTH, "%s/%016llx.bin", SHADER_CACHE_PATH, hash);
+
+    return true;
+}
+
+// Load program from a cached binary, returns 0 on any failure
+static unsigned int LoadCachedProgram(const char *cacheFileName)
+{
+    if (!FileExists(cacheFileName)) return 0;
+
+    int dataSize = 0;
+    unsigned char *data = LoadFileData(cacheFileName, &dataSize);
+    if (data == NULL) return 0;
+
+    unsigned int program = 0;
+    ShaderCacheHeader header = { 0 };
+
+    if (dataSize >= (int)sizeof(ShaderCacheHeader)) memcpy(&header, data, sizeof(ShaderCacheHeader));
+
+    if ((header.magic == SHADER_CACHE_MAGIC) && (header.version == SHADER_CACHE_VERSION) &&
+        (header.size == (unsigned int)(dataSize - sizeof(ShaderCacheHeader))))
+    {
+        program = glCreateProgram();
+        glProgramBinary(program, header.format, data + sizeof(ShaderCacheHeader), header.size);
+
+        // Driver may reject a binary it produced itself (e.g. after an update), not an error
+        GLint success = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+
+        if (success == GL_FALSE)
+        {
+            TraceLog(LOG_INFO, "SHADERCACHE: [%s] Cached binary rejected by driver, compiling from source", cacheFileName);
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    else TraceLog(LOG_WARNING, "SHADERCACHE: [%s] Invalid cache file, compiling from source", cacheFileName);
+
+    UnloadFileData(data);
+
+    return program;
+}
+
+// Save linked program binary to the cache
+static void SaveCachedProgram(const char *cacheFileName, unsigned int program)
+{
+    GLint binarySize = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+    if (binarySize <= 0) return;
+
+    unsigned char *data = (unsigned char *)RL_MALLOC(sizeof(ShaderCacheHeader) + binarySize);
+
+    GLenum format = 0;
+    GLsizei length = 0;
+    glGetProgramBinary(program, binarySize, &length, &format, data + sizeof(ShaderCacheHeader));
+
+    ShaderCacheHeader header = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, format, (unsigned int)length };
+    memcpy(data, &header, sizeof(ShaderCacheHeader));
+
+    if (!DirectoryExists(SHADER_CACHE_PATH)) MAKE_DIRECTORY(SHADER_CACHE_PATH);
+
+    if (SaveFileData(cacheFileName, data, sizeof(ShaderCacheHeader) + length)) TraceLog(LOG_INFO, "SHADERCACHE: [%s] Program binary saved (%i bytes)", cacheFileName, (int)length);
+
+    RL_FREE(data);
+}
+
+// Link compiled shaders into a program retrievable as binary, shaders are deleted
+// NOTE: Returns 0 if any shader failed to compile or the link failed
+static unsigned int LinkProgram(unsigned int *shaders, int count, bool bindAttribs)
+{
+    unsigned int program = 0;
+    bool compiled = true;
+    for (int i = 0; i < count; i++) if (shaders[i] == 0) compiled = false;
+
+    if (compiled)
+    {
+        program = glCreateProgram();
+        for (int i = 0; i < count; i++) glAttachShader(program, shaders[i]);
+
+        // Same attribute locations as rlLoadShaderProgram()
+        if (bindAttribs)
+        {
+            glBindAttribLocation(program, 0, "vertexPosition");
+            glBindAttribLocation(program, 1, "vertexTexCoord");
+            glBindAttribLocation(program, 2, "vertexNormal");
+            glBindAttribLocation(program, 3, "vertexColor");
+            glBindAttribLocation(program, 4, "vertexTangent");
+            glBindAttribLocation(program, 5, "vertexTexCoord2");
+        }
+
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+
+        GLint success = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+
+        if (success == GL_FALSE)
+        {
+            char log[1024] = { 0 };
+            glGetProgramInfoLog(program, sizeof(log), NULL, log);
+            TraceLog(LOG_WARNING, "SHADERCACHE: [ID %i] Failed to link program: %s", program, log);
+
+            glDeleteProgram(program);
+            program = 0;
+        }
+        else
+        {
+            for (int i = 0; i < count; i++) glDetachShader(program, shaders[i]);
+        }
+    }
+
+    for (int i = 0; i < count; i++) if (shaders[i] != 0) glDeleteShader(shaders[i]);
+
+    return program;
+}
+
+// Get shader from a linked program, default locations set as LoadShader() does
+static Shader GetShaderFromProgram(unsigned int program)
+{
+    Shader shader = { 0 };
+
+    shader.id = program;
+    shader.locs = (int *)RL_CALLOC(RL_MAX_SHADER_LOCATIONS, sizeof(int));
+    for (int i = 0; i < RL_MAX_SHADER_LOCATIONS; i++) shader.locs[i] = -1;
+
+    shader.locs[SHADER_LOC_VERTEX_POSITION] = rlGetLocationAttrib(program, "vertexPosition");
+    shader.locs[SHADER_LOC_VERTEX_TEXCOORD01] = rlGetLocationAttrib(program, "vertexTexCoord");
+    shader.locs[SHADER_LOC_VERTEX_TEXCOORD02] = rlGetLocationAttrib(program, "vertexTexCoord2");
+    shader.locs[SHADER_LOC_VERTEX_NORMAL] = rlGetLocationAttrib(program, "vertexNormal");
+    shader.locs[SHADER_LOC_VERTEX_TANGENT] = rlGetLocationAttrib(program, "vertexTangent");
+    shader.locs[SHADER_LOC_VERTEX_COLOR] = rlGetLocationAttrib(program, "vertexColor");
+
+    shader.locs[SHADER_LOC_MATRIX_MVP] = rlGetLocationUniform(program, "mvp");
+    shader.locs[SHADER_LOC_MATRIX_VIEW] = rlGetLocationUniform(program, "matView");
+    shader.locs[SHADER_LOC_MATRIX_PROJECTION] = rlGetLocationUniform(program, "matProjection");
+    shader.locs[SHADER_LOC_MATRIX_MODEL] = rlGetLocationUniform(program, "matModel");
+    shader.locs[SHADER_LOC_MATRIX_NORMAL] = rlGetLocationUniform(program, "matNormal");
+    shader.locs[SHADER_LOC_COLOR_DIFFUSE] = rlGetLocationUniform(program, "colDiffuse");
+    shader.locs[SHADER_LOC_MAP_DIFFUSE] = rlGetLocationUniform(program, "texture0");
+    shader.locs[SHADER_LOC_MAP_SPECULAR] = rlGetLocationUniform(program, "texture1");
+    shader.locs[SHADER_LOC_MAP_NORMAL] = rlGetLocationUniform(program, "texture2");
+
+    return shader;
+}
+
+#endif // NBODY_SHADERCACHE_IMPLEMENTATION
@@ -0,0 +1,248 @@
+/**********************************************************************************************
+*
+*   nbody.sleep - Contact islands and sleeping of resting clumps
+*
+*   Late in a clumping run most bodies rest in contact and barely move, yet every step still
+*   integrates them and sums the gravity of every other body on them. island_sleep.comp finds
+*   the islands of bodies in contact each step and puts resting ones to sleep:
+*
+*       Islands     Connected components of the contact pairs of the neighbour lists
+*                   (nbody_neighbours.h), by lock-free parallel union-find: roots are hooked
+*                   under lower slots with atomicCompSwap, then every body points to its root
+*       Rest        An island is calm while the kinetic energy of each of its bodies is below
+*                   sleepEnergy: the largest body energy is tested rather than the island sum,
+*                   so one threshold fits islands of any size. Each body counts its calm steps
+*                   (by stable id, across reorders)
+*       Sleep       An island of SLEEP_MIN_BODIES or more sleeps once all its bodies have been
+*                   calm for sleepSteps. It stays asleep only as long as nothing disturbs it
+*
+*   Sleeping bodies are not integrated and not moved by contacts, and their force loop is
+*   skipped, except on diagnostics steps where it sums every body for the potential (the
+*   aggregate of its own island would count its own mass). For everyone else, gravity comes
+*   from a compact source list: the awake bodies plus one aggregate mass per sleeping island,
+*   at its center of mass. Once most bodies are asleep, steps cost little more than the
+*   islands pass.
+*
+*   A body that comes into contact with a sleeping island is still outside it during that step:
+*   the island bodies are pinned and the awake body resolves the whole overlap. The islands pass
+*   of the next step unites it with the island, and its rest count joins the island minimum, so
+*   the whole island wakes in that same pass, before the integrator runs, unless the newcomer
+*   has been calm for sleepSteps as well.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_SLEEP_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define SLEEP_STEPS
+*   #define SLEEP_ENERGY
+*       May be defined before including this file to override the defaults below.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input of the step)
+*      17 - uint bodyIds[]                      (slot -> id, see nbody_reorder.h)
+*      20 - uint neighbourData[]                (contact pairs, see nbody_neighbours.h)
+*      28 - sleep state                         (counters, gravity sources, per slot sleep flags)
+*      29 - Island islands[]                    (union-find and per island sums)
+*      30 - uint restSteps[]                    (per stable id)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute programs
+*       nbody_readback.h    Fenced readback of the counters
+*       nbody_neighbours.h  Contact pairs
+*
+*   NOTE: Rest is measured in the simulation frame, a drifting or spinning clump never sleeps.
+*   With the default contact response clumps keep spinning, they come to rest with the contact
+*   solver (nbody_contacts.h). Sleeping islands ignore outside gravity until woken, and sources
+*   are appended in no fixed order, so runs with sleeping are not bitwise repeatable
+*
+**********************************************************************************************/
+
+#ifndef NBODY_SLEEP_H
+#define NBODY_SLEEP_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef SLEEP_STEPS
+    #define SLEEP_STEPS             60          // Calm steps before an island sleeps
+#endif
+#ifndef SLEEP_ENERGY
+    #define SLEEP_ENERGY            2.0e-3f     // Largest kinetic energy v^2/2 of a calm island body
+#endif
+
+// IMPORTANT: These must match the defines in island_sleep.comp
+#define SLEEP_GROUP_SIZE            64
+#define SLEEP_MIN_BODIES            8           // Smaller islands never sleep
+
+#define SLEEP_READBACK_SLOTS        3           // Counters in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Sleep counters, std430 layout of the head of island_sleep.comp binding 28
+typedef struct SleepCounters {
+    unsigned int sourceCount;       // Gravity sources: awake bodies and sleeping islands
+    unsigned int sleepingBodies;
+    unsigned int islandCount;       // Islands of SLEEP_MIN_BODIES or more
+    unsigned int sleepingIslands;
+} SleepCounters;
+
+// Sleeping islands data
+typedef struct SleepIslands {
+    unsigned int program;
+    unsigned int sleepBuffer;       // SSBO: SleepCounters, vec4[NUM_BODIES] sources, uint[NUM_BODIES] flags
+    unsigned int islandBuffer;      // SSBO: 32 bytes per slot
+    unsigned int restBuffer;        // SSBO: uint[NUM_BODIES]
+    ReadbackQueue counterReadback;
+
+    int sleepSteps;
+    float sleepEnergy;
+
+    long long updates;              // Updates since load
+    SleepCounters counters;         // Read back a few frames late
+
+    int stageLoc;
+    int sleepStepsLoc;
+    int sleepEnergyLoc;
+    int boxSizeLoc;
+    int enabledLoc;                 // Integrator uniform location
+} SleepIslands;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+SleepIslands LoadSleepIslands(unsigned int integratorProgram, int sleepSteps, float sleepEnergy);  // Load islands program and buffers
+void UnloadSleepIslands(SleepIslands islands);                                  // Unload islands program and buffers
+void UpdateSleepIslands(SleepIslands *islands, unsigned int bodyBuffer, unsigned int idBuffer, NeighbourLists lists, float boxSize);  // Find islands, decide which sleep this step
+void ResetSleepIslands(SleepIslands *islands);                                  // Wake everything, rest counts start over
+void BindSleepIslands(SleepIslands islands, bool enabled);                      // Bind sleep state to the enabled integrator program
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_SLEEP_H
+
+
+/***********************************************************************************
+*
+*   NBODY SLEEP IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_SLEEP_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load islands program and buffers, nothing sleeps before sleepSteps updates
+// NOTE: sleepSteps <= 0 selects SLEEP_STEPS, sleepEnergy <= 0 selects SLEEP_ENERGY
+SleepIslands LoadSleepIslands(unsigned int integratorProgram, int sleepSteps, float sleepEnergy)
+{
+    SleepIslands islands = { 0 };
+
+    islands.program = LoadComputeProgramCached("resources/shaders/glsl430/island_sleep.comp", NULL);
+    islands.stageLoc = rlGetLocationUniform(islands.program, "stage");
+    islands.sleepStepsLoc = rlGetLocationUniform(islands.program, "sleepSteps");
+    islands.sleepEnergyLoc = rlGetLocationUniform(islands.program, "sleepEnergy");
+    islands.boxSizeLoc = rlGetLocationUniform(islands.program, "boxSize");
+    islands.enabledLoc = rlGetLocationUniform(integratorProgram, "sleeping");
+
+    // Flags follow the sources, std430 packs them right after
+    islands.sleepBuffer = rlLoadShaderBuffer(sizeof(SleepCounters) + NUM_BODIES*4*sizeof(float) + NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    islands.islandBuffer = rlLoadShaderBuffer(NUM_BODIES*8*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    islands.restBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), NULL, RL_DYNAMIC_COPY);
+    islands.counterReadback = LoadReadbackQueue(SLEEP_READBACK_SLOTS, sizeof(SleepCounters));
+
+    islands.sleepSteps = (sleepSteps > 0)? sleepSteps : SLEEP_STEPS;
+    islands.sleepEnergy = (sleepEnergy > 0.0f)? sleepEnergy : SLEEP_ENERGY;
+
+    ResetSleepIslands(&islands);
+
+    return islands;
+}
+
+// Unload islands program and buffers
+void UnloadSleepIslands(SleepIslands islands)
+{
+    rlUnloadShaderBuffer(islands.sleepBuffer);
+    rlUnloadShaderBuffer(islands.islandBuffer);
+    rlUnloadShaderBuffer(islands.restBuffer);
+    UnloadReadbackQueue(islands.counterReadback);
+    rlUnloadShaderProgram(islands.program);
+}
+
+// Find the contact islands of the input bodies, update rest counts, decide which islands sleep
+// this step and build the gravity sources of the integrator
+// NOTE: Must run after UpdateNeighbourLists() on the same bodies. Counters of the earlier
+// updates are collected here, without waiting
+void UpdateSleepIslands(SleepIslands *islands, unsigned int bodyBuffer, unsigned int idBuffer, NeighbourLists lists, float boxSize)
+{
+    for (int slot = PollReadback(&islands->counterReadback); slot >= 0; slot = PollReadback(&islands->counterReadback))
+    {
+        islands->counters = *(const SleepCounters *)GetReadbackData(islands->counterReadback, slot);
+        ReleaseReadback(&islands->counterReadback, slot);
+    }
+
+    rlEnableShader(islands->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(idBuffer, 17);
+    rlBindShaderBuffer(lists.listBuffer, 20);
+    rlBindShaderBuffer(islands->sleepBuffer, 28);
+    rlBindShaderBuffer(islands->islandBuffer, 29);
+    rlBindShaderBuffer(islands->restBuffer, 30);
+    rlSetUniform(islands->sleepStepsLoc, &islands->sleepSteps, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(islands->sleepEnergyLoc, &islands->sleepEnergy, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(islands->boxSizeLoc, &boxSize, RL_SHADER_UNIFORM_FLOAT, 1);
+
+    // Init, union, flatten, sums, rest, decision: each stage reads what the previous wrote
+    for (int stage = 0; stage <= 5; stage++)
+    {
+        rlSetUniform(islands->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+        rlComputeShaderDispatch(NUM_BODIES/SLEEP_GROUP_SIZE, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    rlDisableShader();
+
+    islands->updates++;
+    if (!IsReadbackQueueFull(islands->counterReadback)) RequestReadback(&islands->counterReadback, islands->sleepBuffer, 0, sizeof(SleepCounters), islands->updates);
+}
+
+// Wake everything, rest counts start over, e.g. when sleeping is enabled again
+void ResetSleepIslands(SleepIslands *islands)
+{
+    unsigned int *zeros = (unsigned int *)RL_CALLOC(NUM_BODIES, sizeof(unsigned int));
+
+    rlUpdateShaderBuffer(islands->restBuffer, zeros, NUM_BODIES*sizeof(unsigned int), 0);
+
+    RL_FREE(zeros);
+
+    islands->counters = (SleepCounters){ 0 };
+}
+
+// Bind sleep state (binding 28) to the enabled integrator program, gravity then comes from
+// the sources and sleeping bodies rest. Also read by SolveContacts(), see ContactSolver.sleeping
+void BindSleepIslands(SleepIslands islands, bool enabled)
+{
+    int sleeping = enabled? 1 : 0;
+
+    rlSetUniform(islands.enabledLoc, &sleeping, RL_SHADER_UNIFORM_INT, 1);
+    rlBindShaderBuffer(islands.sleepBuffer, 28);
+}
+
+#endif // NBODY_SLEEP_IMPLEMENTATION
@@ -0,0 +1,186 @@
+/**********************************************************************************************
+*
+*   nbody.stats - On-GPU reduction of global body statistics
+*
+*   Reduces the body buffer into center of mass, AABB, total linear and angular momentum,
+*   kinetic and potential energy and max speed with a two stage compute reduction (per workgroup
+*   partials, then a single workgroup). Results are copied into a readback queue of
+*   STATS_LATENCY slots and read in place once their fence has signaled, a frame or two
+*   later, so the CPU never waits on the GPU nor loops over the bodies.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_STATS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   SHADER BINDINGS:
+*       0 - nbody nbodies[]                     (input)
+*       8 - float potentials[]                  (input, written by nbody.comp)
+*       9 - BodyStats partials[STATS_GROUPS]
+*      10 - BodyStats result
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached compute program
+*       nbody_readback.h    Fenced readback of the results
+*
+**********************************************************************************************/
+
+#ifndef NBODY_STATS_H
+#define NBODY_STATS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+// IMPORTANT: These must match the defines in stats_reduce.comp
+#define STATS_GROUP_SIZE        128
+#define STATS_GROUPS            32
+
+#define STATS_LATENCY           2           // Results in flight
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Body statistics, std430 layout
+// NOTE: matches the structure defined in stats_reduce.comp
+typedef struct BodyStats {
+    float centerOfMass[4];      // xyz: center of mass, w: total mass
+    float boundsMin[4];         // xyz: AABB min
+    float boundsMax[4];         // xyz: AABB max
+    float momentum[4];          // xyz: total linear momentum, w: max speed
+    float energy[4];            // x: kinetic, y: potential, z: total
+    float angularMomentum[4];   // xyz: total angular momentum about the center of mass
+} BodyStats;
+
+// Statistics reduction data
+typedef struct StatsReduction {
+    unsigned int program;
+    unsigned int partialBuffer;                     // SSBO: BodyStats[STATS_GROUPS]
+    unsigned int resultBuffer;                      // SSBO: BodyStats, copied into a readback slot
+    ReadbackQueue readback;                         // STATS_LATENCY slots, tagged with the step
+    bool withPotential[READBACK_MAX_SLOTS];         // Potentials were computed for the step of a slot
+    int stageLoc;
+
+    BodyStats stats;            // Latest available statistics, potential energy may be stale
+    bool ready;                 // At least one result was read back
+
+    BodyStats diagnostics;      // Latest available statistics with valid potential energy
+    long long diagnosticsStep;  // Simulation step of diagnostics
+    bool diagnosticsUpdated;    // diagnostics changed during the last update
+} StatsReduction;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+StatsReduction LoadStatsReduction(void);                    // Load reduction program and buffers
+void UnloadStatsReduction(StatsReduction reduction);        // Unload reduction program and buffers
+bool UpdateStatsReduction(StatsReduction *reduction, unsigned int bodyBuffer, unsigned int potentialBuffer, long long step, bool withPotential); // Reduce bodies, collect finished results
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_STATS_H
+
+
+/***********************************************************************************
+*
+*   NBODY STATS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_STATS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load reduction program and buffers
+StatsReduction LoadStatsReduction(void)
+{
+    StatsReduction reduction = { 0 };
+
+    reduction.program = LoadComputeProgramCached("resources/shaders/glsl430/stats_reduce.comp", NULL);
+
+    reduction.stageLoc = rlGetLocationUniform(reduction.program, "stage");
+
+    reduction.partialBuffer = rlLoadShaderBuffer(STATS_GROUPS*sizeof(BodyStats), NULL, RL_DYNAMIC_COPY);
+    reduction.resultBuffer = rlLoadShaderBuffer(sizeof(BodyStats), NULL, RL_DYNAMIC_COPY);
+    reduction.readback = LoadReadbackQueue(STATS_LATENCY, sizeof(BodyStats));
+
+    return reduction;
+}
+
+// Unload reduction program and buffers
+void UnloadStatsReduction(StatsReduction reduction)
+{
+    UnloadReadbackQueue(reduction.readback);
+    rlUnloadShaderBuffer(reduction.resultBuffer);
+    rlUnloadShaderBuffer(reduction.partialBuffer);
+    rlUnloadShaderProgram(reduction.program);
+}
+
+// Reduce bodies into the next result buffer, collect finished results
+// NOTE: reduction->stats is updated with the newest result the GPU already finished,
+// withPotential tells whether potentialBuffer was written for this step
+// NOTE: Returns false when no readback slot was free, bodies were not reduced
+bool UpdateStatsReduction(StatsReduction *reduction, unsigned int bodyBuffer, unsigned int potentialBuffer, long long step, bool withPotential)
+{
+    reduction->diagnosticsUpdated = false;
+
+    // Collect finished results, oldest first
+    for (int slot = PollReadback(&reduction->readback); slot >= 0; slot = PollReadback(&reduction->readback))
+    {
+        reduction->stats = *(const BodyStats *)GetReadbackData(reduction->readback, slot);
+        reduction->ready = true;
+
+        if (reduction->withPotential[slot])
+        {
+            reduction->diagnostics = reduction->stats;
+            reduction->diagnosticsStep = reduction->readback.tags[slot];
+            reduction->diagnosticsUpdated = true;
+        }
+
+        ReleaseReadback(&reduction->readback, slot);
+    }
+
+    // All results still in flight, skip this frame rather than wait
+    if (IsReadbackQueueFull(reduction->readback)) return false;
+
+    int stage = 0;
+
+    rlEnableShader(reduction->program);
+    rlBindShaderBuffer(bodyBuffer, 0);
+    rlBindShaderBuffer(potentialBuffer, 8);
+    rlBindShaderBuffer(reduction->partialBuffer, 9);
+    rlBindShaderBuffer(reduction->resultBuffer, 10);
+
+    rlSetUniform(reduction->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(STATS_GROUPS, 1, 1);
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    stage = 1;
+    rlSetUniform(reduction->stageLoc, &stage, RL_SHADER_UNIFORM_INT, 1);
+    rlComputeShaderDispatch(1, 1, 1);
+    rlDisableShader();
+
+    // Copied after the reduction, the result buffer can be reused by the next update
+    int slot = RequestReadback(&reduction->readback, reduction->resultBuffer, 0, sizeof(BodyStats), step);
+    reduction->withPotential[slot] = withPotential;
+
+    return true;
+}
+
+#endif // NBODY_STATS_IMPLEMENTATION
@@ -0,0 +1,537 @@
+/**********************************************************************************************
+*
+*   nbody.tasks - Work-stealing task scheduler
+*
+*   A fixed pool of worker threads, each one owning a Chase-Lev deque of tasks. Workers push
+*   and pop spawned tasks at the bottom of their own deque (newest first, cache friendly) and,
+*   once it is empty, steal the oldest task at the top of a random victim deque, which tends
+*   to be the largest piece of work left. Irregular workloads such as tree walks through
+*   clumped bodies balance themselves without any static partitioning.
+*
+*   Tasks are fork-join: a task spawns children into a TaskGroup, then waits for the group.
+*   A waiting worker keeps executing other tasks meanwhile, it never blocks.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_TASKS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       C11 atomics, pthreads (not available on Windows, tasks run inline there)
+*
+*   NOTE: The thread calling RunTaskPool() is worker 0 for the duration of the run.
+*   Every spawned task must belong to a group that some task waits for, RunTaskPool()
+*   returns once the root task returned.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_TASKS_H
+#define NBODY_TASKS_H
+
+#include <stdbool.h>        // Required for: bool
+#include <stdatomic.h>      // Required for: atomic_int
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define TASK_MAX_WORKERS        64          // Max threads of a pool, the calling thread included
+#define TASK_DEQUE_CAPACITY     4096        // Tasks per worker deque (power of two), spawning into a full deque runs inline
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Task function, data is owned by the spawner and must outlive the task
+typedef void (*TaskFunc)(void *data);
+
+// Range task function of ParallelFor(), processes [begin, end)
+typedef void (*TaskRangeFunc)(void *data, int begin, int end);
+
+// Spawned tasks not finished yet
+typedef struct TaskGroup {
+    atomic_int pending;
+} TaskGroup;
+
+// Worker statistics of the last RunTaskPool()
+typedef struct TaskWorkerStats {
+    long long tasks;            // Tasks executed
+    long long steals;           // Tasks stolen from other workers
+    long long failedSteals;     // Steal attempts finding an empty deque or losing a race
+    double busyTime;            // Seconds executing tasks
+    double idleTime;            // Seconds looking for work
+} TaskWorkerStats;
+
+typedef struct TaskPool TaskPool;   // Opaque, see implementation
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+TaskPool *LoadTaskPool(int workerCount);                                    // Start workerCount - 1 threads, hardware threads if workerCount <= 0
+void UnloadTaskPool(TaskPool *pool);                                        // Stop and join worker threads
+int GetTaskPoolWorkerCount(const TaskPool *pool);                           // Workers, the calling thread included
+TaskWorkerStats GetTaskWorkerStats(const TaskPool *pool, int worker);       // Statistics of the last run
+
+void RunTaskPool(TaskPool *pool, TaskFunc func, void *data);                // Run a root task on all workers, wait for it
+void SpawnTask(TaskPool *pool, TaskGroup *group, TaskFunc func, void *data);  // Spawn a task into group, from a task
+void WaitTaskGroup(TaskPool *pool, TaskGroup *group);                       // Execute tasks until group is done
+void ParallelFor(TaskPool *pool, int begin, int end, int grain, TaskRangeFunc func, void *data);  // Split [begin, end) in tasks of at most grain, from a task
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_TASKS_H
+
+
+/***********************************************************************************
+*
+*   NBODY TASKS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_TASKS_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+
+#if !defined(_WIN32)
+    #include <pthread.h>    // Required for: pthread_create(), pthread_cond_wait()
+    #include <sched.h>      // Required for: sched_yield()
+    #include <time.h>       // Required for: clock_gettime()
+    #include <unistd.h>     // Required for: sysconf()
+#endif
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Task taken from a deque
+typedef struct Task {
+    TaskFunc func;
+    void *data;
+    TaskGroup *group;
+} Task;
+
+// Deque slot, fields are atomic because thieves may read a slot the owner is reusing,
+// the steal is then discarded by the failed compare-exchange on top
+typedef struct TaskSlot {
+    _Atomic(TaskFunc) func;
+    _Atomic(void *) data;
+    _Atomic(TaskGroup *) group;
+} TaskSlot;
+
+// Chase-Lev work-stealing deque, owner works at the bottom, thieves at the top
+typedef struct TaskDeque {
+    atomic_llong top;
+    char padding[64];                   // Keep top and bottom on different cache lines
+    atomic_llong bottom;
+    TaskSlot slots[TASK_DEQUE_CAPACITY];
+} TaskDeque;
+
+typedef struct TaskWorker {
+    TaskPool *pool;
+    int index;
+    unsigned int random;                // Victim selection state
+    int depth;                          // Nested task executions, busy time counts the outer one
+    TaskDeque deque;
+    TaskWorkerStats stats;
+#if !defined(_WIN32)
+    pthread_t thread;
+#endif
+} TaskWorker;
+
+// Range split data of ParallelFor()
+typedef struct ParallelForRange {
+    TaskPool *pool;
+    int begin;
+    int end;
+    int grain;
+    TaskRangeFunc func;
+    void *data;
+} ParallelForRange;
+
+struct TaskPool {
+    int workerCount;
+    TaskWorker *workers;
+
+    atomic_int running;                 // A run is in progress, workers look for tasks
+    atomic_int activeWorkers;           // Threads still inside the current run
+#if !defined(_WIN32)
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+#endif
+    unsigned long long epoch;           // Run counter, protected by mutex
+    bool quit;
+};
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static _Thread_local TaskWorker *currentWorker = NULL;     // Worker running on this thread, NULL outside runs
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static bool PushTask(TaskDeque *deque, TaskFunc func, void *data, TaskGroup *group);
+static bool PopTask(TaskDeque *deque, Task *task);
+static bool StealTask(TaskDeque *deque, Task *task);
+static bool RunNextTask(TaskWorker *worker);               // Pop or steal one task and execute it
+static void ExecuteTask(TaskWorker *worker, TaskFunc func, void *data, TaskGroup *group);
+static void ParallelForTask(void *data);
+static double GetTaskTime(void);
+static void YieldWorker(void);                              // Let other threads run while no task is available
+#if !defined(_WIN32)
+static void *RunTaskWorker(void *data);                     // Worker thread main loop
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Start workerCount - 1 worker threads, the calling thread is worker 0 of every run
+TaskPool *LoadTaskPool(int workerCount)
+{
+#if defined(_WIN32)
+    workerCount = 1;
+#else
+    if (workerCount <= 0) workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (workerCount < 1) workerCount = 1;
+    if (workerCount > TASK_MAX_WORKERS) workerCount = TASK_MAX_WORKERS;
+
+    TaskPool *pool = (TaskPool *)calloc(1, sizeof(TaskPool));
+    pool->workers = (TaskWorker *)calloc(workerCount, sizeof(TaskWorker));
+    pool->workerCount = workerCount;
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].random = 0x9e3779b9u*(i + 1);
+    }
+
+#if !defined(_WIN32)
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int i = 1; i < workerCount; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, RunTaskWorker, &pool->workers[i]) != 0)
+        {
+            pool->workerCount = i;      // Run with the threads we got
+            break;
+        }
+    }
+#endif
+
+    return pool;
+}
+
+// Stop and join worker threads
+void UnloadTaskPool(TaskPool *pool)
+{
+    if (pool == NULL) return;
+
+#if !defined(_WIN32)
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 1; i < pool->workerCount; i++) pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+#endif
+
+    free(pool->workers);
+    free(pool);
+}
+
+// Workers, the calling thread included
+int GetTaskPoolWorkerCount(const TaskPool *pool)
+{
+    return pool->workerCount;
+}
+
+// Statistics of a worker during the last run
+TaskWorkerStats GetTaskWorkerStats(const TaskPool *pool, int worker)
+{
+    TaskWorkerStats stats = { 0 };
+
+    if ((worker >= 0) && (worker < pool->workerCount)) stats = pool->workers[worker].stats;
+
+    return stats;
+}
+
+// Run a root task on all workers and wait until it returned
+void RunTaskPool(TaskPool *pool, TaskFunc func, void *data)
+{
+    TaskWorker *worker = &pool->workers[0];
+
+    for (int i = 0; i < pool->workerCount; i++) pool->workers[i].stats = (TaskWorkerStats){ 0 };
+
+    atomic_store(&pool->activeWorkers, pool->workerCount - 1);
+    atomic_store(&pool->running, 1);
+
+#if !defined(_WIN32)
+    pthread_mutex_lock(&pool->mutex);
+    pool->epoch++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+#endif
+
+    double start = GetTaskTime();
+
+    currentWorker = worker;
+    ExecuteTask(worker, func, data, NULL);
+    currentWorker = NULL;
+
+    worker->stats.idleTime = (GetTaskTime() - start) - worker->stats.busyTime;
+
+    // Stats are only read once every thread left the run
+    atomic_store(&pool->running, 0);
+    while (atomic_load(&pool->activeWorkers) > 0) { }
+}
+
+// Spawn a task into group, it may run on any worker
+// NOTE: Outside of a run, or with a full deque, the task runs inline
+void SpawnTask(TaskPool *pool, TaskGroup *group, TaskFunc func, void *data)
+{
+    TaskWorker *worker = currentWorker;
+
+    atomic_fetch_add(&group->pending, 1);
+
+    if ((worker == NULL) || (worker->pool != pool) || !PushTask(&worker->deque, func, data, group))
+    {
+        if ((worker != NULL) && (worker->pool == pool)) ExecuteTask(worker, func, data, group);
+        else
+        {
+            func(data);
+            atomic_fetch_sub_explicit(&group->pending, 1, memory_order_release);
+        }
+    }
+}
+
+// Execute tasks until every task of group is done
+void WaitTaskGroup(TaskPool *pool, TaskGroup *group)
+{
+    TaskWorker *worker = currentWorker;
+
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) > 0)
+    {
+        if ((worker == NULL) || (worker->pool != pool) || !RunNextTask(worker)) YieldWorker();
+    }
+}
+
+// Split [begin, end) in halves down to grain, halves are spawned so idle workers steal large ones first
+void ParallelFor(TaskPool *pool, int begin, int end, int grain, TaskRangeFunc func, void *data)
+{
+    if (grain < 1) grain = 1;
+
+    ParallelForRange range = { pool, begin, end, grain, func, data };
+    ParallelForTask(&range);
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Push a task at the bottom of the owner deque, false if full
+static bool PushTask(TaskDeque *deque, TaskFunc func, void *data, TaskGroup *group)
+{
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if ((bottom - top) >= TASK_DEQUE_CAPACITY) return false;
+
+    TaskSlot *slot = &deque->slots[bottom & (TASK_DEQUE_CAPACITY - 1)];
+    atomic_store_explicit(&slot->func, func, memory_order_relaxed);
+    atomic_store_explicit(&slot->data, data, memory_order_relaxed);
+    atomic_store_explicit(&slot->group, group, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return true;
+}
+
+// Pop the newest task from the bottom of the owner deque
+static bool PopTask(TaskDeque *deque, Task *task)
+{
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom)
+    {
+        // Empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    TaskSlot *slot = &deque->slots[bottom & (TASK_DEQUE_CAPACITY - 1)];
+    task->func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+    task->data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+    task->group = atomic_load_explicit(&slot->group, memory_order_relaxed);
+
+    bool taken = true;
+
+    if (top == bottom)
+    {
+        // Last task, race against thieves for it
+        taken = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return taken;
+}
+
+// Steal the oldest task from the top of a victim deque
+static bool StealTask(TaskDeque *deque, Task *task)
+{
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) return false;
+
+    TaskSlot *slot = &deque->slots[top & (TASK_DEQUE_CAPACITY - 1)];
+    task->func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+    task->data = atomic_load_explicit(&slot->data, memory_order_relaxed);
+    task->group = atomic_load_explicit(&slot->group, memory_order_relaxed);
+
+    return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Pop a task from the own deque, or steal one from a random victim, and execute it
+static bool RunNextTask(TaskWorker *worker)
+{
+    TaskPool *pool = worker->pool;
+    Task task = { 0 };
+    bool found = PopTask(&worker->deque, &task);
+
+    for (int attempt = 0; !found && (attempt < pool->workerCount - 1); attempt++)
+    {
+        worker->random ^= worker->random << 13;
+        worker->random ^= worker->random >> 17;
+        worker->random ^= worker->random << 5;
+
+        int victim = (int)(worker->random%(pool->workerCount - 1));
+        if (victim >= worker->index) victim++;          // Never ourselves
+
+        found = StealTask(&pool->workers[victim].deque, &task);
+
+        if (found) worker->stats.steals++;
+        else worker->stats.failedSteals++;
+    }
+
+    if (found) ExecuteTask(worker, task.func, task.data, task.group);
+
+    return found;
+}
+
+// Execute a task on worker, then signal its group
+static void ExecuteTask(TaskWorker *worker, TaskFunc func, void *data, TaskGroup *group)
+{
+    double start = (worker->depth == 0)? GetTaskTime() : 0.0;
+
+    worker->depth++;
+    func(data);
+    worker->depth--;
+
+    worker->stats.tasks++;
+    if (worker->depth == 0) worker->stats.busyTime += GetTaskTime() - start;
+
+    if (group != NULL) atomic_fetch_sub_explicit(&group->pending, 1, memory_order_release);
+}
+
+// Range task of ParallelFor(), spawns the upper half and keeps splitting the lower one
+static void ParallelForTask(void *data)
+{
+    ParallelForRange *range = (ParallelForRange *)data;
+
+    if ((range->end - range->begin) <= range->grain)
+    {
+        range->func(range->data, range->begin, range->end);
+        return;
+    }
+
+    int middle = range->begin + (range->end - range->begin)/2;
+
+    ParallelForRange upper = *range;
+    upper.begin = middle;
+
+    ParallelForRange lower = *range;
+    lower.end = middle;
+
+    TaskGroup group = { 0 };
+    SpawnTask(range->pool, &group, ParallelForTask, &upper);
+    ParallelForTask(&lower);
+    WaitTaskGroup(range->pool, &group);
+}
+
+// Monotonic time in seconds
+static double GetTaskTime(void)
+{
+#if defined(_WIN32)
+    return 0.0;
+#else
+    struct timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec*1e-9;
+#endif
+}
+
+// Let other threads run while no task is available
+static void YieldWorker(void)
+{
+#if !defined(_WIN32)
+    sched_yield();
+#endif
+}
+
+#if !defined(_WIN32)
+// Worker thread main loop, sleeps between runs
+static void *RunTaskWorker(void *data)
+{
+    TaskWorker *worker = (TaskWorker *)data;
+    TaskPool *pool = worker->pool;
+    unsigned long long seenEpoch = 0;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while ((pool->epoch == seenEpoch) && !pool->quit) pthread_cond_wait(&pool->wake, &pool->mutex);
+        seenEpoch = pool->epoch;
+        bool quit = pool->quit;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (quit) break;
+
+        double start = GetTaskTime();
+
+        currentWorker = worker;
+        while (atomic_load(&pool->running))
+        {
+            if (!RunNextTask(worker)) YieldWorker();
+        }
+        currentWorker = NULL;
+
+        worker->stats.idleTime = (GetTaskTime() - start) - worker->stats.busyTime;
+
+        atomic_fetch_sub(&pool->activeWorkers, 1);
+    }
+
+    return NULL;
+}
+#endif
+
+#endif // NBODY_TASKS_IMPLEMENTATION
@@ -0,0 +1,158 @@
+/**********************************************************************************************
+*
+*   nbody.timer - GPU time measurement with non-blocking timer queries
+*
+*   Wraps GL_TIME_ELAPSED queries in a small ring so results are read back
+*   GPU_TIMER_LATENCY frames later, once available, instead of stalling the pipeline.
+*   When all queries are still in flight, the frame is not timed rather than waited for.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_TIMER_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   NOTE: GL_TIME_ELAPSED queries can not be nested, only one timer may be running at once
+*
+**********************************************************************************************/
+
+#ifndef NBODY_TIMER_H
+#define NBODY_TIMER_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define GPU_TIMER_LATENCY       4           // Queries in flight per timer
+#define GPU_TIMER_SMOOTHING     0.1         // Exponential moving average factor
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// GPU timer data
+typedef struct GpuTimer {
+    unsigned int queries[GPU_TIMER_LATENCY];
+    bool pending[GPU_TIMER_LATENCY];    // Query issued, result not yet collected
+    int current;                        // Next query to use
+    bool running;                       // Query begun this frame, false when the frame is skipped
+    long long skipped;                  // Frames not timed, every query was in flight
+    double lastMs;                      // Last collected time in milliseconds
+    double averageMs;                   // Smoothed time in milliseconds
+} GpuTimer;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+GpuTimer LoadGpuTimer(void);                    // Load timer queries
+void UnloadGpuTimer(GpuTimer timer);            // Unload timer queries
+void BeginGpuTimer(GpuTimer *timer);            // Start timing GPU commands
+void EndGpuTimer(GpuTimer *timer);              // Stop timing GPU commands, collect finished results
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_TIMER_H
+
+
+/***********************************************************************************
+*
+*   NBODY TIMER IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_TIMER_IMPLEMENTATION)
+
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glGenQueries(), glBeginQuery(), glGetQueryObjectui64v()
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static bool CollectGpuTimerQuery(GpuTimer *timer, int index);  // Collect one query result, false while not available
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load timer queries
+GpuTimer LoadGpuTimer(void)
+{
+    GpuTimer timer = { 0 };
+
+    glGenQueries(GPU_TIMER_LATENCY, timer.queries);
+
+    return timer;
+}
+
+// Unload timer queries
+void UnloadGpuTimer(GpuTimer timer)
+{
+    glDeleteQueries(GPU_TIMER_LATENCY, timer.queries);
+}
+
+// Start timing GPU commands
+void BeginGpuTimer(GpuTimer *timer)
+{
+    // Flush batched draws so they are not accounted in this timer
+    rlDrawRenderBatchActive();
+
+    // Oldest query still in flight: skip this frame rather than wait for it
+    timer->running = !timer->pending[timer->current] || CollectGpuTimerQuery(timer, timer->current);
+
+    if (timer->running) glBeginQuery(GL_TIME_ELAPSED, timer->queries[timer->current]);
+    else timer->skipped++;
+}
+
+// Stop timing GPU commands, collect finished results
+void EndGpuTimer(GpuTimer *timer)
+{
+    rlDrawRenderBatchActive();
+
+    if (timer->running)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+
+        timer->pending[timer->current] = true;
+        timer->current = (timer->current + 1)%GPU_TIMER_LATENCY;
+        timer->running = false;
+    }
+
+    // Collect every result that is already available, oldest first
+    for (int i = 0; i < GPU_TIMER_LATENCY; i++)
+    {
+        int index = (timer->current + i)%GPU_TIMER_LATENCY;
+        if (!timer->pending[index]) continue;
+        if (!CollectGpuTimerQuery(timer, index)) break;
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Collect the result of a pending query into the averages, never waits
+static bool CollectGpuTimerQuery(GpuTimer *timer, int index)
+{
+    GLuint available = 0;
+    glGetQueryObjectuiv(timer->queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return false;
+
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(timer->queries[index], GL_QUERY_RESULT, &elapsed);
+    timer->pending[index] = false;
+
+    timer->lastMs = (double)elapsed/1000000.0;
+    if (timer->averageMs == 0.0) timer->averageMs = timer->lastMs;
+    else timer->averageMs += (timer->lastMs - timer->averageMs)*GPU_TIMER_SMOOTHING;
+
+    return true;
+}
+
+#endif // NBODY_TIMER_IMPLEMENTATION
@@ -0,0 +1,206 @@
+/**********************************************************************************************
+*
+*   nbody.trails - Body motion trails kept in a GPU history ring
+*
+*   Every TRAIL_STEP_INTERVAL steps the integrator (nbody.comp) writes the new position of
+*   each traced body into the next slot of a per body ring of TRAIL_LENGTH points. Trails
+*   are drawn as instanced line segments, one instance per traced body, the vertex shader walks
+*   the ring backwards from its head and fades the oldest points out. Nothing is ever shifted,
+*   copied or read back to the CPU. In a periodic box, a point recorded after the body wrapped
+*   across a face has w = 0 and the segment before it is dropped, it would cross the box.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_TRAILS_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   #define TRAIL_LENGTH / TRAIL_STEP_INTERVAL / TRAIL_BODY_STRIDE
+*       May be defined before including this file to override the defaults below.
+*       History memory is (NUM_BODIES/TRAIL_BODY_STRIDE)*TRAIL_LENGTH*16 bytes.
+*
+*   SHADER BINDINGS:
+*      11 - vec4 trailPoints[]                  (written and read by nbody.comp, read by trails.vs)
+*
+*   DEPENDENCIES:
+*       nbody_shadercache.h Cached trail shader
+*
+**********************************************************************************************/
+
+#ifndef NBODY_TRAILS_H
+#define NBODY_TRAILS_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#ifndef TRAIL_LENGTH
+    #define TRAIL_LENGTH            32          // History points per traced body
+#endif
+#ifndef TRAIL_STEP_INTERVAL
+    #define TRAIL_STEP_INTERVAL     4           // Simulation steps between two history points
+#endif
+#ifndef TRAIL_BODY_STRIDE
+    #define TRAIL_BODY_STRIDE       1           // One body out of TRAIL_BODY_STRIDE is traced
+#endif
+
+#define MAX_TRAILS                  (NUM_BODIES/TRAIL_BODY_STRIDE)
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Body trails data
+typedef struct BodyTrails {
+    unsigned int historyBuffer;     // SSBO: vec4[MAX_TRAILS*TRAIL_LENGTH]
+    unsigned int vao;               // Empty vertex array, points are fetched from the SSBO
+    Shader shader;                  // Trail line segments shader
+
+    int head;                       // Ring slot of the newest point
+    int count;                      // Points written so far, up to TRAIL_LENGTH
+    int step;                       // Simulation steps since the last point
+
+    int slotLoc;                    // Integrator uniform locations
+    int lengthLoc;
+    int strideLoc;
+    int headLoc;                    // Trail shader uniform locations
+    int countLoc;
+} BodyTrails;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+BodyTrails LoadBodyTrails(unsigned int integratorProgram);             // Load history ring and trail shader
+void UnloadBodyTrails(BodyTrails trails);                               // Unload history ring and trail shader
+void ResetBodyTrails(BodyTrails *trails);                               // Forget recorded history
+void BindBodyTrails(BodyTrails *trails, bool record);                   // Bind history ring to the enabled integrator program, advance it
+void DrawBodyTrails(BodyTrails trails, Color color);                    // Draw trails, must be called inside BeginMode3D()
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_TRAILS_H
+
+
+/***********************************************************************************
+*
+*   NBODY TRAILS IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_TRAILS_IMPLEMENTATION)
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"        // Required for: MatrixMultiply()
+
+#include "external/glad.h"  // Required for: glDrawArraysInstanced()
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Load history ring and trail shader
+// NOTE: integratorProgram is the compute program writing the history points
+BodyTrails LoadBodyTrails(unsigned int integratorProgram)
+{
+    BodyTrails trails = { 0 };
+
+    trails.historyBuffer = rlLoadShaderBuffer(MAX_TRAILS*TRAIL_LENGTH*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    trails.vao = rlLoadVertexArray();
+
+    trails.shader = LoadShaderCached("resources/shaders/glsl430/trails.vs", "resources/shaders/glsl430/trails.fs", NULL);
+    trails.shader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(trails.shader, "mvp");
+    trails.headLoc = GetShaderLocation(trails.shader, "trailHead");
+    trails.countLoc = GetShaderLocation(trails.shader, "trailCount");
+
+    int length = TRAIL_LENGTH;
+    SetShaderValue(trails.shader, GetShaderLocation(trails.shader, "trailLength"), &length, SHADER_UNIFORM_INT);
+
+    trails.slotLoc = rlGetLocationUniform(integratorProgram, "trailSlot");
+    trails.lengthLoc = rlGetLocationUniform(integratorProgram, "trailLength");
+    trails.strideLoc = rlGetLocationUniform(integratorProgram, "trailStride");
+
+    return trails;
+}
+
+// Unload history ring and trail shader
+void UnloadBodyTrails(BodyTrails trails)
+{
+    UnloadShader(trails.shader);
+    rlUnloadVertexArray(trails.vao);
+    rlUnloadShaderBuffer(trails.historyBuffer);
+}
+
+// Forget recorded history, trails restart from the current positions
+void ResetBodyTrails(BodyTrails *trails)
+{
+    trails->head = 0;
+    trails->count = 0;
+    trails->step = 0;
+}
+
+// Bind history ring to the enabled integrator program and advance it by one step
+// NOTE: A point is recorded every TRAIL_STEP_INTERVAL steps, only if record is true
+void BindBodyTrails(BodyTrails *trails, bool record)
+{
+    int slot = -1;
+
+    if (record && (trails->step == 0))
+    {
+        slot = (trails->count == 0)? 0 : (trails->head + 1)%TRAIL_LENGTH;
+        trails->head = slot;
+        if (trails->count < TRAIL_LENGTH) trails->count++;
+    }
+
+    if (record) trails->step = (trails->step + 1)%TRAIL_STEP_INTERVAL;
+
+    int length = TRAIL_LENGTH;
+    int stride = TRAIL_BODY_STRIDE;
+
+    rlBindShaderBuffer(trails->historyBuffer, 11);
+    rlSetUniform(trails->slotLoc, &slot, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(trails->lengthLoc, &length, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(trails->strideLoc, &stride, RL_SHADER_UNIFORM_INT, 1);
+}
+
+// Draw trails as one line segments instance per traced body
+// NOTE: History writes must be made visible first, see GL_SHADER_STORAGE_BARRIER_BIT
+void DrawBodyTrails(BodyTrails trails, Color color)
+{
+    if (trails.count < 2) return;
+
+    // Flush batched draws, trails use their own draw call
+    rlDrawRenderBatchActive();
+
+    Matrix matMVP = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+    float colDiffuse[4] = { color.r/255.0f, color.g/255.0f, color.b/255.0f, color.a/255.0f };
+
+    // Blended over the scene, trails do not occlude each other
+    rlEnableDepthTest();
+    rlDisableDepthMask();
+    rlEnableColorBlend();
+    rlSetBlendMode(BLEND_ALPHA);
+
+    rlEnableShader(trails.shader.id);
+        rlSetUniformMatrix(trails.shader.locs[SHADER_LOC_MATRIX_MVP], matMVP);
+        rlSetUniform(trails.shader.locs[SHADER_LOC_COLOR_DIFFUSE], colDiffuse, RL_SHADER_UNIFORM_VEC4, 1);
+        rlSetUniform(trails.headLoc, &trails.head, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(trails.countLoc, &trails.count, RL_SHADER_UNIFORM_INT, 1);
+
+        rlBindShaderBuffer(trails.historyBuffer, 11);
+
+        rlEnableVertexArray(trails.vao);
+        glDrawArraysInstanced(GL_LINES, 0, 2*(trails.count - 1), MAX_TRAILS);
+        rlDisableVertexArray();
+    rlDisableShader();
+
+    rlEnableDepthMask();
+}
+
+#endif // NBODY_TRAILS_IMPLEMENTATION
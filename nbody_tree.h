@@ -0,0 +1,456 @@
+/**********************************************************************************************
+*
+*   nbody.tree - Barnes-Hut octree integrator on the work-stealing task pool
+*
+*   Every step the bodies are sorted into an octree, nodes split while they hold more than
+*   leafSize bodies. Each node keeps its center of mass and mass (monopole moment),
+*   computed bottom-up once its children are built. Each body then walks the tree from the
+*   root: a node seen under an angle below theta (size/distance) acts as a single point
+*   mass, otherwise it is opened; leaves are applied body by body, contacts included.
+*
+*   All three phases run on a TaskPool (nbody_tasks.h): large nodes build their children as
+*   tasks, moments are combined when the child tasks joined, and the walk is a ParallelFor
+*   over bodies in tree order. Walks through clumps cost far more than through empty space,
+*   idle workers steal the remaining ranges instead of waiting on a static partition.
+*
+*   CONFIGURATION:
+*
+*   #define NBODY_TREE_IMPLEMENTATION
+*       Generates the implementation of the library into the included file.
+*       If not defined, the library is in header only mode and can be included in other headers
+*       or source files without problems. But only ONE file should hold the implementation.
+*
+*   DEPENDENCIES:
+*       nbody_cpu.h         Body type, pair interaction and integration
+*       nbody_tasks.h       Work-stealing task pool
+*
+*   StepBodiesTreeLet() integrates only the first bodies of the tree: the others are remote
+*   bodies, sources only, and extra point masses are applied to every integrated body. This is
+*   the walk over a locally essential tree of the ORB mode of nbody_ring.h.
+*
+*   NOTE: Nodes are only accepted as point masses when none of their bodies can be in contact
+*   with the walking body, contacts are resolved exactly, gravity is approximated.
+*
+**********************************************************************************************/
+
+#ifndef NBODY_TREE_H
+#define NBODY_TREE_H
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define TREE_LEAF_SIZE          8           // Max bodies of a leaf
+#define TREE_MAX_DEPTH          32          // Nodes deeper than this stay leaves (coincident bodies)
+#define TREE_TASK_BODIES        1024        // Nodes with more bodies build their children as tasks
+#define TREE_WALK_GRAIN         32          // Bodies per force walk task
+#define TREE_DEFAULT_THETA      0.5f        // Opening angle, 0 opens every node (exact all pairs)
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Octree node
+typedef struct TreeNode {
+    float center[3];            // Cube center
+    float halfSize;             // Cube half size
+    float centerOfMass[3];
+    float mass;                 // Bodies in the node, all bodies have the same mass
+    int first;                  // First body in BodyTree.order
+    int count;                  // Bodies in the node
+    int firstChild;             // First child node, children are contiguous, -1 for leaves
+    int childCount;
+} TreeNode;
+
+// Barnes-Hut tree data
+typedef struct BodyTree {
+    int capacity;               // Max bodies
+    int nodeCapacity;           // Max nodes, deeper nodes stay leaves once reached
+    TreeNode *nodes;
+    atomic_int nodeCount;
+    int *order;                 // Body indices, each node covers a contiguous range
+    int *scratch;               // Octant partition buffer
+    int leafSize;               // Max bodies of a leaf, TREE_LEAF_SIZE by default
+    float theta;                // Opening angle
+} BodyTree;
+
+#ifdef __cplusplus
+extern "C" {            // Prevents name mangling of functions
+#endif
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+BodyTree LoadBodyTree(int capacity, float theta);                           // Allocate tree for up to capacity bodies
+void UnloadBodyTree(BodyTree tree);                                         // Free tree
+void BuildBodyTree(BodyTree *tree, TaskPool *pool, const Body *bodies, int count);       // Build tree and moments only
+void StepBodiesTree(BodyTree *tree, TaskPool *pool, const Body *bodies, Body *result, int count);  // Build tree and integrate one step
+void StepBodiesTreeLet(BodyTree *tree, TaskPool *pool, const Body *bodies, Body *result, int count, int remoteCount, const float *masses, int massCount);  // Integrate count bodies, with remote bodies and point masses as sources
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NBODY_TREE_H
+
+
+/***********************************************************************************
+*
+*   NBODY TREE IMPLEMENTATION
+*
+************************************************************************************/
+
+#if defined(NBODY_TREE_IMPLEMENTATION)
+
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: memcpy()
+#include <math.h>           // Required for: sqrtf(), fabsf(), fminf(), fmaxf()
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// One tree step, shared by all tasks
+typedef struct TreeStep {
+    BodyTree *tree;
+    TaskPool *pool;
+    const Body *bodies;
+    Body *result;
+    int count;                  // Bodies of the tree
+    int integrated;             // Bodies [0, integrated) are integrated, the others are sources only
+    const float *masses;        // Point masses applied to every integrated body, xyz and mass
+    int massCount;
+} TreeStep;
+
+// Node build task data
+typedef struct TreeBuild {
+    TreeStep *step;
+    int node;
+    int depth;
+} TreeBuild;
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Declaration
+//----------------------------------------------------------------------------------
+static void StepTreeTask(void *data);                               // Root task: build, walk
+static void BuildTreeTask(void *data);                              // Root task: bounds, build
+static void BuildTreeNode(void *data);                              // Split a node, build children, combine moments
+static void WalkTreeRange(void *data, int begin, int end);          // Integrate bodies [begin, end) of the tree order
+static void ApplyPointMass(Body *body, const float *position, float mass);  // Gravity of a node as a point mass
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Allocate tree for up to capacity bodies
+BodyTree LoadBodyTree(int capacity, float theta)
+{
+    BodyTree tree = { 0 };
+
+    tree.capacity = capacity;
+    tree.nodeCapacity = 4*capacity + 64;
+    tree.nodes = (TreeNode *)calloc(tree.nodeCapacity, sizeof(TreeNode));
+    tree.order = (int *)calloc(capacity, sizeof(int));
+    tree.scratch = (int *)calloc(capacity, sizeof(int));
+    tree.leafSize = TREE_LEAF_SIZE;
+    tree.theta = theta;
+
+    return tree;
+}
+
+// Free tree
+void UnloadBodyTree(BodyTree tree)
+{
+    free(tree.nodes);
+    free(tree.order);
+    free(tree.scratch);
+}
+
+// Build the tree of bodies and its moments, without integrating
+// NOTE: Node 0 is the root, bodies of a node are order[first, first + count)
+void BuildBodyTree(BodyTree *tree, TaskPool *pool, const Body *bodies, int count)
+{
+    if (count > tree->capacity) count = tree->capacity;
+
+    TreeStep step = { tree, pool, bodies, NULL, count, 0, NULL, 0 };
+    RunTaskPool(pool, BuildTreeTask, &step);
+}
+
+// Build the tree of bodies and integrate one step into result
+// NOTE: Per worker steal and idle statistics of the step are available from the pool,
+// see GetTaskWorkerStats()
+void StepBodiesTree(BodyTree *tree, TaskPool *pool, const Body *bodies, Body *result, int count)
+{
+    if (count > tree->capacity) count = tree->capacity;
+
+    TreeStep step = { tree, pool, bodies, result, count, count, NULL, 0 };
+    RunTaskPool(pool, StepTreeTask, &step);
+}
+
+// Build the tree of count bodies and remoteCount more bodies after them, integrate the count
+// first ones into result[0, count), with massCount point masses (xyz, mass) added to each
+// NOTE: Remote bodies and point masses must not overlap, see the LET export of nbody_ring.h
+void StepBodiesTreeLet(BodyTree *tree, TaskPool *pool, const Body *bodies, Body *result, int count, int remoteCount, const float *masses, int massCount)
+{
+    int total = count + remoteCount;
+    if (total > tree->capacity) total = tree->capacity;
+    if (count > total) count = total;
+
+    TreeStep step = { tree, pool, bodies, result, total, count, masses, massCount };
+    RunTaskPool(pool, StepTreeTask, &step);
+}
+
+//----------------------------------------------------------------------------------
+// Module specific Functions Definition
+//----------------------------------------------------------------------------------
+
+// Root task of a step: parallel build with moments, parallel walk
+static void StepTreeTask(void *data)
+{
+    TreeStep *step = (TreeStep *)data;
+
+    if (step->count == 0) return;
+
+    BuildTreeTask(step);
+    ParallelFor(step->pool, 0, step->count, TREE_WALK_GRAIN, WalkTreeRange, step);
+}
+
+// Root task of a build: bounds, parallel build with moments
+static void BuildTreeTask(void *data)
+{
+    TreeStep *step = (TreeStep *)data;
+    BodyTree *tree = step->tree;
+    const Body *bodies = step->bodies;
+
+    if (step->count == 0) return;
+
+    // Root cube around all bodies
+    float boundsMin[3] = { bodies[0].px, bodies[0].py, bodies[0].pz };
+    float boundsMax[3] = { bodies[0].px, bodies[0].py, bodies[0].pz };
+
+    for (int i = 0; i < step->count; i++)
+    {
+        float p[3] = { bodies[i].px, bodies[i].py, bodies[i].pz };
+
+        for (int k = 0; k < 3; k++)
+        {
+            boundsMin[k] = fminf(boundsMin[k], p[k]);
+            boundsMax[k] = fmaxf(boundsMax[k], p[k]);
+        }
+
+        tree->order[i] = i;
+    }
+
+    TreeNode *root = &tree->nodes[0];
+    *root = (TreeNode){ 0 };
+
+    float halfSize = 0.0f;
+    for (int k = 0; k < 3; k++)
+    {
+        root->center[k] = (boundsMin[k] + boundsMax[k])*0.5f;
+        halfSize = fmaxf(halfSize, (boundsMax[k] - boundsMin[k])*0.5f);
+    }
+
+    root->halfSize = halfSize*1.001f + 1e-3f;     // Bodies on the max faces stay inside
+    root->first = 0;
+    root->count = step->count;
+
+    atomic_store(&tree->nodeCount, 1);
+
+    TreeBuild build = { step, 0, 0 };
+    BuildTreeNode(&build);
+}
+
+// Split a node into its non-empty octants, build them (as tasks for large ones), then
+// combine their moments
+static void BuildTreeNode(void *data)
+{
+    TreeBuild *build = (TreeBuild *)data;
+    BodyTree *tree = build->step->tree;
+    const Body *bodies = build->step->bodies;
+    TreeNode *node = &tree->nodes[build->node];
+
+    node->firstChild = -1;
+    node->childCount = 0;
+
+    int childCount = 0;
+    int counts[8] = { 0 };
+
+    if ((node->count > tree->leafSize) && (build->depth < TREE_MAX_DEPTH))
+    {
+        for (int i = node->first; i < (node->first + node->count); i++)
+        {
+            const Body *body = &bodies[tree->order[i]];
+            int octant = ((body->px > node->center[0])? 1 : 0) | ((body->py > node->center[1])? 2 : 0) | ((body->pz > node->center[2])? 4 : 0);
+            counts[octant]++;
+        }
+
+        for (int k = 0; k < 8; k++) if (counts[k] > 0) childCount++;
+
+        int firstChild = atomic_fetch_add(&tree->nodeCount, childCount);
+
+        // Out of nodes, stay a leaf: slower walk, same result
+        if ((firstChild + childCount) > tree->nodeCapacity) childCount = 0;
+        else node->firstChild = firstChild;
+    }
+
+    if (childCount == 0)
+    {
+        // Leaf moments
+        float sum[3] = { 0 };
+
+        for (int i = node->first; i < (node->first + node->count); i++)
+        {
+            const Body *body = &bodies[tree->order[i]];
+            sum[0] += body->px;
+            sum[1] += body->py;
+            sum[2] += body->pz;
+        }
+
+        node->mass = (float)node->count;
+        for (int k = 0; k < 3; k++) node->centerOfMass[k] = sum[k]/node->mass;
+
+        return;
+    }
+
+    // Counting sort of the node range by octant
+    int offsets[8] = { 0 };
+    for (int k = 1; k < 8; k++) offsets[k] = offsets[k - 1] + counts[k - 1];
+
+    for (int i = node->first; i < (node->first + node->count); i++)
+    {
+        const Body *body = &bodies[tree->order[i]];
+        int octant = ((body->px > node->center[0])? 1 : 0) | ((body->py > node->center[1])? 2 : 0) | ((body->pz > node->center[2])? 4 : 0);
+        tree->scratch[node->first + offsets[octant]++] = tree->order[i];
+    }
+
+    memcpy(tree->order + node->first, tree->scratch + node->first, node->count*sizeof(int));
+
+    // Children, in octant order
+    TreeBuild builds[8] = { 0 };
+    TaskGroup group = { 0 };
+    int child = 0;
+    int first = node->first;
+
+    for (int k = 0; k < 8; k++)
+    {
+        if (counts[k] == 0) continue;
+
+        TreeNode *childNode = &tree->nodes[node->firstChild + child];
+        *childNode = (TreeNode){ 0 };
+
+        float quarter = node->halfSize*0.5f;
+        childNode->center[0] = node->center[0] + ((k & 1)? quarter : -quarter);
+        childNode->center[1] = node->center[1] + ((k & 2)? quarter : -quarter);
+        childNode->center[2] = node->center[2] + ((k & 4)? quarter : -quarter);
+        childNode->halfSize = quarter;
+        childNode->first = first;
+        childNode->count = counts[k];
+
+        builds[child] = (TreeBuild){ build->step, node->firstChild + child, build->depth + 1 };
+
+        if (counts[k] > TREE_TASK_BODIES) SpawnTask(build->step->pool, &group, BuildTreeNode, &builds[child]);
+        else BuildTreeNode(&builds[child]);
+
+        first += counts[k];
+        child++;
+    }
+
+    node->childCount = childCount;
+
+    WaitTaskGroup(build->step->pool, &group);
+
+    // Moments from the children
+    float sum[3] = { 0 };
+    float mass = 0.0f;
+
+    for (int c = 0; c < childCount; c++)
+    {
+        const TreeNode *childNode = &tree->nodes[node->firstChild + c];
+
+        for (int k = 0; k < 3; k++) sum[k] += childNode->centerOfMass[k]*childNode->mass;
+        mass += childNode->mass;
+    }
+
+    node->mass = mass;
+    for (int k = 0; k < 3; k++) node->centerOfMass[k] = sum[k]/mass;
+}
+
+// Integrate bodies [begin, end) of the tree order, neighbours in the order walk the same nodes
+static void WalkTreeRange(void *data, int begin, int end)
+{
+    TreeStep *step = (TreeStep *)data;
+    const BodyTree *tree = step->tree;
+    const Body *bodies = step->bodies;
+
+    // Children are pushed, at most 8 per level
+    int stack[8*TREE_MAX_DEPTH + 8];
+    float potential = 0.0f;     // Not reported
+
+    for (int k = begin; k < end; k++)
+    {
+        int index = tree->order[k];
+        if (index >= step->integrated) continue;
+
+        Body newBody = bodies[index];
+
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            const TreeNode *node = &tree->nodes[stack[--stackSize]];
+
+            if (node->firstChild < 0)
+            {
+                for (int i = node->first; i < (node->first + node->count); i++)
+                {
+                    if (tree->order[i] != index) ApplyBodyPair(&newBody, &potential, &bodies[tree->order[i]]);
+                }
+
+                continue;
+            }
+
+            float dx = newBody.px - node->centerOfMass[0];
+            float dy = newBody.py - node->centerOfMass[1];
+            float dz = newBody.pz - node->centerOfMass[2];
+            float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+
+            // Far enough for the angle criterion, outside the cube and out of contact reach
+            // of any body in it (the center of mass is inside the cube, at most a diagonal away)
+            bool inside = (fabsf(newBody.px - node->center[0]) <= node->halfSize) &&
+                          (fabsf(newBody.py - node->center[1]) <= node->halfSize) &&
+                          (fabsf(newBody.pz - node->center[2]) <= node->halfSize);
+
+            if (!inside && ((2.0f*node->halfSize) < (tree->theta*dist)) && ((dist - 3.4642f*node->halfSize) > (2.0f*BODY_RADIUS)))
+            {
+                ApplyPointMass(&newBody, node->centerOfMass, node->mass);
+            }
+            else
+            {
+                for (int c = node->childCount - 1; c >= 0; c--) stack[stackSize++] = node->firstChild + c;
+            }
+        }
+
+        // Remote subtrees accepted for every integrated body
+        for (int m = 0; m < step->massCount; m++) ApplyPointMass(&newBody, &step->masses[4*m], step->masses[4*m + 3]);
+
+        IntegrateBodies(&newBody, 1);
+        step->result[index] = newBody;
+    }
+}
+
+// Gravity of a node as a point mass at its center of mass
+static void ApplyPointMass(Body *body, const float *position, float mass)
+{
+    float dx = body->px - position[0];
+    float dy = body->py - position[1];
+    float dz = body->pz - position[2];
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+    float scale = mass/(dist*dist*dist);
+
+    body->vx -= dx*scale;
+    body->vy -= dy*scale;
+    body->vz -= dz*scale;
+}
+
+#endif // NBODY_TREE_IMPLEMENTATION
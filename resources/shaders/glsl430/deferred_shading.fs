@@ -0,0 +1,155 @@
+#version 430
+
+// Lighting pass: runs once per covered pixel, whatever the overdraw of the geometry pass
+// NOTE: Shading must match lighting.fs
+
+in vec2 texCoord;
+
+// G-buffer
+uniform sampler2D gNormal;
+uniform sampler2D gAlbedo;
+uniform sampler2D gDepth;
+
+// Output fragment color
+out vec4 finalColor;
+
+#define     MAX_LIGHTS              4
+#define     LIGHT_DIRECTIONAL       0
+#define     LIGHT_POINT             1
+
+struct Light {
+    int enabled;
+    int type;
+    vec3 position;
+    vec3 target;
+    vec4 color;
+};
+
+// Input lighting values
+uniform Light lights[MAX_LIGHTS];
+uniform vec4 ambient;
+uniform vec3 viewPos;
+uniform mat4 invViewProj;
+
+// Clustered point lights
+// IMPORTANT: These must match nbody_lights.h
+#define     CLUSTER_X               16
+#define     CLUSTER_Y               9
+#define     CLUSTER_Z               24
+
+struct PointLight {
+    vec4 position;      // xyz: world position, w: radius of influence
+    vec4 color;         // rgb: color, a: intensity
+};
+
+layout(std430, binding = 3) readonly restrict buffer pointLightLayout {
+    PointLight pointLights[];
+};
+
+layout(std430, binding = 4) readonly restrict buffer clusterGridLayout {
+    uvec2 clusterGrid[];        // x: offset into clusterIndices, y: light count
+};
+
+layout(std430, binding = 5) readonly restrict buffer clusterIndexLayout {
+    uint clusterIndexCount;
+    uint clusterIndices[];
+};
+
+uniform mat4 matView;
+uniform vec2 screenSize;
+uniform vec2 clusterDepth;      // x: near, y: far of the exponential depth slices
+uniform int pointLightsEnabled;
+
+// Cluster containing the current fragment
+uint clusterIndex(vec3 worldPos)
+{
+    float viewDepth = -(matView*vec4(worldPos, 1.0)).z;
+    float slice = log(max(viewDepth, clusterDepth.x)/clusterDepth.x)/log(clusterDepth.y/clusterDepth.x)*float(CLUSTER_Z);
+
+    uvec3 cluster = uvec3(
+        clamp(uint(gl_FragCoord.x/screenSize.x*float(CLUSTER_X)), 0u, uint(CLUSTER_X - 1)),
+        clamp(uint(gl_FragCoord.y/screenSize.y*float(CLUSTER_Y)), 0u, uint(CLUSTER_Y - 1)),
+        clamp(uint(slice), 0u, uint(CLUSTER_Z - 1)));
+
+    return cluster.x + CLUSTER_X*(cluster.y + CLUSTER_Y*cluster.z);
+}
+
+void main()
+{
+    float depth = texture(gDepth, texCoord).r;
+    if (depth >= 1.0) discard;      // Background
+
+    vec4 texelColor = texture(gAlbedo, texCoord);
+    vec3 normal = texture(gNormal, texCoord).rgb;
+
+    // World position from depth
+    vec4 worldPos = invViewProj*vec4(texCoord*2.0 - 1.0, depth*2.0 - 1.0, 1.0);
+    vec3 fragPosition = worldPos.xyz/worldPos.w;
+
+    vec3 lightDot = vec3(0.0);
+    vec3 viewD = normalize(viewPos - fragPosition);
+    vec3 specular = vec3(0.0);
+
+    for (int i = 0; i < MAX_LIGHTS; i++)
+    {
+        if (lights[i].enabled == 1)
+        {
+            vec3 light = vec3(0.0);
+
+            if (lights[i].type == LIGHT_DIRECTIONAL)
+            {
+                light = -normalize(lights[i].target - lights[i].position);
+            }
+
+            if (lights[i].type == LIGHT_POINT)
+            {
+                light = normalize(lights[i].position - fragPosition);
+            }
+
+            float NdotL = max(dot(normal, light), 0.0);
+            lightDot += lights[i].color.rgb*NdotL;
+
+            float specCo = 0.0;
+            if (NdotL > 0.0) specCo = pow(max(0.0, dot(viewD, reflect(-(light), normal))), 16.0); // 16 refers to shine
+            specular += specCo;
+        }
+    }
+
+    // Only the point lights touching this fragment cluster are shaded
+    if (pointLightsEnabled == 1)
+    {
+        uvec2 cell = clusterGrid[clusterIndex(fragPosition)];
+
+        for (uint i = 0; i < cell.y; i++)
+        {
+            PointLight pointLight = pointLights[clusterIndices[cell.x + i]];
+
+            vec3 toLight = pointLight.position.xyz - fragPosition;
+            float dist = length(toLight);
+            if (dist >= pointLight.position.w) continue;
+
+            vec3 light = toLight/dist;
+
+            // Smooth window falling to zero at the radius of influence
+            float falloff = clamp(1.0 - pow(dist/pointLight.position.w, 4.0), 0.0, 1.0);
+            float attenuation = falloff*falloff*pointLight.color.a;
+
+            float NdotL = max(dot(normal, light), 0.0);
+            lightDot += pointLight.color.rgb*NdotL*attenuation;
+
+            float specCo = 0.0;
+            if (NdotL > 0.0) specCo = pow(max(0.0, dot(viewD, reflect(-(light), normal))), 16.0);
+            specular += specCo*attenuation;
+        }
+    }
+
+    // NOTE: colDiffuse is already applied to the albedo by gbuffer.fs
+    finalColor = (texelColor*((vec4(1.0) + vec4(specular, 1.0))*vec4(lightDot, 1.0)));
+    finalColor += texelColor*(ambient/10.0);
+
+    // Gamma correction
+    finalColor = pow(finalColor, vec4(1.0/2.2));
+
+    // Keep depth so later 3D draws are still occluded by bodies
+    gl_FragDepth = depth;
+}
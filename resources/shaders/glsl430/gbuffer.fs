@@ -0,0 +1,20 @@
+#version 430
+
+// Geometry pass: only normals and albedo are written, world position is
+// reconstructed from the depth attachment in deferred_shading.fs
+layout (location = 0) out vec3 gNormal;
+layout (location = 1) out vec4 gAlbedo;
+
+// Input vertex attributes (from vertex shader)
+in vec2 fragTexCoord;
+in vec3 fragNormal;
+
+// Input uniform values
+uniform sampler2D texture0;
+uniform vec4 colDiffuse;
+
+void main()
+{
+    gNormal = normalize(fragNormal);
+    gAlbedo = texture(texture0, fragTexCoord)*colDiffuse;
+}
@@ -0,0 +1,30 @@
+#version 430
+
+// Same as gbuffer_instancing.vs, instances fetched from the culled instance list
+
+// Input vertex attributes
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec3 vertexNormal;
+
+layout(std430, binding = 6) readonly restrict buffer visibleLayout {
+    vec4 visibleInstances[];        // xyz: position, w: radius
+};
+
+// Input uniform values
+uniform mat4 mvp;
+
+// Output vertex attributes (to fragment shader)
+out vec2 fragTexCoord;
+out vec3 fragNormal;
+
+void main()
+{
+    vec4 instance = visibleInstances[gl_InstanceID];
+
+    fragTexCoord = vertexTexCoord;
+    fragNormal = normalize(vertexNormal);
+
+    // Calculate final vertex position
+    gl_Position = mvp*vec4(instance.xyz + vertexPosition*instance.w, 1.0);
+}
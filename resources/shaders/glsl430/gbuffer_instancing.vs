@@ -0,0 +1,25 @@
+#version 430
+
+// Input vertex attributes
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec3 vertexNormal;
+
+in vec4 instancePosition;       // xyz: position, w: radius
+
+// Input uniform values
+uniform mat4 mvp;
+
+// Output vertex attributes (to fragment shader)
+out vec2 fragTexCoord;
+out vec3 fragNormal;
+
+void main()
+{
+    fragTexCoord = vertexTexCoord;
+    fragNormal = normalize(vertexNormal);
+
+    // Calculate final vertex position
+    // NOTE: Model matrix of the instance is a uniform scale and a translation
+    gl_Position = mvp*vec4(instancePosition.xyz + vertexPosition*instancePosition.w, 1.0);
+}
@@ -32,6 +32,49 @@ uniform Light lights[MAX_LIGHTS];
 uniform vec4 ambient;
 uniform vec3 viewPos;
 
+// Clustered point lights
+// IMPORTANT: These must match nbody_lights.h
+#define     CLUSTER_X               16
+#define     CLUSTER_Y               9
+#define     CLUSTER_Z               24
+
+struct PointLight {
+    vec4 position;      // xyz: world position, w: radius of influence
+    vec4 color;         // rgb: color, a: intensity
+};
+
+layout(std430, binding = 3) readonly restrict buffer pointLightLayout {
+    PointLight pointLights[];
+};
+
+layout(std430, binding = 4) readonly restrict buffer clusterGridLayout {
+    uvec2 clusterGrid[];        // x: offset into clusterIndices, y: light count
+};
+
+layout(std430, binding = 5) readonly restrict buffer clusterIndexLayout {
+    uint clusterIndexCount;
+    uint clusterIndices[];
+};
+
+uniform mat4 matView;
+uniform vec2 screenSize;
+uniform vec2 clusterDepth;      // x: near, y: far of the exponential depth slices
+uniform int pointLightsEnabled;
+
+// Cluster containing the current fragment
+uint clusterIndex(vec3 worldPos)
+{
+    float viewDepth = -(matView*vec4(worldPos, 1.0)).z;
+    float slice = log(max(viewDepth, clusterDepth.x)/clusterDepth.x)/log(clusterDepth.y/clusterDepth.x)*float(CLUSTER_Z);
+
+    uvec3 cluster = uvec3(
+        clamp(uint(gl_FragCoord.x/screenSize.x*float(CLUSTER_X)), 0u, uint(CLUSTER_X - 1)),
+        clamp(uint(gl_FragCoord.y/screenSize.y*float(CLUSTER_Y)), 0u, uint(CLUSTER_Y - 1)),
+        clamp(uint(slice), 0u, uint(CLUSTER_Z - 1)));
+
+    return cluster.x + CLUSTER_X*(cluster.y + CLUSTER_Y*cluster.z);
+}
+
 void main()
 {
     // Texel color fetching from texture sampler
@@ -68,6 +111,34 @@ void main()
         }
     }
 
+    // Only the point lights touching this fragment cluster are shaded
+    if (pointLightsEnabled == 1)
+    {
+        uvec2 cell = clusterGrid[clusterIndex(fragPosition)];
+
+        for (uint i = 0; i < cell.y; i++)
+        {
+            PointLight pointLight = pointLights[clusterIndices[cell.x + i]];
+
+            vec3 toLight = pointLight.position.xyz - fragPosition;
+            float dist = length(toLight);
+            if (dist >= pointLight.position.w) continue;
+
+            vec3 light = toLight/dist;
+
+            // Smooth window falling to zero at the radius of influence
+            float falloff = clamp(1.0 - pow(dist/pointLight.position.w, 4.0), 0.0, 1.0);
+            float attenuation = falloff*falloff*pointLight.color.a;
+
+            float NdotL = max(dot(normal, light), 0.0);
+            lightDot += pointLight.color.rgb*NdotL*attenuation;
+
+            float specCo = 0.0;
+            if (NdotL > 0.0) specCo = pow(max(0.0, dot(viewD, reflect(-(light), normal))), 16.0);
+            specular += specCo*attenuation;
+        }
+    }
+
     finalColor = (texelColor*((colDiffuse + vec4(specular, 1.0))*vec4(lightDot, 1.0)));
     finalColor += texelColor*(ambient/10.0)*colDiffuse;
 
@@ -0,0 +1,35 @@
+#version 430
+
+// Same as lighting_instancing.vs, instances fetched from the culled instance list
+
+// Input vertex attributes
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+in vec3 vertexNormal;
+
+layout(std430, binding = 6) readonly restrict buffer visibleLayout {
+    vec4 visibleInstances[];        // xyz: position, w: radius
+};
+
+// Input uniform values
+uniform mat4 mvp;
+
+// Output vertex attributes (to fragment shader)
+out vec3 fragPosition;
+out vec2 fragTexCoord;
+out vec4 fragColor;
+out vec3 fragNormal;
+
+void main()
+{
+    vec4 instance = visibleInstances[gl_InstanceID];
+    vec3 worldPosition = instance.xyz + vertexPosition*instance.w;
+
+    // Send vertex attributes to fragment shader
+    fragPosition = worldPosition;
+    fragTexCoord = vertexTexCoord;
+    fragNormal = normalize(vertexNormal);
+
+    // Calculate final vertex position
+    gl_Position = mvp*vec4(worldPosition, 1.0);
+}
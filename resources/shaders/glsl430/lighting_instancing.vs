@@ -6,7 +6,7 @@ in vec2 vertexTexCoord;
 in vec3 vertexNormal;
 //in vec4 vertexColor;      // Not required
 
-in mat4 instanceTransform;
+in vec4 instancePosition;       // xyz: position, w: radius
 
 // Input uniform values
 uniform mat4 mvp;
@@ -22,15 +22,16 @@ out vec3 fragNormal;
 
 void main()
 {
-    // Compute MVP for current instance
-    mat4 mvpi = mvp*instanceTransform;
+    // Model matrix of the instance is a uniform scale and a translation
+    vec3 worldPosition = instancePosition.xyz + vertexPosition*instancePosition.w;
 
     // Send vertex attributes to fragment shader
-    fragPosition = vec3(mvpi*vec4(vertexPosition, 1.0));
+    // NOTE: World space position, required by point lights
+    fragPosition = worldPosition;
     fragTexCoord = vertexTexCoord;
     //fragColor = vertexColor;
     fragNormal = normalize(vec3(matNormal*vec4(vertexNormal, 1.0)));
 
     // Calculate final vertex position
-    gl_Position = mvpi*vec4(vertexPosition, 1.0);
+    gl_Position = mvp*vec4(worldPosition, 1.0);
 }
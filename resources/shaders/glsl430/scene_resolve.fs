@@ -0,0 +1,20 @@
+#version 430
+
+// Copies an offscreen scene (color + depth texture) into the current framebuffer
+
+in vec2 texCoord;
+
+uniform sampler2D sceneColor;
+uniform sampler2D sceneDepth;
+
+// Output fragment color
+out vec4 finalColor;
+
+void main()
+{
+    float depth = texture(sceneDepth, texCoord).r;
+    if (depth >= 1.0) discard;      // Background
+
+    finalColor = texture(sceneColor, texCoord);
+    gl_FragDepth = depth;
+}
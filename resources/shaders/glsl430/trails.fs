@@ -0,0 +1,15 @@
+#version 430
+
+// Input vertex attributes (from vertex shader)
+in float fragFade;
+
+// Input uniform values
+uniform vec4 colDiffuse;
+
+// Output fragment color
+out vec4 finalColor;
+
+void main()
+{
+    finalColor = vec4(colDiffuse.rgb, colDiffuse.a*fragFade*fragFade);
+}
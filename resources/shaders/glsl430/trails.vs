@@ -0,0 +1,36 @@
+#version 430
+
+// Body trails: one line list instance per traced body, two vertices per history segment
+// NOTE: No vertex attributes, points are fetched from the history ring
+
+layout(std430, binding = 11) readonly restrict buffer trailLayout {
+    vec4 trailPoints[];         // TRAIL_LENGTH points per traced body, xyz: position, w: 0 breaks the trail before it
+};
+
+// Input uniform values
+uniform mat4 mvp;
+uniform int trailLength;        // Points per traced body
+uniform int trailHead;          // Ring slot of the newest point
+uniform int trailCount;         // Points written so far, up to trailLength
+
+// Output vertex attributes (to fragment shader)
+out float fragFade;
+
+void main()
+{
+    // Walk the ring backwards from its head, nothing is ever shifted. Segment n joins the
+    // point n steps back to the point n + 1 steps back
+    int segment = gl_VertexID/2;
+    int age = segment + gl_VertexID%2;
+    int newerSlot = (trailHead - segment + trailLength)%trailLength;
+    int slot = (trailHead - age + trailLength)%trailLength;
+    vec4 point = trailPoints[gl_InstanceID*trailLength + slot];
+
+    // Newest point opaque, oldest fully faded
+    fragFade = 1.0 - float(age)/float(max(trailCount - 1, 1));
+
+    // Broken before its newer point (the body wrapped across the periodic box): both ends
+    // beyond the far plane, the segment is clipped away
+    if (trailPoints[gl_InstanceID*trailLength + newerSlot].w == 0.0) gl_Position = vec4(0.0, 0.0, 2.0, 1.0);
+    else gl_Position = mvp*vec4(point.xyz, 1.0);
+}
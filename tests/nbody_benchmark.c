@@ -0,0 +1,282 @@
+/*******************************************************************************************
+*
+*   nbody benchmark - Direct sum, symmetric pairs, Barnes-Hut and FMM at equal force error
+*
+*   Builds a uniform cube of non-overlapping bodies at rest, so the velocity change of one
+*   step is the gravity alone, and measures the mean relative error of the CPU tree
+*   (nbody_tree.h) and FMM (nbody_fmm.h) velocity changes against the direct sum
+*   (nbody_cpu.h) over a sweep of opening angles and expansion orders. For each target error,
+*   prints the fastest configuration of every method reaching it. The symmetric direct sum
+*   (nbody_pairs.h) is timed against the gather loop, with one lane per worker, and the ring
+*   cluster (nbody_ring.h) with one rank per worker, at least two, in its direct ring pass and
+*   in its ORB tree mode at the default opening angle.
+*
+*   Usage:
+*       nbody_benchmark [bodies] [workers]          Defaults to 8192 bodies, 1 worker
+*
+*   NOTE: With the default single worker the timings compare algorithms, not parallelism;
+*   the FMM traversal is serial while the tree walk scales with the workers
+*
+*   NOTE: The ring cluster forks its ranks, it runs before the task pool starts its threads
+*
+********************************************************************************************/
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free(), atoi()
+#include <math.h>           // Required for: sqrt(), cbrtf()
+#include <stdbool.h>
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_TASKS_IMPLEMENTATION
+#include "nbody_tasks.h"
+
+#define NBODY_TREE_IMPLEMENTATION
+#include "nbody_tree.h"
+
+#define NBODY_FMM_IMPLEMENTATION
+#include "nbody_fmm.h"
+
+#define NBODY_PAIRS_IMPLEMENTATION
+#include "nbody_pairs.h"
+
+#define NBODY_RING_IMPLEMENTATION
+#include "nbody_ring.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define BENCHMARK_SPACING       6.0f        // Mean spacing of the bodies, in body radii
+#define BENCHMARK_REPEATS       3           // Timed steps, the fastest is kept
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// One measured configuration
+typedef struct Measure {
+    const char *method;
+    int order;                      // Expansion order, 0 for the tree monopole
+    float theta;
+    double error;                   // Mean relative velocity change error
+    double time;                    // Seconds per step
+} Measure;
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const float thetas[] = { 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f };
+static const int orders[] = { 2, 3, 4, 5, 6 };
+static const double targetErrors[] = { 1e-2, 1e-3, 1e-4 };
+
+static unsigned int randomState = 0x12345678;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static float RandomFloat(void);
+static double GetStepError(const Body *bodies, const Body *reference, const Body *result, int count);
+static void PrintBest(const char *method, const Measure *measures, int measureCount, double targetError, double directTime);
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+    int count = (argc > 1)? atoi(argv[1]) : 8192;
+    int workers = (argc > 2)? atoi(argv[2]) : 1;
+
+    if (count < 2) count = 2;
+
+    Body *bodies = (Body *)calloc(count, sizeof(Body));
+    Body *reference = (Body *)calloc(count, sizeof(Body));
+    Body *result = (Body *)calloc(count, sizeof(Body));
+
+    // Uniform cube, bodies at least 1.5 diameters apart so no pair is in contact
+    float side = cbrtf((float)count)*BENCHMARK_SPACING;
+
+    for (int i = 0; i < count; i++)
+    {
+        bool overlap = true;
+
+        while (overlap)
+        {
+            bodies[i] = (Body){ RandomFloat()*side, RandomFloat()*side, RandomFloat()*side, 0.0f, 0.0f, 0.0f };
+            overlap = false;
+
+            for (int j = 0; (j < i) && !overlap; j++)
+            {
+                float dx = bodies[i].px - bodies[j].px;
+                float dy = bodies[i].py - bodies[j].py;
+                float dz = bodies[i].pz - bodies[j].pz;
+                overlap = ((dx*dx + dy*dy + dz*dz) < (9.0f*BODY_RADIUS*BODY_RADIUS));
+            }
+        }
+    }
+
+    double start = GetTaskTime();
+    StepBodiesReference(bodies, reference, NULL, count);
+    double directTime = GetTaskTime() - start;
+
+    printf("%i bodies, direct sum %.3f ms\n", count, directTime*1000.0);
+
+    // Ring cluster, direct sum over ranks passing tiles then the tree on ORB domains, compute
+    // and wait times of the slowest rank
+    for (int mode = 0; mode < 2; mode++)
+    {
+        float theta = (mode == 0)? 0.0f : TREE_DEFAULT_THETA;
+        RingCluster ring = LoadRingCluster(bodies, count, (workers > 2)? workers : 2, theta);
+
+        if (ring.ready)
+        {
+            start = GetTaskTime();
+            bool stepped = StepRingCluster(&ring, 1) && GetRingClusterBodies(ring, result);
+            double ringTime = GetTaskTime() - start;
+
+            if (stepped) printf("%s %i ranks: error %.3e, %.3f ms (%.1fx direct), compute %.3f ms, wait %.3f ms\n", (mode == 0)? "ring" : "ring tree",
+                ring.ranks, GetStepError(bodies, reference, result, count), ringTime*1000.0, directTime/ringTime, ring.computeTime*1000.0, ring.waitTime*1000.0);
+        }
+
+        UnloadRingCluster(ring);
+    }
+
+    TaskPool *pool = LoadTaskPool(workers);
+
+    printf("%i workers\n", GetTaskPoolWorkerCount(pool));
+
+    // Symmetric direct sum, each pair once
+    PairSolver pairs = LoadPairSolver(count, GetTaskPoolWorkerCount(pool));
+    double pairsTime = 1e30;
+
+    for (int r = 0; r < BENCHMARK_REPEATS; r++)
+    {
+        start = GetTaskTime();
+        StepBodiesPairs(&pairs, pool, bodies, result, NULL, count);
+        pairsTime = fmin(pairsTime, GetTaskTime() - start);
+    }
+
+    printf("pairs %i lanes: error %.3e, %.3f ms (%.1fx direct), %lld pairs\n",
+        pairs.laneCount, GetStepError(bodies, reference, result, count), pairsTime*1000.0, directTime/pairsTime, pairs.pairCount);
+
+    UnloadPairSolver(pairs);
+
+    int thetaCount = (int)(sizeof(thetas)/sizeof(thetas[0]));
+    int orderCount = (int)(sizeof(orders)/sizeof(orders[0]));
+    Measure *treeMeasures = (Measure *)calloc(thetaCount, sizeof(Measure));
+    Measure *fmmMeasures = (Measure *)calloc(thetaCount*orderCount, sizeof(Measure));
+
+    // Barnes-Hut over the opening angles
+    for (int t = 0; t < thetaCount; t++)
+    {
+        BodyTree tree = LoadBodyTree(count, thetas[t]);
+        Measure *measure = &treeMeasures[t];
+
+        *measure = (Measure){ "tree", 0, thetas[t], 0.0, 1e30 };
+
+        for (int r = 0; r < BENCHMARK_REPEATS; r++)
+        {
+            start = GetTaskTime();
+            StepBodiesTree(&tree, pool, bodies, result, count);
+            measure->time = fmin(measure->time, GetTaskTime() - start);
+        }
+
+        measure->error = GetStepError(bodies, reference, result, count);
+        printf("tree theta %.2f: error %.3e, %.3f ms\n", measure->theta, measure->error, measure->time*1000.0);
+
+        UnloadBodyTree(tree);
+    }
+
+    // FMM over the opening angles and expansion orders
+    for (int o = 0; o < orderCount; o++)
+    {
+        for (int t = 0; t < thetaCount; t++)
+        {
+            FmmSolver fmm = LoadFmmSolver(count, orders[o], thetas[t]);
+            Measure *measure = &fmmMeasures[o*thetaCount + t];
+
+            *measure = (Measure){ "fmm", orders[o], thetas[t], 0.0, 1e30 };
+
+            for (int r = 0; r < BENCHMARK_REPEATS; r++)
+            {
+                start = GetTaskTime();
+                StepBodiesFmm(&fmm, pool, bodies, result, count);
+                measure->time = fmin(measure->time, GetTaskTime() - start);
+            }
+
+            measure->error = GetStepError(bodies, reference, result, count);
+            printf("fmm order %i theta %.2f: error %.3e, %.3f ms, %lld M2L, %lld P2P\n",
+                measure->order, measure->theta, measure->error, measure->time*1000.0, fmm.m2lCount, fmm.p2pCount);
+
+            UnloadFmmSolver(fmm);
+        }
+    }
+
+    printf("\nFastest configuration at equal force error:\n");
+
+    for (int e = 0; e < (int)(sizeof(targetErrors)/sizeof(targetErrors[0])); e++)
+    {
+        printf("error <= %.0e: direct %.3f ms\n", targetErrors[e], directTime*1000.0);
+        PrintBest("tree", treeMeasures, thetaCount, targetErrors[e], directTime);
+        PrintBest("fmm", fmmMeasures, thetaCount*orderCount, targetErrors[e], directTime);
+    }
+
+    free(treeMeasures);
+    free(fmmMeasures);
+    UnloadTaskPool(pool);
+    free(bodies);
+    free(reference);
+    free(result);
+
+    return 0;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Fixed-seed uniform random in [0, 1), xorshift32
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
+
+// Mean relative error of the velocity changes of one step
+// NOTE: Bodies start at rest, the velocity after a step is the damped velocity change
+static double GetStepError(const Body *bodies, const Body *reference, const Body *result, int count)
+{
+    double sum = 0.0;
+
+    for (int i = 0; i < count; i++)
+    {
+        double dx = result[i].vx - reference[i].vx;
+        double dy = result[i].vy - reference[i].vy;
+        double dz = result[i].vz - reference[i].vz;
+        double dv = (double)(reference[i].vx - bodies[i].vx)*(reference[i].vx - bodies[i].vx) +
+                    (double)(reference[i].vy - bodies[i].vy)*(reference[i].vy - bodies[i].vy) +
+                    (double)(reference[i].vz - bodies[i].vz)*(reference[i].vz - bodies[i].vz);
+
+        if (dv > 0.0) sum += sqrt((dx*dx + dy*dy + dz*dz)/dv);
+    }
+
+    return sum/count;
+}
+
+// Print the fastest measure of a method within the target error
+static void PrintBest(const char *method, const Measure *measures, int measureCount, double targetError, double directTime)
+{
+    const Measure *best = NULL;
+
+    for (int i = 0; i < measureCount; i++)
+    {
+        if ((measures[i].error <= targetError) && ((best == NULL) || (measures[i].time < best->time))) best = &measures[i];
+    }
+
+    if (best == NULL) printf("    %-4s not reached\n", method);
+    else printf("    %-4s order %i theta %.2f: error %.3e, %.3f ms (%.1fx direct)\n",
+        method, best->order, best->theta, best->error, best->time*1000.0, directTime/best->time);
+}
@@ -0,0 +1,313 @@
+/*******************************************************************************************
+*
+*   nbody gpu contacts - Clumps settled by the contact solver at long steps
+*
+*   Integrates a cold lattice of bodies with the contact solver of nbody_contacts.h, gravity
+*   collapses it into a clump that has to come to rest:
+*
+*       settle      Lattice settling at CONTACT_MAX_STEP_SCALE*DT with the default sweeps: mean
+*                   kinetic energy and deepest overlap under their bounds, no body thrown out
+*                   of the clump, total momentum kept
+*
+*   Usage:
+*       nbody_gpu_contacts <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt. The
+*   force loop runs over every slot, so the settle case takes a few minutes there
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp()
+#include <math.h>           // Required for: sqrtf(), fmaxf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+// IMPORTANT: Must match nbody.c
+#define TIME_STEP 0.008f
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+#define NBODY_NEIGHBOURS_IMPLEMENTATION
+#include "nbody_neighbours.h"
+
+#define NBODY_CONTACTS_IMPLEMENTATION
+#include "nbody_contacts.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define CONTACTS_LATTICE_SIDE   8           // Bodies along an edge of the lattice, the others are parked
+#define CONTACTS_SPACING        2.2f        // Lattice spacing, bodies start 0.2 apart
+#define CONTACTS_STEPS          120         // Steps of the settle case, the collapse is over after about 60
+#define CONTACTS_MEAN_ENERGY    0.25f       // Bound on the mean kinetic energy per body, a blown up clump has hundreds
+#define CONTACTS_MAX_OVERLAP    0.3f        // Bound on the deepest overlap, unconverged sweeps leave 0.4 and more
+#define CONTACTS_MAX_RADIUS     15.0f       // Bound on the distance of a body to the center, the clump settles within 10
+#define CONTACTS_MAX_MOMENTUM   1.0e-3f     // Bound on the total momentum per body
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct ContactCase {
+    const char *name;
+    bool (*run)(void);
+} ContactCase;
+
+// Clump measures of a state
+typedef struct ClumpState {
+    float maxEnergy;                // Largest kinetic energy of a body, center of mass frame
+    float meanEnergy;
+    float maxOverlap;               // Deepest overlap of a pair
+    float maxRadius;                // Largest distance of a body to the center of mass
+    float momentum;                 // Length of the total momentum per body
+} ClumpState;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunSettle(void);
+
+static int InitLattice(Body *bodies, int side, float spacing);     // Cubic lattice centered on the origin, the other slots parked
+static ClumpState GetClumpState(const Body *bodies, int count);
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const ContactCase cases[] = {
+    { "settle", RunSettle },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const ContactCase *contactCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) contactCase = &cases[i];
+    }
+
+    if (contactCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu contacts");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", contactCase->name);
+        return 1;
+    }
+
+    bool passed = contactCase->run();
+
+    printf("%s: %s\n", contactCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Cold lattice collapsing into a clump at the longest solver step, stepped like nbody.c steps
+// with the solver on: lists on the input, gravity and prediction, lists on the prediction, sweeps
+static bool RunSettle(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    int count = InitLattice(bodies, CONTACTS_LATTICE_SIDE, CONTACTS_SPACING);
+
+    unsigned int program = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", NULL);
+
+    unsigned int buffers[2] = {
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY),
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY)
+    };
+    unsigned int instances = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(NUM_BODIES*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int trailPoints = rlLoadShaderBuffer(4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    NeighbourLists lists = LoadNeighbourLists(program, NEIGHBOUR_SKIN);
+    ContactSolver solver = LoadContactSolver(program, 0, TIME_STEP*CONTACT_MAX_STEP_SCALE);
+
+    // No potentials, no trail points
+    int computePotential = 0;
+    int trailSlot = -1;
+    int trailStride = 1;
+
+    for (int step = 0; step < CONTACTS_STEPS; step++)
+    {
+        unsigned int input = buffers[step%2];
+        unsigned int output = buffers[(step + 1)%2];
+
+        UpdateNeighbourLists(&lists, input, 0.0f);
+
+        rlEnableShader(program);
+        rlBindShaderBuffer(input, 0);
+        rlBindShaderBuffer(output, 1);
+        rlBindShaderBuffer(instances, 2);
+        rlBindShaderBuffer(potentials, 8);
+        rlBindShaderBuffer(trailPoints, 11);
+        rlSetUniform(rlGetLocationUniform(program, "computePotential"), &computePotential, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailSlot"), &trailSlot, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailStride"), &trailStride, RL_SHADER_UNIFORM_INT, 1);
+        BindNeighbourLists(lists, true);
+        BindContactSolver(solver, true);
+        rlComputeShaderDispatch(16, 16, 16);
+        rlDisableShader();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        UpdateNeighbourLists(&lists, output, 0.0f);
+        SolveContacts(solver, input, output, instances, lists, 0.0f);
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(buffers[CONTACTS_STEPS%2], bodies, NUM_BODIES*sizeof(Body), 0);
+
+    ClumpState state = GetClumpState(bodies, count);
+
+    printf("settle: %i bodies, %i steps at %i*DT, %i sweeps: kinetic energy mean %g max %g, max overlap %g, max radius %g, momentum %g\n",
+        count, CONTACTS_STEPS, CONTACT_MAX_STEP_SCALE, solver.iterations, state.meanEnergy, state.maxEnergy, state.maxOverlap, state.maxRadius, state.momentum);
+
+    UnloadContactSolver(solver);
+    UnloadNeighbourLists(lists);
+    rlUnloadShaderBuffer(buffers[0]);
+    rlUnloadShaderBuffer(buffers[1]);
+    rlUnloadShaderBuffer(instances);
+    rlUnloadShaderBuffer(potentials);
+    rlUnloadShaderBuffer(trailPoints);
+    rlUnloadShaderProgram(program);
+    free(bodies);
+
+    return (state.meanEnergy < CONTACTS_MEAN_ENERGY) && (state.maxOverlap < CONTACTS_MAX_OVERLAP) &&
+        (state.maxRadius < CONTACTS_MAX_RADIUS) && (state.momentum < CONTACTS_MAX_MOMENTUM);
+}
+
+// Cubic lattice of side^3 bodies centered on the origin, jittered by a hundredth of a unit so
+// the collapse is not perfectly symmetric, the other slots parked
+static int InitLattice(Body *bodies, int side, float spacing)
+{
+    int count = side*side*side;
+    float offset = 0.5f*(float)(side - 1)*spacing;
+
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if (i >= count)
+        {
+            bodies[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+            continue;
+        }
+
+        bodies[i].px = (float)(i%side)*spacing - offset + 0.01f*(RandomFloat() - 0.5f);
+        bodies[i].py = (float)((i/side)%side)*spacing - offset + 0.01f*(RandomFloat() - 0.5f);
+        bodies[i].pz = (float)(i/(side*side))*spacing - offset + 0.01f*(RandomFloat() - 0.5f);
+        bodies[i].vx = 0.0f;
+        bodies[i].vy = 0.0f;
+        bodies[i].vz = 0.0f;
+    }
+
+    return count;
+}
+
+// Kinetic energies and radii in the center of mass frame, overlaps and momentum of the first
+// count bodies
+static ClumpState GetClumpState(const Body *bodies, int count)
+{
+    ClumpState state = { 0 };
+    double momentum[3] = { 0 };
+    double center[3] = { 0 };
+
+    for (int i = 0; i < count; i++)
+    {
+        momentum[0] += bodies[i].vx;
+        momentum[1] += bodies[i].vy;
+        momentum[2] += bodies[i].vz;
+        center[0] += bodies[i].px;
+        center[1] += bodies[i].py;
+        center[2] += bodies[i].pz;
+    }
+
+    float vx = (float)(momentum[0]/count);
+    float vy = (float)(momentum[1]/count);
+    float vz = (float)(momentum[2]/count);
+    state.momentum = sqrtf(vx*vx + vy*vy + vz*vz);
+
+    for (int i = 0; i < count; i++)
+    {
+        float dvx = bodies[i].vx - vx;
+        float dvy = bodies[i].vy - vy;
+        float dvz = bodies[i].vz - vz;
+        float energy = 0.5f*(dvx*dvx + dvy*dvy + dvz*dvz);
+
+        state.maxEnergy = fmaxf(state.maxEnergy, energy);
+        state.meanEnergy += energy/count;
+
+        float rx = bodies[i].px - (float)(center[0]/count);
+        float ry = bodies[i].py - (float)(center[1]/count);
+        float rz = bodies[i].pz - (float)(center[2]/count);
+        state.maxRadius = fmaxf(state.maxRadius, sqrtf(rx*rx + ry*ry + rz*rz));
+
+        for (int j = i + 1; j < count; j++)
+        {
+            float dx = bodies[j].px - bodies[i].px;
+            float dy = bodies[j].py - bodies[i].py;
+            float dz = bodies[j].pz - bodies[i].pz;
+
+            state.maxOverlap = fmaxf(state.maxOverlap, 2.0f - sqrtf(dx*dx + dy*dy + dz*dz));
+        }
+    }
+
+    return state;
+}
+
+// Fixed-seed uniform random in [0, 1), xorshift32
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
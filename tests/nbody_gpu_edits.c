@@ -0,0 +1,516 @@
+/*******************************************************************************************
+*
+*   nbody gpu edits - Body edit queue of nbody_edits.h checked on the GPU
+*
+*   Runs body_edit.comp over a cloud whose slots and stable ids are shuffled like after a
+*   reorder, against the expected bodies and free list:
+*
+*       spawn       Two spawn commands fill their balls at their velocities with the ids on top
+*                   of the free list, every other body is untouched
+*       delete      Bodies in two balls are parked at rest and their ids pushed on the free list,
+*                   a watched id is reported deleted through the counters readback, an id kept
+*                   is not
+*       impulse     Overlapping impulses and a velocity field applied in queue order, no body
+*                   moves and no slot changes
+*       underflow   Spawns past the free ids are dropped and the free count is restored to zero,
+*                   deletes of an apply free their ids for its spawns
+*
+*   Usage:
+*       nbody_gpu_edits <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier(), glFinish()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp(), memcmp()
+#include <math.h>           // Required for: fabsf(), fmaxf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_EDITS_IMPLEMENTATION
+#include "nbody_edits.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define EDITS_ID_STRIDE         1237        // Slot -> id shuffle, odd so it is a permutation
+#define EDITS_CLOUD_SIZE        40.0f       // Side of the cube of the live bodies, centered
+#define EDITS_READBACK_TRIES    64          // Empty applies collecting the counters readback
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct EditsCase {
+    const char *name;
+    bool (*run)(void);
+} EditsCase;
+
+// Bodies with ids below liveCount live in the cloud, the others are parked and free
+typedef struct EditScene {
+    int liveCount;
+    Body *bodies;                   // Initial bodies by slot
+    unsigned int *ids;              // Slot -> id
+    unsigned int *slots;            // Id -> slot
+
+    unsigned int bodyBuffer;
+    unsigned int idBuffer;
+    unsigned int slotBuffer;
+    BodyEditQueue queue;
+} EditScene;
+
+// GPU state after an apply
+typedef struct EditState {
+    Body *bodies;                   // By slot
+    BodyEditCounters counters;
+    unsigned int *freeIds;
+} EditState;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunSpawn(void);
+static bool RunDelete(void);
+static bool RunImpulse(void);
+static bool RunUnderflow(void);
+
+static EditScene LoadEditScene(int liveCount);          // Shuffled cloud and its edit queue
+static void UnloadEditScene(EditScene scene);
+static EditState ReadEditState(EditScene scene);        // Bodies, counters and free list
+static void UnloadEditState(EditState state);
+static bool CollectEditCounters(EditScene *scene);      // Empty applies until the counters readback is in
+static bool IsInBall(Body body, Vector3 center, float radius);
+static int CountLive(EditState state);
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const EditsCase cases[] = {
+    { "spawn", RunSpawn },
+    { "delete", RunDelete },
+    { "impulse", RunImpulse },
+    { "underflow", RunUnderflow },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const EditsCase *editsCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) editsCase = &cases[i];
+    }
+
+    if (editsCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu edits");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", editsCase->name);
+        return 1;
+    }
+
+    bool passed = editsCase->run();
+
+    printf("%s: %s\n", editsCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Two spawns in balls clear of the cloud, from a free list of 3072 ids
+static bool RunSpawn(void)
+{
+    EditScene scene = LoadEditScene(1024);
+
+    const Vector3 centers[2] = { { -30.0f, 0.0f, 0.0f }, { 30.0f, 5.0f, 0.0f } };
+    const float radii[2] = { 5.0f, 4.0f };
+    const int counts[2] = { 100, 50 };
+    const Vector3 velocities[2] = { { 1.0f, 2.0f, 3.0f }, { -1.0f, 0.0f, 0.5f } };
+
+    for (int i = 0; i < 2; i++) QueueBodySpawn(&scene.queue, centers[i], radii[i], counts[i], velocities[i]);
+    bool slotsChanged = ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+
+    EditState state = ReadEditState(scene);
+    int spawnedIn[2] = { 0 };
+    int errors = 0;
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        Body body = state.bodies[slot];
+        unsigned int id = scene.ids[slot];
+
+        // Ids are popped off the top of the free list, the last 150 of it
+        bool spawned = (id >= (unsigned int)(NUM_BODIES - counts[0] - counts[1]));
+
+        if (!spawned)
+        {
+            if (memcmp(&body, &scene.bodies[slot], sizeof(Body)) != 0) errors++;
+            continue;
+        }
+
+        int ball = -1;
+        for (int i = 0; i < 2; i++)
+        {
+            if (IsInBall(body, centers[i], radii[i]*1.0001f) && (body.vx == velocities[i].x) && (body.vy == velocities[i].y) && (body.vz == velocities[i].z)) ball = i;
+        }
+
+        if (ball < 0) errors++;
+        else spawnedIn[ball]++;
+    }
+
+    bool counted = CollectEditCounters(&scene);
+    unsigned int freeCount = (unsigned int)(NUM_BODIES - scene.liveCount - counts[0] - counts[1]);
+
+    printf("spawn: %i and %i bodies in the balls, %i errors, %u free, %u spawned, %u dropped\n", spawnedIn[0], spawnedIn[1], errors, state.counters.freeCount, state.counters.spawned, state.counters.dropped);
+
+    bool passed = slotsChanged && (errors == 0) && (spawnedIn[0] == counts[0]) && (spawnedIn[1] == counts[1]) &&
+        (state.counters.freeCount == freeCount) && (state.counters.spawned == 150) && (state.counters.deleted == 0) && (state.counters.dropped == 0) &&
+        counted && (scene.queue.counters.freeCount == freeCount) && (scene.queue.counters.spawned == 150);
+
+    UnloadEditState(state);
+    UnloadEditScene(scene);
+
+    return passed;
+}
+
+// Two deletes in the cloud while watching a body inside, then a delete while watching a body
+// outside every ball
+static bool RunDelete(void)
+{
+    EditScene scene = LoadEditScene(NUM_BODIES - 256);
+
+    const Vector3 centers[2] = { { 0.0f, 0.0f, 0.0f }, { 15.0f, 0.0f, 0.0f } };
+    const float radii[2] = { 8.0f, 3.0f };
+
+    // Expected deletes and the watched ids
+    bool *deleted = (bool *)calloc(NUM_BODIES, sizeof(bool));
+    int deleteCount = 0;
+    int watchedIn = -1;
+    int watchedOut = -1;
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        Body body = scene.bodies[slot];
+        if (body.px >= BODY_PARKED) continue;
+
+        deleted[slot] = IsInBall(body, centers[0], radii[0]) || IsInBall(body, centers[1], radii[1]);
+        if (deleted[slot]) deleteCount++;
+
+        if (deleted[slot] && (watchedIn < 0)) watchedIn = (int)scene.ids[slot];
+        if (!deleted[slot] && !IsInBall(body, (Vector3){ -15.0f, 0.0f, 0.0f }, 4.0f) && (watchedOut < 0)) watchedOut = (int)scene.ids[slot];
+    }
+
+    scene.queue.watchedId = watchedIn;
+    for (int i = 0; i < 2; i++) QueueBodyDelete(&scene.queue, centers[i], radii[i]);
+    bool slotsChanged = ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+
+    EditState state = ReadEditState(scene);
+    int errors = 0;
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        Body body = state.bodies[slot];
+
+        if (!deleted[slot]) { if (memcmp(&body, &scene.bodies[slot], sizeof(Body)) != 0) errors++; }
+        else if ((body.px != BODY_PARKED) || (body.py != 0.0f) || (body.pz != 0.0f) || (body.vx != 0.0f) || (body.vy != 0.0f) || (body.vz != 0.0f)) errors++;
+    }
+
+    // The ids freed at load stay below, the deleted ids are pushed on top in any order
+    for (int i = 0; i < 256; i++) if (state.freeIds[i] != (unsigned int)(NUM_BODIES - 256 + i)) errors++;
+    for (int i = 256; i < (int)state.counters.freeCount; i++)
+    {
+        unsigned int id = state.freeIds[i];
+        if ((id >= NUM_BODIES) || !deleted[scene.slots[id]]) errors++;
+        else deleted[scene.slots[id]] = false;        // Counted once
+    }
+
+    bool reported = CollectEditCounters(&scene) && scene.queue.watchedDeleted;
+
+    // A body kept by the next delete is not reported
+    scene.queue.watchedId = watchedOut;
+    scene.queue.watchedDeleted = false;
+    QueueBodyDelete(&scene.queue, (Vector3){ -15.0f, 0.0f, 0.0f }, 4.0f);
+    ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+    bool kept = CollectEditCounters(&scene) && !scene.queue.watchedDeleted;
+
+    printf("delete: %i bodies expected, %u deleted, %u free, %i errors, watched delete %s, kept body %s\n", deleteCount, state.counters.deleted, state.counters.freeCount,
+        errors, reported? "reported" : "MISSED", kept? "not reported" : "REPORTED");
+
+    bool passed = slotsChanged && (deleteCount > 0) && (errors == 0) && (state.counters.deleted == (unsigned int)deleteCount) &&
+        (state.counters.freeCount == (unsigned int)(256 + deleteCount)) && (watchedIn >= 0) && (watchedOut >= 0) && reported && kept;
+
+    free(deleted);
+    UnloadEditState(state);
+    UnloadEditScene(scene);
+
+    return passed;
+}
+
+// Impulses and a velocity field overlapping in the cloud, expected velocities applied on CPU in
+// queue order
+static bool RunImpulse(void)
+{
+    EditScene scene = LoadEditScene(NUM_BODIES);
+
+    const Vector3 centers[3] = { { 0.0f, 0.0f, 0.0f }, { 5.0f, 0.0f, 0.0f }, { -6.0f, 2.0f, 0.0f } };
+    const float radii[3] = { 10.0f, 10.0f, 6.0f };
+    const Vector3 impulses[2] = { { 0.0f, 5.0f, 0.0f }, { 1.0f, 0.0f, -2.0f } };
+    const Vector3 fieldVelocity = { 0.0f, 0.0f, 2.0f };
+    const float spin = 0.5f;
+
+    QueueBodyImpulse(&scene.queue, centers[0], radii[0], impulses[0]);
+    QueueBodyVelocityField(&scene.queue, centers[2], radii[2], fieldVelocity, spin);
+    QueueBodyImpulse(&scene.queue, centers[1], radii[1], impulses[1]);
+    bool slotsChanged = ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+
+    EditState state = ReadEditState(scene);
+    int touched = 0;
+    int errors = 0;
+    float maxError = 0.0f;
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        Body body = scene.bodies[slot];
+        Body expected = body;
+
+        if (IsInBall(body, centers[0], radii[0])) { expected.vx += impulses[0].x; expected.vy += impulses[0].y; expected.vz += impulses[0].z; }
+        if (IsInBall(body, centers[2], radii[2]))
+        {
+            // Rotation about +Y through the center: spin*cross(up, offset)
+            expected.vx = fieldVelocity.x + spin*(body.pz - centers[2].z);
+            expected.vy = fieldVelocity.y;
+            expected.vz = fieldVelocity.z - spin*(body.px - centers[2].x);
+        }
+        if (IsInBall(body, centers[1], radii[1])) { expected.vx += impulses[1].x; expected.vy += impulses[1].y; expected.vz += impulses[1].z; }
+
+        if ((expected.vx != body.vx) || (expected.vy != body.vy) || (expected.vz != body.vz)) touched++;
+
+        Body result = state.bodies[slot];
+        if ((result.px != body.px) || (result.py != body.py) || (result.pz != body.pz)) errors++;
+
+        float error = fmaxf(fabsf(result.vx - expected.vx), fmaxf(fabsf(result.vy - expected.vy), fabsf(result.vz - expected.vz)));
+        maxError = fmaxf(maxError, error);
+        if (error > 1e-6f*(1.0f + fabsf(expected.vx))) errors++;
+    }
+
+    printf("impulse: %i bodies touched, %i errors, max velocity error %g\n", touched, errors, maxError);
+
+    bool passed = !slotsChanged && (touched > 0) && (errors == 0) && (state.counters.freeCount == 0) && (state.counters.deleted == 0);
+
+    UnloadEditState(state);
+    UnloadEditScene(scene);
+
+    return passed;
+}
+
+// Free list of 10 ids: 100 spawns, then 5 with none left, then a delete of the spawned bodies
+// and 4 spawns in the same apply
+static bool RunUnderflow(void)
+{
+    EditScene scene = LoadEditScene(NUM_BODIES - 10);
+
+    const Vector3 spawnCenter = { 40.0f, 0.0f, 0.0f };
+    const Vector3 respawnCenter = { -40.0f, 0.0f, 0.0f };
+    const Vector3 rest = { 0.0f, 0.0f, 0.0f };
+
+    QueueBodySpawn(&scene.queue, spawnCenter, 5.0f, 100, rest);
+    ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+    EditState first = ReadEditState(scene);
+
+    QueueBodySpawn(&scene.queue, spawnCenter, 5.0f, 5, rest);
+    ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+    EditState second = ReadEditState(scene);
+
+    // Deletes push their ids before the spawns of the apply pop
+    QueueBodyDelete(&scene.queue, spawnCenter, 5.5f);
+    QueueBodySpawn(&scene.queue, respawnCenter, 3.0f, 4, rest);
+    ApplyBodyEdits(&scene.queue, scene.bodyBuffer, scene.idBuffer, scene.slotBuffer);
+    EditState third = ReadEditState(scene);
+
+    int respawned = 0;
+    for (int slot = 0; slot < NUM_BODIES; slot++) if (IsInBall(third.bodies[slot], respawnCenter, 3.0001f)) respawned++;
+
+    const EditState *states[3] = { &first, &second, &third };
+    const BodyEditCounters expected[3] = { { 0, 10, 0, 90 }, { 0, 10, 0, 95 }, { 6, 14, 10, 95 } };
+    const int live[3] = { NUM_BODIES, NUM_BODIES, NUM_BODIES - 6 };
+    bool passed = (respawned == 4);
+
+    for (int i = 0; i < 3; i++)
+    {
+        BodyEditCounters counters = states[i]->counters;
+
+        printf("underflow: apply %i, %u free, %u spawned, %u deleted, %u dropped, %i live\n", i + 1, counters.freeCount, counters.spawned, counters.deleted, counters.dropped, CountLive(*states[i]));
+
+        passed = passed && (counters.freeCount == expected[i].freeCount) && (counters.spawned == expected[i].spawned) &&
+            (counters.deleted == expected[i].deleted) && (counters.dropped == expected[i].dropped) && (CountLive(*states[i]) == live[i]);
+    }
+
+    UnloadEditState(first);
+    UnloadEditState(second);
+    UnloadEditState(third);
+    UnloadEditScene(scene);
+
+    return passed;
+}
+
+// Cloud of liveCount bodies with distinct velocities, slots shuffled against ids like after a
+// reorder, the parked ids on the free list in increasing order
+static EditScene LoadEditScene(int liveCount)
+{
+    EditScene scene = { 0 };
+
+    scene.liveCount = liveCount;
+    scene.bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    scene.ids = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    scene.slots = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        unsigned int id = (unsigned int)((slot*EDITS_ID_STRIDE)%NUM_BODIES);
+
+        scene.ids[slot] = id;
+        scene.slots[id] = (unsigned int)slot;
+
+        if (id >= (unsigned int)liveCount) scene.bodies[slot] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        else scene.bodies[slot] = (Body){ (RandomFloat() - 0.5f)*EDITS_CLOUD_SIZE, (RandomFloat() - 0.5f)*EDITS_CLOUD_SIZE, (RandomFloat() - 0.5f)*EDITS_CLOUD_SIZE, (float)id, RandomFloat(), RandomFloat() };
+    }
+
+    unsigned int *freeIds = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    for (int i = 0; i < (NUM_BODIES - liveCount); i++) freeIds[i] = (unsigned int)(liveCount + i);
+
+    scene.bodyBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), scene.bodies, RL_DYNAMIC_COPY);
+    scene.idBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), scene.ids, RL_DYNAMIC_COPY);
+    scene.slotBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), scene.slots, RL_DYNAMIC_COPY);
+    scene.queue = LoadBodyEditQueue(freeIds, NUM_BODIES - liveCount);
+
+    free(freeIds);
+
+    return scene;
+}
+
+// Unload scene buffers and data
+static void UnloadEditScene(EditScene scene)
+{
+    UnloadBodyEditQueue(scene.queue);
+    rlUnloadShaderBuffer(scene.bodyBuffer);
+    rlUnloadShaderBuffer(scene.idBuffer);
+    rlUnloadShaderBuffer(scene.slotBuffer);
+    free(scene.bodies);
+    free(scene.ids);
+    free(scene.slots);
+}
+
+// Read bodies, counters and free list straight from the buffers
+static EditState ReadEditState(EditScene scene)
+{
+    EditState state = { 0 };
+
+    state.bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    state.freeIds = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(scene.bodyBuffer, state.bodies, NUM_BODIES*sizeof(Body), 0);
+    rlReadShaderBuffer(scene.queue.freeBuffer, &state.counters, sizeof(BodyEditCounters), 0);
+    rlReadShaderBuffer(scene.queue.freeBuffer, state.freeIds, NUM_BODIES*sizeof(unsigned int), sizeof(BodyEditCounters));
+
+    return state;
+}
+
+// Unload state data
+static void UnloadEditState(EditState state)
+{
+    free(state.bodies);
+    free(state.freeIds);
+}
+
+// Empty applies until every counters readback in flight is collected, false when one never
+// signals
+static bool CollectEditCounters(EditScene *scene)
+{
+    glFinish();
+
+    for (int i = 0; i < EDITS_READBACK_TRIES; i++)
+    {
+        ApplyBodyEdits(&scene->queue, scene->bodyBuffer, scene->idBuffer, scene->slotBuffer);
+
+        bool pending = false;
+        for (int slot = 0; slot < scene->queue.counterReadback.slotCount; slot++) if (scene->queue.counterReadback.states[slot] != READBACK_FREE) pending = true;
+        if (!pending) return true;
+    }
+
+    return false;
+}
+
+// Check if a live body lies in a ball, same test as body_edit.comp
+static bool IsInBall(Body body, Vector3 center, float radius)
+{
+    if (body.px >= BODY_PARKED) return false;
+
+    float dx = body.px - center.x;
+    float dy = body.py - center.y;
+    float dz = body.pz - center.z;
+
+    return ((dx*dx + dy*dy + dz*dz) <= radius*radius);
+}
+
+// Count the bodies that are not parked
+static int CountLive(EditState state)
+{
+    int live = 0;
+    for (int slot = 0; slot < NUM_BODIES; slot++) if (state.bodies[slot].px < BODY_PARKED) live++;
+
+    return live;
+}
+
+// Fixed-seed xorshift32 uniform random in [0, 1)
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
@@ -0,0 +1,492 @@
+/*******************************************************************************************
+*
+*   nbody gpu lists - Neighbour lists walked through the BVH checked against the every-pair search
+*
+*   Builds the Verlet lists of nbody_neighbours.h twice over the same bodies, once testing
+*   every pair and once walking the BVH of nbody_bvh.h, and requires the same lists:
+*
+*       open        Dense clump, scattered bodies and parked slots, in open space
+*       periodic    Same bodies wrapped into a periodic box, pairs across the faces
+*       overflow    Clump too dense for NEIGHBOUR_CAPACITY, truncated lists keep their lowest
+*                   slots: of two lists of a body, the shorter is a prefix of the longer
+*       steps       Collapsing cloud integrated by nbody.comp with contacts from the lists,
+*                   both paths in lockstep: lists refitted, rebuilt on displacement, and the
+*                   integrated bodies must stay bit identical
+*
+*   Usage:
+*       nbody_gpu_lists <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp(), memcmp()
+#include <math.h>           // Required for: cbrtf(), floorf(), fminf(), fmaxf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+#define NBODY_NEIGHBOURS_IMPLEMENTATION
+#include "nbody_neighbours.h"
+
+#define NBODY_BVH_IMPLEMENTATION
+#include "nbody_bvh.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define LISTS_PARKED_STRIDE     16          // One slot out of LISTS_PARKED_STRIDE is free
+#define LISTS_OVERFLOW_BUILDS   8           // Builds of the overflow case, each truncates other bodies
+#define LISTS_STEPS             12          // Steps of the lockstep integration
+#define LISTS_LIST_SIZE         ((2*NUM_BODIES + NEIGHBOUR_CAPACITY)*sizeof(unsigned int))
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct ListCase {
+    const char *name;
+    bool (*run)(void);
+} ListCase;
+
+// Same lists built both ways
+typedef struct ListPair {
+    NeighbourLists lists[2];        // Every pair, then BVH
+    BodyBvh bvh;
+    unsigned int *data[2];          // Lists read back
+} ListPair;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunOpenSpace(void);
+static bool RunPeriodicBox(void);
+static bool RunOverflow(void);
+static bool RunLockstep(void);
+
+static void InitCloud(Body *bodies, float side, float scatter);     // Cube of bodies, one out of five scattered further, parked slots
+static void GetBodyBounds(const Body *bodies, float *boundsMin, float *boundsMax);
+static ListPair LoadListPair(unsigned int integratorProgram);
+static void UnloadListPair(ListPair pair);
+static void BuildListPair(ListPair *pair, unsigned int bodyBuffers[2], const float *boundsMin, const float *boundsMax, float boxSize, bool rebuild);
+static int CompareListPair(ListPair *pair, bool truncated, int *entries);     // Bodies whose lists differ
+static NeighbourState GetNeighbourState(NeighbourLists lists);
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const ListCase cases[] = {
+    { "open", RunOpenSpace },
+    { "periodic", RunPeriodicBox },
+    { "overflow", RunOverflow },
+    { "steps", RunLockstep },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const ListCase *listCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) listCase = &cases[i];
+    }
+
+    if (listCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu lists");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", listCase->name);
+        return 1;
+    }
+
+    bool passed = listCase->run();
+
+    printf("%s: %s\n", listCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Lists of a clump with scattered bodies and parked slots, in open space
+static bool RunOpenSpace(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    InitCloud(bodies, cbrtf((float)NUM_BODIES)*2.2f, 4.0f);
+
+    unsigned int buffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+    unsigned int bodyBuffers[2] = { buffer, buffer };
+    float boundsMin[3] = { 0 };
+    float boundsMax[3] = { 0 };
+    GetBodyBounds(bodies, boundsMin, boundsMax);
+
+    ListPair pair = LoadListPair(0);
+    int entries = 0;
+
+    BuildListPair(&pair, bodyBuffers, boundsMin, boundsMax, 0.0f, true);
+    int differences = CompareListPair(&pair, false, &entries);
+
+    printf("open: %i neighbour entries, %i bodies with different lists\n", entries, differences);
+
+    UnloadListPair(pair);
+    rlUnloadShaderBuffer(buffer);
+    free(bodies);
+
+    return (differences == 0) && (entries > 0);
+}
+
+// Lists of the same bodies wrapped into a periodic box, the BVH walks the images of the query
+static bool RunPeriodicBox(void)
+{
+    float side = cbrtf((float)NUM_BODIES)*2.2f;
+    float boxSize = 2.5f*side;
+
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    InitCloud(bodies, side, 4.0f);
+
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if (bodies[i].px >= BODY_PARKED) continue;
+
+        bodies[i].px -= boxSize*floorf(bodies[i].px/boxSize + 0.5f);
+        bodies[i].py -= boxSize*floorf(bodies[i].py/boxSize + 0.5f);
+        bodies[i].pz -= boxSize*floorf(bodies[i].pz/boxSize + 0.5f);
+    }
+
+    unsigned int buffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+    unsigned int bodyBuffers[2] = { buffer, buffer };
+    float boundsMin[3] = { 0 };
+    float boundsMax[3] = { 0 };
+    GetBodyBounds(bodies, boundsMin, boundsMax);
+
+    ListPair pair = LoadListPair(0);
+    int entries = 0;
+
+    BuildListPair(&pair, bodyBuffers, boundsMin, boundsMax, boxSize, true);
+    int differences = CompareListPair(&pair, false, &entries);
+
+    printf("periodic: box %g, %i neighbour entries, %i bodies with different lists\n", boxSize, entries, differences);
+
+    UnloadListPair(pair);
+    rlUnloadShaderBuffer(buffer);
+    free(bodies);
+
+    return (differences == 0) && (entries > 0);
+}
+
+// Truncated lists of a clump far denser than the list capacity
+// NOTE: Ranges are reserved in arrival order, so which bodies get truncated changes between
+// builds, only the kept slots of every body are compared. Only the body whose range straddles
+// the capacity keeps part of its list, so the case builds several times
+static bool RunOverflow(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    InitCloud(bodies, 12.0f, 1.0f);
+
+    unsigned int buffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+    unsigned int bodyBuffers[2] = { buffer, buffer };
+    float boundsMin[3] = { 0 };
+    float boundsMax[3] = { 0 };
+    GetBodyBounds(bodies, boundsMin, boundsMax);
+
+    ListPair pair = LoadListPair(0);
+    NeighbourState states[2] = { 0 };
+    int entries = 0;
+    int differences = 0;
+
+    for (int build = 0; build < LISTS_OVERFLOW_BUILDS; build++)
+    {
+        BuildListPair(&pair, bodyBuffers, boundsMin, boundsMax, 0.0f, true);
+        differences += CompareListPair(&pair, true, &entries);
+
+        states[0] = GetNeighbourState(pair.lists[0]);
+        states[1] = GetNeighbourState(pair.lists[1]);
+    }
+
+    printf("overflow: %u and %u truncated lists, %i neighbour entries, %i bodies with different kept slots over %i builds\n",
+        states[0].overflow, states[1].overflow, entries, differences, LISTS_OVERFLOW_BUILDS);
+
+    UnloadListPair(pair);
+    rlUnloadShaderBuffer(buffer);
+    free(bodies);
+
+    return (differences == 0) && (states[0].overflow > 0) && (states[1].overflow > 0);
+}
+
+// Collapsing cloud integrated with contacts from the lists, every-pair and BVH lists in lockstep
+// NOTE: The BVH is refitted every step and its bounds are the initial ones, like the stale
+// bounds nbody.c passes; lists are only rebuilt when the displacement check asks for it
+static bool RunLockstep(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    Body *results[2] = { (Body *)calloc(NUM_BODIES, sizeof(Body)), (Body *)calloc(NUM_BODIES, sizeof(Body)) };
+    InitCloud(bodies, cbrtf((float)NUM_BODIES)*2.4f, 1.0f);
+
+    float boundsMin[3] = { 0 };
+    float boundsMax[3] = { 0 };
+    GetBodyBounds(bodies, boundsMin, boundsMax);
+
+    unsigned int program = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", NULL);
+
+    // Ping-pong bodies of each path
+    unsigned int buffers[2][2] = { 0 };
+    for (int p = 0; p < 2; p++)
+    {
+        buffers[p][0] = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+        buffers[p][1] = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY);
+    }
+
+    unsigned int instances = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(NUM_BODIES*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int trailPoints = rlLoadShaderBuffer(4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    ListPair pair = LoadListPair(program);
+
+    // No potentials, no trail points
+    int computePotential = 0;
+    int trailSlot = -1;
+    int trailStride = 1;
+
+    int differences = 0;
+    int divergedStep = -1;
+
+    for (int step = 0; (step < LISTS_STEPS) && (divergedStep < 0); step++)
+    {
+        unsigned int inputs[2] = { buffers[0][step%2], buffers[1][step%2] };
+        int entries = 0;
+
+        BuildListPair(&pair, inputs, boundsMin, boundsMax, 0.0f, false);
+        differences = CompareListPair(&pair, false, &entries);
+
+        for (int p = 0; p < 2; p++)
+        {
+            rlEnableShader(program);
+            rlBindShaderBuffer(buffers[p][step%2], 0);
+            rlBindShaderBuffer(buffers[p][(step + 1)%2], 1);
+            rlBindShaderBuffer(instances, 2);
+            rlBindShaderBuffer(potentials, 8);
+            rlBindShaderBuffer(trailPoints, 11);
+            rlSetUniform(rlGetLocationUniform(program, "computePotential"), &computePotential, RL_SHADER_UNIFORM_INT, 1);
+            rlSetUniform(rlGetLocationUniform(program, "trailSlot"), &trailSlot, RL_SHADER_UNIFORM_INT, 1);
+            rlSetUniform(rlGetLocationUniform(program, "trailStride"), &trailStride, RL_SHADER_UNIFORM_INT, 1);
+            BindNeighbourLists(pair.lists[p], true);
+            rlComputeShaderDispatch(16, 16, 16);
+            rlDisableShader();
+
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        for (int p = 0; p < 2; p++) rlReadShaderBuffer(buffers[p][(step + 1)%2], results[p], NUM_BODIES*sizeof(Body), 0);
+
+        if ((differences > 0) || (memcmp(results[0], results[1], NUM_BODIES*sizeof(Body)) != 0)) divergedStep = step;
+    }
+
+    NeighbourState states[2] = { GetNeighbourState(pair.lists[0]), GetNeighbourState(pair.lists[1]) };
+
+    int contacts = 0;
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if (pair.data[0][2*i + 1] > 0) contacts++;
+    }
+
+    printf("steps: %i steps, %u and %u list builds, %i bodies listing neighbours, %i BVH rebuilds\n",
+        LISTS_STEPS, states[0].rebuilds, states[1].rebuilds, contacts, pair.bvh.rebuilds);
+    if (divergedStep >= 0) printf("steps: paths diverged at step %i, %i bodies with different lists\n", divergedStep, differences);
+
+    UnloadListPair(pair);
+    for (int p = 0; p < 2; p++)
+    {
+        rlUnloadShaderBuffer(buffers[p][0]);
+        rlUnloadShaderBuffer(buffers[p][1]);
+        free(results[p]);
+    }
+    rlUnloadShaderBuffer(instances);
+    rlUnloadShaderBuffer(potentials);
+    rlUnloadShaderBuffer(trailPoints);
+    rlUnloadShaderProgram(program);
+    free(bodies);
+
+    // Lists must have been rebuilt while the bodies moved, not only built once
+    return (divergedStep < 0) && (states[0].rebuilds > 1) && (states[0].rebuilds == states[1].rebuilds) && (contacts > 0);
+}
+
+// Cold cube of bodies centered on the origin, one out of five spread over scatter times the side,
+// one slot out of LISTS_PARKED_STRIDE parked
+static void InitCloud(Body *bodies, float side, float scatter)
+{
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        float extent = ((i%5) == 0)? side*scatter : side;
+
+        if ((i%LISTS_PARKED_STRIDE) == (LISTS_PARKED_STRIDE - 1)) bodies[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        else bodies[i] = (Body){ (RandomFloat() - 0.5f)*extent, (RandomFloat() - 0.5f)*extent, (RandomFloat() - 0.5f)*extent, 0.0f, 0.0f, 0.0f };
+    }
+}
+
+// Bounds of the bodies, parked slots left out
+static void GetBodyBounds(const Body *bodies, float *boundsMin, float *boundsMax)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        boundsMin[axis] = 1e30f;
+        boundsMax[axis] = -1e30f;
+    }
+
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if (bodies[i].px >= BODY_PARKED) continue;
+
+        const float position[3] = { bodies[i].px, bodies[i].py, bodies[i].pz };
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            boundsMin[axis] = fminf(boundsMin[axis], position[axis]);
+            boundsMax[axis] = fmaxf(boundsMax[axis], position[axis]);
+        }
+    }
+}
+
+// Load both list paths and the BVH walked by the second
+static ListPair LoadListPair(unsigned int integratorProgram)
+{
+    ListPair pair = { 0 };
+
+    for (int p = 0; p < 2; p++)
+    {
+        pair.lists[p] = LoadNeighbourLists(integratorProgram, NEIGHBOUR_SKIN);
+        pair.data[p] = (unsigned int *)calloc(1, LISTS_LIST_SIZE);
+    }
+
+    pair.bvh = LoadBodyBvh(BVH_REBUILD_INFLATION);
+
+    return pair;
+}
+
+// Unload both list paths and the BVH
+static void UnloadListPair(ListPair pair)
+{
+    for (int p = 0; p < 2; p++)
+    {
+        UnloadNeighbourLists(pair.lists[p]);
+        free(pair.data[p]);
+    }
+
+    UnloadBodyBvh(pair.bvh);
+}
+
+// Update the lists of both paths, the second one walks the BVH refitted on its bodies
+// NOTE: rebuild forces a build, otherwise the displacement check of each path decides
+static void BuildListPair(ListPair *pair, unsigned int bodyBuffers[2], const float *boundsMin, const float *boundsMax, float boxSize, bool rebuild)
+{
+    UpdateBodyBvh(&pair->bvh, bodyBuffers[1], boundsMin, boundsMax);
+    pair->lists[0].bvhBuffer = 0;
+    pair->lists[1].bvhBuffer = pair->bvh.nodeBuffer;
+
+    for (int p = 0; p < 2; p++)
+    {
+        if (rebuild) InvalidateNeighbourLists(&pair->lists[p]);
+        UpdateNeighbourLists(&pair->lists[p], bodyBuffers[p], boxSize);
+    }
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    for (int p = 0; p < 2; p++) rlReadShaderBuffer(pair->lists[p].listBuffer, pair->data[p], LISTS_LIST_SIZE, 0);
+}
+
+// Bodies whose lists differ between the two paths, entries counts the neighbours of the first
+// NOTE: With truncated lists allowed, the shorter list of a body only has to be a prefix of
+// the longer one
+static int CompareListPair(ListPair *pair, bool truncated, int *entries)
+{
+    const unsigned int *a = pair->data[0];
+    const unsigned int *b = pair->data[1];
+    int differences = 0;
+
+    *entries = 0;
+
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        unsigned int countA = a[2*i + 1];
+        unsigned int countB = b[2*i + 1];
+        unsigned int common = (countA < countB)? countA : countB;
+        bool same = truncated || (countA == countB);
+
+        for (unsigned int k = 0; same && (k < common); k++)
+        {
+            if (a[a[2*i] + k] != b[b[2*i] + k]) same = false;
+        }
+
+        if (!same) differences++;
+        *entries += countA;
+    }
+
+    return differences;
+}
+
+// Neighbour counters of the last update, read back right away
+static NeighbourState GetNeighbourState(NeighbourLists lists)
+{
+    NeighbourState state = { 0 };
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(lists.stateBuffer, &state, sizeof(NeighbourState), 0);
+
+    return state;
+}
+
+// Fixed-seed uniform random in [0, 1), xorshift32
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
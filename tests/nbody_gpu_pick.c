@@ -0,0 +1,389 @@
+/*******************************************************************************************
+*
+*   nbody gpu pick - Two-pass atomicMin pick of nbody_picking.h checked on the GPU
+*
+*   Runs body_pick.comp over bodies placed along a slanted ray among a cloud clear of it, with
+*   slots and stable ids shuffled like after a reorder:
+*
+*       nearest     Bodies on the ray, grazing it and behind its origin: the pick is the nearest
+*                   sphere hit in front, at its depth, and the tracked copy follows that body
+*       tie         Bodies hit at the exact same depth: the pick is the lowest stable id, then a
+*                   higher id slightly nearer wins over them
+*       miss        A ray passing beside every body and parked slots on it: no hit, no pick
+*
+*   Usage:
+*       nbody_gpu_pick <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+#include "raymath.h"        // Required for: Vector3Normalize(), Vector3CrossProduct()
+
+#include "external/glad.h"  // Required for: glMemoryBarrier(), glFinish()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp(), memcpy()
+#include <math.h>           // Required for: sqrtf(), fabsf(), cosf(), sinf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match body_pick.comp
+#define PICK_RADIUS 1.0f
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_PICKING_IMPLEMENTATION
+#include "nbody_picking.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define PICK_ID_STRIDE          1237        // Slot -> id shuffle, odd so it is a permutation
+#define PICK_READBACK_TRIES     64          // Updates collecting a readback
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct PickCase {
+    const char *name;
+    bool (*run)(void);
+} PickCase;
+
+// Cloud clear of the ray, with bodies placed on it by PlacePickBody()
+typedef struct PickScene {
+    Ray ray;                        // Direction normalized
+    Vector3 side;                   // Unit vector across the ray
+    Body *bodies;                   // By slot
+    unsigned int *ids;              // Slot -> id
+    unsigned int *slots;            // Id -> slot
+} PickScene;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunNearest(void);
+static bool RunTie(void);
+static bool RunMiss(void);
+
+static PickScene LoadPickScene(void);                   // Cloud away from a slanted ray
+static void UnloadPickScene(PickScene scene);
+static void PlacePickBody(PickScene *scene, unsigned int id, float along, float across);  // Body at a distance along the ray and across it
+static float GetPickDepth(PickScene scene, unsigned int id);  // Expected hit distance, same formula as body_pick.comp
+static bool PickBody(PickScene scene, BodyPicker *picker, PickResult *result);  // Pick on the GPU, raw result and collected pick
+static float GetResultDepth(PickResult result);         // Hit distance of the depth bits
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const PickCase cases[] = {
+    { "nearest", RunNearest },
+    { "tie", RunTie },
+    { "miss", RunMiss },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const PickCase *pickCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) pickCase = &cases[i];
+    }
+
+    if (pickCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu pick");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", pickCase->name);
+        return 1;
+    }
+
+    bool passed = pickCase->run();
+
+    printf("%s: %s\n", pickCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Bodies along the ray: a grazing one nearest, centered ones further, some beside the ray, one
+// behind the origin and one holding the origin
+static bool RunNearest(void)
+{
+    PickScene scene = LoadPickScene();
+
+    PlacePickBody(&scene, 2000, 30.0f, 0.0f);
+    PlacePickBody(&scene, 11, 20.0f, 0.5f);
+    PlacePickBody(&scene, 3001, 12.0f, 0.9f);           // Grazing, hit near 12 - 0.44
+    PlacePickBody(&scene, 5, 12.0f, 1.1f);              // Just beside the ray
+    PlacePickBody(&scene, 7, -5.0f, 0.0f);              // Behind the origin
+    PlacePickBody(&scene, 8, 11.0f, 1.5f);              // Beside the ray, nearer
+    PlacePickBody(&scene, 900, 0.2f, 0.0f);             // Origin inside, exit point at 1.2
+
+    // The body holding the origin is hit at its exit point, nearer than the grazing one, so
+    // it is checked first and then moved off the ray
+    BodyPicker picker = LoadBodyPicker();
+    PickResult result = { 0 };
+
+    bool picked = PickBody(scene, &picker, &result);
+    float inside = GetPickDepth(scene, 900);
+    bool exitHit = picked && (result.id == 900) && (picker.pickedId == 900) && (fabsf(GetResultDepth(result) - inside) < 1e-5f);
+
+    printf("nearest: origin inside body %u at depth %.6f, expected 900 at %.6f\n", result.id, GetResultDepth(result), inside);
+
+    PlacePickBody(&scene, 900, 40.0f, 3.0f);
+
+    picked = PickBody(scene, &picker, &result);
+    float expected = GetPickDepth(scene, 3001);
+    float depthError = fabsf(GetResultDepth(result) - expected);
+
+    // The tracked copy follows the picked body
+    unsigned int bodyBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), scene.bodies, RL_DYNAMIC_COPY);
+    unsigned int slotBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), scene.slots, RL_DYNAMIC_COPY);
+
+    for (int i = 0; (i < PICK_READBACK_TRIES) && !picker.trackedValid; i++)
+    {
+        UpdateBodyPicker(&picker, bodyBuffer, slotBuffer);
+        glFinish();
+    }
+
+    Body body = scene.bodies[scene.slots[3001]];
+    bool tracked = picker.trackedValid && (picker.trackedPosition.x == body.px) && (picker.trackedPosition.y == body.py) && (picker.trackedPosition.z == body.pz);
+
+    printf("nearest: body %u at depth %.6f, expected 3001 at %.6f, picked %i, tracked %s\n", result.id, GetResultDepth(result), expected, picker.pickedId, tracked? "yes" : "NO");
+
+    bool passed = exitHit && picked && (result.id == 3001) && (picker.pickedId == 3001) && (depthError < 1e-5f) && tracked;
+
+    rlUnloadShaderBuffer(bodyBuffer);
+    rlUnloadShaderBuffer(slotBuffer);
+    UnloadBodyPicker(picker);
+    UnloadPickScene(scene);
+
+    return passed;
+}
+
+// Bodies stacked at one position, so their hit distances are the same float whatever the
+// rounding, in slots far apart
+static bool RunTie(void)
+{
+    PickScene scene = LoadPickScene();
+
+    const unsigned int tied[4] = { 3000, 2500, 17, 900 };
+    for (int i = 0; i < 4; i++) PlacePickBody(&scene, tied[i], 15.0f, 0.5f);
+    PlacePickBody(&scene, 3, 25.0f, 0.5f);             // Lower id, further
+
+    BodyPicker picker = LoadBodyPicker();
+    PickResult result = { 0 };
+
+    bool picked = PickBody(scene, &picker, &result);
+    bool lowest = picked && (result.id == 17) && (picker.pickedId == 17);
+
+    printf("tie: body %u at depth %.6f, expected 17 at %.6f, picked %i\n", result.id, GetResultDepth(result), GetPickDepth(scene, 17), picker.pickedId);
+
+    // A slightly nearer higher id wins over the tie
+    PlacePickBody(&scene, 3999, 14.9f, 0.5f);
+
+    picked = PickBody(scene, &picker, &result);
+    bool nearer = picked && (result.id == 3999) && (picker.pickedId == 3999);
+
+    printf("tie: nearer body %u at depth %.6f, expected 3999 at %.6f\n", result.id, GetResultDepth(result), GetPickDepth(scene, 3999));
+
+    UnloadBodyPicker(picker);
+    UnloadPickScene(scene);
+
+    return lowest && nearer;
+}
+
+// Bodies just beside the ray and parked slots on it
+static bool RunMiss(void)
+{
+    PickScene scene = LoadPickScene();
+
+    PlacePickBody(&scene, 40, 10.0f, 1.05f);
+    PlacePickBody(&scene, 41, 20.0f, -1.05f);
+
+    // Parked slots sit far off at px = BODY_PARKED, set one on the ray with the flag kept
+    PlacePickBody(&scene, 42, 5.0f, 0.0f);
+    scene.bodies[scene.slots[42]].px = BODY_PARKED;
+
+    BodyPicker picker = LoadBodyPicker();
+    picker.pickedId = 40;           // A miss stops tracking
+
+    PickResult result = { 0 };
+    bool picked = PickBody(scene, &picker, &result);
+
+    printf("miss: id %08x, depth %08x, picked %i\n", result.id, result.depth, picker.pickedId);
+
+    bool passed = picked && (result.id == PICK_NONE) && (result.depth == PICK_NONE) && (picker.pickedId == -1);
+
+    UnloadBodyPicker(picker);
+    UnloadPickScene(scene);
+
+    return passed;
+}
+
+// Cloud of bodies at least 5 units across the ray, a quarter of the slots parked, slots
+// shuffled against ids like after a reorder
+static PickScene LoadPickScene(void)
+{
+    PickScene scene = { 0 };
+
+    scene.ray.position = (Vector3){ -12.0f, 3.0f, 7.0f };
+    scene.ray.direction = Vector3Normalize((Vector3){ 1.0f, 2.0f, -0.5f });
+    scene.side = Vector3Normalize(Vector3CrossProduct(scene.ray.direction, (Vector3){ 0.0f, 0.0f, 1.0f }));
+
+    scene.bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    scene.ids = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    scene.slots = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        unsigned int id = (unsigned int)((slot*PICK_ID_STRIDE)%NUM_BODIES);
+
+        scene.ids[slot] = id;
+        scene.slots[id] = (unsigned int)slot;
+
+        if ((id%4) == 3)
+        {
+            scene.bodies[slot] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+            continue;
+        }
+
+        // Across the ray by 5 to 25 units, in any direction about it
+        float along = (RandomFloat() - 0.3f)*80.0f;
+        float across = 5.0f + 20.0f*RandomFloat();
+        float angle = 6.2831853f*RandomFloat();
+        Vector3 up = Vector3CrossProduct(scene.side, scene.ray.direction);
+        Vector3 offset = Vector3Add(Vector3Scale(scene.side, across*cosf(angle)), Vector3Scale(up, across*sinf(angle)));
+        Vector3 position = Vector3Add(Vector3Add(scene.ray.position, Vector3Scale(scene.ray.direction, along)), offset);
+
+        scene.bodies[slot] = (Body){ position.x, position.y, position.z, 0.0f, 0.0f, 0.0f };
+    }
+
+    return scene;
+}
+
+// Unload scene data
+static void UnloadPickScene(PickScene scene)
+{
+    free(scene.bodies);
+    free(scene.ids);
+    free(scene.slots);
+}
+
+// Move body id to a distance along the ray and across it, on the side vector
+static void PlacePickBody(PickScene *scene, unsigned int id, float along, float across)
+{
+    Vector3 position = Vector3Add(Vector3Add(scene->ray.position, Vector3Scale(scene->ray.direction, along)), Vector3Scale(scene->side, across));
+
+    scene->bodies[scene->slots[id]] = (Body){ position.x, position.y, position.z, 0.0f, 0.0f, 0.0f };
+}
+
+// Hit distance of body id, -1 on a miss, same formula as rayHit() of body_pick.comp
+static float GetPickDepth(PickScene scene, unsigned int id)
+{
+    Body body = scene.bodies[scene.slots[id]];
+    Vector3 offset = { body.px - scene.ray.position.x, body.py - scene.ray.position.y, body.pz - scene.ray.position.z };
+    float along = Vector3DotProduct(offset, scene.ray.direction);
+    Vector3 perpendicular = Vector3Subtract(offset, Vector3Scale(scene.ray.direction, along));
+    float h = PICK_RADIUS*PICK_RADIUS - Vector3DotProduct(perpendicular, perpendicular);
+
+    if (h < 0.0f) return -1.0f;
+
+    float t = along - sqrtf(h);
+    if (t < 0.0f) t = along + sqrtf(h);
+
+    return t;
+}
+
+// Pick through RequestBodyPick(), the raw (depth, id) result read from its buffer and the
+// pick collected by UpdateBodyPicker(). False when the readback never came
+static bool PickBody(PickScene scene, BodyPicker *picker, PickResult *result)
+{
+    unsigned int bodyBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), scene.bodies, RL_DYNAMIC_COPY);
+    unsigned int idBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), scene.ids, RL_DYNAMIC_COPY);
+    unsigned int slotBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), scene.slots, RL_DYNAMIC_COPY);
+
+    RequestBodyPick(picker, scene.ray, bodyBuffer, idBuffer);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(picker->resultBuffer, result, 2*sizeof(unsigned int), 0);
+
+    // Collected once the fence signals, every pick readback slot is then free again
+    bool collected = false;
+    for (int i = 0; (i < PICK_READBACK_TRIES) && !collected; i++)
+    {
+        glFinish();
+        UpdateBodyPicker(picker, bodyBuffer, slotBuffer);
+
+        collected = true;
+        for (int slot = 0; slot < picker->pickReadback.slotCount; slot++) if (picker->pickReadback.states[slot] != READBACK_FREE) collected = false;
+    }
+
+    rlUnloadShaderBuffer(bodyBuffer);
+    rlUnloadShaderBuffer(idBuffer);
+    rlUnloadShaderBuffer(slotBuffer);
+
+    return collected;
+}
+
+// Hit distance of the depth bits of a result
+static float GetResultDepth(PickResult result)
+{
+    float depth = 0.0f;
+    memcpy(&depth, &result.depth, sizeof(float));
+
+    return depth;
+}
+
+// Fixed-seed xorshift32 uniform random in [0, 1)
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
@@ -0,0 +1,333 @@
+/*******************************************************************************************
+*
+*   nbody gpu reorder - Radix sort and body reorder of nbody_reorder.h checked on the GPU
+*
+*       sort        Random keys with many duplicates sorted by radix_sort.comp, against a CPU
+*                   stable sort, with an even and an odd count of radix passes
+*       reorder     Cloud with parked slots reordered along Morton, Hilbert, then Morton again:
+*                   sorted keys equal the nbody_sfc.h keys of the bodies now in those slots,
+*                   bodyIds and bodySlots are inverse permutations, every body keeps its data
+*
+*   Usage:
+*       nbody_gpu_reorder <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free(), qsort()
+#include <string.h>         // Required for: strcmp(), memcmp()
+#include <math.h>           // Required for: fminf(), fmaxf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_TASKS_IMPLEMENTATION
+#include "nbody_tasks.h"
+
+#define NBODY_SFC_IMPLEMENTATION
+#include "nbody_sfc.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define REORDER_DISTINCT_KEYS   512         // Distinct keys of the sort case, most keys repeat
+#define REORDER_PARKED_STRIDE   16          // One slot out of REORDER_PARKED_STRIDE is free
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct ReorderCase {
+    const char *name;
+    bool (*run)(void);
+} ReorderCase;
+
+// Key and value of the CPU reference sort
+typedef struct KeyValue {
+    unsigned int key;
+    unsigned int value;
+} KeyValue;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunSort(void);
+static bool RunReorder(void);
+
+static int SortKeyBits(RadixSorter *sorter, int keyBits);           // Mismatches of one GPU sort against the CPU sort
+static int CheckReorder(BodyReorder reorder, unsigned int bodyBuffer, const Body *original, const float *boundsMin, const float *boundsMax);
+static unsigned int GetBodyKey(Body body, ReorderCurve curve, const float *boundsMin, float scale);
+static int CompareKeyValues(const void *a, const void *b);
+static unsigned int RandomUint(void);                   // Fixed-seed xorshift32
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const ReorderCase cases[] = {
+    { "sort", RunSort },
+    { "reorder", RunReorder },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const ReorderCase *reorderCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) reorderCase = &cases[i];
+    }
+
+    if (reorderCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu reorder");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", reorderCase->name);
+        return 1;
+    }
+
+    bool passed = reorderCase->run();
+
+    printf("%s: %s\n", reorderCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Radix sort of random keys: REORDER_KEY_BITS sorts in an even pass count, 10 bits in three
+// passes and ends with the copy back into buffers 0
+static bool RunSort(void)
+{
+    RadixSorter sorter = LoadRadixSorter();
+
+    int wide = SortKeyBits(&sorter, REORDER_KEY_BITS);
+    int narrow = SortKeyBits(&sorter, 10);
+
+    printf("sort: %i mismatches over %i bits, %i over 10 bits\n", wide, REORDER_KEY_BITS, narrow);
+
+    UnloadRadixSorter(sorter);
+
+    return (wide == 0) && (narrow == 0);
+}
+
+// Cloud with parked slots reordered three times, checked after each
+static bool RunReorder(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    float boundsMin[3] = { 1e30f, 1e30f, 1e30f };
+    float boundsMax[3] = { -1e30f, -1e30f, -1e30f };
+
+    // Velocities make every body unique, so a body copied into the wrong slot shows
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if ((i%REORDER_PARKED_STRIDE) == (REORDER_PARKED_STRIDE - 1))
+        {
+            bodies[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, (float)i, 0.0f, 0.0f };
+            continue;
+        }
+
+        bodies[i] = (Body){ (RandomFloat() - 0.5f)*80.0f, (RandomFloat() - 0.5f)*40.0f, (RandomFloat() - 0.5f)*20.0f, (float)i, RandomFloat(), RandomFloat() };
+
+        const float position[3] = { bodies[i].px, bodies[i].py, bodies[i].pz };
+        for (int axis = 0; axis < 3; axis++)
+        {
+            boundsMin[axis] = fminf(boundsMin[axis], position[axis]);
+            boundsMax[axis] = fmaxf(boundsMax[axis], position[axis]);
+        }
+    }
+
+    unsigned int bodyBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+    unsigned int spareBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY);
+
+    BodyReorder reorder = LoadBodyReorder(1, REORDER_CURVE_MORTON);
+    const ReorderCurve curves[3] = { REORDER_CURVE_MORTON, REORDER_CURVE_HILBERT, REORDER_CURVE_MORTON };
+    int errors[3] = { 0 };
+    bool reordered = true;
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        reorder.curve = curves[pass];
+        reordered = reordered && UpdateBodyReorder(&reorder, &bodyBuffer, &spareBuffer, boundsMin, boundsMax);
+        errors[pass] = CheckReorder(reorder, bodyBuffer, bodies, boundsMin, boundsMax);
+    }
+
+    printf("reorder: %i, %i and %i errors after the Morton, Hilbert and Morton reorders\n", errors[0], errors[1], errors[2]);
+
+    UnloadBodyReorder(reorder);
+    rlUnloadShaderBuffer(bodyBuffer);
+    rlUnloadShaderBuffer(spareBuffer);
+    free(bodies);
+
+    return reordered && (errors[0] == 0) && (errors[1] == 0) && (errors[2] == 0);
+}
+
+// Sort random keys of keyBits bits on the GPU, slots as values, count the sorted pairs that
+// differ from a CPU stable sort
+static int SortKeyBits(RadixSorter *sorter, int keyBits)
+{
+    KeyValue *expected = (KeyValue *)calloc(NUM_BODIES, sizeof(KeyValue));
+    unsigned int *keys = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    unsigned int *values = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    unsigned int mask = (keyBits < 32)? ((1u << keyBits) - 1u) : 0xffffffffu;
+
+    // Few distinct keys, so stability is checked on long runs of equal keys
+    unsigned int distinct[REORDER_DISTINCT_KEYS] = { 0 };
+    for (int i = 0; i < REORDER_DISTINCT_KEYS; i++) distinct[i] = RandomUint() & mask;
+
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        keys[i] = distinct[RandomUint()%REORDER_DISTINCT_KEYS];
+        values[i] = (unsigned int)i;
+        expected[i] = (KeyValue){ keys[i], values[i] };
+    }
+
+    rlUpdateShaderBuffer(sorter->keyBuffers[0], keys, NUM_BODIES*sizeof(unsigned int), 0);
+    rlUpdateShaderBuffer(sorter->valueBuffers[0], values, NUM_BODIES*sizeof(unsigned int), 0);
+
+    SortRadixKeys(sorter, keyBits);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(sorter->keyBuffers[0], keys, NUM_BODIES*sizeof(unsigned int), 0);
+    rlReadShaderBuffer(sorter->valueBuffers[0], values, NUM_BODIES*sizeof(unsigned int), 0);
+
+    // Values are distinct, ordering ties by value is the stable order
+    qsort(expected, NUM_BODIES, sizeof(KeyValue), CompareKeyValues);
+
+    int mismatches = 0;
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        if ((keys[i] != expected[i].key) || (values[i] != expected[i].value)) mismatches++;
+    }
+
+    free(expected);
+    free(keys);
+    free(values);
+
+    return mismatches;
+}
+
+// Errors of the current reorder state: unsorted keys, keys differing from the nbody_sfc.h key
+// of the body in their slot, broken id maps, bodies differing from their original data
+static int CheckReorder(BodyReorder reorder, unsigned int bodyBuffer, const Body *original, const float *boundsMin, const float *boundsMax)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    unsigned int *keys = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    unsigned int *ids = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    unsigned int *slots = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(bodyBuffer, bodies, NUM_BODIES*sizeof(Body), 0);
+    rlReadShaderBuffer(reorder.sorter.keyBuffers[0], keys, NUM_BODIES*sizeof(unsigned int), 0);
+    rlReadShaderBuffer(reorder.idBuffers[0], ids, NUM_BODIES*sizeof(unsigned int), 0);
+    rlReadShaderBuffer(reorder.slotBuffer, slots, NUM_BODIES*sizeof(unsigned int), 0);
+
+    // Same quantization as UpdateBodyReorder()
+    float extent = fmaxf(boundsMax[0] - boundsMin[0], fmaxf(boundsMax[1] - boundsMin[1], boundsMax[2] - boundsMin[2]));
+    float scale = (float)(1 << (REORDER_KEY_BITS/3))/extent;
+
+    int errors = 0;
+
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        unsigned int id = ids[slot];
+
+        if ((slot > 0) && (keys[slot] < keys[slot - 1])) errors++;
+        if ((id >= NUM_BODIES) || (slots[id] != (unsigned int)slot)) { errors++; continue; }
+        if (memcmp(&bodies[slot], &original[id], sizeof(Body)) != 0) errors++;
+        if (keys[slot] != GetBodyKey(original[id], reorder.curve, boundsMin, scale)) errors++;
+    }
+
+    free(bodies);
+    free(keys);
+    free(ids);
+    free(slots);
+
+    return errors;
+}
+
+// Curve key of a body, quantized like reorder.comp
+static unsigned int GetBodyKey(Body body, ReorderCurve curve, const float *boundsMin, float scale)
+{
+    const float position[3] = { body.px, body.py, body.pz };
+    unsigned int cell[3] = { 0 };
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float quantized = fminf(fmaxf((position[axis] - boundsMin[axis])*scale, 0.0f), (float)((1 << SFC_BITS) - 1));
+        cell[axis] = (unsigned int)quantized;
+    }
+
+    return (curve == REORDER_CURVE_HILBERT)? GetHilbertKey(cell[0], cell[1], cell[2]) : GetMortonKey(cell[0], cell[1], cell[2]);
+}
+
+// Order of the CPU reference sort: key, then value
+static int CompareKeyValues(const void *a, const void *b)
+{
+    const KeyValue *left = (const KeyValue *)a;
+    const KeyValue *right = (const KeyValue *)b;
+
+    if (left->key != right->key) return (left->key < right->key)? -1 : 1;
+    if (left->value != right->value) return (left->value < right->value)? -1 : 1;
+
+    return 0;
+}
+
+// Fixed-seed xorshift32
+static unsigned int RandomUint(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return randomState;
+}
+
+// Fixed-seed uniform random in [0, 1)
+static float RandomFloat(void)
+{
+    return (float)(RandomUint() >> 8)/16777216.0f;
+}
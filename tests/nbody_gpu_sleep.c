@@ -0,0 +1,527 @@
+/*******************************************************************************************
+*
+*   nbody gpu sleep - Contact islands and sleeping checked on the GPU
+*
+*   Runs the islands pass of nbody_sleep.h over resting bodies built to a plan:
+*
+*       sleep       Calm lattice island sleeps after sleepSteps updates, a calm island under
+*                   SLEEP_MIN_BODIES and isolated bodies stay awake
+*       wake        A moving body touching the sleeping island wakes all of it in the next update
+*       gravity     Awake bodies around the sleeping island: one integrator step from the island
+*                   aggregate against the same step summing every body
+*       overflow    Islands of a clump past NEIGHBOUR_CAPACITY against a CPU union-find over the
+*                   same truncated lists
+*
+*   Usage:
+*       nbody_gpu_sleep <case>
+*
+*   NOTE: Needs an OpenGL 4.3 context like the GPU backend of nbody_regression, it runs fine on
+*   Mesa llvmpipe (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stdio.h>          // Required for: printf()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp()
+#include <math.h>           // Required for: sqrtf(), fabsf(), fmaxf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+// IMPORTANT: Must match island_sleep.comp
+#define SLEEP_CONTACT_MARGIN 0.1f
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+#define NBODY_NEIGHBOURS_IMPLEMENTATION
+#include "nbody_neighbours.h"
+
+#define NBODY_SLEEP_IMPLEMENTATION
+#include "nbody_sleep.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define SLEEP_LATTICE_SIDE      4           // Bodies along an edge of the sleeping island
+#define SLEEP_SPACING           2.05f       // Island spacing, within the contact margin
+#define SLEEP_SMALL_BODIES      4           // Calm island too small to sleep
+#define SLEEP_PROBES            6           // Isolated awake bodies around the island
+#define SLEEP_PROBE_DISTANCE    30.0f       // Distance of the probes to the island center
+#define SLEEP_GRAVITY_ERROR     1.0e-3f     // Relative velocity change error of the probes
+#define SLEEP_CORE_SIDE         12.0f       // Dense core of the overflow case
+#define SLEEP_SCATTER_SIDE      60.0f       // Scattered bodies of the overflow case
+#define SLEEP_LIST_SIZE         ((2*NUM_BODIES + NEIGHBOUR_CAPACITY)*sizeof(unsigned int))
+#define SLEEP_FLAGS_OFFSET      (sizeof(SleepCounters) + NUM_BODIES*4*sizeof(float))
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Test case
+typedef struct SleepCase {
+    const char *name;
+    bool (*run)(void);
+} SleepCase;
+
+// Islands pass over a body buffer, with the lists it reads and identity body ids
+typedef struct SleepScene {
+    unsigned int program;           // Integrator, for the uniforms of the lists and islands
+    unsigned int bodyBuffer;
+    unsigned int idBuffer;
+    NeighbourLists lists;
+    SleepIslands islands;
+} SleepScene;
+
+// Island plan of the scene bodies
+typedef struct ScenePlan {
+    int islandBodies;               // Slots [0, islandBodies) form the lattice island
+    int smallFirst;                 // Slots of the small island
+    int probeFirst;                 // Slots of the isolated probes
+    int count;                      // Slots in use, the others are parked
+} ScenePlan;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static bool RunSleep(void);
+static bool RunWake(void);
+static bool RunGravity(void);
+static bool RunOverflow(void);
+
+static ScenePlan InitScene(Body *bodies);               // Lattice island, small island and probes at rest, other slots parked
+static SleepScene LoadSleepScene(const Body *bodies);
+static void UnloadSleepScene(SleepScene scene);
+static void UpdateSleepScene(SleepScene *scene, int updates);
+static void GetSleepFlags(SleepScene scene, unsigned int *flags, SleepCounters *counters);
+static void IntegrateStep(SleepScene scene, unsigned int outputBuffer, bool sleeping);
+static unsigned int FindRoot(unsigned int *parents, unsigned int slot);
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const SleepCase cases[] = {
+    { "sleep", RunSleep },
+    { "wake", RunWake },
+    { "gravity", RunGravity },
+    { "overflow", RunOverflow },
+};
+
+static unsigned int randomState = 0x12345678u;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <case>\n", argv[0]);
+        return 1;
+    }
+
+    const SleepCase *sleepCase = NULL;
+    for (int i = 0; i < (int)(sizeof(cases)/sizeof(cases[0])); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) == 0) sleepCase = &cases[i];
+    }
+
+    if (sleepCase == NULL)
+    {
+        printf("Unknown case: %s\n", argv[1]);
+        return 1;
+    }
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody gpu sleep");
+
+    if (!IsWindowReady())
+    {
+        printf("%s: FAILED, no OpenGL context\n", sleepCase->name);
+        return 1;
+    }
+
+    bool passed = sleepCase->run();
+
+    printf("%s: %s\n", sleepCase->name, passed? "passed" : "FAILED");
+
+    CloseWindow();
+
+    return passed? 0 : 1;
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// Calm lattice island asleep at the sleepSteps-th update, not one update earlier, small
+// island and probes awake
+static bool RunSleep(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    unsigned int *flags = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    ScenePlan plan = InitScene(bodies);
+
+    SleepScene scene = LoadSleepScene(bodies);
+    SleepCounters early = { 0 };
+    SleepCounters counters = { 0 };
+
+    UpdateSleepScene(&scene, scene.islands.sleepSteps - 1);
+    GetSleepFlags(scene, flags, &early);
+
+    UpdateSleepScene(&scene, 1);
+    GetSleepFlags(scene, flags, &counters);
+
+    int islandAsleep = 0;
+    int othersAsleep = 0;
+    for (int i = 0; i < plan.count; i++)
+    {
+        if ((i < plan.islandBodies) && (flags[i] != 0)) islandAsleep++;
+        if ((i >= plan.islandBodies) && (flags[i] != 0)) othersAsleep++;
+    }
+
+    // Awake: the small island and the probes, one source each, plus the island aggregate
+    unsigned int sources = (unsigned int)(plan.count - plan.islandBodies) + 1;
+
+    printf("sleep: %i of %i island bodies asleep, %i other bodies asleep, %u sleeping before sleepSteps\n",
+        islandAsleep, plan.islandBodies, othersAsleep, early.sleepingBodies);
+    printf("sleep: %u islands, %u sleeping, %u sources\n", counters.islandCount, counters.sleepingIslands, counters.sourceCount);
+
+    UnloadSleepScene(scene);
+    free(flags);
+    free(bodies);
+
+    return (early.sleepingBodies == 0) && (islandAsleep == plan.islandBodies) && (othersAsleep == 0) &&
+        (counters.sleepingBodies == (unsigned int)plan.islandBodies) && (counters.islandCount == 1) &&
+        (counters.sleepingIslands == 1) && (counters.sourceCount == sources);
+}
+
+// Sleeping island woken by a moving body brought into contact
+static bool RunWake(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    unsigned int *flags = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+    ScenePlan plan = InitScene(bodies);
+
+    SleepScene scene = LoadSleepScene(bodies);
+    SleepCounters asleep = { 0 };
+    SleepCounters woken = { 0 };
+
+    UpdateSleepScene(&scene, scene.islands.sleepSteps);
+    GetSleepFlags(scene, flags, &asleep);
+
+    // First probe moved against the +x face of the island, next to its corner body, moving in
+    const Body *corner = &bodies[SLEEP_LATTICE_SIDE - 1];
+    Body visitor = { corner->px + SLEEP_SPACING, corner->py, corner->pz, -1.0f, 0.0f, 0.0f };
+    rlUpdateShaderBuffer(scene.bodyBuffer, &visitor, sizeof(Body), plan.probeFirst*sizeof(Body));
+
+    UpdateSleepScene(&scene, 1);
+    GetSleepFlags(scene, flags, &woken);
+
+    int islandAsleep = 0;
+    for (int i = 0; i < plan.islandBodies; i++) if (flags[i] != 0) islandAsleep++;
+
+    printf("wake: %u bodies asleep before contact, %u after, %i island bodies still flagged\n",
+        asleep.sleepingBodies, woken.sleepingBodies, islandAsleep);
+
+    UnloadSleepScene(scene);
+    free(flags);
+    free(bodies);
+
+    return (asleep.sleepingBodies == (unsigned int)plan.islandBodies) && (woken.sleepingBodies == 0) &&
+        (woken.sleepingIslands == 0) && (islandAsleep == 0);
+}
+
+// Probe velocity changes over one integrator step, gravity of the sleeping island from its
+// aggregate against every body summed
+// NOTE: The island is a cube, its quadrupole vanishes and the aggregate error falls off with
+// the fourth power of the distance
+static bool RunGravity(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    Body *results[2] = { (Body *)calloc(NUM_BODIES, sizeof(Body)), (Body *)calloc(NUM_BODIES, sizeof(Body)) };
+    ScenePlan plan = InitScene(bodies);
+
+    SleepScene scene = LoadSleepScene(bodies);
+    unsigned int outputs[2] = {
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY),
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY)
+    };
+
+    UpdateSleepScene(&scene, scene.islands.sleepSteps);
+
+    IntegrateStep(scene, outputs[0], true);
+    IntegrateStep(scene, outputs[1], false);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    for (int p = 0; p < 2; p++) rlReadShaderBuffer(outputs[p], results[p], NUM_BODIES*sizeof(Body), 0);
+
+    float maxError = 0.0f;
+    bool pinned = true;
+
+    for (int i = plan.probeFirst; i < plan.count; i++)
+    {
+        float aggregate[3] = { results[0][i].vx, results[0][i].vy, results[0][i].vz };
+        float exact[3] = { results[1][i].vx, results[1][i].vy, results[1][i].vz };
+        float error = 0.0f;
+        float length = 0.0f;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            error += (aggregate[axis] - exact[axis])*(aggregate[axis] - exact[axis]);
+            length += exact[axis]*exact[axis];
+        }
+
+        maxError = fmaxf(maxError, sqrtf(error/length));
+    }
+
+    // Sleeping bodies are not integrated
+    for (int i = 0; i < plan.islandBodies; i++)
+    {
+        if ((results[0][i].px != bodies[i].px) || (results[0][i].vx != 0.0f)) pinned = false;
+    }
+
+    printf("gravity: %i probes at %g, largest relative velocity change error %g, island %s\n",
+        SLEEP_PROBES, SLEEP_PROBE_DISTANCE, maxError, pinned? "pinned" : "moved");
+
+    rlUnloadShaderBuffer(outputs[0]);
+    rlUnloadShaderBuffer(outputs[1]);
+    UnloadSleepScene(scene);
+    for (int p = 0; p < 2; p++) free(results[p]);
+    free(bodies);
+
+    return (maxError < SLEEP_GRAVITY_ERROR) && pinned;
+}
+
+// Islands of a clump too dense for NEIGHBOUR_CAPACITY against a CPU union-find over the lists
+// the GPU read: pairs are united from both ends, a body whose list was cut off still joins
+// through the lists of its neighbours
+static bool RunOverflow(void)
+{
+    Body *bodies = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    unsigned int *listData = (unsigned int *)calloc(1, SLEEP_LIST_SIZE);
+    unsigned int *islandData = (unsigned int *)calloc(NUM_BODIES, 8*sizeof(unsigned int));
+    unsigned int *parents = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    // Half the bodies in a core far too dense for the lists, the others scattered wide in small
+    // islands, one slot out of sixteen parked
+    for (int i = 0; i < NUM_BODIES; i++)
+    {
+        float extent = ((i%2) == 0)? SLEEP_CORE_SIDE : SLEEP_SCATTER_SIDE;
+
+        if ((i%16) == 15) bodies[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        else bodies[i] = (Body){ (RandomFloat() - 0.5f)*extent, (RandomFloat() - 0.5f)*extent, (RandomFloat() - 0.5f)*extent, 0.0f, 0.0f, 0.0f };
+    }
+
+    SleepScene scene = LoadSleepScene(bodies);
+    UpdateSleepScene(&scene, 1);
+
+    NeighbourState state = { 0 };
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(scene.lists.stateBuffer, &state, sizeof(NeighbourState), 0);
+    rlReadShaderBuffer(scene.lists.listBuffer, listData, SLEEP_LIST_SIZE, 0);
+    rlReadShaderBuffer(scene.islands.islandBuffer, islandData, NUM_BODIES*8*sizeof(unsigned int), 0);
+
+    // Same contact test as island_sleep.comp, roots are the lowest slot of each island
+    for (unsigned int i = 0; i < NUM_BODIES; i++) parents[i] = i;
+
+    float reach = 2.0f + SLEEP_CONTACT_MARGIN;
+    for (unsigned int i = 0; i < NUM_BODIES; i++)
+    {
+        for (unsigned int k = 0; k < listData[2*i + 1]; k++)
+        {
+            unsigned int other = listData[listData[2*i] + k];
+            float dx = bodies[i].px - bodies[other].px;
+            float dy = bodies[i].py - bodies[other].py;
+            float dz = bodies[i].pz - bodies[other].pz;
+
+            if ((dx*dx + dy*dy + dz*dz) >= reach*reach) continue;
+
+            unsigned int a = FindRoot(parents, i);
+            unsigned int b = FindRoot(parents, other);
+            if (a < b) parents[b] = a;
+            else parents[a] = b;
+        }
+    }
+
+    int differences = 0;
+    int roots = 0;
+    for (unsigned int i = 0; i < NUM_BODIES; i++)
+    {
+        if (bodies[i].px >= BODY_PARKED) continue;
+
+        unsigned int root = FindRoot(parents, i);
+        if (islandData[8*i] != root) differences++;
+        if (root == i) roots++;
+    }
+
+    printf("overflow: %u truncated lists, %i islands, %i bodies in a different island than the CPU union-find\n",
+        state.overflow, roots, differences);
+
+    UnloadSleepScene(scene);
+    free(parents);
+    free(islandData);
+    free(listData);
+    free(bodies);
+
+    return (differences == 0) && (state.overflow > 0) && (roots > 1);
+}
+
+// Lattice island at the origin, a small square island and probes around, all at rest
+static ScenePlan InitScene(Body *bodies)
+{
+    ScenePlan plan = { 0 };
+    float offset = 0.5f*(float)(SLEEP_LATTICE_SIDE - 1)*SLEEP_SPACING;
+    int slot = 0;
+
+    for (int i = 0; i < NUM_BODIES; i++) bodies[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int i = 0; i < SLEEP_LATTICE_SIDE*SLEEP_LATTICE_SIDE*SLEEP_LATTICE_SIDE; i++, slot++)
+    {
+        bodies[slot] = (Body){ (float)(i%SLEEP_LATTICE_SIDE)*SLEEP_SPACING - offset,
+            (float)((i/SLEEP_LATTICE_SIDE)%SLEEP_LATTICE_SIDE)*SLEEP_SPACING - offset,
+            (float)(i/(SLEEP_LATTICE_SIDE*SLEEP_LATTICE_SIDE))*SLEEP_SPACING - offset, 0.0f, 0.0f, 0.0f };
+    }
+    plan.islandBodies = slot;
+
+    // Square of touching bodies far from the rest
+    plan.smallFirst = slot;
+    for (int i = 0; i < SLEEP_SMALL_BODIES; i++, slot++)
+    {
+        bodies[slot] = (Body){ -2.0f*SLEEP_PROBE_DISTANCE + (float)(i%2)*SLEEP_SPACING, (float)(i/2)*SLEEP_SPACING, 0.0f, 0.0f, 0.0f, 0.0f };
+    }
+
+    // Probes along the axes, both sides
+    plan.probeFirst = slot;
+    for (int i = 0; i < SLEEP_PROBES; i++, slot++)
+    {
+        float position[3] = { 0.0f, 0.0f, 0.0f };
+        position[i%3] = ((i/3) == 0)? SLEEP_PROBE_DISTANCE : -SLEEP_PROBE_DISTANCE;
+        position[(i + 1)%3] = 0.25f*SLEEP_PROBE_DISTANCE;
+
+        bodies[slot] = (Body){ position[0], position[1], position[2], 0.0f, 0.0f, 0.0f };
+    }
+
+    plan.count = slot;
+
+    return plan;
+}
+
+// Bodies uploaded with identity ids, lists and islands loaded against the integrator program
+static SleepScene LoadSleepScene(const Body *bodies)
+{
+    SleepScene scene = { 0 };
+    unsigned int *ids = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < NUM_BODIES; i++) ids[i] = i;
+
+    scene.program = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", NULL);
+    scene.bodyBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), bodies, RL_DYNAMIC_COPY);
+    scene.idBuffer = rlLoadShaderBuffer(NUM_BODIES*sizeof(unsigned int), ids, RL_DYNAMIC_COPY);
+    scene.lists = LoadNeighbourLists(scene.program, NEIGHBOUR_SKIN);
+    scene.islands = LoadSleepIslands(scene.program, 0, 0.0f);
+
+    free(ids);
+
+    return scene;
+}
+
+// Unload the scene buffers and modules
+static void UnloadSleepScene(SleepScene scene)
+{
+    UnloadSleepIslands(scene.islands);
+    UnloadNeighbourLists(scene.lists);
+    rlUnloadShaderBuffer(scene.bodyBuffer);
+    rlUnloadShaderBuffer(scene.idBuffer);
+    rlUnloadShaderProgram(scene.program);
+}
+
+// Islands passes over the unchanged bodies, lists checked before each like nbody.c does
+static void UpdateSleepScene(SleepScene *scene, int updates)
+{
+    for (int i = 0; i < updates; i++)
+    {
+        UpdateNeighbourLists(&scene->lists, scene->bodyBuffer, 0.0f);
+        UpdateSleepIslands(&scene->islands, scene->bodyBuffer, scene->idBuffer, scene->lists, 0.0f);
+    }
+}
+
+// Sleep flags and counters of the last update, read back right away
+static void GetSleepFlags(SleepScene scene, unsigned int *flags, SleepCounters *counters)
+{
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(scene.islands.sleepBuffer, counters, sizeof(SleepCounters), 0);
+    rlReadShaderBuffer(scene.islands.sleepBuffer, flags, NUM_BODIES*sizeof(unsigned int), SLEEP_FLAGS_OFFSET);
+}
+
+// One integrator step of the scene bodies into outputBuffer, gravity from the sleep sources
+// or from every body
+static void IntegrateStep(SleepScene scene, unsigned int outputBuffer, bool sleeping)
+{
+    unsigned int instances = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(NUM_BODIES*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int trailPoints = rlLoadShaderBuffer(4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    // No potentials, no trail points
+    int computePotential = 0;
+    int trailSlot = -1;
+    int trailStride = 1;
+
+    rlEnableShader(scene.program);
+    rlBindShaderBuffer(scene.bodyBuffer, 0);
+    rlBindShaderBuffer(outputBuffer, 1);
+    rlBindShaderBuffer(instances, 2);
+    rlBindShaderBuffer(potentials, 8);
+    rlBindShaderBuffer(trailPoints, 11);
+    rlBindShaderBuffer(scene.idBuffer, 17);
+    rlSetUniform(rlGetLocationUniform(scene.program, "computePotential"), &computePotential, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(rlGetLocationUniform(scene.program, "trailSlot"), &trailSlot, RL_SHADER_UNIFORM_INT, 1);
+    rlSetUniform(rlGetLocationUniform(scene.program, "trailStride"), &trailStride, RL_SHADER_UNIFORM_INT, 1);
+    BindNeighbourLists(scene.lists, true);
+    BindSleepIslands(scene.islands, sleeping);
+    rlComputeShaderDispatch(16, 16, 16);
+    rlDisableShader();
+
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    rlUnloadShaderBuffer(instances);
+    rlUnloadShaderBuffer(potentials);
+    rlUnloadShaderBuffer(trailPoints);
+}
+
+// Root of a slot in the CPU union-find
+static unsigned int FindRoot(unsigned int *parents, unsigned int slot)
+{
+    while (parents[slot] != slot) slot = parents[slot];
+
+    return slot;
+}
+
+// Fixed-seed uniform random in [0, 1), xorshift32
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
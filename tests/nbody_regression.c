@@ -0,0 +1,965 @@
+/*******************************************************************************************
+*
+*   nbody regression - Integrators checked against golden snapshots
+*
+*   Runs a fixed-seed scenario through every integrator backend (CPU reference of
+*   nbody_cpu.h, multi-process ring of nbody_ring.h and its ORB tree mode, Barnes-Hut tree
+*   of nbody_tree.h, fast multipole method of nbody_fmm.h, P3M of nbody_pm.h, the tree on
+*   bodies reordered along the Hilbert curve of nbody_sfc.h, symmetric direct sum of
+*   nbody_pairs.h, GPU nbody.comp) for a fixed number of steps and compares the final state
+*   against the snapshot stored in tests/golden/, within per scenario tolerances. Clumped scenarios only bound how far the
+*   backends drift apart through the order of their contacts, the contact-free lattice holds
+*   every backend to round-off or to the error of its gravity approximation.
+*   Any change to the physics, or any optimisation that alters results beyond float
+*   round-off, makes this test fail.
+*
+*   Usage:
+*       nbody_regression <scenario> <golden dir>            Check all backends
+*       nbody_regression <scenario> <golden dir> --update   Rewrite snapshot from the CPU reference
+*
+*   Scenarios: two_body, plummer, head_on, lattice, collisions, periodic
+*
+*   The periodic scenario drifts a lattice across the faces of a periodic box, its reference
+*   takes every pair at its minimum image plus the exact Ewald correction (nbody_ewald.h).
+*   P3M runs it with periodic boundaries, backends without a periodic mode skip it. The GPU
+*   runs twice: the plain nbody.comp path, then the shipped defaults of nbody.c (Hilbert
+*   reorders, neighbour lists through the BVH). The shipped defaults dispatch all NUM_BODIES
+*   slots, they only run the short collisions and periodic scenarios.
+*
+*   NOTE: The GPU backend needs an OpenGL 4.3 context, it runs fine on Mesa llvmpipe
+*   (LIBGL_ALWAYS_SOFTWARE=1) under a virtual display, see CMakeLists.txt
+*
+********************************************************************************************/
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "external/glad.h"  // Required for: glMemoryBarrier()
+
+#include <stdio.h>          // Required for: printf(), fopen(), fgets()
+#include <stdlib.h>         // Required for: calloc(), free()
+#include <string.h>         // Required for: strcmp(), memcmp()
+#include <math.h>           // Required for: sqrtf(), powf(), cosf(), sinf(), fmaxf(), isnan(), roundf(), floorf()
+
+// IMPORTANT: Must match the NUM_BODIES default of the shaders, modules load them without defines
+#define NUM_BODIES 4096
+
+// IMPORTANT: Must match nbody_edits.h
+#define BODY_PARKED 1.0e18f     // px of a free slot
+
+#define NBODY_CPU_IMPLEMENTATION
+#include "nbody_cpu.h"
+
+#define NBODY_TASKS_IMPLEMENTATION
+#include "nbody_tasks.h"
+
+#define NBODY_TREE_IMPLEMENTATION
+#include "nbody_tree.h"
+
+#define NBODY_RING_IMPLEMENTATION
+#include "nbody_ring.h"
+
+#define NBODY_FMM_IMPLEMENTATION
+#include "nbody_fmm.h"
+
+#define NBODY_PM_IMPLEMENTATION
+#include "nbody_pm.h"
+
+#define NBODY_SFC_IMPLEMENTATION
+#include "nbody_sfc.h"
+
+#define NBODY_PAIRS_IMPLEMENTATION
+#include "nbody_pairs.h"
+
+#define NBODY_SHADERCACHE_IMPLEMENTATION
+#include "nbody_shadercache.h"
+
+#define NBODY_READBACK_IMPLEMENTATION
+#include "nbody_readback.h"
+
+#define NBODY_REORDER_IMPLEMENTATION
+#include "nbody_reorder.h"
+
+#define NBODY_EWALD_IMPLEMENTATION
+#include "nbody_ewald.h"
+
+#define NBODY_NEIGHBOURS_IMPLEMENTATION
+#include "nbody_neighbours.h"
+
+#define NBODY_BVH_IMPLEMENTATION
+#include "nbody_bvh.h"
+
+//----------------------------------------------------------------------------------
+// Defines and Macros
+//----------------------------------------------------------------------------------
+#define REGRESSION_RING_RANKS   4           // More ranks than bodies in some scenarios, on purpose
+#define REGRESSION_TREE_WORKERS 4
+#define REGRESSION_PM_GRID      32          // The short range covers the small scenarios, cutoff 8.4 in the periodic box
+#define REGRESSION_SORT_INTERVAL 16         // Steps between two Hilbert reorders of the sorted tree
+#define REGRESSION_BOX_SIZE     48.0f       // Periodic box of the 4x4x4 lattice, 12 apart
+
+// Contact-free tolerance scale of the tree, its force error grows about with theta^2
+#define REGRESSION_TREE_SCALE   (100.0f*TREE_DEFAULT_THETA*TREE_DEFAULT_THETA)
+
+// Contact-free tolerance scale of the FMM, its force error grows about with theta^(order + 1)
+#if FMM_DEFAULT_ORDER != 4
+    #error "REGRESSION_FMM_SCALE assumes FMM_DEFAULT_ORDER 4"
+#endif
+#define REGRESSION_FMM_SCALE    (1500.0f*FMM_DEFAULT_THETA*FMM_DEFAULT_THETA*FMM_DEFAULT_THETA*FMM_DEFAULT_THETA*FMM_DEFAULT_THETA)
+
+//----------------------------------------------------------------------------------
+// Types and Structures Definition
+//----------------------------------------------------------------------------------
+
+// Regression scenario
+typedef struct Scenario {
+    const char *name;
+    int count;                      // Bodies
+    int steps;                      // Simulation steps run by every backend
+    void (*init)(Body *bodies, int count);
+    float positionTolerance;        // Max position error of the GPU backend
+    float velocityTolerance;        // Max velocity error of the GPU backend
+    bool contacts;                  // Bodies touch, approximate backends diverge by contact order
+    bool farField;                  // Large enough for the FMM to translate far cells (M2L)
+    float boxSize;                  // Periodic box side, 0 in open space
+    bool shipped;                   // Short enough for the backends dispatching all NUM_BODIES slots
+} Scenario;
+
+// Integrator backend
+typedef struct Backend {
+    const char *name;
+    bool (*run)(const Scenario *scenario, Body *bodies);     // Integrate scenario->steps steps in place
+    float toleranceScale;           // Applied to the scenario tolerances
+    float freeToleranceScale;       // Applied instead on contact-free scenarios
+    bool periodic;                  // Runs the periodic scenarios
+    bool allSlots;                  // Dispatches all NUM_BODIES slots, runs the shipped scenarios only
+} Backend;
+
+//----------------------------------------------------------------------------------
+// Module Functions Declaration
+//----------------------------------------------------------------------------------
+static void InitTwoBody(Body *bodies, int count);       // Circular orbit pair
+static void InitPlummer(Body *bodies, int count);       // Plummer sphere in virial equilibrium
+static void InitHeadOn(Body *bodies, int count);        // Pair colliding almost head-on
+static void InitLattice(Body *bodies, int count);       // Jittered cubic lattice, never in contact
+static void InitCollisions(Body *bodies, int count);    // Pairs colliding almost head-on, far apart
+static void InitDriftingLattice(Body *bodies, int count);   // Lattice filling the periodic box, drifting across its faces
+
+static bool RunCpuReference(const Scenario *scenario, Body *bodies);
+static bool RunRingCluster(const Scenario *scenario, Body *bodies);
+static bool RunRingTree(const Scenario *scenario, Body *bodies);
+static bool RunBarnesHut(const Scenario *scenario, Body *bodies);
+static bool RunFastMultipole(const Scenario *scenario, Body *bodies);
+static bool RunParticleMesh(const Scenario *scenario, Body *bodies);
+static bool RunSortedTree(const Scenario *scenario, Body *bodies);
+static bool RunSymmetricPairs(const Scenario *scenario, Body *bodies);
+static bool RunGpuCompute(const Scenario *scenario, Body *bodies);
+static bool RunGpuDefaults(const Scenario *scenario, Body *bodies);
+
+static void StepBodiesPeriodic(const Body *bodies, Body *result, int count, float boxSize);  // Minimum image pairs plus the exact Ewald correction
+static void GetLiveBounds(const Body *bodies, int count, float *boundsMin, float *boundsMax);  // Bounds of the bodies not parked
+
+static float RandomFloat(void);                         // Fixed-seed uniform random in [0, 1)
+static bool SaveSnapshot(const char *fileName, const Scenario *scenario, const Body *bodies);
+static bool LoadSnapshot(const char *fileName, const Scenario *scenario, Body *bodies);
+
+//----------------------------------------------------------------------------------
+// Global Variables Definition
+//----------------------------------------------------------------------------------
+static const Scenario scenarios[] = {
+    { "two_body", 2, 400, InitTwoBody, 1e-3f, 1e-3f, false, false, 0.0f, false },
+    { "plummer", 64, 300, InitPlummer, 1e-2f, 1e-2f, true, false, 0.0f, false },
+    { "head_on", 2, 300, InitHeadOn, 1e-3f, 1e-3f, true, false, 0.0f, false },
+    { "lattice", 512, 100, InitLattice, 1e-3f, 1e-3f, false, true, 0.0f, false },
+    { "collisions", 16, 40, InitCollisions, 1e-3f, 1e-3f, true, false, 0.0f, true },
+    { "periodic", 64, 40, InitDriftingLattice, 1e-3f, 1e-3f, false, false, REGRESSION_BOX_SIZE, true },
+};
+
+// NOTE: The CPU reference produced the snapshots, it must match them to round-off. The ring
+// resolves contacts in tile order instead of index order, a body pushed out of contact sees
+// the gravity of the next tiles from a different position, so clumped scenarios diverge.
+// The tree (alone or on the ORB domains of the ring), the FMM and P3M approximate far
+// gravity and resolve contacts in their own order, reordering bodies along the curve changes
+// that order again. Symmetric pairs resolve all contacts of a body from the input state at once.
+// The GPU defaults resolve contacts from the lists after the whole gravity sum, in the slot
+// order of the last reorder. They dispatch every slot, parked or not, which llvmpipe pays per
+// workgroup, so they only run the short shipped scenarios.
+// Without contacts, exact backends only differ by the summation order, approximate ones by
+// their force error, so the lattice tolerances stay tight: the tree is bound by its opening
+// angle, the FMM by its opening angle and order, P3M by its mesh. In the periodic box, P3M sums
+// the images on its mesh, the reference through the Ewald series
+static const Backend backends[] = {
+    { "cpu", RunCpuReference, 0.1f, 0.1f, true, false },
+    { "ring", RunRingCluster, 100.0f, 1.0f, false, false },
+    { "ring_tree", RunRingTree, 300.0f, REGRESSION_TREE_SCALE, false, false },
+    { "tree", RunBarnesHut, 300.0f, REGRESSION_TREE_SCALE, false, false },
+    { "fmm", RunFastMultipole, 300.0f, REGRESSION_FMM_SCALE, false, false },
+    { "p3m", RunParticleMesh, 300.0f, 100.0f, true, false },
+    { "tree_sfc", RunSortedTree, 300.0f, REGRESSION_TREE_SCALE, false, false },
+    { "pairs", RunSymmetricPairs, 300.0f, 1.0f, false, false },
+    { "gpu", RunGpuCompute, 1.0f, 1.0f, true, false },
+    { "gpu_defaults", RunGpuDefaults, 100.0f, 1.0f, true, true },
+};
+
+static unsigned int randomState = 0;
+
+//------------------------------------------------------------------------------------
+// Program main entry point
+//------------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <scenario> <golden dir> [--update]\n", argv[0]);
+        return 1;
+    }
+
+    const Scenario *scenario = NULL;
+    for (int i = 0; i < (int)(sizeof(scenarios)/sizeof(scenarios[0])); i++)
+    {
+        if (strcmp(scenarios[i].name, argv[1]) == 0) scenario = &scenarios[i];
+    }
+
+    if (scenario == NULL)
+    {
+        printf("Unknown scenario: %s\n", argv[1]);
+        return 1;
+    }
+
+    bool update = (argc > 3) && (strcmp(argv[3], "--update") == 0);
+
+    char snapshotFileName[512] = { 0 };
+    snprintf(snapshotFileName, sizeof(snapshotFileName), "%s/%s.txt", argv[2], scenario->name);
+
+    Body *initial = (Body *)calloc(scenario->count, sizeof(Body));
+    Body *golden = (Body *)calloc(scenario->count, sizeof(Body));
+    Body *bodies = (Body *)calloc(scenario->count, sizeof(Body));
+
+    randomState = 0x12345678u;
+    scenario->init(initial, scenario->count);
+
+    int result = 0;
+
+    if (update)
+    {
+        memcpy(bodies, initial, scenario->count*sizeof(Body));
+        RunCpuReference(scenario, bodies);
+
+        if (SaveSnapshot(snapshotFileName, scenario, bodies)) printf("%s: snapshot written to %s\n", scenario->name, snapshotFileName);
+        else result = 1;
+    }
+    else if (!LoadSnapshot(snapshotFileName, scenario, golden)) result = 1;
+    else
+    {
+        for (int b = 0; b < (int)(sizeof(backends)/sizeof(backends[0])); b++)
+        {
+            const Backend *backend = &backends[b];
+
+            if ((scenario->boxSize > 0.0f) && !backend->periodic)
+            {
+                printf("%s [%s]: skipped, open space only\n", scenario->name, backend->name);
+                continue;
+            }
+
+            if (backend->allSlots && !scenario->shipped)
+            {
+                printf("%s [%s]: skipped, shipped scenarios only\n", scenario->name, backend->name);
+                continue;
+            }
+
+            memcpy(bodies, initial, scenario->count*sizeof(Body));
+
+            if (!backend->run(scenario, bodies))
+            {
+                printf("%s [%s]: FAILED, backend not available or did not run its full path\n", scenario->name, backend->name);
+                result = 1;
+                continue;
+            }
+
+            float positionError = 0.0f;
+            float velocityError = 0.0f;
+            bool finite = true;
+
+            for (int i = 0; i < scenario->count; i++)
+            {
+                float dp[3] = { bodies[i].px - golden[i].px, bodies[i].py - golden[i].py, bodies[i].pz - golden[i].pz };
+                float dv[3] = { bodies[i].vx - golden[i].vx, bodies[i].vy - golden[i].vy, bodies[i].vz - golden[i].vz };
+
+                // Periodic box: a body wrapped on one side of a face and not on the other is close
+                if (scenario->boxSize > 0.0f) for (int k = 0; k < 3; k++) dp[k] -= scenario->boxSize*roundf(dp[k]/scenario->boxSize);
+
+                float positionDelta = sqrtf(dp[0]*dp[0] + dp[1]*dp[1] + dp[2]*dp[2]);
+                float velocityDelta = sqrtf(dv[0]*dv[0] + dv[1]*dv[1] + dv[2]*dv[2]);
+
+                // NaN never compares greater, check it explicitly
+                if (isnan(positionDelta) || isnan(velocityDelta)) finite = false;
+
+                positionError = fmaxf(positionError, positionDelta);
+                velocityError = fmaxf(velocityError, velocityDelta);
+            }
+
+            float toleranceScale = scenario->contacts? backend->toleranceScale : backend->freeToleranceScale;
+            float positionTolerance = scenario->positionTolerance*toleranceScale;
+            float velocityTolerance = scenario->velocityTolerance*toleranceScale;
+            bool passed = finite && (positionError <= positionTolerance) && (velocityError <= velocityTolerance);
+
+            printf("%s [%s]: %s, max position error %g (tolerance %g), max velocity error %g (tolerance %g)\n",
+                scenario->name, backend->name, passed? "passed" : "FAILED",
+                positionError, positionTolerance, velocityError, velocityTolerance);
+
+            if (!passed) result = 1;
+        }
+    }
+
+    free(initial);
+    free(golden);
+    free(bodies);
+
+    return result;
+}
+
+//----------------------------------------------------------------------------------
+// Scenarios
+//----------------------------------------------------------------------------------
+
+// Circular orbit pair, separation 20, orbit decays through velocity damping
+static void InitTwoBody(Body *bodies, int count)
+{
+    (void)count;
+
+    float separation = 20.0f;
+    float speed = sqrtf(BODY_GM/(2.0f*separation));
+
+    bodies[0] = (Body){ -separation/2.0f, 0.0f, 0.0f, 0.0f, 0.0f, -speed };
+    bodies[1] = (Body){ separation/2.0f, 0.0f, 0.0f, 0.0f, 0.0f, speed };
+}
+
+// Plummer sphere of scale radius 30, sampled as in Aarseth, Henon and Wielen (1974)
+static void InitPlummer(Body *bodies, int count)
+{
+    float scale = 30.0f;
+    float totalGM = count*BODY_GM;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Radius from the inverse cumulative mass, the outer tail is cut
+        float mass = 0.0f;
+        while ((mass < 1e-3f) || (mass > 0.9f)) mass = RandomFloat();
+        float r = scale/sqrtf(powf(mass, -2.0f/3.0f) - 1.0f);
+
+        // Speed from the distribution function by rejection, q = v/vEscape
+        float q = 0.0f;
+        float g = 1.0f;
+        while (g > q*q*powf(1.0f - q*q, 3.5f))
+        {
+            q = RandomFloat();
+            g = 0.1f*RandomFloat();
+        }
+
+        float v = q*sqrtf(2.0f*totalGM)*powf(r*r + scale*scale, -0.25f);
+
+        // Isotropic directions
+        float cosTheta = 2.0f*RandomFloat() - 1.0f;
+        float sinTheta = sqrtf(1.0f - cosTheta*cosTheta);
+        float phi = 6.2831853f*RandomFloat();
+        bodies[i].px = r*sinTheta*cosf(phi);
+        bodies[i].py = r*sinTheta*sinf(phi);
+        bodies[i].pz = r*cosTheta;
+
+        cosTheta = 2.0f*RandomFloat() - 1.0f;
+        sinTheta = sqrtf(1.0f - cosTheta*cosTheta);
+        phi = 6.2831853f*RandomFloat();
+        bodies[i].vx = v*sinTheta*cosf(phi);
+        bodies[i].vy = v*sinTheta*sinf(phi);
+        bodies[i].vz = v*cosTheta;
+    }
+}
+
+// Pair colliding almost head-on, offset along y so the contact normal is oblique
+static void InitHeadOn(Body *bodies, int count)
+{
+    (void)count;
+
+    bodies[0] = (Body){ -6.0f, -0.25f, 0.0f, 10.0f, 0.0f, 0.0f };
+    bodies[1] = (Body){ 6.0f, 0.25f, 0.0f, -10.0f, 0.0f, 0.0f };
+}
+
+// Cold cubic lattice of spacing 12, jittered by up to 2 per axis, collapsing under its own
+// gravity. Bodies stay over 6 apart for the 100 steps of the scenario (contacts start around
+// step 190), so backends only differ by their gravity, never by the order of contacts
+static void InitLattice(Body *bodies, int count)
+{
+    float spacing = 12.0f;
+    int side = 1;
+    while (side*side*side < count) side++;
+
+    for (int i = 0; i < count; i++)
+    {
+        int x = i%side;
+        int y = (i/side)%side;
+        int z = i/(side*side);
+
+        bodies[i].px = (x - 0.5f*(side - 1))*spacing + 4.0f*(RandomFloat() - 0.5f);
+        bodies[i].py = (y - 0.5f*(side - 1))*spacing + 4.0f*(RandomFloat() - 0.5f);
+        bodies[i].pz = (z - 0.5f*(side - 1))*spacing + 4.0f*(RandomFloat() - 0.5f);
+        bodies[i].vx = 0.5f*(RandomFloat() - 0.5f);
+        bodies[i].vy = 0.5f*(RandomFloat() - 0.5f);
+        bodies[i].vz = 0.5f*(RandomFloat() - 0.5f);
+    }
+}
+
+// Pairs colliding almost head-on like InitHeadOn(), 2 apart, on a lattice of spacing 30.
+// Each contact only involves its own pair, the far pairs barely pull, so the order of
+// contacts does not matter and every backend must catch them all within the short run
+static void InitCollisions(Body *bodies, int count)
+{
+    float spacing = 30.0f;
+    int pairs = count/2;
+    int side = 1;
+    while (side*side*side < pairs) side++;
+
+    for (int i = 0; i < pairs; i++)
+    {
+        float cx = (i%side - 0.5f*(side - 1))*spacing;
+        float cy = ((i/side)%side - 0.5f*(side - 1))*spacing;
+        float cz = (i/(side*side) - 0.5f*(side - 1))*spacing;
+        float offset = 0.5f*RandomFloat();
+
+        bodies[2*i] = (Body){ cx - 2.0f, cy - offset, cz, 10.0f, 0.0f, 0.0f };
+        bodies[2*i + 1] = (Body){ cx + 2.0f, cy + offset, cz, -10.0f, 0.0f, 0.0f };
+    }
+}
+
+// Lattice of the scenario count filling the periodic box, with a common drift that carries
+// every body across the faces within the 40 steps. Gravity is summed over all images, the
+// nearest bodies pull from the other side of a face, still never in contact
+static void InitDriftingLattice(Body *bodies, int count)
+{
+    InitLattice(bodies, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        bodies[i].vx += 100.0f;
+        bodies[i].vy += 60.0f;
+        bodies[i].vz += 40.0f;
+    }
+}
+
+//----------------------------------------------------------------------------------
+// Backends
+//----------------------------------------------------------------------------------
+
+// CPU reference integrator, with the Ewald sum in a periodic box
+static bool RunCpuReference(const Scenario *scenario, Body *bodies)
+{
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        if (scenario->boxSize > 0.0f) StepBodiesPeriodic(bodies, next, scenario->count, scenario->boxSize);
+        else StepBodiesReference(bodies, next, NULL, scenario->count);
+        memcpy(bodies, next, scenario->count*sizeof(Body));
+    }
+
+    free(next);
+
+    return true;
+}
+
+// Multi-process ring cluster, REGRESSION_RING_RANKS local processes
+static bool RunRingCluster(const Scenario *scenario, Body *bodies)
+{
+    RingCluster cluster = LoadRingCluster(bodies, scenario->count, REGRESSION_RING_RANKS, 0.0f);
+
+    bool success = StepRingCluster(&cluster, scenario->steps) && GetRingClusterBodies(cluster, bodies);
+
+    UnloadRingCluster(cluster);
+
+    return success;
+}
+
+// Barnes-Hut tree on the ORB domains of the ring cluster, locally essential trees exchanged
+static bool RunRingTree(const Scenario *scenario, Body *bodies)
+{
+    RingCluster cluster = LoadRingCluster(bodies, scenario->count, REGRESSION_RING_RANKS, TREE_DEFAULT_THETA);
+
+    bool success = StepRingCluster(&cluster, scenario->steps) && GetRingClusterBodies(cluster, bodies);
+
+    UnloadRingCluster(cluster);
+
+    return success;
+}
+
+// Barnes-Hut tree on a work-stealing pool, prints per worker statistics of the last step
+static bool RunBarnesHut(const Scenario *scenario, Body *bodies)
+{
+    TaskPool *pool = LoadTaskPool(REGRESSION_TREE_WORKERS);
+    BodyTree tree = LoadBodyTree(scenario->count, TREE_DEFAULT_THETA);
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        StepBodiesTree(&tree, pool, bodies, next, scenario->count);
+        memcpy(bodies, next, scenario->count*sizeof(Body));
+    }
+
+    for (int i = 0; i < GetTaskPoolWorkerCount(pool); i++)
+    {
+        TaskWorkerStats stats = GetTaskWorkerStats(pool, i);
+        printf("%s [tree]: worker %i, %lld tasks, %lld steals (%lld failed), busy %.3f ms, idle %.3f ms\n",
+            scenario->name, i, stats.tasks, stats.steals, stats.failedSteals, stats.busyTime*1000.0, stats.idleTime*1000.0);
+    }
+
+    free(next);
+    UnloadBodyTree(tree);
+    UnloadTaskPool(pool);
+
+    return true;
+}
+
+// Fast multipole method, prints the interaction counts of the last step
+static bool RunFastMultipole(const Scenario *scenario, Body *bodies)
+{
+    TaskPool *pool = LoadTaskPool(REGRESSION_TREE_WORKERS);
+    FmmSolver fmm = LoadFmmSolver(scenario->count, FMM_DEFAULT_ORDER, FMM_DEFAULT_THETA);
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        StepBodiesFmm(&fmm, pool, bodies, next, scenario->count);
+        memcpy(bodies, next, scenario->count*sizeof(Body));
+    }
+
+    printf("%s [fmm]: order %i, %lld M2L, %lld P2P\n", scenario->name, fmm.order, fmm.m2lCount, fmm.p2pCount);
+
+    // Without M2L translations the expansions (P2M, M2M, M2L, L2L, L2P) were never used
+    bool expanded = !scenario->farField || (fmm.m2lCount > 0);
+
+    free(next);
+    UnloadFmmSolver(fmm);
+    UnloadTaskPool(pool);
+
+    return expanded;
+}
+
+// P3M with isolated boundaries, or periodic ones in the box of the scenario
+static bool RunParticleMesh(const Scenario *scenario, Body *bodies)
+{
+    TaskPool *pool = LoadTaskPool(REGRESSION_TREE_WORKERS);
+    PmBoundary boundary = (scenario->boxSize > 0.0f)? PM_BOUNDARY_PERIODIC : PM_BOUNDARY_ISOLATED;
+    PmSolver pm = LoadPmSolver(scenario->count, REGRESSION_PM_GRID, boundary, scenario->boxSize, true);
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        StepBodiesPm(&pm, pool, bodies, next, scenario->count);
+        memcpy(bodies, next, scenario->count*sizeof(Body));
+    }
+
+    free(next);
+    UnloadPmSolver(pm);
+    UnloadTaskPool(pool);
+
+    return true;
+}
+
+// Barnes-Hut tree on bodies sorted along the Hilbert curve every REGRESSION_SORT_INTERVAL steps
+// NOTE: Stable ids restore the initial body order before the comparison
+static bool RunSortedTree(const Scenario *scenario, Body *bodies)
+{
+    TaskPool *pool = LoadTaskPool(REGRESSION_TREE_WORKERS);
+    BodyTree tree = LoadBodyTree(scenario->count, TREE_DEFAULT_THETA);
+    BodySorter sorter = LoadBodySorter(scenario->count);
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+    int *ids = (int *)calloc(scenario->count, sizeof(int));
+
+    for (int i = 0; i < scenario->count; i++) ids[i] = i;
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        if ((step%REGRESSION_SORT_INTERVAL) == 0) SortBodiesByCurve(&sorter, pool, bodies, ids, NULL, scenario->count, SFC_CURVE_HILBERT);
+
+        StepBodiesTree(&tree, pool, bodies, next, scenario->count);
+        memcpy(bodies, next, scenario->count*sizeof(Body));
+    }
+
+    for (int i = 0; i < scenario->count; i++) bodies[ids[i]] = next[i];
+
+    free(ids);
+    free(next);
+    UnloadBodySorter(sorter);
+    UnloadBodyTree(tree);
+    UnloadTaskPool(pool);
+
+    return true;
+}
+
+// Symmetric direct sum, one lane per worker, runs every scenario twice and requires bit identical results
+static bool RunSymmetricPairs(const Scenario *scenario, Body *bodies)
+{
+    TaskPool *pool = LoadTaskPool(REGRESSION_TREE_WORKERS);
+    PairSolver solver = LoadPairSolver(scenario->count, GetTaskPoolWorkerCount(pool));
+    Body *runs[2] = { (Body *)calloc(scenario->count, sizeof(Body)), (Body *)calloc(scenario->count, sizeof(Body)) };
+    Body *next = (Body *)calloc(scenario->count, sizeof(Body));
+
+    for (int r = 0; r < 2; r++)
+    {
+        memcpy(runs[r], bodies, scenario->count*sizeof(Body));
+
+        for (int step = 0; step < scenario->steps; step++)
+        {
+            StepBodiesPairs(&solver, pool, runs[r], next, NULL, scenario->count);
+            memcpy(runs[r], next, scenario->count*sizeof(Body));
+        }
+    }
+
+    bool deterministic = (memcmp(runs[0], runs[1], scenario->count*sizeof(Body)) == 0);
+    if (!deterministic) printf("%s [pairs]: runs differ with %i lanes\n", scenario->name, solver.laneCount);
+
+    memcpy(bodies, runs[0], scenario->count*sizeof(Body));
+
+    free(next);
+    free(runs[0]);
+    free(runs[1]);
+    UnloadPairSolver(solver);
+    UnloadTaskPool(pool);
+
+    return deterministic;
+}
+
+// GPU integrator, nbody.comp built for the scenario body count
+static bool RunGpuCompute(const Scenario *scenario, Body *bodies)
+{
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody regression");
+
+    if (!IsWindowReady()) return false;
+
+    unsigned int program = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", TextFormat("#define NUM_BODIES %i\n", scenario->count));
+
+    if (program == 0)
+    {
+        CloseWindow();
+        return false;
+    }
+
+    unsigned int buffers[2] = {
+        rlLoadShaderBuffer(scenario->count*sizeof(Body), bodies, RL_DYNAMIC_COPY),
+        rlLoadShaderBuffer(scenario->count*sizeof(Body), NULL, RL_DYNAMIC_COPY)
+    };
+    unsigned int instances = rlLoadShaderBuffer(scenario->count*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(scenario->count*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int trailPoints = rlLoadShaderBuffer(4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    EwaldTable ewald = LoadEwaldTable(program, scenario->boxSize);
+
+    // No potentials, no trail points
+    int computePotential = 0;
+    int trailSlot = -1;
+    int trailStride = 1;
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        rlEnableShader(program);
+        rlBindShaderBuffer(buffers[step%2], 0);
+        rlBindShaderBuffer(buffers[(step + 1)%2], 1);
+        rlBindShaderBuffer(instances, 2);
+        rlBindShaderBuffer(potentials, 8);
+        rlBindShaderBuffer(trailPoints, 11);
+        rlSetUniform(rlGetLocationUniform(program, "computePotential"), &computePotential, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailSlot"), &trailSlot, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailStride"), &trailStride, RL_SHADER_UNIFORM_INT, 1);
+        BindEwaldTable(ewald, scenario->boxSize > 0.0f);
+
+        // One invocation per body, global id x is the body index
+        rlComputeShaderDispatch(scenario->count, 1, 1);
+        rlDisableShader();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    rlReadShaderBuffer(buffers[scenario->steps%2], bodies, scenario->count*sizeof(Body), 0);
+
+    rlUnloadShaderBuffer(buffers[0]);
+    rlUnloadShaderBuffer(buffers[1]);
+    rlUnloadShaderBuffer(instances);
+    rlUnloadShaderBuffer(potentials);
+    rlUnloadShaderBuffer(trailPoints);
+    UnloadEwaldTable(ewald);
+    rlUnloadShaderProgram(program);
+
+    CloseWindow();
+
+    return true;
+}
+
+// GPU integrator in the shipped configuration of nbody.c: NUM_BODIES slots, the scenario
+// bodies first and the others parked, Hilbert reorders, contacts from the neighbour lists
+// built through the BVH. Bounds are read back every step, like the statistics of nbody.c
+// NOTE: Bodies come back in stable id order, the slots are wherever the last reorder put them
+static bool RunGpuDefaults(const Scenario *scenario, Body *bodies)
+{
+    if (scenario->count > NUM_BODIES) return false;
+
+    SetTraceLogLevel(LOG_WARNING);
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(64, 64, "nbody regression");
+
+    if (!IsWindowReady()) return false;
+
+    unsigned int program = LoadComputeProgramCached("resources/shaders/glsl430/nbody.comp", NULL);
+
+    if (program == 0)
+    {
+        CloseWindow();
+        return false;
+    }
+
+    Body *slots = (Body *)calloc(NUM_BODIES, sizeof(Body));
+    unsigned int *ids = (unsigned int *)calloc(NUM_BODIES, sizeof(unsigned int));
+
+    memcpy(slots, bodies, scenario->count*sizeof(Body));
+    for (int i = scenario->count; i < NUM_BODIES; i++) slots[i] = (Body){ BODY_PARKED, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+    unsigned int bodyBuffers[2] = {
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), slots, RL_DYNAMIC_COPY),
+        rlLoadShaderBuffer(NUM_BODIES*sizeof(Body), NULL, RL_DYNAMIC_COPY)
+    };
+    unsigned int instances = rlLoadShaderBuffer(NUM_BODIES*4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int potentials = rlLoadShaderBuffer(NUM_BODIES*sizeof(float), NULL, RL_DYNAMIC_COPY);
+    unsigned int trailPoints = rlLoadShaderBuffer(4*sizeof(float), NULL, RL_DYNAMIC_COPY);
+
+    bool periodic = (scenario->boxSize > 0.0f);
+    float boxSize = periodic? scenario->boxSize : 0.0f;
+
+    BodyReorder reorder = LoadBodyReorder(REORDER_INTERVAL, REORDER_CURVE_HILBERT);
+    EwaldTable ewald = LoadEwaldTable(program, boxSize);
+    NeighbourLists neighbours = LoadNeighbourLists(program, NEIGHBOUR_SKIN);
+    BodyBvh bvh = LoadBodyBvh(BVH_REBUILD_INFLATION);
+
+    // No potentials, no trail points
+    int computePotential = 0;
+    int trailSlot = -1;
+    int trailStride = 1;
+
+    for (int step = 0; step < scenario->steps; step++)
+    {
+        float boundsMin[3] = { 0 };
+        float boundsMax[3] = { 0 };
+        GetLiveBounds(slots, NUM_BODIES, boundsMin, boundsMax);
+
+        // Lists and BVH leaves hold slots
+        if (UpdateBodyReorder(&reorder, &bodyBuffers[0], &bodyBuffers[1], boundsMin, boundsMax))
+        {
+            InvalidateNeighbourLists(&neighbours);
+            InvalidateBodyBvh(&bvh);
+        }
+
+        UpdateBodyBvh(&bvh, bodyBuffers[0], boundsMin, boundsMax);
+        neighbours.bvhBuffer = bvh.nodeBuffer;
+        UpdateNeighbourLists(&neighbours, bodyBuffers[0], boxSize);
+
+        rlEnableShader(program);
+        rlBindShaderBuffer(bodyBuffers[0], 0);
+        rlBindShaderBuffer(bodyBuffers[1], 1);
+        rlBindShaderBuffer(instances, 2);
+        rlBindShaderBuffer(potentials, 8);
+        rlBindShaderBuffer(trailPoints, 11);
+        rlSetUniform(rlGetLocationUniform(program, "computePotential"), &computePotential, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailSlot"), &trailSlot, RL_SHADER_UNIFORM_INT, 1);
+        rlSetUniform(rlGetLocationUniform(program, "trailStride"), &trailStride, RL_SHADER_UNIFORM_INT, 1);
+        BindBodyIds(reorder);
+        BindEwaldTable(ewald, periodic);
+        BindNeighbourLists(neighbours, true);
+        rlComputeShaderDispatch(16, 16, 16);
+        rlDisableShader();
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        unsigned int temp = bodyBuffers[0];
+        bodyBuffers[0] = bodyBuffers[1];
+        bodyBuffers[1] = temp;
+
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        rlReadShaderBuffer(bodyBuffers[0], slots, NUM_BODIES*sizeof(Body), 0);
+    }
+
+    rlReadShaderBuffer(reorder.idBuffers[0], ids, NUM_BODIES*sizeof(unsigned int), 0);
+
+    int found = 0;
+    for (int slot = 0; slot < NUM_BODIES; slot++)
+    {
+        if (ids[slot] < (unsigned int)scenario->count)
+        {
+            bodies[ids[slot]] = slots[slot];
+            found++;
+        }
+    }
+
+    printf("%s [gpu_defaults]: %i list builds, %i BVH rebuilds\n", scenario->name, neighbours.rebuilds, bvh.rebuilds);
+
+    UnloadBodyBvh(bvh);
+    UnloadNeighbourLists(neighbours);
+    UnloadEwaldTable(ewald);
+    UnloadBodyReorder(reorder);
+    rlUnloadShaderBuffer(bodyBuffers[0]);
+    rlUnloadShaderBuffer(bodyBuffers[1]);
+    rlUnloadShaderBuffer(instances);
+    rlUnloadShaderBuffer(potentials);
+    rlUnloadShaderBuffer(trailPoints);
+    rlUnloadShaderProgram(program);
+    free(slots);
+    free(ids);
+
+    CloseWindow();
+
+    // Every body still held by exactly one slot
+    return (found == scenario->count);
+}
+
+//----------------------------------------------------------------------------------
+// Module Functions Definition
+//----------------------------------------------------------------------------------
+
+// One step of the periodic box: every pair at its minimum image through ApplyBodyPair(), plus
+// the Ewald correction of the other images computed from the series, not from the table
+// NOTE: Same order of operations as nbody.comp, the GPU only differs by the table lookup
+static void StepBodiesPeriodic(const Body *bodies, Body *result, int count, float boxSize)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Body newBody = bodies[i];
+        float potential = 0.0f;
+
+        for (int j = 0; j < count; j++)
+        {
+            if (j == i) continue;
+
+            float delta[3] = { newBody.px - bodies[j].px, newBody.py - bodies[j].py, newBody.pz - bodies[j].pz };
+            for (int k = 0; k < 3; k++) delta[k] -= boxSize*roundf(delta[k]/boxSize);
+
+            // Nearest image of the other body, seen from the moving body
+            Body image = bodies[j];
+            image.px = newBody.px - delta[0];
+            image.py = newBody.py - delta[1];
+            image.pz = newBody.pz - delta[2];
+
+            ApplyBodyPair(&newBody, &potential, &image);
+
+            if (sqrtf(delta[0]*delta[0] + delta[1]*delta[1] + delta[2]*delta[2]) < 0.001f) continue;
+
+            double correction[4] = { 0 };
+            ComputeEwaldCorrection(delta[0]/boxSize, delta[1]/boxSize, delta[2]/boxSize, correction);
+
+            newBody.vx += (float)(correction[0]/(boxSize*boxSize));
+            newBody.vy += (float)(correction[1]/(boxSize*boxSize));
+            newBody.vz += (float)(correction[2]/(boxSize*boxSize));
+        }
+
+        result[i] = newBody;
+    }
+
+    IntegrateBodies(result, count);
+
+    // Wrap back into [-boxSize/2, boxSize/2)
+    for (int i = 0; i < count; i++)
+    {
+        result[i].px -= boxSize*floorf(result[i].px/boxSize + 0.5f);
+        result[i].py -= boxSize*floorf(result[i].py/boxSize + 0.5f);
+        result[i].pz -= boxSize*floorf(result[i].pz/boxSize + 0.5f);
+    }
+}
+
+// Bounds of the bodies not parked, the keys of the reorder and the BVH are quantized over them
+static void GetLiveBounds(const Body *bodies, int count, float *boundsMin, float *boundsMax)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        boundsMin[k] = 1e30f;
+        boundsMax[k] = -1e30f;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (bodies[i].px >= BODY_PARKED) continue;
+
+        float p[3] = { bodies[i].px, bodies[i].py, bodies[i].pz };
+
+        for (int k = 0; k < 3; k++)
+        {
+            boundsMin[k] = fminf(boundsMin[k], p[k]);
+            boundsMax[k] = fmaxf(boundsMax[k], p[k]);
+        }
+    }
+}
+
+// Fixed-seed uniform random in [0, 1), xorshift32, same sequence on every platform
+static float RandomFloat(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+
+    return (float)(randomState >> 8)/16777216.0f;
+}
+
+// Save bodies as a text snapshot, one body per line
+static bool SaveSnapshot(const char *fileName, const Scenario *scenario, const Body *bodies)
+{
+    FILE *file = fopen(fileName, "w");
+
+    if (file == NULL)
+    {
+        printf("%s: could not write snapshot %s\n", scenario->name, fileName);
+        return false;
+    }
+
+    fprintf(file, "# nbody regression snapshot: %s, %i bodies, %i steps\n", scenario->name, scenario->count, scenario->steps);
+    fprintf(file, "# px py pz vx vy vz\n");
+
+    for (int i = 0; i < scenario->count; i++)
+    {
+        fprintf(file, "%.9g %.9g %.9g %.9g %.9g %.9g\n", bodies[i].px, bodies[i].py, bodies[i].pz, bodies[i].vx, bodies[i].vy, bodies[i].vz);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+// Load a text snapshot, it must hold exactly scenario->count bodies
+static bool LoadSnapshot(const char *fileName, const Scenario *scenario, Body *bodies)
+{
+    FILE *file = fopen(fileName, "r");
+
+    if (file == NULL)
+    {
+        printf("%s: could not read snapshot %s, run with --update to create it\n", scenario->name, fileName);
+        return false;
+    }
+
+    char line[256] = { 0 };
+    int count = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if ((line[0] == '#') || (line[0] == '\n')) continue;
+
+        Body body = { 0 };
+        if (sscanf(line, "%f %f %f %f %f %f", &body.px, &body.py, &body.pz, &body.vx, &body.vy, &body.vz) != 6) break;
+
+        if (count < scenario->count) bodies[count] = body;
+        count++;
+    }
+
+    fclose(file);
+
+    if (count != scenario->count)
+    {
+        printf("%s: snapshot %s holds %i bodies, expected %i\n", scenario->name, fileName, count, scenario->count);
+        return false;
+    }
+
+    return true;
+}